@@ -0,0 +1,66 @@
+/* Micro-benchmark for the lexer: lexing a generated source of several megabytes, made of
+ * indented lines of symbols, numbers, string literals and comments, like generated code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/lexer.h"
+#include "../src/memory.h"
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+#define RUN_COUNT 5
+
+static double now(void) {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static size_t generate_source(char *source, size_t size) {
+    static const char *const lines[] = {
+        "    # Push the next value and check it against the limit.\n",
+        "    counter_value dupe 1_000 < if\n",
+        "        \"Reached the limit of the generated loop body.\\n\" print\n",
+        "        vector_x vector_y + 0x7F and swap pop\n",
+        "    elif accumulator 3.25f64 * to f32 then\n",
+        "        \"Another string literal, long enough to take a few blocks.\" print\n",
+        "    end\n",
+        "\n",
+    };
+    int line_count = sizeof lines / sizeof lines[0];
+    size_t length = 0;
+    for (int i = 0; ; i = (i + 1) % line_count) {
+        size_t line_length = strlen(lines[i]);
+        if (length + line_length > size) break;
+        memcpy(&source[length], lines[i], line_length);
+        length += line_length;
+    }
+    return length;
+}
+
+int main(void) {
+    char *source = malloc(SOURCE_SIZE);
+    CHECK_ALLOCATION(source);
+    size_t length = generate_source(source, SOURCE_SIZE);
+    double best = 0.0;
+    long token_count = 0;
+    for (int run = 0; run < RUN_COUNT; ++run) {
+        struct lexer lexer = {0};
+        init_lexer(&lexer, source, source + length, "<generated>");
+        token_count = 0;
+        double start = now();
+        while (next_token(&lexer).type != TOKEN_EOT) {
+            ++token_count;
+        }
+        double elapsed = now() - start;
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    printf("%zu bytes, %ld tokens: %7.1f ms, %7.1f MB/s, %5.1f ns/token\n",
+           length, token_count, best * 1e3, length / best * 1e-6, best * 1e9 / token_count);
+    free(source);
+}
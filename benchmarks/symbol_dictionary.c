@@ -0,0 +1,85 @@
+/* Micro-benchmark for the symbol dictionary: inserting N symbols, then looking up each one
+ * (hits) and N names which aren't there (misses), for N from 1k to 1M.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/memory.h"
+#include "../src/string_view.h"
+#include "../src/symbol.h"
+
+#define MAX_SYMBOL_COUNT (1000 * 1000)
+#define NAME_SIZE 32
+
+static double now(void) {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static struct string_view make_name(char *buffer, const char *prefix, int i) {
+    int length = snprintf(buffer, NAME_SIZE, "%s%d", prefix, i);
+    return (struct string_view) {.start = buffer, .length = length};
+}
+
+static void run(int count, char *names, char *missing) {
+    struct string_view *hits = malloc(count * sizeof *hits);
+    struct string_view *misses = malloc(count * sizeof *misses);
+    CHECK_ALLOCATION(hits);
+    CHECK_ALLOCATION(misses);
+    for (int i = 0; i < count; ++i) {
+        // Mix short (inline) and long names, as in real sources.
+        hits[i] = make_name(&names[i * NAME_SIZE], (i % 2 == 0) ? "f" : "Vector.field_", i);
+        misses[i] = make_name(&missing[i * NAME_SIZE], (i % 2 == 0) ? "g" : "Vector.other_", i);
+    }
+    struct symbol_dictionary dict;
+    init_symbol_dictionary(&dict);
+    double start = now();
+    for (int i = 0; i < count; ++i) {
+        insert_symbol(&dict, &(struct symbol) {
+                .name = hits[i],
+                .type = SYM_FUNCTION,
+                .function.index = i,
+            });
+    }
+    double inserted = now();
+    long found = 0;
+    for (int i = 0; i < count; ++i) {
+        struct symbol *symbol = lookup_symbol(&dict, &hits[i]);
+        found += (symbol != NULL && symbol->function.index == i);
+    }
+    double looked_up = now();
+    long not_found = 0;
+    for (int i = 0; i < count; ++i) {
+        not_found += (lookup_symbol(&dict, &misses[i]) == NULL);
+    }
+    double missed = now();
+    if (found != count || not_found != count) {
+        fprintf(stderr, "Lookup failed: %ld/%d found, %ld/%d not found.\n",
+                found, count, not_found, count);
+        exit(1);
+    }
+    printf("%8d symbols: insert %7.1f ns, hit %7.1f ns, miss %7.1f ns (capacity %d)\n",
+           count,
+           (inserted - start) * 1e9 / count,
+           (looked_up - inserted) * 1e9 / count,
+           (missed - looked_up) * 1e9 / count,
+           dict.capacity);
+    free_symbol_dictionary(&dict);
+    free(hits);
+    free(misses);
+}
+
+int main(void) {
+    char *names = malloc((size_t)MAX_SYMBOL_COUNT * NAME_SIZE);
+    char *missing = malloc((size_t)MAX_SYMBOL_COUNT * NAME_SIZE);
+    CHECK_ALLOCATION(names);
+    CHECK_ALLOCATION(missing);
+    for (int count = 1000; count <= MAX_SYMBOL_COUNT; count *= 10) {
+        run(count, names, missing);
+    }
+    free(names);
+    free(missing);
+}
@@ -6,26 +6,155 @@
 #include <string.h>
 
 #include "asm.h"
+#include "memory.h"
 
 
-void init_assembly(struct asm_block *assembly) {
+void init_assembly(struct asm_block *assembly, FILE *file) {
+    assembly->file = file;
+    assembly->text = NULL;
     assembly->count = 0;
     assembly->status = ASM_OK;
-    memset(&assembly->code, 0, ASM_CODE_SIZE);
+    assembly->lines = NULL;
 }
 
-void asm_vwrite(struct asm_block *assembly, const char *restrict code, va_list args) {
-    assert(assembly->count + 1 <= ASM_CODE_SIZE);  // +1 for null byte.
+void init_assembly_text(struct asm_block *assembly, struct asm_text *text) {
+    init_assembly(assembly, NULL);
+    assembly->text = text;
+    text->count = 0;
+}
+
+static char *reserve_text(struct asm_text *text, size_t count) {
+    if (text->count + count > text->capacity) {
+        size_t new_capacity = (text->capacity > 0) ? text->capacity : ASM_BUFFER_SIZE;
+        while (new_capacity < text->count + count) {
+            new_capacity += new_capacity / 2;
+        }
+        text->code = reallocate_array(text->code, text->capacity, new_capacity, 1);
+        text->capacity = new_capacity;
+    }
+    char *start = &text->code[text->count];
+    text->count += count;
+    return start;
+}
+
+static void write_bytes(struct asm_block *assembly, const char *bytes, size_t count) {
+    if (assembly->text != NULL) {
+        memcpy(reserve_text(assembly->text, count), bytes, count);
+    }
+    else if (fwrite(bytes, 1, count, assembly->file) != count) {
+        assembly->status = ASM_WRITE_ERROR;
+    }
+}
+
+void asm_flush(struct asm_block *assembly) {
+    if (asm_had_error(assembly) || assembly->count == 0) return;
+    write_bytes(assembly, assembly->code, assembly->count);
+    assembly->count = 0;
+}
+
+void asm_write_text(struct asm_block *assembly, const struct asm_text *text) {
+    if (asm_had_error(assembly)) return;
+    if (assembly->count + text->count <= ASM_BUFFER_SIZE - 1) {
+        memcpy(&assembly->code[assembly->count], text->code, text->count);
+        assembly->count += text->count;
+        return;
+    }
+    asm_flush(assembly);
+    if (asm_had_error(assembly)) return;
+    write_bytes(assembly, text->code, text->count);
+}
+
+void free_asm_text(struct asm_text *text) {
+    free_array(text->code, text->capacity, 1);
+    text->code = NULL;
+    text->count = 0;
+    text->capacity = 0;
+}
+
+static void write_code(struct asm_block *assembly, const char *restrict code, va_list args) {
+    assert(assembly->count < ASM_BUFFER_SIZE);  // Room for null byte.
     if (asm_had_error(assembly)) return;  // If there was an error, do nothing.
-    size_t max_count = ASM_CODE_SIZE - assembly->count;
-    int count = vsnprintf(&assembly->code[assembly->count], max_count, code, args);
-    if (count < 0 || (size_t)count > max_count) {
+    size_t max_count = ASM_BUFFER_SIZE - assembly->count;
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int count = vsnprintf(&assembly->code[assembly->count], max_count, code, args_copy);
+    va_end(args_copy);
+    if (count < 0) {
         assembly->status = ASM_WRITE_ERROR;
         return;
     }
+    if ((size_t)count >= max_count) {
+        // Not enough space left (the code was truncated), so flush the buffer and try again.
+        asm_flush(assembly);
+        if (asm_had_error(assembly)) return;
+        if ((size_t)count >= ASM_BUFFER_SIZE) {
+            // Too big for the buffer, so write it out directly.
+            if (assembly->text != NULL) {
+                // Reserve room for the null byte, then drop it.
+                vsnprintf(reserve_text(assembly->text, count + 1), count + 1, code, args);
+                --assembly->text->count;
+            }
+            else if (vfprintf(assembly->file, code, args) < 0) {
+                assembly->status = ASM_WRITE_ERROR;
+            }
+            return;
+        }
+        vsnprintf(assembly->code, ASM_BUFFER_SIZE, code, args);
+    }
     assembly->count += count;
 }
 
+static void write_raw(struct asm_block *assembly, const char *restrict code, ...) {
+    va_list args;
+    va_start(args, code);
+    write_code(assembly, code, args);
+    va_end(args);
+}
+
+static char *copy_string(struct asm_block *assembly, const char *string, size_t length) {
+    char *copy = region_alloc_uninit(assembly->lines->strings, length + 1);
+    if (copy == NULL) {
+        assembly->status = ASM_WRITE_ERROR;
+        return NULL;
+    }
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+static void append_line(struct asm_block *assembly, struct asm_line line) {
+    DARRAY_APPEND(assembly->lines, line);
+}
+
+static char *format_string(struct asm_block *assembly, const char *restrict format, va_list args) {
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int length = vsnprintf(NULL, 0, format, args_copy);
+    va_end(args_copy);
+    if (length < 0) {
+        assembly->status = ASM_WRITE_ERROR;
+        return NULL;
+    }
+    char *string = region_alloc_uninit(assembly->lines->strings, length + 1);
+    if (string == NULL) {
+        assembly->status = ASM_WRITE_ERROR;
+        return NULL;
+    }
+    vsnprintf(string, length + 1, format, args);
+    return string;
+}
+
+void asm_vwrite(struct asm_block *assembly, const char *restrict code, va_list args) {
+    if (assembly->lines == NULL) {
+        write_code(assembly, code, args);
+        return;
+    }
+    if (asm_had_error(assembly)) return;
+    const char *text = format_string(assembly, code, args);
+    if (text == NULL) return;
+    append_line(assembly, (struct asm_line) {.kind = ASM_LINE_TEXT, .mnemonic = text});
+}
+
 void asm_write(struct asm_block *assembly, const char *restrict code, ...) {
     va_list args;
     va_start(args, code);
@@ -33,6 +162,100 @@ void asm_write(struct asm_block *assembly, const char *restrict code, ...) {
     va_end(args);
 }
 
+static void write_line(struct asm_block *assembly, const struct asm_line *line) {
+    switch (line->kind) {
+    case ASM_LINE_INSTRUCTION:
+        write_raw(assembly, "\t%s", line->mnemonic);
+        for (int i = 0; i < line->operand_count; ++i) {
+            write_raw(assembly, (i == 0) ? "\t%s" : ", %s", line->operands[i]);
+        }
+        if (line->comment != NULL) {
+            write_raw(assembly, (line->operand_count < 2) ? "\t\t; %s" : "\t; %s",
+                                  line->comment);
+        }
+        write_raw(assembly, "\n");
+        break;
+    case ASM_LINE_LABEL:
+        write_raw(assembly, "  %s:\n", line->mnemonic);
+        break;
+    case ASM_LINE_TEXT:
+        write_raw(assembly, "%s", line->mnemonic);
+        break;
+    case ASM_LINE_DELETED:
+        break;
+    }
+}
+
+void asm_write_inst(struct asm_block *assembly, const char *mnemonic, const char *comment,
+                    const char *restrict operands, ...) {
+    if (asm_had_error(assembly)) return;
+    char formatted[ASM_OPERANDS_SIZE];
+    va_list args;
+    va_start(args, operands);
+    int length = vsnprintf(formatted, sizeof formatted, operands, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= sizeof formatted) {
+        assembly->status = ASM_WRITE_ERROR;
+        return;
+    }
+    struct asm_line line = {
+        .kind = ASM_LINE_INSTRUCTION,
+        .mnemonic = mnemonic,
+        .comment = comment,
+        .operand_count = 0,
+    };
+    // Split the operands at each separator.
+    char *start = formatted;
+    while (*start != '\0') {
+        assert(line.operand_count < ASM_MAX_OPERANDS);
+        char *end = strchr(start, ASM_SEP[0]);
+        bool is_last = (end == NULL);
+        if (is_last) end = &formatted[length];
+        *end = '\0';
+        line.operands[line.operand_count++] = (assembly->lines != NULL)
+            ? copy_string(assembly, start, end - start)
+            : start;
+        if (is_last) break;
+        start = end + 1;
+    }
+    if (asm_had_error(assembly)) return;
+    if (assembly->lines != NULL) {
+        append_line(assembly, line);
+    }
+    else {
+        write_line(assembly, &line);
+    }
+}
+
+void init_asm_line_list(struct asm_line_list *lines) {
+    INIT_DARRAY(lines, DARRAY_INIT_SIZE);
+    lines->strings = new_region(ASM_STRINGS_REGION_SIZE);
+    CHECK_ALLOCATION(lines->strings);
+}
+
+void free_asm_line_list(struct asm_line_list *lines) {
+    FREE_DARRAY(lines);
+    kill_region(lines->strings);
+    lines->strings = NULL;
+}
+
+void asm_start_lines(struct asm_block *assembly, struct asm_line_list *lines) {
+    assert(assembly->lines == NULL);
+    lines->count = 0;
+    clear_region(lines->strings);
+    assembly->lines = lines;
+}
+
+void asm_end_lines(struct asm_block *assembly) {
+    struct asm_line_list *lines = assembly->lines;
+    assert(lines != NULL);
+    assembly->lines = NULL;
+    for (int i = 0; i < lines->count; ++i) {
+        write_line(assembly, &lines->items[i]);
+    }
+    lines->count = 0;
+}
+
 void asm_start_asm(struct asm_block *assembly) {
     asm_write(assembly, "format PE64 console\n");
     asm_write(assembly, "include 'win64ax.inc'\n\n");
@@ -52,12 +275,20 @@ void asm_section_(struct asm_block *assembly, const char *section_name, ...) {
 }
 
 void asm_label(struct asm_block *assembly, const char *restrict label, ...) {
-    asm_write(assembly, "  ");
     va_list args;
     va_start(args, label);
-    asm_vwrite(assembly, label, args);
+    if (assembly->lines != NULL) {
+        const char *name = (!asm_had_error(assembly)) ? format_string(assembly, label, args) : NULL;
+        if (name != NULL) {
+            append_line(assembly, (struct asm_line) {.kind = ASM_LINE_LABEL, .mnemonic = name});
+        }
+    }
+    else {
+        write_raw(assembly, "  ");
+        write_code(assembly, label, args);
+        write_raw(assembly, ":\n");
+    }
     va_end(args);
-    asm_write(assembly, ":\n");
 }
 
 static bool can_be_in_fasm_string(char c) {
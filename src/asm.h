@@ -3,25 +3,85 @@
 
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdio.h>
 
+#include "region.h"
 #include "string_view.h"
 
-#define ASM_CODE_SIZE 4 * 1024 *1024
+#define ASM_BUFFER_SIZE 64 * 1024
+#define ASM_MAX_OPERANDS 4
+#define ASM_OPERANDS_SIZE 512
+#define ASM_STRINGS_REGION_SIZE 64 * 1024
 
+// Separates the operands of an instruction before they are split up.
+#define ASM_SEP "\x1f"
+
+/* A single line of buffered assembly. Instructions are kept in a structured form so that they
+ * can be inspected and rewritten (see peephole.c) before being serialised to FASM text.
+ */
+struct asm_line {
+    enum asm_line_kind {
+        ASM_LINE_INSTRUCTION,
+        ASM_LINE_LABEL,
+        ASM_LINE_TEXT,
+        ASM_LINE_DELETED,
+    } kind;
+    const char *mnemonic;  // Instruction mnemonic, label name or raw text.
+    const char *comment;
+    int operand_count;
+    const char *operands[ASM_MAX_OPERANDS];
+};
+
+struct asm_line_list {
+    int count;
+    int capacity;
+    struct asm_line *items;
+    struct region *strings;
+};
+
+/* Growable in-memory destination for assembly code. Functions generated in parallel are
+ * written to one of these before being copied to the output in order.
+ */
+struct asm_text {
+    size_t count;
+    size_t capacity;
+    char *code;
+};
+
+/* Assembly code is written to a file through a fixed-size buffer, which is flushed whenever it
+ * fills up. This keeps memory use bounded no matter how large the program is.
+ */
 struct asm_block {
+    FILE *file;
+    struct asm_text *text;  // When non-NULL, the buffer is flushed here instead of to file.
     size_t count;
     enum asm_status {
         ASM_OK,
         ASM_WRITE_ERROR,
     } status;
-    char code[ASM_CODE_SIZE];
+    struct asm_line_list *lines;  // When non-NULL, lines are collected here instead.
+    char code[ASM_BUFFER_SIZE];
 };
 
-void init_assembly(struct asm_block *assembly);
+void init_assembly(struct asm_block *assembly, FILE *file);
+void init_assembly_text(struct asm_block *assembly, struct asm_text *text);
+void asm_flush(struct asm_block *assembly);
+
+void asm_write_text(struct asm_block *assembly, const struct asm_text *text);
+void free_asm_text(struct asm_text *text);
 
 void asm_write(struct asm_block *assembly, const char *restrict code, ...);
 void asm_vwrite(struct asm_block *assembly, const char *restrict code, va_list args);
 
+void asm_write_inst(struct asm_block *assembly, const char *mnemonic, const char *comment,
+                    const char *restrict operands, ...);
+
+void init_asm_line_list(struct asm_line_list *lines);
+void free_asm_line_list(struct asm_line_list *lines);
+
+void asm_start_lines(struct asm_block *assembly, struct asm_line_list *lines);
+void asm_end_lines(struct asm_block *assembly);
+
 void asm_write_sv(struct asm_block *assembly, const struct string_view *sv);
 
 void asm_start_asm(struct asm_block *assembly);
@@ -32,49 +92,49 @@ void asm_label(struct asm_block *assembly, const char *label, ...);
 #define asm_reset_status(assembly) ((assembly)->status = ASM_OK)
 
 #define asm_write_inst0(assembly, inst) \
-    asm_write(assembly, "\t" inst "\n")
+    asm_write_inst(assembly, inst, NULL, "")
 #define asm_write_inst0c(assembly, inst, comment) \
-    asm_write(assembly, "\t" inst "\t\t; " comment "\n")
+    asm_write_inst(assembly, inst, comment, "")
 #define asm_write_inst1(assembly, inst, arg1) \
-    asm_write(assembly, "\t" inst "\t" arg1 "\n")
+    asm_write_inst(assembly, inst, NULL, arg1)
 #define asm_write_inst1c(assembly, inst, arg1, comment) \
-    asm_write(assembly, "\t" inst "\t" arg1 "\t\t; " comment "\n")
+    asm_write_inst(assembly, inst, comment, arg1)
 #define asm_write_inst2(assembly, inst, arg1, arg2) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 "\n")
+    asm_write_inst(assembly, inst, NULL, arg1 ASM_SEP arg2)
 #define asm_write_inst2c(assembly, inst, arg1, arg2, comment) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 "\t; " comment "\n")
+    asm_write_inst(assembly, inst, comment, arg1 ASM_SEP arg2)
 #define asm_write_inst3(assembly, inst, arg1, arg2, arg3) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 "\n")
+    asm_write_inst(assembly, inst, NULL, arg1 ASM_SEP arg2 ASM_SEP arg3)
 #define asm_write_inst3c(assembly, inst, arg1, arg2, arg3, comment) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 "\t; " comment "\n")
+    asm_write_inst(assembly, inst, comment, arg1 ASM_SEP arg2 ASM_SEP arg3)
 #define asm_write_inst4(assembly, inst, arg1, arg2, arg3, arg4) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 ", " arg4 "\n")
+    asm_write_inst(assembly, inst, NULL, arg1 ASM_SEP arg2 ASM_SEP arg3 ASM_SEP arg4)
 #define asm_write_inst4c(assembly, inst, arg1, arg2, arg3, arg4, comment) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 ", " arg4 "\t; " comment "\n")
+    asm_write_inst(assembly, inst, comment, arg1 ASM_SEP arg2 ASM_SEP arg3 ASM_SEP arg4)
 
 
-#define asm_write_inst0f(assembly, inst, ...)            \
-    asm_write(assembly, "\t" inst "\n", __VA_ARGS__)
+#define asm_write_inst0f(assembly, inst, ...) \
+    asm_write_inst(assembly, inst, NULL, "", __VA_ARGS__)
 #define asm_write_inst0cf(assembly, inst, comment, ...) \
-    asm_write(assembly, "\t" inst "\t\t; " comment "\n", VA_ARGS)
+    asm_write_inst(assembly, inst, comment, "", __VA_ARGS__)
 #define asm_write_inst1f(assembly, inst, arg1, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 "\n", __VA_ARGS__)
+    asm_write_inst(assembly, inst, NULL, arg1, __VA_ARGS__)
 #define asm_write_inst1cf(assembly, inst, arg1, comment, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 "\t; " comment "\n", __VA_ARGS__)
+    asm_write_inst(assembly, inst, comment, arg1, __VA_ARGS__)
 #define asm_write_inst2f(assembly, inst, arg1, arg2, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 "\n", __VA_ARGS__)
+    asm_write_inst(assembly, inst, NULL, arg1 ASM_SEP arg2, __VA_ARGS__)
 #define asm_write_inst2cf(assembly, inst, arg1, arg2, comment, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 "\t; " comment "\n", __VA_ARGS__)
+    asm_write_inst(assembly, inst, comment, arg1 ASM_SEP arg2, __VA_ARGS__)
 #define asm_write_inst3f(assembly, inst, arg1, arg2, arg3, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 "\n", __VA_ARGS__)
+    asm_write_inst(assembly, inst, NULL, arg1 ASM_SEP arg2 ASM_SEP arg3, __VA_ARGS__)
 #define asm_write_inst3cf(assembly, inst, arg1, arg2, arg3, comment, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 "\t; " comment "\n",\
-              __VA_ARGS__)
+    asm_write_inst(assembly, inst, comment, arg1 ASM_SEP arg2 ASM_SEP arg3, __VA_ARGS__)
 #define asm_write_inst4f(assembly, inst, arg1, arg2, arg3, arg4, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 ", " arg4 "\n", __VA_ARGS__)
+    asm_write_inst(assembly, inst, NULL, arg1 ASM_SEP arg2 ASM_SEP arg3 ASM_SEP arg4, \
+                   __VA_ARGS__)
 #define asm_write_inst4cf(assembly, inst, arg1, arg2, arg3, arg4, comment, ...) \
-    asm_write(assembly, "\t" inst "\t" arg1 ", " arg2 ", " arg3 ", " arg4 "\t; " comment "\n",\
-              __VA_ARGS__)
+    asm_write_inst(assembly, inst, comment, arg1 ASM_SEP arg2 ASM_SEP arg3 ASM_SEP arg4, \
+                   __VA_ARGS__)
 
 #define asm_section(assembly, ...) asm_section_(assembly, __VA_ARGS__, NULL)
 
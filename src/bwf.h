@@ -1,9 +1,9 @@
 #ifndef BWF_H
 #define BWF_H
 
-#define BWF_version_number 5
+#define BWF_version_number 6
 
-/* Bude Binary Word-oriented Format version 5
+/* Bude Binary Word-oriented Format version 6
  *
  * BudeBWF is a file format for storing word-oriented Bude IR code.
  * The format is structured as a series of fixed-sized fields and variable-sized data entries
@@ -13,12 +13,23 @@
  * The sections are as follows:
  *  - HEADER section comprising the file format's "magic number" (a series of ASCII characters
  *    spelling out "BudeBWF" and the version number (the ASCII character "v" followed by 1 or
- *    more ASCII digits). The current version number for this standard is version 5. The HEADER
+ *    more ASCII digits). The current version number for this standard is version 6. The HEADER
  *    section is terminated by an ASCII line feed character.
  *  - DATA-INFO section holding information pertaining to the data section and -- from version
  *    2 onwards -- the data-info-field-count which holds the number of other fields in this
  *    section.
+ *  - SECTION-INDEX section (from version 6 onwards) holding the offset of each table in the
+ *    DATA section, followed by the FUNCTION-INDEX, which holds the offset of each entry in the
+ *    FUNCTION-TABLE. All offsets are measured in bytes from the start of the file. The tables
+ *    are listed in the order of `enum bwf_section` below; a reader should ignore any offsets
+ *    past the ones it knows about (given by section-count). The index allows a reader to
+ *    find a table or function without parsing everything before it.
  *  - DATA section comprising the main data of the IR.
+ *  - SYMBOL-TABLE section (optional, from version 6 onwards) holding the functions the module
+ *    exports to and imports from other modules (see linker.h). The section is present if
+ *    section-count is at least 6 and its offset is non-zero. An imported function's entry in
+ *    the FUNCTION-TABLE has no code, and a reader should reject any other function without
+ *    code. A reader should skip entries of a kind it doesn't know.
  *
  * Structure:
  *
@@ -31,6 +42,13 @@
  *   user-defined-type-count:s32 } version >= 4
  *   external-function-count:s32 \ version >= 5
  *   external-library-count:s32  /
+ * SECTION-INDEX                 \
+ *   section-count:s32           |
+ *   section-offset:s32          |
+ *   ...                         | version >= 6
+ *   FUNCTION-INDEX              |
+ *     function-offset:s32       |
+ *     ...                       /
  * DATA
  *   STRING-TABLE
  *     size:u32 contents:byte[]
@@ -75,14 +93,63 @@
  *       ...                     |
  *     filename-index:s32        |
  *     ...                       /
+ * SYMBOL-TABLE                  \
+ *   symbol-count:s32            |
+ *   entry-size:s32              |
+ *   kind:s32                    | version >= 6 (optional)
+ *   function-index:s32          |
+ *   name-size:u32 name:byte[]   |
+ *   param-count:s32             |
+ *   ret-count:s32               |
+ *   PARAM-LIST                  |
+ *     type-index:s32            |
+ *     ...                       |
+ *   RET-LIST                    |
+ *     type-index:s32            |
+ *     ...                       |
+ *   ...                         /
+ *
+ * The kind of each SYMBOL-TABLE entry is a value of `enum link_symbol_kind` (see module.h), and
+ * its signature is that of the function, so the linker can check an import against the export
+ * it resolves to.
  *
+ * Compressed variant (BudeBWZ, version 6 onwards)
+ *
+ * A compressed file has the magic number `BudeBWZ` instead of `BudeBWF` and the same structure
+ * as above, except:
+ *  - Every field is encoded as an unsigned LEB128 varint (7 bits per byte, least significant
+ *    group first, with the high bit set on every byte but the last) holding the field's 32 bits.
+ *    The exceptions are the section-count and offset fields of the SECTION-INDEX and
+ *    FUNCTION-INDEX, which keep their fixed sizes.
+ *  - The data-info-field-count counts fields, not bytes; a reader skips any fields it doesn't
+ *    know about by reading them.
+ *  - Each FUNCTION-TABLE entry stores its code compressed (see lz.h):
+ *      entry-size code-size compressed-size compressed-code:byte[] max-for-loop-level ...
+ *    where code-size is the size of the code once decompressed. Since each function is
+ *    compressed on its own, functions can still be loaded individually.
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "ext_function.h"
 #include "function.h"
 #include "type.h"
 
 
+enum bwf_section {
+    BWF_STRING_TABLE,
+    BWF_FUNCTION_TABLE,
+    BWF_USER_DEFINED_TYPE_TABLE,
+    BWF_EXTERNAL_FUNCTION_TABLE,
+    BWF_EXTERNAL_LIBRARY_TABLE,
+    BWF_SYMBOL_TABLE,
+    BWF_SECTION_COUNT
+};
+
+// The sections every version 6+ file has. The rest are optional.
+#define BWF_REQUIRED_SECTION_COUNT BWF_SYMBOL_TABLE
+
 struct data_info {
     int32_t string_count;
     int32_t function_count;
@@ -91,11 +158,19 @@ struct data_info {
     int32_t ext_library_count;
 };
 
+// The most bytes a varint field can take.
+#define BWF_VARINT_MAX_SIZE 5
+
 
 int get_field_count(int version_number);
-int get_function_entry_size(struct function *function, int version_number);
-int get_type_entry_size(const struct type_info *info, int version_number);
-int get_ext_function_entry_size(struct ext_function *external, int version_number);
-int get_ext_library_entry_size(struct ext_library *library, int version_number);
+
+/* Encode `value` as a varint in `bytes`, which must have room for BWF_VARINT_MAX_SIZE bytes.
+ * Returns the number of bytes written.
+ */
+int encode_varint(uint32_t value, uint8_t *bytes);
+/* Decode a varint from the `size` bytes at `bytes`. Returns the number of bytes read, or 0 if
+ * the varint is truncated or too large for 32 bits.
+ */
+int decode_varint(const uint8_t *bytes, size_t size, uint32_t *value);
 
 #endif
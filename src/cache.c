@@ -0,0 +1,157 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L  // For `mkdir()` and `getpid()`.
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bwf.h"
+#include "cache.h"
+#include "memory.h"
+#include "reader.h"
+#include "writer.h"
+
+#if defined(_WIN32)
+#define PATH_SEPARATOR '\\'
+#define get_process_id _getpid
+#else
+#define PATH_SEPARATOR '/'
+#define get_process_id getpid
+#endif
+
+
+static bool is_separator(char c) {
+    return c == '/' || c == PATH_SEPARATOR;
+}
+
+static char *join_path(const char *directory, const char *name) {
+    size_t directory_length = strlen(directory);
+    size_t name_length = strlen(name);
+    char *path = allocate_array(directory_length + name_length + 2, sizeof path[0]);
+    CHECK_ALLOCATION(path);
+    memcpy(path, directory, directory_length);
+    size_t length = directory_length;
+    if (length > 0 && !is_separator(path[length - 1])) {
+        path[length++] = PATH_SEPARATOR;
+    }
+    memcpy(&path[length], name, name_length + 1);
+    return path;
+}
+
+char *get_default_cache_directory(void) {
+#if defined(_WIN32)
+    const char *base = getenv("LOCALAPPDATA");
+    if (base == NULL || base[0] == '\0') return NULL;
+    return join_path(base, "bude");
+#else
+    const char *base = getenv("XDG_CACHE_HOME");
+    // The XDG Base Directory Specification says to ignore relative paths.
+    if (base != NULL && base[0] == '/') return join_path(base, "bude");
+    const char *home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') return NULL;
+    char *cache = join_path(home, ".cache");
+    char *directory = join_path(cache, "bude");
+    free(cache);
+    return directory;
+#endif
+}
+
+struct hash128 new_cache_key(const char *compiler_version) {
+    struct hash128 key = hash_bytes128(compiler_version, strlen(compiler_version),
+                                       (struct hash128) {0});
+    // The entries are BudeBWF files, so a new version of the format needs new entries.
+    int32_t bwf_version = BWF_version_number;
+    return hash_bytes128(&bwf_version, sizeof bwf_version, key);
+}
+
+struct hash128 hash_cache_option(struct hash128 key, const char *option) {
+    return hash_bytes128(option, strlen(option), key);
+}
+
+char *get_cache_entry_path(const char *directory, struct hash128 key,
+                           const char *source, size_t length) {
+    key = hash_bytes128(source, length, key);
+    char name[64];
+    snprintf(name, sizeof name, "%016"PRIx64"%016"PRIx64".bbwf", key.high, key.low);
+    return join_path(directory, name);
+}
+
+bool read_cached_module(const char *path, struct module *module) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;  // Not cached yet.
+    fclose(file);
+    // The entry is read eagerly, so a damaged function is caught here, where the module can
+    // still be compiled from source, rather than when the function is first called.
+    if (try_read_bytecode(path, false, module)) return true;
+    fprintf(stderr, "Warning: ignoring invalid compilation cache entry `%s`.\n", path);
+    return false;
+}
+
+static bool make_directory(const char *path) {
+#if defined(_WIN32)
+    return _mkdir(path) == 0 || errno == EEXIST;
+#else
+    return mkdir(path, 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+/* Make the directory containing `path`, along with any missing parents. */
+static void make_parent_directories(const char *path) {
+    size_t length = strlen(path);
+    char *directory = allocate_array(length + 1, sizeof directory[0]);
+    CHECK_ALLOCATION(directory);
+    memcpy(directory, path, length + 1);
+    for (size_t i = 1; i < length; ++i) {
+        if (!is_separator(directory[i])) continue;
+        char separator = directory[i];
+        directory[i] = '\0';
+        make_directory(directory);  // If this fails, opening the file will fail too.
+        directory[i] = separator;
+    }
+    free(directory);
+}
+
+void write_cached_module(const char *path, struct module *module) {
+    // Each process writes to its own temporary file.
+    size_t temp_size = strlen(path) + 32;
+    char *temp_path = allocate_array(temp_size, sizeof temp_path[0]);
+    CHECK_ALLOCATION(temp_path);
+    snprintf(temp_path, temp_size, "%s.%ld.tmp", path, (long)get_process_id());
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        // The cache directory is only made the first time it's needed.
+        make_parent_directories(temp_path);
+        file = fopen(temp_path, "wb");
+    }
+    int error = (file != NULL) ? write_bytecode(module, file) : errno;
+    if (file != NULL && fclose(file) != 0 && error == 0) {
+        error = errno;
+    }
+    bool renamed = false;
+    if (error == 0) {
+        renamed = rename(temp_path, path) == 0;
+        // Windows won't replace an existing file, but an existing entry holds the same module.
+        if (!renamed && errno != EEXIST) {
+            error = errno;
+        }
+    }
+    if (error != 0) {
+        fprintf(stderr, "Warning: failed to write compilation cache entry `%s`: %s.\n",
+                path, strerror(error));
+    }
+    if (!renamed && file != NULL) {
+        remove(temp_path);
+    }
+    free(temp_path);
+}
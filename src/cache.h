@@ -0,0 +1,39 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+
+#include "hash.h"
+#include "module.h"
+
+/* An on-disk cache of compiled modules, so a program which hasn't changed doesn't have to be
+ * compiled again. Each entry is a BudeBWF file of the type-checked (but unoptimised) module,
+ * named after a hash of everything that went into compiling it: the compiler version, the
+ * options which affect compilation (see `hash_cache_option()`) and the source code.
+ *
+ * Entries are written to a temporary file which is then renamed, so a reader never sees a
+ * partial entry, even if several compilers share the cache.
+ */
+
+/* The default cache directory: `$XDG_CACHE_HOME/bude`, falling back to `~/.cache/bude` (or
+ * `%LOCALAPPDATA%\bude` on Windows). Returns NULL if none of them can be worked out. The path
+ * is allocated with `malloc()`.
+ */
+char *get_default_cache_directory(void);
+/* Start a cache key for the given compiler version. */
+struct hash128 new_cache_key(const char *compiler_version);
+/* Add an option which affects compilation to a cache key. */
+struct hash128 hash_cache_option(struct hash128 key, const char *option);
+/* Get the path of the entry for some source code. The path is allocated with `malloc()`. */
+char *get_cache_entry_path(const char *directory, struct hash128 key,
+                           const char *source, size_t length);
+/* Read a module from the cache. Returns false if there is no (valid) entry. The whole entry is
+ * read and checked up front, so a module read from the cache never needs loading lazily.
+ */
+bool read_cached_module(const char *path, struct module *module);
+/* Write a module to the cache, creating the cache directory if need be. Failing to write the
+ * entry isn't an error, so this only prints a warning.
+ */
+void write_cached_module(const char *path, struct module *module);
+
+#endif
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -29,9 +30,11 @@ struct parser {
 struct compiler {
     struct parser parser;
     struct symbol_dictionary *symbols;
+    struct symbol_scopes scopes;
     struct function *function;
     struct module *module;
     struct region *temp;
+    struct compile_listener *listener;
     int for_loop_level;
     int func_index;
 };
@@ -49,21 +52,25 @@ static struct parser new_parser(struct lexer lexer) {
     };
 }
 
-static void init_compiler(struct compiler *compiler, const char *src, struct module *module,
-                          struct symbol_dictionary *symbols) {
+static void init_compiler(struct compiler *compiler, const char *src, const char *src_end,
+                          struct module *module, struct symbol_dictionary *symbols,
+                          struct compile_listener *listener) {
     compiler->function = NULL;  // Will be set later.
     compiler->func_index = 0;
     struct lexer lexer = {0};  // TODO: introduce `new_lexer()`.
-    init_lexer(&lexer, src, NULL, module->filename);
+    init_lexer(&lexer, src, src_end, module->filename);
     compiler->parser = new_parser(lexer);
     compiler->symbols = symbols;
+    init_symbol_scopes(&compiler->scopes, symbols);
     compiler->for_loop_level = 0;
     compiler->module = module;
     compiler->temp = new_region(TEMP_REGION_SIZE);
     CHECK_ALLOCATION(compiler->temp);
+    compiler->listener = listener;
 }
 
 static void free_compiler(struct compiler *compiler) {
+    free_symbol_scopes(&compiler->scopes);
     kill_region(compiler->temp);
     compiler->temp = NULL;
 }
@@ -88,6 +95,24 @@ static void compile_error(struct compiler *compiler, const char *restrict messag
     fprintf(stderr, "\n");
 }
 
+static void begin_table_update(struct compiler *compiler) {
+    if (compiler->listener != NULL) {
+        compiler->listener->begin_table_update(compiler->listener->context);
+    }
+}
+
+static void end_table_update(struct compiler *compiler) {
+    if (compiler->listener != NULL) {
+        compiler->listener->end_table_update(compiler->listener->context);
+    }
+}
+
+static void notify_function_compiled(struct compiler *compiler, int func_index) {
+    if (compiler->listener != NULL) {
+        compiler->listener->function_compiled(compiler->listener->context, func_index);
+    }
+}
+
 static bool is_at_end(struct compiler *compiler) {
     return compiler->parser.current_token.type == TOKEN_EOT;
 }
@@ -449,12 +474,11 @@ static struct string_view normalise_number(struct compiler *compiler, struct str
     const char *end = SV_END(num_view);
     struct string_builder builder = {0};  // Empty builder.
     struct string_builder *sb = &builder;
-    // NOTE: the update clause, `curr_start = curr_end + 1` may look like it could potentially invoke UB,
-    // since `curr_end` could be equal to `end`, making `curr_start == curr_end + 1`, or, 2-past-the-end
-    // of the string view. However, since we know the underlying string will be null-terminated, we can be
-    // safe in the knowledge that `end` points to at most the null terminator, so `end + 1` is actually
-    // only 1-past-the-end, which is fine -- no UB.
-    for (const char *curr_end, *curr_start = num_view.start; curr_start < end; curr_start = curr_end + 1) {
+    // NOTE: the source code isn't null-terminated (it may be a mapped file), so `end` could be the very
+    // end of the source. The update clause therefore stops at `end` rather than stepping past it, which
+    // would form a pointer 2-past-the-end of the string view (UB).
+    for (const char *curr_end, *curr_start = num_view.start; curr_start < end;
+         curr_start = (curr_end < end) ? curr_end + 1 : end) {
         curr_end = memchr(curr_start, '_', end - curr_start);
         if (curr_end == NULL) {
             // Why does memchr() return NULL on failure?! grrr...
@@ -637,6 +661,8 @@ static void compile_for_loop(struct compiler *compiler) {
     enum t_opcode start_instruction = T_OP_FOR_DEC_START;
     enum t_opcode update_instruction = T_OP_FOR_DEC;
     int loop_level_offset = 1;
+    // The loop variable is only visible in the loop (but variables declared in it are not).
+    int loop_var_index = -1;
     if (match(compiler, TOKEN_SYMBOL)) {
         struct symbol symbol = {
             .name = peek_previous(compiler).value,
@@ -644,13 +670,15 @@ static void compile_for_loop(struct compiler *compiler) {
             .loop_var.level = compiler->for_loop_level + 1
         };
         if (match(compiler, TOKEN_FROM)) {
-            insert_symbol(compiler->symbols, &symbol);
+            loop_var_index = open_scope(&compiler->scopes);
+            insert_scoped_symbol(&compiler->scopes, &symbol);
         } else if (match(compiler, TOKEN_TO)) {
             start_instruction = T_OP_FOR_INC_START;
             update_instruction = T_OP_FOR_INC;
             ++loop_level_offset;  // +1 for loop target.
             ++symbol.loop_var.level;  // Store loop counter above target in loop stack.
-            insert_symbol(compiler->symbols, &symbol);
+            loop_var_index = open_scope(&compiler->scopes);
+            insert_scoped_symbol(&compiler->scopes, &symbol);
         }
         else {
             // Symbol was part of count.
@@ -677,6 +705,9 @@ static void compile_for_loop(struct compiler *compiler) {
     add_jump(block, block->count);
 
     compiler->for_loop_level -= loop_level_offset;
+    if (loop_var_index >= 0) {
+        remove_scoped_symbol(&compiler->scopes, loop_var_index);
+    }
     expect_consume(compiler, TOKEN_END, "Expect `end` after `for` loop.");
 }
 
@@ -802,7 +833,9 @@ static struct string_builder parse_string(struct compiler *compiler) {
 static void compile_string(struct compiler *compiler) {
     START_TEMP(compiler);
     struct string_builder builder = parse_string(compiler);
+    begin_table_update(compiler);
     uint32_t index = write_string(compiler->module, &builder);
+    end_table_update(compiler);
     END_TEMP(compiler);
     emit_immediate_uv(compiler, T_OP_LOAD_STRING8, index);
 }
@@ -875,11 +908,13 @@ static type_index parse_type(struct compiler *compiler, struct token token) {
         swap_parsers(compiler, main_parser);
         /* ----- END SWAPPED PARSERS ------ */
         struct string_view token_sv = token_to_sv(token, compiler->temp);
-        struct symbol *symbol = lookup_symbol(compiler->symbols, &token_sv);
+        struct symbol *symbol = lookup_scoped_symbol(&compiler->scopes, &token_sv);
         type_index array_type = TYPE_ERROR;
         if (symbol == NULL) {
             // Define type and add symbol to symbol table.
+            begin_table_update(compiler);
             array_type = new_type(&compiler->module->types, &token_sv);
+            end_table_update(compiler);
             struct type_info info = {
                 .kind = KIND_ARRAY,
                 .array = {
@@ -889,7 +924,9 @@ static type_index parse_type(struct compiler *compiler, struct token token) {
             };
             // Copy temporary allocation to permanent allocation.
             struct string_view symbol_sv = copy_view_in_region(&token_sv, compiler->module->region);
+            begin_table_update(compiler);
             init_type(&compiler->module->types, array_type, &info);
+            end_table_update(compiler);
             symbol = &(struct symbol) {
                 .name = symbol_sv,
                 .type = SYM_ARRAY,
@@ -922,7 +959,7 @@ static type_index parse_type(struct compiler *compiler, struct token token) {
     case TOKEN_WORD: return TYPE_WORD;
     case TOKEN_STRING: return TYPE_STRING;
     case TOKEN_SYMBOL: {
-        struct symbol *symbol = lookup_symbol(compiler->symbols, &token.value);
+        struct symbol *symbol = lookup_scoped_symbol(&compiler->scopes, &token.value);
         if (symbol == NULL) return TYPE_ERROR;
         switch (symbol->type) {
         case SYM_COMP: return symbol->comp.index;
@@ -940,7 +977,9 @@ static type_index parse_type(struct compiler *compiler, struct token token) {
 static void compile_pack(struct compiler *compiler) {
     expect_consume(compiler, TOKEN_SYMBOL, "Expect pack name after `pack`.");
     struct string_view name = peek_previous(compiler).value;
+    begin_table_update(compiler);
     type_index index = new_type(&compiler->module->types, &name);
+    end_table_update(compiler);
     struct symbol symbol = {
         .name = name,
         .type = SYM_PACK,
@@ -983,14 +1022,18 @@ static void compile_pack(struct compiler *compiler) {
     expect_consume(compiler, TOKEN_END, "Expect `end` after pack definition.");
     info.pack.field_count = field_count;
     info.pack.size = size;
+    begin_table_update(compiler);
     init_type(&compiler->module->types, index, &info);
+    end_table_update(compiler);
 }
 
 static void compile_comp(struct compiler *compiler) {
     START_TEMP(compiler);
     expect_consume(compiler, TOKEN_SYMBOL, "Expect symbol after `comp`.");
     struct string_view name = peek_previous(compiler).value;
+    begin_table_update(compiler);
     type_index index = new_type(&compiler->module->types, &name);
+    end_table_update(compiler);
     struct symbol symbol = {
         .name = name,
         .type = SYM_COMP,
@@ -1054,7 +1097,9 @@ static void compile_comp(struct compiler *compiler) {
         info.comp.offsets[i] = word_count - current->offset;
         current = current->next;
     }
+    begin_table_update(compiler);
     init_type(&compiler->module->types, index, &info);
+    end_table_update(compiler);
     END_TEMP(compiler);
 }
 
@@ -1144,7 +1189,13 @@ static void compile_var(struct compiler *compiler) {
                 .function = compiler->func_index,
             },
         };
-        insert_symbol(compiler->symbols, &symbol);
+        if (compiler->func_index == 0) {
+            // Variables of the main function are global, so later definitions replace them.
+            insert_symbol(compiler->symbols, &symbol);
+        }
+        else {
+            insert_scoped_symbol(&compiler->scopes, &symbol);
+        }
     }
     expect_consume(compiler, TOKEN_END, "Expect `end` after `var` block.");
 }
@@ -1168,7 +1219,7 @@ static void compile_assignment(struct compiler *compiler) {
     }
     expect_consume(compiler, TOKEN_SYMBOL, "Expect symbol after `<-`");
     struct string_view name = peek_previous(compiler).value;
-    struct symbol *symbol = lookup_symbol(compiler->symbols, &name);
+    struct symbol *symbol = lookup_scoped_symbol(&compiler->scopes, &name);
     if (symbol == NULL) {
         compile_error(compiler, "Unknown symbol '"PRI_SV"'", SV_FMT(name));
         exit(1);
@@ -1285,7 +1336,10 @@ static void compile_function(struct compiler *compiler) {
     struct string_view name = {0};
     struct signature sig = parse_signature(compiler, &name);
     expect_consume(compiler, TOKEN_DEF, "Expect `def` after function signature.");
+    begin_table_update(compiler);
     int index = add_function(&compiler->module->functions, sig);
+    add_link_symbol(compiler->module, LINK_SYMBOL_EXPORT, index, &name);
+    end_table_update(compiler);
     struct symbol symbol = {
         .name = name,
         .type = SYM_FUNCTION,
@@ -1293,24 +1347,58 @@ static void compile_function(struct compiler *compiler) {
     };
     insert_symbol(compiler->symbols, &symbol);
     int prev_func_index = enter_function(compiler, index);
+    int scope = open_scope(&compiler->scopes);  // Local variables are only visible inside.
     compile_expr(compiler);  // Body.
     if (!check_last_instruction(compiler, T_OP_RET) || is_jump_dest(block, block->count)) {
         // Implicit return at end of function. Only emit if we need it.
         emit_simple(compiler, T_OP_RET);
     }
+    close_scope(&compiler->scopes, scope);
     leave_function(compiler, prev_func_index);
+    notify_function_compiled(compiler, index);
     expect_consume(compiler, TOKEN_END, "Expect `end` after function body.");
 }
 
+static void compile_module_import(struct compiler *compiler) {
+    /* `import` `def` (`func` sig `end`) ... `end` */
+    while (!check(compiler, TOKEN_END)) {
+        expect_consume(compiler, TOKEN_FUNC,
+                       "Expect `func` before imported function declaration.");
+        struct string_view name = {0};
+        struct signature sig = parse_signature(compiler, &name);
+        begin_table_update(compiler);
+        int index = add_function(&compiler->module->functions, sig);
+        get_function(&compiler->module->functions, index)->is_imported = true;
+        add_link_symbol(compiler->module, LINK_SYMBOL_IMPORT, index, &name);
+        end_table_update(compiler);
+        reset_function(compiler);  // Adding a function may have moved the current one.
+        struct symbol symbol = {
+            .name = name,
+            .type = SYM_FUNCTION,
+            .function.index = index
+        };
+        insert_symbol(compiler->symbols, &symbol);
+        expect_consume(compiler, TOKEN_END, "Expect `end` after imported function declaration.");
+    }
+    expect_consume(compiler, TOKEN_END, "Expect `end` after imported function list.");
+}
+
 static void compile_import(struct compiler *compiler) {
     /* `import` name `def` (`func` sig [`from` name] [`with` call-conv] `end`) ... `end` */
+    if (match(compiler, TOKEN_DEF)) {
+        // Without a library name, the functions are imported from another Bude module.
+        compile_module_import(compiler);
+        return;
+    }
     START_TEMP(compiler);
     struct ext_lib_table *ext_libraries = &compiler->module->ext_libraries;
     expect_consume(compiler, TOKEN_SYMBOL, "Expect external library name.");
     struct string_view lib_name = peek_previous(compiler).value;
+    begin_table_update(compiler);
     write_string(compiler->module, &SB_FROM_SV(lib_name));
+    end_table_update(compiler);
     expect_consume(compiler, TOKEN_DEF, "Expect `def` after external library name.");
-    struct symbol *lib_symbol = lookup_symbol(compiler->symbols, &lib_name);
+    struct symbol *lib_symbol = lookup_scoped_symbol(&compiler->scopes, &lib_name);
     if (lib_symbol == NULL || lib_symbol->type != SYM_EXT_LIBRARY) {
         parse_error(
             compiler,
@@ -1332,7 +1420,9 @@ static void compile_import(struct compiler *compiler) {
                            "Expect external function name after `from`.");
             ext_builder = parse_string(compiler);
         }
+        begin_table_update(compiler);
         uint32_t ext_name_index = write_string(compiler->module, &ext_builder);
+        end_table_update(compiler);
         struct string_view *ext_name = read_string(compiler->module, ext_name_index);
         enum calling_convention call_conv = CC_NATIVE;
         if (match(compiler, TOKEN_WITH)) {
@@ -1357,7 +1447,15 @@ static void compile_import(struct compiler *compiler) {
             }
         }
         struct ext_function external = {.sig = sig, .name = *ext_name, .call_conv = call_conv};
+        const char *signature_error = check_ext_signature(&external);
+        if (signature_error != NULL) {
+            parse_error(compiler, "Cannot import external function '%"PRI_SV"': %s.",
+                        SV_FMT(ext_symbol.name), signature_error);
+            exit(1);
+        }
+        begin_table_update(compiler);
         int ext_index = add_external(&compiler->module->externals, library, &external);
+        end_table_update(compiler);
         ext_symbol.ext_function.index = ext_index;
         insert_symbol(compiler->symbols, &ext_symbol);
         expect_consume(compiler, TOKEN_END, "Expect `end` after external function declaration.");
@@ -1418,7 +1516,7 @@ static void compile_ext_function_symbol(struct compiler *compiler, struct symbol
 
 static void compile_symbol(struct compiler *compiler) {
     struct string_view symbol_text = peek_previous(compiler).value;
-    struct symbol *symbol = lookup_symbol(compiler->symbols, &symbol_text);
+    struct symbol *symbol = lookup_scoped_symbol(&compiler->scopes, &symbol_text);
     if (symbol == NULL) {
         compile_error(compiler, "unknown symbol '%"PRI_SV"'.\n", SV_FMT(symbol_text));
         exit(1);
@@ -1647,14 +1745,16 @@ static void compile_expr(struct compiler *compiler) {
     }
 }
 
-void compile(const char *src, struct module *module, struct symbol_dictionary *symbols) {
+void compile(const char *src, const char *src_end, struct module *module,
+             struct symbol_dictionary *symbols, struct compile_listener *listener) {
     struct compiler compiler;
-    init_compiler(&compiler, src, module, symbols);
+    init_compiler(&compiler, src, src_end, module, symbols, listener);
     init_builtins(compiler.symbols);
     assert(module->functions.count == 0);  // We assume that the function table is empty.
     add_function(&module->functions, (struct signature){0});  // Main/script function.
     enter_function(&compiler, 0);
     compile_expr(&compiler);
     emit_simple(&compiler, T_OP_RET);  // Return from main function.
+    notify_function_compiled(&compiler, 0);
     free_compiler(&compiler);
 }
@@ -5,6 +5,20 @@
 #include "module.h"
 #include "symbol.h"
 
-void compile(const char *src, struct module *module, struct symbol_dictionary *symbols);
+/* Callbacks which let later stages work on a module while it is still being compiled. */
+struct compile_listener {
+    void *context;
+    // Called once the code for a function is complete. The main function is always last.
+    void (*function_compiled)(void *context, int func_index);
+    // Called around any change to the module's function, type, external or string tables.
+    void (*begin_table_update)(void *context);
+    void (*end_table_update)(void *context);
+};
+
+/* Compile the source code from `src` up to `src_end` into `module`. The source needn't be
+ * null-terminated, unless `src_end` is NULL. The listener may be NULL.
+ */
+void compile(const char *src, const char *src_end, struct module *module,
+             struct symbol_dictionary *symbols, struct compile_listener *listener);
 
 #endif
@@ -858,7 +858,15 @@ static instr_disasm get_disassembler(struct ir_block *block) {
 
 void disassemble_block(struct ir_block *block, struct module *module) {
     instr_disasm disassemble_instruction = get_disassembler(block);
+    size_t line = 0;
+    int run = -1;
     for (int offset = 0; offset < block->count; ) {
+        struct location location = get_next_location(block, offset, &run);
+        if (location.line != line && location.line != 0) {
+            // Mark where the code for each source line starts.
+            printf("-- line %zu --\n", location.line);
+            line = location.line;
+        }
         offset = disassemble_instruction(block, module, offset);
     }
 }
@@ -0,0 +1,284 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include "ext_call.h"
+#include "memory.h"
+#include "type_punning.h"
+
+/* External calls from the interpreter.
+ *
+ * An external function is called through a trampoline: a C function which casts the function's
+ * address to a concrete function type and calls it with arguments taken from an array of slots.
+ * The integer and SSE registers are filled independently of one another under the System V
+ * AMD64 convention, so every signature maps onto one of a small number of function types, which
+ * differ only in how the result is returned and how many words go on the native stack. Any
+ * unused register or stack slot is simply ignored by the callee.
+ *
+ * Each external function is classified once, when it is bound, so calling it only involves
+ * scattering the parameters into their slots and an indirect call through the trampoline.
+ *
+ * NOTE: Variadic callees expect al to hold an upper bound on the number of SSE registers used.
+ * The trampolines call through non-variadic function types, so al is not set.
+ */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define EXT_CALL_SYSV_HOST
+#endif
+
+enum ext_ret_kind {
+    EXT_RET_INT,
+    EXT_RET_SSE,
+    EXT_RET_INT_INT,
+    EXT_RET_INT_SSE,
+    EXT_RET_SSE_INT,
+    EXT_RET_SSE_SSE,
+    EXT_RET_KIND_COUNT,
+};
+
+struct ext_int_int {uint64_t a; uint64_t b;};
+struct ext_int_sse {uint64_t a; double b;};
+struct ext_sse_int {double a; uint64_t b;};
+struct ext_sse_sse {double a; double b;};
+
+#define REG_PARAMS                                                      \
+    uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,         \
+    double, double, double, double, double, double, double, double
+
+#define REG_ARGS(args)                                                  \
+    (args)[0], (args)[1], (args)[2], (args)[3], (args)[4], (args)[5],   \
+    u64_to_f64((args)[6]), u64_to_f64((args)[7]), u64_to_f64((args)[8]), \
+    u64_to_f64((args)[9]), u64_to_f64((args)[10]), u64_to_f64((args)[11]), \
+    u64_to_f64((args)[12]), u64_to_f64((args)[13])
+
+static_assert(EXT_CALL_STACK_SLOTS == 14);
+
+#define STACK_PARAMS_0
+#define STACK_PARAMS_2 , uint64_t, uint64_t
+#define STACK_PARAMS_4 STACK_PARAMS_2, uint64_t, uint64_t
+#define STACK_PARAMS_8 STACK_PARAMS_4, uint64_t, uint64_t, uint64_t, uint64_t
+#define STACK_PARAMS_16 STACK_PARAMS_8, uint64_t, uint64_t, uint64_t, uint64_t, \
+        uint64_t, uint64_t, uint64_t, uint64_t
+
+#define STACK_ARGS_0(args)
+#define STACK_ARGS_2(args) , (args)[14], (args)[15]
+#define STACK_ARGS_4(args) STACK_ARGS_2(args), (args)[16], (args)[17]
+#define STACK_ARGS_8(args) STACK_ARGS_4(args), (args)[18], (args)[19], (args)[20], (args)[21]
+#define STACK_ARGS_16(args) STACK_ARGS_8(args), (args)[22], (args)[23], (args)[24], \
+        (args)[25], (args)[26], (args)[27], (args)[28], (args)[29]
+
+static_assert(EXT_CALL_SLOT_COUNT == 30);
+
+#define CONVERT_INT(r) {{(r)}}
+#define CONVERT_SSE(r) {{f64_to_u64(r)}}
+#define CONVERT_INT_INT(r) {{(r).a, (r).b}}
+#define CONVERT_INT_SSE(r) {{(r).a, f64_to_u64((r).b)}}
+#define CONVERT_SSE_INT(r) {{f64_to_u64((r).a), (r).b}}
+#define CONVERT_SSE_SSE(r) {{f64_to_u64((r).a), f64_to_u64((r).b)}}
+
+#define DEFINE_TRAMPOLINE(name, ret_type, convert, n)                   \
+    static struct ext_result name##_##n(ext_address address,            \
+                                        const stack_word args[EXT_CALL_SLOT_COUNT]) { \
+        ret_type (*function)(REG_PARAMS STACK_PARAMS_##n) =             \
+            (ret_type (*)(REG_PARAMS STACK_PARAMS_##n))address;         \
+        ret_type result = function(REG_ARGS(args) STACK_ARGS_##n(args)); \
+        return (struct ext_result) convert(result);                     \
+    }
+
+#define DEFINE_TRAMPOLINES(name, ret_type, convert) \
+    DEFINE_TRAMPOLINE(name, ret_type, convert, 0)   \
+    DEFINE_TRAMPOLINE(name, ret_type, convert, 2)   \
+    DEFINE_TRAMPOLINE(name, ret_type, convert, 4)   \
+    DEFINE_TRAMPOLINE(name, ret_type, convert, 8)   \
+    DEFINE_TRAMPOLINE(name, ret_type, convert, 16)
+
+#define TRAMPOLINE_ROW(name) {name##_0, name##_2, name##_4, name##_8, name##_16}
+#define STACK_BUCKET_COUNT 5
+
+DEFINE_TRAMPOLINES(trampoline_int, uint64_t, CONVERT_INT)
+DEFINE_TRAMPOLINES(trampoline_sse, double, CONVERT_SSE)
+DEFINE_TRAMPOLINES(trampoline_int_int, struct ext_int_int, CONVERT_INT_INT)
+DEFINE_TRAMPOLINES(trampoline_int_sse, struct ext_int_sse, CONVERT_INT_SSE)
+DEFINE_TRAMPOLINES(trampoline_sse_int, struct ext_sse_int, CONVERT_SSE_INT)
+DEFINE_TRAMPOLINES(trampoline_sse_sse, struct ext_sse_sse, CONVERT_SSE_SSE)
+
+static const ext_trampoline trampolines[EXT_RET_KIND_COUNT][STACK_BUCKET_COUNT] = {
+    [EXT_RET_INT]     = TRAMPOLINE_ROW(trampoline_int),
+    [EXT_RET_SSE]     = TRAMPOLINE_ROW(trampoline_sse),
+    [EXT_RET_INT_INT] = TRAMPOLINE_ROW(trampoline_int_int),
+    [EXT_RET_INT_SSE] = TRAMPOLINE_ROW(trampoline_int_sse),
+    [EXT_RET_SSE_INT] = TRAMPOLINE_ROW(trampoline_sse_int),
+    [EXT_RET_SSE_SSE] = TRAMPOLINE_ROW(trampoline_sse_sse),
+};
+
+static int stack_bucket(int stack_word_count) {
+    assert(0 <= stack_word_count && stack_word_count <= EXT_CALL_MAX_STACK_WORDS);
+    if (stack_word_count == 0) return 0;
+    if (stack_word_count <= 2) return 1;
+    if (stack_word_count <= 4) return 2;
+    if (stack_word_count <= 8) return 3;
+    return 4;
+}
+
+static enum ext_ret_kind get_ret_kind(int word_count, enum sysv_class classes[SYSV_MAX_REG_WORDS]) {
+    // No result and MEMORY results both use the INTEGER trampoline; rax is ignored.
+    if (word_count == 0 || classes[0] == SYSV_MEMORY) return EXT_RET_INT;
+    if (word_count == 1) {
+        return (classes[0] == SYSV_SSE) ? EXT_RET_SSE : EXT_RET_INT;
+    }
+    assert(word_count == 2);
+    if (classes[0] == SYSV_SSE) {
+        return (classes[1] == SYSV_SSE) ? EXT_RET_SSE_SSE : EXT_RET_SSE_INT;
+    }
+    return (classes[1] == SYSV_SSE) ? EXT_RET_INT_SSE : EXT_RET_INT_INT;
+}
+
+static bool is_supported_call_conv(enum calling_convention call_conv) {
+#ifdef EXT_CALL_SYSV_HOST
+    return call_conv == CC_SYSV_AMD64 || call_conv == CC_NATIVE;
+#else
+    (void)call_conv;
+    return false;
+#endif
+}
+
+bool bind_external(struct type_table *types, struct ext_function *external,
+                   ext_address address, struct ext_binding *binding) {
+    if (!is_supported_call_conv(external->call_conv)) return false;
+    int param_count = external->sig.param_count;
+    type_index *params = external->sig.params;
+    if (check_ext_signature(external) != NULL) return false;
+    type_index ret_type = (external->sig.ret_count > 0) ? external->sig.rets[0] : TYPE_ERROR;
+    enum sysv_class ret_classes[SYSV_MAX_REG_WORDS] = {0};
+    int ret_word_count = (ret_type != TYPE_ERROR)
+        ? classify_sysv_amd64(types, ret_type, ret_classes)
+        : 0;
+    bool memory_ret = ret_word_count > 0 && ret_classes[0] == SYSV_MEMORY;
+    int param_word_count = 0;
+    for (int i = 0; i < param_count; ++i) {
+        param_word_count += type_word_count(types, params[i]);
+    }
+    uint8_t *arg_slots = (param_word_count > 0)
+        ? allocate_array(param_word_count, sizeof *arg_slots)
+        : NULL;
+    int int_slot = EXT_CALL_INT_SLOTS + memory_ret;  // The hidden return pointer comes first.
+    int sse_slot = EXT_CALL_SSE_SLOTS;
+    int stack_slot = EXT_CALL_STACK_SLOTS;
+    int word = 0;
+    for (int i = 0; i < param_count; ++i) {
+        enum sysv_class classes[SYSV_MAX_REG_WORDS];
+        int word_count = classify_sysv_amd64(types, params[i], classes);
+        int int_words = 0;
+        int sse_words = 0;
+        if (classes[0] != SYSV_MEMORY) {
+            for (int j = 0; j < word_count; ++j) {
+                if (classes[j] == SYSV_SSE) {
+                    ++sse_words;
+                }
+                else {
+                    ++int_words;
+                }
+            }
+        }
+        bool on_stack = classes[0] == SYSV_MEMORY
+            || int_slot + int_words > EXT_CALL_SSE_SLOTS
+            || sse_slot + sse_words > EXT_CALL_STACK_SLOTS;
+        if (on_stack && stack_slot + word_count > EXT_CALL_SLOT_COUNT) {
+            free_array(arg_slots, param_word_count, sizeof *arg_slots);
+            return false;
+        }
+        for (int j = 0; j < word_count; ++j) {
+            if (on_stack) {
+                arg_slots[word++] = stack_slot++;
+            }
+            else if (classes[j] == SYSV_SSE) {
+                arg_slots[word++] = sse_slot++;
+            }
+            else {
+                arg_slots[word++] = int_slot++;
+            }
+        }
+    }
+    assert(word == param_word_count);
+    int stack_word_count = stack_slot - EXT_CALL_STACK_SLOTS;
+    enum ext_ret_kind ret_kind = get_ret_kind(ret_word_count, ret_classes);
+    // A single-word result narrower than a word (including an f32 in xmm0) has undefined upper
+    // bytes, which are masked off by `extend_ext_result()`.
+    bool narrow_ret = ret_word_count == 1 && (ret_kind == EXT_RET_INT || ret_kind == EXT_RET_SSE);
+    *binding = (struct ext_binding) {
+        .address = address,
+        .trampoline = trampolines[ret_kind][stack_bucket(stack_word_count)],
+        .param_word_count = param_word_count,
+        .ret_word_count = ret_word_count,
+        .ret_size = (narrow_ret) ? (int)type_size(types, ret_type) : (int)sizeof(stack_word),
+        .memory_ret = memory_ret,
+        .arg_slots = arg_slots,
+    };
+    return true;
+}
+
+void unbind_external(struct ext_binding *binding) {
+    free_array(binding->arg_slots, binding->param_word_count, sizeof binding->arg_slots[0]);
+    *binding = (struct ext_binding) {0};
+}
+
+stack_word extend_ext_result(const struct ext_binding *binding, stack_word word) {
+    // Only the low bytes of a narrow result are defined. Like the generated code, we zero-extend
+    // them, even for signed types; Bude only sign-extends with the SX instructions.
+    if (binding->ret_size <= 0 || binding->ret_size >= (int)sizeof word) return word;
+    int shift = 8 * ((int)sizeof word - binding->ret_size);
+    return (word << shift) >> shift;
+}
+
+#if defined(_WIN32)
+
+void *open_ext_library(const char *filename) {
+    return LoadLibraryA(filename);
+}
+
+ext_address lookup_ext_symbol(void *library, const char *name) {
+    return (ext_address)GetProcAddress(library, name);
+}
+
+void close_ext_library(void *library) {
+    FreeLibrary(library);
+}
+
+const char *ext_library_error(void) {
+    static char message[32];
+    snprintf(message, sizeof message, "error code %lu", GetLastError());
+    return message;
+}
+
+#else
+
+void *open_ext_library(const char *filename) {
+    return dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+}
+
+ext_address lookup_ext_symbol(void *library, const char *name) {
+    void *symbol = dlsym(library, name);
+    // ISO C doesn't allow casting between object and function pointers, but POSIX guarantees
+    // that their representations are the same.
+    ext_address address;
+    static_assert(sizeof address == sizeof symbol);
+    memcpy(&address, &symbol, sizeof address);
+    return address;
+}
+
+void close_ext_library(void *library) {
+    dlclose(library);
+}
+
+const char *ext_library_error(void) {
+    const char *message = dlerror();
+    return (message != NULL) ? message : "unknown error";
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef EXT_CALL_H
+#define EXT_CALL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ext_function.h"
+#include "stack.h"
+#include "type.h"
+
+/* Argument slots passed to a trampoline. The first SYSV_INT_REG_COUNT slots are the INTEGER
+ * registers, the next SYSV_SSE_REG_COUNT slots are the SSE registers and the rest are words
+ * passed on the native stack.
+ */
+#define EXT_CALL_INT_SLOTS 0
+#define EXT_CALL_SSE_SLOTS (EXT_CALL_INT_SLOTS + SYSV_INT_REG_COUNT)
+#define EXT_CALL_STACK_SLOTS (EXT_CALL_SSE_SLOTS + SYSV_SSE_REG_COUNT)
+#define EXT_CALL_MAX_STACK_WORDS 16
+#define EXT_CALL_SLOT_COUNT (EXT_CALL_STACK_SLOTS + EXT_CALL_MAX_STACK_WORDS)
+
+/* Generic function pointer type for external functions. The trampoline casts it to the correct
+ * type for the call.
+ */
+typedef void (*ext_address)(void);
+
+struct ext_result {
+    stack_word words[SYSV_MAX_REG_WORDS];
+};
+
+typedef struct ext_result (*ext_trampoline)(ext_address address,
+                                            const stack_word args[EXT_CALL_SLOT_COUNT]);
+
+struct ext_binding {
+    ext_address address;
+    ext_trampoline trampoline;
+    int param_word_count;
+    int ret_word_count;
+    int ret_size;  // Size in bytes of a single-word result, for masking.
+    bool memory_ret;
+    uint8_t *arg_slots;  // The argument slot of each parameter word, in stack order.
+};
+
+void *open_ext_library(const char *filename);
+ext_address lookup_ext_symbol(void *library, const char *name);
+void close_ext_library(void *library);
+const char *ext_library_error(void);
+
+bool bind_external(struct type_table *types, struct ext_function *external,
+                   ext_address address, struct ext_binding *binding);
+void unbind_external(struct ext_binding *binding);
+
+stack_word extend_ext_result(const struct ext_binding *binding, stack_word word);
+
+#endif
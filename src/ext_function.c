@@ -59,3 +59,68 @@ struct ext_library *get_ext_library(struct ext_lib_table *libraries, int index)
     assert(0 <= index && index < libraries->count);
     return &libraries->items[index];
 }
+
+static void get_word_types(struct type_table *types, type_index type, type_index *word_types) {
+    // NOTE: word_types is in memory order, i.e., the first field comes first.
+    const struct type_info *info = lookup_type(types, type);
+    assert(info != NULL);
+    switch (info->kind) {
+    case KIND_COMP: {
+        int word_count = info->comp.word_count;
+        for (int i = 0; i < info->comp.field_count; ++i) {
+            int start = word_count - info->comp.offsets[i];
+            get_word_types(types, info->comp.fields[i], &word_types[start]);
+        }
+        break;
+    }
+    case KIND_ARRAY: {
+        type_index element_type = info->array.element_type;
+        int element_word_count = type_word_count(types, element_type);
+        for (int i = 0; i < info->array.element_count; ++i) {
+            get_word_types(types, element_type, &word_types[i * element_word_count]);
+        }
+        break;
+    }
+    default:
+        word_types[0] = type;
+        break;
+    }
+}
+
+static enum sysv_class classify_word_sysv_amd64(struct type_table *types, type_index type) {
+    if (is_float(type)) return SYSV_SSE;
+    if (!is_pack(types, type)) return SYSV_INTEGER;
+    // A pack is SSE only if every field is a float.
+    const struct type_info *info = lookup_type(types, type);
+    for (int i = 0; i < info->pack.field_count; ++i) {
+        if (!is_float(info->pack.fields[i])) return SYSV_INTEGER;
+    }
+    return SYSV_SSE;
+}
+
+/* Classify each word of a type, returning the word count. Types too big for registers are
+ * classified as MEMORY in their entirety.
+ */
+int classify_sysv_amd64(struct type_table *types, type_index type,
+                        enum sysv_class classes[SYSV_MAX_REG_WORDS]) {
+    int word_count = type_word_count(types, type);
+    assert(word_count > 0);
+    if (word_count > SYSV_MAX_REG_WORDS) {
+        classes[0] = SYSV_MEMORY;
+        return word_count;
+    }
+    type_index word_types[SYSV_MAX_REG_WORDS];
+    get_word_types(types, type, word_types);
+    for (int i = 0; i < word_count; ++i) {
+        classes[i] = classify_word_sysv_amd64(types, word_types[i]);
+    }
+    return word_count;
+}
+
+const char *check_ext_signature(const struct ext_function *external) {
+    // Native calling conventions return a single value, in registers or through memory.
+    if (external->call_conv != CC_BUDE && external->sig.ret_count > 1) {
+        return "only the `bude` calling convention can return more than one value";
+    }
+    return NULL;
+}
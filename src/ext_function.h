@@ -16,6 +16,19 @@ enum link_type {
     LINK_DYNAMIC,
 };
 
+/* System V AMD64 argument classes. Each word of a parameter or return value is classified
+ * separately, except that types too big for registers are MEMORY in their entirety.
+ */
+enum sysv_class {
+    SYSV_INTEGER,
+    SYSV_SSE,
+    SYSV_MEMORY,
+};
+
+#define SYSV_INT_REG_COUNT 6
+#define SYSV_SSE_REG_COUNT 8
+#define SYSV_MAX_REG_WORDS 2
+
 struct ext_function {
     struct signature sig;
     struct string_view name;
@@ -55,4 +68,12 @@ struct ext_function *get_external(struct external_table *externals, int index);
 int add_ext_library(struct ext_lib_table *libraries, struct ext_library library);
 struct ext_library *get_ext_library(struct ext_lib_table *libraries, int index);
 
+int classify_sysv_amd64(struct type_table *types, type_index type,
+                        enum sysv_class classes[SYSV_MAX_REG_WORDS]);
+
+/* Check that an external function can be called with its calling convention. Returns a
+ * description of the problem if it can't, or NULL if it can.
+ */
+const char *check_ext_signature(const struct ext_function *external);
+
 #endif
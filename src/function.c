@@ -11,7 +11,7 @@ static void init_local_table(struct local_table *locals) {
 }
 
 static void free_local_table(struct local_table *locals) {
-    INIT_DARRAY(locals, LOCALS_INIT_SIZE);
+    FREE_DARRAY(locals);
 }
 
 void init_function_table(struct function_table *functions) {
@@ -20,12 +20,15 @@ void init_function_table(struct function_table *functions) {
     CHECK_ALLOCATION(functions->region);
 }
 
+void free_function(struct function *function) {
+    free_block(&function->t_code);
+    free_block(&function->w_code);
+    free_local_table(&function->locals);
+}
+
 void free_function_table(struct function_table *functions) {
     for (int i = 0; i < functions->count; ++i) {
-        struct function function = functions->items[i];
-        free_block(&function.t_code);
-        free_block(&function.w_code);
-        free_local_table(&function.locals);
+        free_function(&functions->items[i]);
     }
     FREE_DARRAY(functions);
     kill_region(functions->region);
@@ -34,6 +34,10 @@ struct function {
     struct local_table locals;
     int max_for_loop_level;
     int locals_size;
+    /* Whether the function is only declared here and defined in another module (see linker.h).
+     * Its code is empty until the modules are linked.
+     */
+    bool is_imported;
 };
 
 struct function_table {
@@ -45,6 +49,11 @@ struct function_table {
 
 int add_local(struct function *function, type_index type);
 
+/* Free the code and locals of a function, but not its signature (which is in the table's
+ * region).
+ */
+void free_function(struct function *function);
+
 void init_function_table(struct function_table *functions);
 void free_function_table(struct function_table *functions);
 
@@ -1,12 +1,18 @@
 #include <assert.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 
 #include "asm.h"
 #include "ext_function.h"
 #include "function.h"
 #include "generator.h"
 #include "ir.h"
+#include "memory.h"
+#include "parallel.h"
+#include "peephole.h"
 #include "type_punning.h"
 #include "unicode.h"
 
@@ -31,6 +37,7 @@
 struct generator {
     struct asm_block *assembly;
     struct module *module;
+    struct asm_line_list lines;
     int loop_level;
 };
 
@@ -42,6 +49,83 @@ static void generate_header(struct generator *generator) {
     asm_write(assembly, "\n");
 }
 
+/* Block moves.
+ * Blocks of stack words which are too deep to live in rax/rdx are moved in memory. Small blocks
+ * (known at compile time) are moved with unrolled SSE loads and stores, two words at a time;
+ * large blocks use `rep movsq`. The caller says whether the move must run backwards (i.e. from
+ * high to low addresses), which is needed when the destination overlaps the source from above.
+ */
+
+#define BLOCK_MOVE_UNROLL_LIMIT 16  // Largest block (in words) to move with unrolled SSE.
+#define BLOCK_MOVE_CHUNK_SIZE 4     // Number of xmm registers loaded before storing.
+
+static void generate_move_chunk(struct asm_block *assembly, const char *dest, int dest_offset,
+                                const char *src, int src_offset, int start, int word_count) {
+    /* Move words [start, start + word_count) from src to dest. All loads are done before any
+     * stores, so the chunk may overlap itself. */
+    int reg = 0;
+    int i = 0;
+    for (; i + 2 <= word_count; i += 2, ++reg) {
+        asm_write_inst2f(assembly, "movdqu", "xmm%d", "[%s%+d]",
+                         reg, src, src_offset + 8 * (start + i));
+    }
+    if (i < word_count) {
+        asm_write_inst2f(assembly, "movq", "xmm%d", "qword [%s%+d]",
+                         reg, src, src_offset + 8 * (start + i));
+    }
+    reg = 0;
+    for (i = 0; i + 2 <= word_count; i += 2, ++reg) {
+        asm_write_inst2f(assembly, "movdqu", "[%s%+d]", "xmm%d",
+                         dest, dest_offset + 8 * (start + i), reg);
+    }
+    if (i < word_count) {
+        asm_write_inst2f(assembly, "movq", "qword [%s%+d]", "xmm%d",
+                         dest, dest_offset + 8 * (start + i), reg);
+    }
+}
+
+static void generate_block_move(struct asm_block *assembly, const char *dest, int dest_offset,
+                                const char *src, int src_offset, int word_count, bool backwards) {
+    /* Move word_count words from [src+src_offset] to [dest+dest_offset].
+     * Clobbers xmm0-xmm3, or rcx, r10 and r11 for large blocks. Does not touch rax or rdx. */
+    assert(word_count >= 0);
+    if (word_count == 0) return;
+    if (word_count <= BLOCK_MOVE_UNROLL_LIMIT) {
+        const int chunk_words = 2 * BLOCK_MOVE_CHUNK_SIZE;
+        if (!backwards) {
+            for (int start = 0; start < word_count; start += chunk_words) {
+                int count = (word_count - start < chunk_words) ? word_count - start : chunk_words;
+                generate_move_chunk(assembly, dest, dest_offset, src, src_offset, start, count);
+            }
+        }
+        else {
+            for (int end = word_count; end > 0; end -= chunk_words) {
+                int start = (end > chunk_words) ? end - chunk_words : 0;
+                generate_move_chunk(assembly, dest, dest_offset, src, src_offset,
+                                    start, end - start);
+            }
+        }
+        return;
+    }
+    // rsi and rdi hold the aux stack pointer and loop counter, so must be preserved.
+    asm_write_inst2(assembly, "mov", "r10", "rsi");
+    asm_write_inst2(assembly, "mov", "r11", "rdi");
+    int start = (backwards) ? 8 * (word_count - 1) : 0;
+    asm_write_inst2f(assembly, "lea", "rsi", "[%s%+d]", src, src_offset + start);
+    asm_write_inst2f(assembly, "lea", "rdi", "[%s%+d]", dest, dest_offset + start);
+    asm_write_inst2f(assembly, "mov", "ecx", "%d", word_count);
+    if (backwards) {
+        asm_write_inst0(assembly, "std");
+        asm_write_inst1(assembly, "rep", "movsq");
+        asm_write_inst0(assembly, "cld");
+    }
+    else {
+        asm_write_inst1(assembly, "rep", "movsq");
+    }
+    asm_write_inst2(assembly, "mov", "rsi", "r10");
+    asm_write_inst2(assembly, "mov", "rdi", "r11");
+}
+
 static void generate_popn(struct generator *generator, int n) {
     assert(n > 0);
     struct asm_block *assembly = generator->assembly;
@@ -70,8 +154,9 @@ static void generate_dupen(struct generator *generator, int n) {
     // 42 5 -7 42 rax:5 rdx:-7
     asm_write_inst1(assembly, "push", "rax");
     asm_write_inst1(assembly, "push", "rdx");
-    for (int i = 0; i < n - 2; ++i) {
-        asm_write_inst1f(assembly, "push", "qword [rsp+%d]", 8 * (n - 1));
+    if (n > 2) {
+        asm_write_inst2f(assembly, "sub", "rsp", "%d", 8 * (n - 2));
+        generate_block_move(assembly, "rsp", 0, "rsp", 8 * n, n - 2, false);
     }
 }
 
@@ -184,19 +269,18 @@ static void generate_subcomp_get(struct generator *generator, int offset, int si
         generate_comp_field_get(generator, offset);
         return;
     }
+    // [... (a b c d) e f g<] rax:h rdx:i, offset=9, size=4
+    // [... (a b c d) e f g h i a b<] rax:c rdx:d
     asm_write_inst1(assembly, "push", "rax");
     asm_write_inst1(assembly, "push", "rdx");
-    for (int i = 0; i < size - 2; ++i) {
-        asm_write_inst1f(assembly, "push", "qword [rsp+%d]", 8 * (offset - 1));
+    if (size > 2) {
+        asm_write_inst2f(assembly, "sub", "rsp", "%d", 8 * (size - 2));
+        generate_block_move(assembly, "rsp", 0, "rsp", 8 * offset, size - 2, false);
     }
-    if (offset >= size + 2) {
+    if (offset > size) {
         asm_write_inst2f(assembly, "mov", "rax", "[rsp+%d]", 8 * (offset - 1));
         asm_write_inst2f(assembly, "mov", "rdx", "[rsp+%d]", 8 * (offset - 2));
     }
-    else if (offset == size + 1) {
-        asm_write_inst2f(assembly, "mov", "rax", "[rsp+%d]", 8 * (offset - 1));
-        // rdx remains with same contents.
-    }
     // Else, offset == size, so rax and rdx already have the correct values.
 }
 
@@ -209,35 +293,34 @@ static void generate_subcomp_set(struct generator *generator, int offset, int si
         generate_comp_field_set(generator, offset);
         return;
     }
-    // [ .. .. (x y z a b c d< (e f))] (E F)
-    // offset = 2
-    for (int i = 0; i < size - 2; ++i) {
-        asm_write_inst1f(assembly, "pop", "qword [rsp+%d]", 8 * (offset - 4));
-    }
-    if (offset >= size + 1) {
-        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rdx", 8 * (offset - (size - 2) - 2));
-        asm_write_inst1(assembly, "pop", "rdx");
-    }
-    else {
-        // rdx has the right contents already.
-        asm_write_inst1(assembly, "pop", "rcx");
-    }
+    // [... (a b c d) e f g h i A B<] rax:C rdx:D, offset=9, size=4
+    // [... (A B C D) e f g<] rax:h rdx:i
+    generate_block_move(assembly, "rsp", 8 * offset, "rsp", 0, size - 2, false);
     if (offset >= size + 2) {
-        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rax", 8 * (offset - (size - 2) - 1));
+        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rax", 8 * (offset - 1));
+        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rdx", 8 * (offset - 2));
+        asm_write_inst2f(assembly, "add", "rsp", "%d", 8 * (size - 2));
+        asm_write_inst1(assembly, "pop", "rdx");
         asm_write_inst1(assembly, "pop", "rax");
     }
+    else if (offset == size + 1) {
+        // The last word of the subcomp ends up in rax, and the top of the comp is untouched.
+        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rax", 8 * (offset - 1));
+        asm_write_inst2(assembly, "mov", "rax", "rdx");
+        asm_write_inst2f(assembly, "mov", "rdx", "[rsp+%d]", 8 * (size - 2));
+        asm_write_inst2f(assembly, "add", "rsp", "%d", 8 * size);
+    }
     else {
-        // rax has the right contents already.
-        asm_write_inst1(assembly, "pop", "rcx");
+        // offset == size, so rax and rdx have the right contents already.
+        asm_write_inst2f(assembly, "add", "rsp", "%d", 8 * size);
     }
 }
 
 static void shift_block_down(struct asm_block *assembly, int size, int count) {
-    for (int i = size - 3; i >= 0; --i) {
-        int read_offset = 8 * i;
-        int write_offset = read_offset + 8 * count;
-        asm_write_inst2f(assembly, "mov", "rcx", "[rsp+%d]", read_offset);
-        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rcx", write_offset);
+    if (size > 2) {
+        // The block moves towards higher addresses, so go backwards if it overlaps itself.
+        bool overlapping = count < size - 2;
+        generate_block_move(assembly, "rsp", 8 * count, "rsp", 0, size - 2, overlapping);
     }
     if (size >= 2) {
         asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rax", 8 * (count - 1));
@@ -260,11 +343,8 @@ static void shift_block_up(struct asm_block *assembly, int size, int count) {
     if (size >= 2) {
         asm_write_inst2f(assembly, "mov", "rax", "[rsp+%d]", 8 * (count - 1));
     }
-    for (int i = 0; i < size - 2; ++i) {
-        int write_offset = 8 * i;
-        int read_offset = write_offset + 8 * count;
-        asm_write_inst2f(assembly, "mov", "rcx", "[rsp+%d]", read_offset);
-        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rcx", write_offset);
+    if (size > 2) {
+        generate_block_move(assembly, "rsp", 0, "rsp", 8 * count, size - 2, false);
     }
 }
 
@@ -278,12 +358,9 @@ static void save_block(struct asm_block *assembly, int start_offset, int size) {
         asm_write_inst2f(assembly, "mov", "[rsp-%d]", "rax", 8 * (size - 1 + start_offset));
         ++i;
     }
-    for (; i < size; ++i) {
-        int read_offset = 8 * (start_offset + i - 2);
-        int write_offset = 8 * (size - i);
-        asm_write_inst2f(assembly, "mov", "rcx", "[rsp+%d]", read_offset);
-        asm_write_inst2f(assembly, "mov", "[rsp-%d]", "rcx", write_offset);
-    }
+    // The remaining words are contiguous both in the stack and in the saved block.
+    generate_block_move(assembly, "rsp", -8 * (size - i), "rsp", 8 * (start_offset + i - 2),
+                        size - i, false);
 }
 
 static void restore_block(struct asm_block *assembly, int start_offset, int size) {
@@ -296,12 +373,8 @@ static void restore_block(struct asm_block *assembly, int start_offset, int size
         asm_write_inst2f(assembly, "mov", "rax", "[rsp-%d]", 8 * (size - 1 + start_offset));
         ++i;
     }
-    for (; i < size; ++ i) {
-        int read_offset = 8 * (size - i);
-        int write_offset = 8 * (start_offset + i - 2);
-        asm_write_inst2f(assembly, "mov", "rcx", "[rsp-%d]", read_offset);
-        asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rcx", write_offset);
-    }
+    generate_block_move(assembly, "rsp", 8 * (start_offset + i - 2), "rsp", -8 * (size - i),
+                        size - i, false);
 }
 
 static void generate_swap_comps(struct generator *generator, int lhs_size, int rhs_size) {
@@ -325,7 +398,7 @@ static void generate_swap_comps(struct generator *generator, int lhs_size, int r
         shift_block_up(assembly, lhs_size, 1);
         asm_write_inst2f(assembly, "mov", "[rsp+%d]", "r8", 8 * (lhs_size - 2));
     }
-    else if (lhs_size == rhs_size) {
+    else if (lhs_size == rhs_size && rhs_size - 2 <= BLOCK_MOVE_UNROLL_LIMIT) {
         // Special case: lhs = rhs (i.e. non-overlapping).
         assert(rhs_size >= 2);
         asm_write_inst2(assembly, "mov", "rcx", "rdx");
@@ -334,16 +407,25 @@ static void generate_swap_comps(struct generator *generator, int lhs_size, int r
         asm_write_inst2(assembly, "mov", "rcx", "rax");
         asm_write_inst2f(assembly, "mov", "rax", "[rsp+%d]", 8 * (rhs_size - 1));
         asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rcx", 8 * (rhs_size - 1));
-        for (int i = 2; i < rhs_size; ++i) {
+        // Swap the rest two words at a time.
+        for (int i = 2; i < rhs_size; i += 2) {
             int lhs_offset = 8 * (i + rhs_size - 2);
             int rhs_offset = 8 * (i - 2);
-            asm_write_inst2f(assembly, "mov", "rcx", "[rsp+%d]", rhs_offset);
-            asm_write_inst2f(assembly, "mov", "r8", "[rsp+%d]", lhs_offset);
-            asm_write_inst2f(assembly, "mov", "[rsp+%d]", "r8", rhs_offset);
-            asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rcx", lhs_offset);
+            if (i + 1 < rhs_size) {
+                asm_write_inst2f(assembly, "movdqu", "xmm0", "[rsp+%d]", rhs_offset);
+                asm_write_inst2f(assembly, "movdqu", "xmm1", "[rsp+%d]", lhs_offset);
+                asm_write_inst2f(assembly, "movdqu", "[rsp+%d]", "xmm1", rhs_offset);
+                asm_write_inst2f(assembly, "movdqu", "[rsp+%d]", "xmm0", lhs_offset);
+            }
+            else {
+                asm_write_inst2f(assembly, "mov", "rcx", "[rsp+%d]", rhs_offset);
+                asm_write_inst2f(assembly, "mov", "r8", "[rsp+%d]", lhs_offset);
+                asm_write_inst2f(assembly, "mov", "[rsp+%d]", "r8", rhs_offset);
+                asm_write_inst2f(assembly, "mov", "[rsp+%d]", "rcx", lhs_offset);
+            }
         }
     }
-    else if (lhs_size < rhs_size) {
+    else if (lhs_size <= rhs_size) {
         // General case, lhs < rhs.
         save_block(assembly, rhs_size, lhs_size);
         shift_block_down(assembly, rhs_size, lhs_size);
@@ -357,11 +439,11 @@ static void generate_swap_comps(struct generator *generator, int lhs_size, int r
     }
 }
 
-static bool is_power_of_two(unsigned n) {
+static bool is_power_of_two(uint64_t n) {
     return (n & (n-1)) == 0 && n != 0;
 }
 
-static int get_power_of_two(unsigned n) {
+static int get_power_of_two(uint64_t n) {
     assert(is_power_of_two(n));
     int power = 0;
     for (n -= 1; n != 0; ++power) {
@@ -370,6 +452,322 @@ static int get_power_of_two(unsigned n) {
     return power;
 }
 
+static bool fits_imm32(int64_t value) {
+    return INT32_MIN <= value && value <= INT32_MAX;
+}
+
+struct unsigned_magic {
+    uint64_t multiplier;
+    int shift;
+    bool add;  // The true multiplier is 65 bits wide, so needs an extra add.
+};
+
+struct signed_magic {
+    int64_t multiplier;
+    int shift;
+};
+
+static struct unsigned_magic get_unsigned_magic(uint64_t divisor) {
+    /* Magic number for unsigned division (Hacker's Delight, magicu2), extended to 64 bits. */
+    assert(divisor >= 2);
+    const uint64_t max_s64 = INT64_MAX;
+    struct unsigned_magic magic = {.add = false};
+    int p = 63;
+    uint64_t p64 = 0;  // 2^(p-64).
+    uint64_t q = max_s64 / divisor;
+    uint64_t r = max_s64 - q * divisor;
+    uint64_t delta = 0;
+    do {
+        ++p;
+        p64 = (p == 64) ? 1 : 2 * p64;
+        if (r + 1 >= divisor - r) {
+            if (q >= max_s64) magic.add = true;
+            q = 2 * q + 1;
+            r = 2 * r + 1 - divisor;
+        }
+        else {
+            if (q >= max_s64 + 1) magic.add = true;
+            q = 2 * q;
+            r = 2 * r + 1;
+        }
+        delta = divisor - 1 - r;
+    } while (p < 128 && p64 < delta);
+    magic.multiplier = q + 1;
+    magic.shift = p - 64;
+    return magic;
+}
+
+static struct signed_magic get_signed_magic(int64_t divisor) {
+    /* Magic number for signed division (Hacker's Delight, magic), extended to 64 bits. */
+    assert(divisor != INT64_MIN);
+    assert(divisor <= -2 || divisor >= 2);
+    const uint64_t two63 = UINT64_C(1) << 63;
+    uint64_t ad = (divisor < 0) ? -divisor : divisor;
+    uint64_t t = two63 + (s64_to_u64(divisor) >> 63);
+    uint64_t anc = t - 1 - t % ad;  // Absolute value of nc.
+    int p = 63;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad;
+    uint64_t r2 = two63 - q2 * ad;
+    uint64_t delta = 0;
+    do {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            ++q1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            ++q2;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    uint64_t multiplier = q2 + 1;
+    if (divisor < 0) multiplier = -multiplier;
+    return (struct signed_magic) {.multiplier = u64_to_s64(multiplier), .shift = p - 64};
+}
+
+static void generate_mask(struct asm_block *assembly, uint64_t mask) {
+    /* rdx &= mask */
+    if (mask == 0) {
+        asm_write_inst2(assembly, "xor", "edx", "edx");
+    }
+    else if (mask == UINT32_MAX) {
+        asm_write_inst2(assembly, "mov", "edx", "edx");  // Zero-extends.
+    }
+    else if (mask <= INT32_MAX) {
+        asm_write_inst2f(assembly, "and", "rdx", "%"PRIu64, mask);
+    }
+    else {
+        asm_write_inst2f(assembly, "mov", "rcx", "%"PRIu64, mask);
+        asm_write_inst2(assembly, "and", "rdx", "rcx");
+    }
+}
+
+static void generate_remainder(struct asm_block *assembly, uint64_t divisor) {
+    /* rdx = rcx - rax * divisor, where rcx is the dividend and rax is the quotient. */
+    int64_t value = u64_to_s64(divisor);
+    if (fits_imm32(value)) {
+        asm_write_inst3f(assembly, "imul", "rdx", "rax", "%"PRId64, value);
+    }
+    else {
+        asm_write_inst2f(assembly, "mov", "rdx", "%"PRId64, value);
+        asm_write_inst2(assembly, "imul", "rdx", "rax");
+    }
+    asm_write_inst2(assembly, "sub", "rcx", "rdx");
+    asm_write_inst2(assembly, "mov", "rdx", "rcx");
+}
+
+static void generate_mult_constant(struct generator *generator, uint64_t constant) {
+    /* rdx *= constant, using shifts and `lea` where possible. */
+    struct asm_block *assembly = generator->assembly;
+    int64_t value = u64_to_s64(constant);
+    if (constant == 0) {
+        asm_write_inst2(assembly, "xor", "edx", "edx");
+        return;
+    }
+    if (value == -1) {
+        asm_write_inst1(assembly, "neg", "rdx");
+        return;
+    }
+    // constant = odd * 2^shift
+    int shift = 0;
+    uint64_t odd = constant;
+    for (; (odd & 1) == 0; odd >>= 1) {
+        ++shift;
+    }
+    if (odd == 1 || odd == 3 || odd == 5 || odd == 9) {
+        if (odd != 1) {
+            asm_write_inst2f(assembly, "lea", "rdx", "[rdx+rdx*%d]", (int)odd - 1);
+        }
+        if (shift > 0) {
+            asm_write_inst2f(assembly, "shl", "rdx", "%d", shift);
+        }
+    }
+    else if (is_power_of_two(constant + 1)) {
+        // x * (2^n - 1) = (x << n) - x
+        asm_write_inst2(assembly, "mov", "rcx", "rdx");
+        asm_write_inst2f(assembly, "shl", "rdx", "%d", get_power_of_two(constant + 1));
+        asm_write_inst2(assembly, "sub", "rdx", "rcx");
+    }
+    else if (is_power_of_two(constant - 1)) {
+        // x * (2^n + 1) = (x << n) + x
+        asm_write_inst2(assembly, "mov", "rcx", "rdx");
+        asm_write_inst2f(assembly, "shl", "rdx", "%d", get_power_of_two(constant - 1));
+        asm_write_inst2(assembly, "add", "rdx", "rcx");
+    }
+    else if (fits_imm32(value)) {
+        asm_write_inst3f(assembly, "imul", "rdx", "rdx", "%"PRId64, value);
+    }
+    else {
+        asm_write_inst2f(assembly, "mov", "rcx", "%"PRId64, value);
+        asm_write_inst2(assembly, "imul", "rdx", "rcx");
+    }
+}
+
+static void generate_divmod_constant(struct generator *generator, uint64_t divisor) {
+    /* Unsigned rax, rdx = rdx divmod divisor, without `div`. */
+    struct asm_block *assembly = generator->assembly;
+    assert(divisor != 0);
+    asm_write_inst1(assembly, "push", "rax");
+    if (is_power_of_two(divisor)) {
+        asm_write_inst2(assembly, "mov", "rax", "rdx");
+        int shift = get_power_of_two(divisor);
+        if (shift > 0) {
+            asm_write_inst2f(assembly, "shr", "rax", "%d", shift);
+        }
+        generate_mask(assembly, divisor - 1);
+        return;
+    }
+    struct unsigned_magic magic = get_unsigned_magic(divisor);
+    asm_write_inst2(assembly, "mov", "rcx", "rdx");
+    asm_write_inst2f(assembly, "mov", "rax", "%"PRIu64, magic.multiplier);
+    asm_write_inst1(assembly, "mul", "rcx");  // rdx = high word of product.
+    if (magic.add) {
+        asm_write_inst2(assembly, "mov", "rax", "rcx");
+        asm_write_inst2(assembly, "sub", "rax", "rdx");
+        asm_write_inst2(assembly, "shr", "rax", "1");
+        asm_write_inst2(assembly, "add", "rdx", "rax");
+        if (magic.shift > 1) {
+            asm_write_inst2f(assembly, "shr", "rdx", "%d", magic.shift - 1);
+        }
+    }
+    else if (magic.shift > 0) {
+        asm_write_inst2f(assembly, "shr", "rdx", "%d", magic.shift);
+    }
+    asm_write_inst2(assembly, "mov", "rax", "rdx");
+    generate_remainder(assembly, divisor);
+}
+
+static void generate_idivmod_constant(struct generator *generator, int64_t divisor) {
+    /* Signed (truncated) rax, rdx = rdx idivmod divisor, without `idiv`. */
+    struct asm_block *assembly = generator->assembly;
+    assert(divisor != 0 && divisor != INT64_MIN);
+    uint64_t abs_divisor = (divisor < 0) ? -divisor : divisor;
+    asm_write_inst1(assembly, "push", "rax");
+    if (abs_divisor == 1) {
+        asm_write_inst2(assembly, "mov", "rax", "rdx");
+        if (divisor < 0) {
+            asm_write_inst1(assembly, "neg", "rax");
+        }
+        asm_write_inst2(assembly, "xor", "edx", "edx");
+        return;
+    }
+    asm_write_inst2(assembly, "mov", "rcx", "rdx");
+    if (is_power_of_two(abs_divisor)) {
+        // Bias negative dividends by 2^n - 1 so that the shift rounds towards zero.
+        int shift = get_power_of_two(abs_divisor);
+        asm_write_inst2(assembly, "mov", "rax", "rdx");
+        if (shift > 1) {
+            asm_write_inst2(assembly, "sar", "rax", "63");
+        }
+        asm_write_inst2f(assembly, "shr", "rax", "%d", 64 - shift);
+        asm_write_inst2(assembly, "add", "rax", "rcx");
+        asm_write_inst2f(assembly, "sar", "rax", "%d", shift);
+        asm_write_inst2(assembly, "mov", "rdx", "rax");
+        asm_write_inst2f(assembly, "shl", "rdx", "%d", shift);
+        asm_write_inst2(assembly, "sub", "rcx", "rdx");
+        asm_write_inst2(assembly, "mov", "rdx", "rcx");
+        if (divisor < 0) {
+            asm_write_inst1(assembly, "neg", "rax");
+        }
+        return;
+    }
+    struct signed_magic magic = get_signed_magic(divisor);
+    asm_write_inst2f(assembly, "mov", "rax", "%"PRId64, magic.multiplier);
+    asm_write_inst1(assembly, "imul", "rcx");  // rdx = high word of product.
+    if (divisor > 0 && magic.multiplier < 0) {
+        asm_write_inst2(assembly, "add", "rdx", "rcx");
+    }
+    else if (divisor < 0 && magic.multiplier > 0) {
+        asm_write_inst2(assembly, "sub", "rdx", "rcx");
+    }
+    if (magic.shift > 0) {
+        asm_write_inst2f(assembly, "sar", "rdx", "%d", magic.shift);
+    }
+    // Add one to negative quotients.
+    asm_write_inst2(assembly, "mov", "rax", "rdx");
+    asm_write_inst2(assembly, "shr", "rax", "63");
+    asm_write_inst2(assembly, "add", "rax", "rdx");
+    generate_remainder(assembly, divisor);
+}
+
+static void generate_edivmod_constant(struct generator *generator, int64_t divisor) {
+    /* Euclidean rax, rdx = rdx edivmod divisor, without `idiv`. */
+    struct asm_block *assembly = generator->assembly;
+    assert(divisor != 0 && divisor != INT64_MIN);
+    uint64_t abs_divisor = (divisor < 0) ? -divisor : divisor;
+    if (is_power_of_two(abs_divisor)) {
+        // An arithmetic shift already rounds towards negative infinity.
+        asm_write_inst1(assembly, "push", "rax");
+        asm_write_inst2(assembly, "mov", "rax", "rdx");
+        int shift = get_power_of_two(abs_divisor);
+        if (shift > 0) {
+            asm_write_inst2f(assembly, "sar", "rax", "%d", shift);
+        }
+        if (divisor < 0) {
+            asm_write_inst1(assembly, "neg", "rax");
+        }
+        generate_mask(assembly, abs_divisor - 1);
+        return;
+    }
+    // Same fix-up as for W_OP_EDIVMOD, but sign(b) and abs(b) are known.
+    generate_idivmod_constant(generator, divisor);
+    if (abs_divisor <= INT32_MAX) {
+        asm_write_inst2f(assembly, "lea", "rcx", "[rdx+%"PRIu64"]", abs_divisor);
+    }
+    else {
+        asm_write_inst2f(assembly, "mov", "rcx", "%"PRIu64, abs_divisor);
+        asm_write_inst2(assembly, "add", "rcx", "rdx");
+    }
+    asm_write_inst2f(assembly, "lea", "r8", "[rax%+d]", (divisor < 0) ? 1 : -1);
+    asm_write_inst2(assembly, "test", "rdx", "rdx");
+    asm_write_inst2(assembly, "cmovs", "rdx", "rcx");
+    asm_write_inst2(assembly, "cmovs", "rax", "r8");
+}
+
+static int generate_constant_operation(struct generator *generator, struct ir_block *block,
+                                       int ip) {
+    /* Instruction selection for arithmetic on a constant pushed immediately before.
+     * Returns the index of the last byte consumed, or -1 if the pair was not reduced. */
+    uint64_t constant = 0;
+    if (!read_w_int_constant(block, ip, &constant)) return -1;
+    int next_ip = ip + get_w_instruction_size(block->code[ip]);
+    if (next_ip >= block->count || is_jump_dest(block, next_ip)) return -1;
+    enum w_opcode instruction = block->code[next_ip];
+    int64_t value = u64_to_s64(constant);
+    struct asm_block *assembly = generator->assembly;
+    switch (instruction) {
+    case W_OP_MULT:
+        asm_write(assembly, "  ;;\t=== %s %"PRId64" ===\n", get_opcode_name(instruction), value);
+        generate_mult_constant(generator, constant);
+        break;
+    case W_OP_DIVMOD:
+        if (constant == 0) return -1;
+        asm_write(assembly, "  ;;\t=== %s %"PRIu64" ===\n", get_opcode_name(instruction), constant);
+        generate_divmod_constant(generator, constant);
+        break;
+    case W_OP_IDIVMOD:
+        if (value == 0 || value == INT64_MIN) return -1;
+        asm_write(assembly, "  ;;\t=== %s %"PRId64" ===\n", get_opcode_name(instruction), value);
+        generate_idivmod_constant(generator, value);
+        break;
+    case W_OP_EDIVMOD:
+        if (value == 0 || value == INT64_MIN) return -1;
+        asm_write(assembly, "  ;;\t=== %s %"PRId64" ===\n", get_opcode_name(instruction), value);
+        generate_edivmod_constant(generator, value);
+        break;
+    default:
+        return -1;
+    }
+    return next_ip + get_w_instruction_size(instruction) - 1;
+}
+
 static void generate_array_get(struct generator *generator, int element_count, int word_count) {
     struct asm_block *assembly = generator->assembly;
     // TODO: Add optional bounds checking.
@@ -379,7 +777,7 @@ static void generate_array_get(struct generator *generator, int element_count, i
             asm_write_inst2f(assembly, "shl", "rdx", "%d", get_power_of_two(word_count));
         }
         else {
-            asm_write_inst2f(assembly, "mul", "rdx", "%d", word_count);
+            asm_write_inst3f(assembly, "imul", "rdx", "rdx", "%d", word_count);
         }
     }
     asm_write_inst1(assembly, "neg", "rdx");  // Index.
@@ -393,8 +791,9 @@ static void generate_array_get(struct generator *generator, int element_count, i
     if (word_count <= 1) return;
     asm_write_inst1(assembly, "push", "rax");
     asm_write_inst2(assembly, "mov", "rax", "[rcx]");
-    for (int i = word_count - 2; i >= 1; --i) {
-        asm_write_inst1f(assembly, "push", "qword [rcx+%d]", 8 * i);
+    if (word_count > 2) {
+        asm_write_inst2f(assembly, "sub", "rsp", "%d", 8 * (word_count - 2));
+        generate_block_move(assembly, "rsp", 0, "rcx", 8, word_count - 2, false);
     }
 }
 
@@ -406,7 +805,7 @@ static void generate_array_set(struct generator *generator, int element_count, i
             asm_write_inst2f(assembly, "shl", "rdx", "%d", get_power_of_two(word_count));
         }
         else {
-            asm_write_inst2f(assembly, "mul", "rdx", "%d", word_count);
+            asm_write_inst3f(assembly, "imul", "rdx", "rdx", "%d", word_count);
         }
     }
     // [(5 42 -7) (1 2 3)] (11 54 9) 1
@@ -417,8 +816,9 @@ static void generate_array_set(struct generator *generator, int element_count, i
     asm_write_inst1(assembly, "neg", "rdx");  // Index.
     asm_write_inst2f(assembly, "lea", "rcx", "[rsp+rdx*8+%d]", (element_count * word_count - 1) * 8);
     asm_write_inst2(assembly, "mov", "[rcx]", "rax");
-    for (int i = 1; i < word_count; ++i) {
-        asm_write_inst1f(assembly, "pop", "qword [rcx+%d]", 8 * i);
+    if (word_count > 1) {
+        generate_block_move(assembly, "rcx", 8, "rsp", 0, word_count - 1, false);
+        asm_write_inst2f(assembly, "add", "rsp", "%d", 8 * (word_count - 1));
     }
     asm_write_inst1(assembly, "pop", "rdx");
     asm_write_inst1(assembly, "pop", "rax");
@@ -576,11 +976,180 @@ static void generate_external_call_ms_x64(struct generator *generator,
     }
 }
 
+/* System V AMD64 calling convention.
+ *
+ * Each parameter is classified according to the ABI. Bude comps are laid out like C structs with
+ * one 8-byte member per word (field order; the opposite order to the stack). Scalars, packs and
+ * comps of at most two words are passed in registers (INTEGER words in rdi, rsi, rdx, rcx, r8,
+ * r9; SSE words in xmm0-xmm7) if enough registers remain. Larger comps (MEMORY) are copied onto
+ * the stack. Results come back in rax/rdx and xmm0/xmm1, or through a hidden pointer (in rdi) to
+ * a buffer at the top of aux for larger comps.
+ *
+ * rsi and rdi are caller-saved in this convention, so we keep them in r12 and r13 (callee-saved)
+ * across the call. rbx is already callee-saved.
+ */
+
+static const char *const sysv_int_regs[SYSV_INT_REG_COUNT] = {
+    "rdi", "rsi", "rdx", "rcx", "r8", "r9",
+};
+
+static const char *const sysv_sse_regs[SYSV_SSE_REG_COUNT] = {
+    "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+};
+
 static void generate_external_call_sysv_amd64(struct generator *generator,
                                               struct ext_function *external) {
-    // TODO: implement this.
-    (void)generator, (void)external;
-    assert(0 && "Not implemented");
+    int param_count = external->sig.param_count;
+    type_index *params = external->sig.params;
+    struct type_table *types = &generator->module->types;
+    struct asm_block *assembly = generator->assembly;
+    assert(param_count >= 0);
+    type_index ret_type = (external->sig.ret_count > 0) ? external->sig.rets[0] : TYPE_ERROR;
+    enum sysv_class ret_classes[SYSV_MAX_REG_WORDS] = {0};
+    int ret_word_count = (ret_type != TYPE_ERROR)
+        ? classify_sysv_amd64(types, ret_type, ret_classes)
+        : 0;
+    bool memory_ret = ret_word_count > 0 && ret_classes[0] == SYSV_MEMORY;
+    // Assign each parameter a location.
+    enum sysv_class (*param_classes)[SYSV_MAX_REG_WORDS] =
+        allocate_array(param_count, sizeof *param_classes);
+    bool *on_stack = allocate_array(param_count, sizeof *on_stack);
+    int *word_offsets = allocate_array(param_count, sizeof *word_offsets);
+    int int_reg_count = memory_ret;  // The hidden return pointer takes the first register.
+    int sse_reg_count = 0;
+    int stack_word_count = 0;
+    int param_word_count = 0;
+    for (int i = param_count - 1; i >= 0; --i) {
+        // Offset from the top of the stack to the last word of the parameter.
+        word_offsets[i] = param_word_count;
+        param_word_count += type_word_count(types, params[i]);
+    }
+    for (int i = 0; i < param_count; ++i) {
+        int word_count = classify_sysv_amd64(types, params[i], param_classes[i]);
+        int int_words = 0;
+        int sse_words = 0;
+        if (param_classes[i][0] != SYSV_MEMORY) {
+            for (int j = 0; j < word_count; ++j) {
+                if (param_classes[i][j] == SYSV_SSE) {
+                    ++sse_words;
+                }
+                else {
+                    ++int_words;
+                }
+            }
+        }
+        on_stack[i] = param_classes[i][0] == SYSV_MEMORY
+            || int_reg_count + int_words > SYSV_INT_REG_COUNT
+            || sse_reg_count + sse_words > SYSV_SSE_REG_COUNT;
+        if (on_stack[i]) {
+            stack_word_count += word_count;
+        }
+        else {
+            int_reg_count += int_words;
+            sse_reg_count += sse_words;
+        }
+    }
+    // Set up the frame. All parameters are addressed through rbp.
+    asm_write_inst1(assembly, "push", "rax");
+    asm_write_inst1(assembly, "push", "rdx");
+    asm_write_inst2(assembly, "mov", "rbp", "rsp");
+    asm_write_inst2(assembly, "mov", "r12", "rsi");
+    asm_write_inst2(assembly, "mov", "r13", "rdi");
+    asm_write_inst2(assembly, "and", "spl", "0F0h");
+    if (stack_word_count % 2 == 1) {
+        asm_write_inst2(assembly, "sub", "rsp", "8");  // Keep the stack aligned for the call.
+    }
+    // Stack arguments are pushed in reverse order, each with its first word at the lowest address.
+    for (int i = param_count - 1; i >= 0; --i) {
+        if (!on_stack[i]) continue;
+        int word_count = type_word_count(types, params[i]);
+        for (int j = word_count - 1; j >= 0; --j) {
+            int stack_offset = word_offsets[i] + word_count - 1 - j;
+            asm_write_inst1f(assembly, "push", "qword [rbp+%d]", 8 * stack_offset);
+        }
+    }
+    // Register arguments.
+    int int_reg = 0;
+    int sse_reg = 0;
+    if (memory_ret) {
+        // Return buffer on aux. The callee doesn't touch aux, so it doesn't need reserving.
+        asm_write_inst2f(assembly, "mov", "%s", "r12", sysv_int_regs[int_reg++]);
+    }
+    for (int i = 0; i < param_count; ++i) {
+        if (on_stack[i]) continue;
+        int word_count = type_word_count(types, params[i]);
+        for (int j = 0; j < word_count; ++j) {
+            int stack_offset = word_offsets[i] + word_count - 1 - j;
+            if (param_classes[i][j] == SYSV_SSE) {
+                asm_write_inst2f(assembly, "movq", "%s", "qword [rbp+%d]",
+                                 sysv_sse_regs[sse_reg++], 8 * stack_offset);
+            }
+            else {
+                asm_write_inst2f(assembly, "mov", "%s", "[rbp+%d]",
+                                 sysv_int_regs[int_reg++], 8 * stack_offset);
+            }
+        }
+    }
+    free_array(param_classes, param_count, sizeof *param_classes);
+    free_array(on_stack, param_count, sizeof *on_stack);
+    free_array(word_offsets, param_count, sizeof *word_offsets);
+    // Number of vector registers used, in case the callee is variadic.
+    asm_write_inst2f(assembly, "mov", "eax", "%d", sse_reg);
+    asm_write_inst1f(assembly, "call", "[%"PRI_SV"]", SV_FMT(external->name));
+    asm_write_inst2(assembly, "mov", "rsi", "r12");
+    asm_write_inst2(assembly, "mov", "rdi", "r13");
+    asm_write_inst2f(assembly, "lea", "rsp", "[rbp+%d]", 8 * param_word_count);
+    if (ret_word_count == 0) {
+        asm_write_inst1(assembly, "pop", "rdx");
+        asm_write_inst1(assembly, "pop", "rax");
+    }
+    else if (memory_ret) {
+        // rax points to the returned comp.
+        for (int i = 0; i < ret_word_count - 2; ++i) {
+            asm_write_inst1f(assembly, "push", "qword [rax+%d]", 8 * i);
+        }
+        asm_write_inst2f(assembly, "mov", "rdx", "[rax+%d]", 8 * (ret_word_count - 1));
+        asm_write_inst2f(assembly, "mov", "rax", "[rax+%d]", 8 * (ret_word_count - 2));
+    }
+    else if (ret_word_count == 2) {
+        // The first word goes in rax (on the Bude stack) and the second in rdx.
+        bool first_sse = ret_classes[0] == SYSV_SSE;
+        bool second_sse = ret_classes[1] == SYSV_SSE;
+        if (!first_sse && second_sse) {
+            asm_write_inst2(assembly, "movq", "rdx", "xmm0");
+        }
+        else if (first_sse && !second_sse) {
+            asm_write_inst2(assembly, "mov", "rdx", "rax");
+            asm_write_inst2(assembly, "movq", "rax", "xmm0");
+        }
+        else if (first_sse && second_sse) {
+            asm_write_inst2(assembly, "movq", "rax", "xmm0");
+            asm_write_inst2(assembly, "movq", "rdx", "xmm1");
+        }
+    }
+    else {
+        assert(ret_word_count == 1);
+        int ret_size = type_size(types, ret_type);
+        if (ret_type == TYPE_F32) {
+            asm_write_inst2(assembly, "movd", "edx", "xmm0");
+        }
+        else if (ret_classes[0] == SYSV_SSE) {
+            asm_write_inst2(assembly, "movq", "rdx", "xmm0");
+        }
+        else if (ret_size == 1) {
+            asm_write_inst2(assembly, "movzx", "edx", "al");
+        }
+        else if (ret_size == 2) {
+            asm_write_inst2(assembly, "movzx", "edx", "ax");
+        }
+        else if (ret_size == 4) {
+            asm_write_inst2(assembly, "mov", "edx", "eax");
+        }
+        else {
+            asm_write_inst2(assembly, "mov", "rdx", "rax");
+        }
+        asm_write_inst1(assembly, "pop", "rax");
+    }
 }
 
 static void generate_external_call(struct generator *generator, struct ext_function *external) {
@@ -597,6 +1166,12 @@ static void generate_external_call(struct generator *generator, struct ext_funct
         [CC_MS_X64] = generate_external_call_ms_x64,
         [CC_SYSV_AMD64] = generate_external_call_sysv_amd64,
     };
+    const char *signature_error = check_ext_signature(external);
+    if (signature_error != NULL) {
+        fprintf(stderr, "Cannot call external function '%"PRI_SV"': %s.\n",
+                SV_FMT(external->name), signature_error);
+        exit(1);
+    }
     dispatch_table[external->call_conv](generator, external);
 }
 
@@ -621,6 +1196,8 @@ static void generate_function(struct generator *generator, int func_index) {
     generator->loop_level = 0;
     struct asm_block *assembly = generator->assembly;
     struct function *function = get_function(&generator->module->functions, func_index);
+    // Buffer the function's code so the peephole optimiser can clean it up.
+    asm_start_lines(assembly, &generator->lines);
     asm_label(assembly, "func_%d", func_index);
     // Layout of aux frame: [ret][base][... Loops ...][... Locals ...][... aux ...]
     //                            ^rbx                                 ^rsi
@@ -638,6 +1215,11 @@ static void generate_function(struct generator *generator, int func_index) {
         }
         enum w_opcode instruction = block->code[ip];
         if (instruction == W_OP_NOP) continue;
+        int last_ip = generate_constant_operation(generator, block, ip);
+        if (last_ip >= 0) {
+            ip = last_ip;
+            continue;
+        }
         asm_write(assembly, "  ;;\t=== %s ===\n", get_opcode_name(instruction));
         switch (instruction) {
         case W_OP_NOP:
@@ -1839,6 +2421,8 @@ static void generate_function(struct generator *generator, int func_index) {
             break;
         }
     }
+    peephole_optimise(&generator->lines);
+    asm_end_lines(assembly);
 }
 
 static void generate_decode_utf8(struct generator *generator) {
@@ -1967,7 +2551,138 @@ static void generate_encode_utf16(struct generator *generator) {
     asm_write_inst0(assembly, "ret");
 }
 
-void generate_code(struct generator *generator) {
+/* Parallel code generation.
+ *
+ * Functions are independent of one another (all their labels are local), so each one can be
+ * generated by a different thread. A worker generates a function into its own text buffer and
+ * the main thread copies the buffers to the output in function-index order, so the output is
+ * identical to the serial path. Workers may only run a fixed window of functions ahead of the
+ * one being written, which keeps memory use bounded.
+ */
+
+#define CODEGEN_WINDOW_PER_THREAD 4
+
+#ifndef __STDC_NO_THREADS__
+
+struct codegen_pool {
+    struct module *module;
+    mtx_t lock;
+    cnd_t progress;
+    int function_count;
+    int window;
+    int next;  // The next function to be claimed by a worker.
+    int written;  // The number of functions written to the output so far.
+    bool had_error;
+    bool *done;  // Indexed by function index modulo window, as is texts.
+    struct asm_text *texts;
+};
+
+static int codegen_worker(void *arg) {
+    struct codegen_pool *pool = arg;
+    struct asm_block *assembly = malloc(sizeof *assembly);
+    CHECK_ALLOCATION(assembly);
+    struct generator generator = {
+        .assembly = assembly,
+        .module = pool->module,
+        .loop_level = 0,
+    };
+    init_asm_line_list(&generator.lines);
+    mtx_lock(&pool->lock);
+    for (;;) {
+        while (pool->next < pool->function_count && pool->next >= pool->written + pool->window) {
+            cnd_wait(&pool->progress, &pool->lock);
+        }
+        if (pool->next >= pool->function_count) break;
+        int index = pool->next++;
+        mtx_unlock(&pool->lock);
+        int slot = index % pool->window;
+        init_assembly_text(assembly, &pool->texts[slot]);
+        generate_function(&generator, index);
+        asm_flush(assembly);
+        mtx_lock(&pool->lock);
+        pool->done[slot] = true;
+        if (asm_had_error(assembly)) {
+            pool->had_error = true;
+        }
+        cnd_broadcast(&pool->progress);
+    }
+    mtx_unlock(&pool->lock);
+    free_asm_line_list(&generator.lines);
+    free(assembly);
+    return 0;
+}
+
+/* Returns false if the functions should be generated serially instead. */
+static bool generate_functions_parallel(struct generator *generator, int thread_count) {
+    int function_count = generator->module->functions.count;
+    if (thread_count > function_count) {
+        thread_count = function_count;
+    }
+    if (thread_count <= 1) return false;
+    struct codegen_pool pool = {
+        .module = generator->module,
+        .function_count = function_count,
+        .window = CODEGEN_WINDOW_PER_THREAD * thread_count,
+        .next = 0,
+        .written = 0,
+        .had_error = false,
+    };
+    if (mtx_init(&pool.lock, mtx_plain) != thrd_success) return false;
+    if (cnd_init(&pool.progress) != thrd_success) {
+        mtx_destroy(&pool.lock);
+        return false;
+    }
+    pool.done = allocate_array(pool.window, sizeof *pool.done);
+    pool.texts = allocate_array(pool.window, sizeof *pool.texts);
+    thrd_t *threads = allocate_array(thread_count, sizeof *threads);
+    int started_count = 0;
+    while (started_count < thread_count
+           && thrd_create(&threads[started_count], codegen_worker, &pool) == thrd_success) {
+        ++started_count;
+    }
+    if (started_count > 0) {
+        for (int i = 0; i < function_count; ++i) {
+            int slot = i % pool.window;
+            mtx_lock(&pool.lock);
+            while (!pool.done[slot]) {
+                cnd_wait(&pool.progress, &pool.lock);
+            }
+            pool.done[slot] = false;
+            mtx_unlock(&pool.lock);
+            asm_write_text(generator->assembly, &pool.texts[slot]);
+            mtx_lock(&pool.lock);
+            pool.written = i + 1;
+            cnd_broadcast(&pool.progress);
+            mtx_unlock(&pool.lock);
+        }
+        for (int i = 0; i < started_count; ++i) {
+            thrd_join(threads[i], NULL);
+        }
+        if (pool.had_error) {
+            generator->assembly->status = ASM_WRITE_ERROR;
+        }
+    }
+    for (int i = 0; i < pool.window; ++i) {
+        free_asm_text(&pool.texts[i]);
+    }
+    free_array(threads, thread_count, sizeof *threads);
+    free_array(pool.texts, pool.window, sizeof *pool.texts);
+    free_array(pool.done, pool.window, sizeof *pool.done);
+    cnd_destroy(&pool.progress);
+    mtx_destroy(&pool.lock);
+    return started_count > 0;
+}
+
+#else
+
+static bool generate_functions_parallel([[maybe_unused]] struct generator *generator,
+                                        [[maybe_unused]] int thread_count) {
+    return false;
+}
+
+#endif
+
+static void generate_code_start(struct generator *generator) {
     struct asm_block *assembly = generator->assembly;
     asm_section(assembly, ".code", "code", "readable", "executable");
     asm_write(assembly, "\n");
@@ -1993,9 +2708,15 @@ void generate_code(struct generator *generator) {
     generate_encode_utf8(generator);
     generate_decode_utf16(generator);
     generate_encode_utf16(generator);
+}
+
+static void generate_code(struct generator *generator, int thread_count) {
+    generate_code_start(generator);
     // Functions.
-    for (int i = 0; i < generator->module->functions.count; ++i) {
-        generate_function(generator, i);
+    if (!generate_functions_parallel(generator, thread_count)) {
+        for (int i = 0; i < generator->module->functions.count; ++i) {
+            generate_function(generator, i);
+        }
     }
 }
 
@@ -2076,16 +2797,49 @@ static void generate_bss(struct generator *generator) {
     asm_write_inst1(assembly, "rq", "1024*1024");
 }
 
-enum generate_result generate(struct module *module, struct asm_block *assembly) {
+static enum generate_result generate_end(struct generator *generator) {
+    generate_constants(generator);
+    generate_imports(generator);
+    generate_bss(generator);
+    free_asm_line_list(&generator->lines);
+    asm_flush(generator->assembly);
+    return (!asm_had_error(generator->assembly)) ? GENERATE_OK : GENERATE_ERROR;
+}
+
+enum generate_result generate(struct module *module, struct asm_block *assembly,
+                              int thread_count) {
+    thread_count = get_thread_count(thread_count);
     struct generator generator = {
         .assembly = assembly,
         .module = module,
         .loop_level = 0,
     };
+    init_asm_line_list(&generator.lines);
     generate_header(&generator);
-    generate_code(&generator);
-    generate_constants(&generator);
-    generate_imports(&generator);
-    generate_bss(&generator);
-    return (!asm_had_error(generator.assembly)) ? GENERATE_OK : GENERATE_ERROR;
+    generate_code(&generator, thread_count);
+    return generate_end(&generator);
+}
+
+struct generator *start_generate(struct module *module, struct asm_block *assembly) {
+    struct generator *generator = allocate_array(1, sizeof *generator);
+    *generator = (struct generator) {
+        .assembly = assembly,
+        .module = module,
+        .loop_level = 0,
+    };
+    init_asm_line_list(&generator->lines);
+    generate_header(generator);
+    generate_code_start(generator);
+    return generator;
+}
+
+void generate_next_function(struct generator *generator, int func_index) {
+    generate_function(generator, func_index);
+    free_block(&get_function(&generator->module->functions, func_index)->w_code);
+}
+
+enum generate_result finish_generate(struct generator *generator) {
+    enum generate_result result = generate_end(generator);
+    free_array(generator, 1, sizeof *generator);
+    return result;
 }
@@ -9,6 +9,21 @@ enum generate_result {
     GENERATE_ERROR,
 };
 
-enum generate_result generate(struct module *module, struct asm_block *assembly);
+/* Generate FASM code for the module. Functions are generated using up to thread_count threads
+ * (or one per processor if thread_count is not positive); the output is the same either way.
+ */
+enum generate_result generate(struct module *module, struct asm_block *assembly,
+                              int thread_count);
+
+/* Generate FASM code for the module one function at a time, as each becomes available. The
+ * functions may be passed in any order, and the code for each one is freed once it has been
+ * generated. The rest of the module (strings, externals etc.) must be complete by the time
+ * finish_generate() is called.
+ */
+struct generator;
+
+struct generator *start_generate(struct module *module, struct asm_block *assembly);
+void generate_next_function(struct generator *generator, int func_index);
+enum generate_result finish_generate(struct generator *generator);
 
 #endif
@@ -1,10 +1,84 @@
+#include <string.h>
+
 #include "hash.h"
 
-uint32_t hash_sv(const struct string_view *key) {
-    uint32_t hash = 2166136261u;
-    for (size_t i = 0; i < key->length; ++i) {
-        hash ^= key->start[i];
-        hash *= 16777619;
+#define HASH_SEED 0x243F6A8885A308D3u
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15u
+// Used for the second half of a 128-bit hash, so that it's independent of the first.
+#define HASH_SEED2 0x13198A2E03707344u
+#define HASH_MULTIPLIER2 0xC2B2AE3D27D4EB4Fu
+
+static uint64_t mix_with(uint64_t hash, uint64_t word, uint64_t multiplier) {
+    hash = (hash ^ word) * multiplier;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t mix(uint64_t hash, uint64_t word) {
+    return mix_with(hash, word, HASH_MULTIPLIER);
+}
+
+static uint64_t read_word(const unsigned char *bytes, size_t length) {
+    // Any bytes past `length` are zero-padded.
+    uint64_t word = 0;
+    if (length >= sizeof word) {
+        memcpy(&word, bytes, sizeof word);
+        return word;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        word |= (uint64_t)bytes[i] << (8 * i);
     }
+    return word;
+}
+
+/* Final avalanche (from MurmurHash3's fmix64) so the low bits depend on every byte. */
+static uint64_t avalanche(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDu;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53u;
+    hash ^= hash >> 33;
     return hash;
 }
+
+uint32_t hash_bytes(const void *data, size_t length) {
+    // Hash a word (8 bytes) at a time, with the remaining bytes zero-padded into a final word.
+    const unsigned char *bytes = data;
+    uint64_t hash = HASH_SEED ^ (length * HASH_MULTIPLIER);
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, bytes, sizeof word);
+        hash = mix(hash, word);
+        bytes += sizeof word;
+    }
+    if (length > 0) {
+        uint64_t word = 0;
+        for (size_t i = 0; i < length; ++i) {
+            word |= (uint64_t)bytes[i] << (8 * i);
+        }
+        hash = mix(hash, word);
+    }
+    // Final avalanche (from MurmurHash3's fmix64) so the low bits depend on every byte.
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDu;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+uint32_t hash_sv(const struct string_view *key) {
+    return hash_bytes(key->start, key->length);
+}
+
+struct hash128 hash_bytes128(const void *data, size_t length, struct hash128 seed) {
+    const unsigned char *bytes = data;
+    uint64_t low = seed.low ^ HASH_SEED ^ (length * HASH_MULTIPLIER);
+    uint64_t high = seed.high ^ HASH_SEED2 ^ (length * HASH_MULTIPLIER2);
+    for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+        uint64_t word = read_word(&bytes[i], length - i);
+        low = mix_with(low, word, HASH_MULTIPLIER);
+        // Rotating the word means the halves don't see the same sequence of values.
+        high = mix_with(high, (word << 29) | (word >> 35), HASH_MULTIPLIER2);
+    }
+    low = avalanche(low);
+    high = avalanche(high ^ low);
+    return (struct hash128) {.low = low, .high = high};
+}
@@ -1,10 +1,26 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "string_view.h"
 
+uint32_t hash_bytes(const void *data, size_t length);
 uint32_t hash_sv(const struct string_view *key);
 
+/* A wide hash for identifying data by its contents (see cache.h), where a collision would mean
+ * mistaking one input for another. It isn't cryptographic, but with 128 bits, accidental
+ * collisions are vanishingly unlikely.
+ */
+struct hash128 {
+    uint64_t low;
+    uint64_t high;
+};
+
+/* Hash `length` bytes, continuing from the hash `seed` (which can be zeroed to start). Chaining
+ * calls this way hashes the whole series of inputs, including where each one ends.
+ */
+struct hash128 hash_bytes128(const void *data, size_t length, struct hash128 seed);
+
 #endif
@@ -7,11 +7,13 @@
 #include <string.h>
 
 #include "disassembler.h"
+#include "ext_call.h"
 #include "function.h"
 #include "interpreter.h"
 #include "ir.h"
 #include "memory.h"
 #include "module.h"
+#include "reader.h"
 #include "stack.h"
 #include "type_punning.h"
 #include "unicode.h"
@@ -41,8 +43,79 @@
         push(stack, f64_to_u64(a op b));   \
     } while (0)
 
+static bool load_externals(struct interpreter *interpreter) {
+    struct module *module = interpreter->module;
+    int library_count = module->ext_libraries.count;
+    int external_count = module->externals.count;
+    interpreter->ext_libraries = (library_count > 0)
+        ? allocate_array(library_count, sizeof *interpreter->ext_libraries)
+        : NULL;
+    interpreter->ext_bindings = (external_count > 0)
+        ? allocate_array(external_count, sizeof *interpreter->ext_bindings)
+        : NULL;
+    for (int i = 0; i < library_count; ++i) {
+        struct ext_library *library = &module->ext_libraries.items[i];
+        const char *filename = view_to_string(&library->filename, module->region);
+        void *handle = open_ext_library(filename);
+        if (handle == NULL) {
+            fprintf(stderr, "Failed to load library '%s': %s.\n", filename, ext_library_error());
+            return false;
+        }
+        interpreter->ext_libraries[i] = handle;
+        for (int j = 0; j < library->count; ++j) {
+            int ext_index = library->items[j];
+            struct ext_function *external = get_external(&module->externals, ext_index);
+            const char *name = view_to_string(&external->name, module->region);
+            ext_address address = lookup_ext_symbol(handle, name);
+            if (address == NULL) {
+                fprintf(stderr, "Failed to find function '%s' in library '%s': %s.\n",
+                        name, filename, ext_library_error());
+                return false;
+            }
+            const char *signature_error = check_ext_signature(external);
+            if (signature_error != NULL) {
+                fprintf(stderr, "External function '%s' cannot be called: %s.\n",
+                        name, signature_error);
+                return false;
+            }
+            if (!bind_external(&module->types, external, address,
+                               &interpreter->ext_bindings[ext_index])) {
+                fprintf(stderr, "External function '%s' cannot be called by the interpreter "
+                        "(unsupported calling convention or too many parameters).\n", name);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void unload_externals(struct interpreter *interpreter) {
+    struct module *module = interpreter->module;
+    if (interpreter->ext_bindings != NULL) {
+        for (int i = 0; i < module->externals.count; ++i) {
+            unbind_external(&interpreter->ext_bindings[i]);
+        }
+        free_array(interpreter->ext_bindings, module->externals.count,
+                   sizeof *interpreter->ext_bindings);
+    }
+    if (interpreter->ext_libraries != NULL) {
+        for (int i = 0; i < module->ext_libraries.count; ++i) {
+            if (interpreter->ext_libraries[i] != NULL) {
+                close_ext_library(interpreter->ext_libraries[i]);
+            }
+        }
+        free_array(interpreter->ext_libraries, module->ext_libraries.count,
+                   sizeof *interpreter->ext_libraries);
+    }
+    interpreter->ext_bindings = NULL;
+    interpreter->ext_libraries = NULL;
+}
+
 bool init_interpreter(struct interpreter *interpreter, struct module *module) {
     interpreter->module = module;
+    interpreter->ext_libraries = NULL;
+    interpreter->ext_bindings = NULL;
+    if (!load_function(module, 0)) return false;
     struct function *main_func = get_function(&module->functions, 0);
     interpreter->current_function = 0;  // Function 0 is the entry point.
     interpreter->ip = 0;
@@ -62,6 +135,9 @@ bool init_interpreter(struct interpreter *interpreter, struct module *module) {
     init_stack(interpreter->call_stack);
     // Needs to happen after aux has been initialised.
     interpreter->locals = interpreter->auxiliary_stack->elements;
+    if (!load_externals(interpreter)) {
+        return false;
+    }
     // Dummy return address to simulate entry point code.
     /* struct pair32 dummy_retinfo = {0, main_func->w_code.count}; */
     /* push(interpreter->call_stack, pair32_to_u64(dummy_retinfo)); */
@@ -69,6 +145,7 @@ bool init_interpreter(struct interpreter *interpreter, struct module *module) {
 }
 
 void free_interpreter(struct interpreter *interpreter) {
+    unload_externals(interpreter);
     free(interpreter->main_stack);
     free(interpreter->auxiliary_stack);
     free(interpreter->loop_stack);
@@ -161,6 +238,8 @@ static void call(struct interpreter *interpreter, int index) {
     push(interpreter->call_stack, pair32_to_u64(retinfo));
     push(interpreter->loop_stack, interpreter->for_loop_level);
     interpreter->for_loop_level = 0;
+    // Functions of a lazily-read module are loaded the first time they are called.
+    if (!load_function(interpreter->module, index)) exit(1);
     struct function *callee = get_function(&interpreter->module->functions, index);
     interpreter->block = &callee->w_code;
     interpreter->current_function = index;
@@ -169,6 +248,36 @@ static void call(struct interpreter *interpreter, int index) {
     interpreter->ip = -1;  // -1 since ip will be incremented.
 }
 
+static void ext_call(struct interpreter *interpreter, int index) {
+    struct ext_binding *binding = &interpreter->ext_bindings[index];
+    assert(binding->trampoline != NULL);
+    stack_word args[EXT_CALL_SLOT_COUNT] = {0};
+    if (binding->param_word_count > 0) {
+        const stack_word *params = peekn(interpreter->main_stack, binding->param_word_count);
+        for (int i = 0; i < binding->param_word_count; ++i) {
+            args[binding->arg_slots[i]] = params[i];
+        }
+        popn(interpreter->main_stack, binding->param_word_count);
+    }
+    stack_word *ret_buffer = NULL;
+    if (binding->memory_ret) {
+        // The callee writes large results to a buffer on aux, which we pass a pointer to.
+        ret_buffer = reserve(interpreter->auxiliary_stack, binding->ret_word_count);
+        args[EXT_CALL_INT_SLOTS] = (uintptr_t)ret_buffer;
+    }
+    struct ext_result result = binding->trampoline(binding->address, args);
+    if (binding->memory_ret) {
+        push_all(interpreter->main_stack, binding->ret_word_count, ret_buffer);
+        restore(interpreter->auxiliary_stack, ret_buffer);
+    }
+    else if (binding->ret_word_count == 1) {
+        push(interpreter->main_stack, extend_ext_result(binding, result.words[0]));
+    }
+    else if (binding->ret_word_count > 1) {
+        push_all(interpreter->main_stack, binding->ret_word_count, result.words);
+    }
+}
+
 static void ret(struct interpreter *interpreter) {
     restore(interpreter->auxiliary_stack, interpreter->locals);
     interpreter->locals = (stack_word *)pop(interpreter->auxiliary_stack);
@@ -1249,11 +1358,24 @@ enum interpret_result interpret(struct interpreter *interpreter) {
             call(interpreter, index);
             break;
         }
-        case W_OP_EXTCALL8:
-        case W_OP_EXTCALL16:
-        case W_OP_EXTCALL32:
-            assert(false && "Not implemented");
+        case W_OP_EXTCALL8: {
+            uint8_t index = read_u8(interpreter->block, interpreter->ip + 1);
+            interpreter->ip += 1;
+            ext_call(interpreter, index);
             break;
+        }
+        case W_OP_EXTCALL16: {
+            uint16_t index = read_u16(interpreter->block, interpreter->ip + 1);
+            interpreter->ip += 2;
+            ext_call(interpreter, index);
+            break;
+        }
+        case W_OP_EXTCALL32: {
+            uint32_t index = read_u32(interpreter->block, interpreter->ip + 1);
+            interpreter->ip += 4;
+            ext_call(interpreter, index);
+            break;
+        }
         case W_OP_RET:
             ret(interpreter);
             break;
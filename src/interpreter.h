@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 
+#include "ext_call.h"
 #include "module.h"
 #include "ir.h"
 #include "stack.h"
@@ -20,6 +21,8 @@ struct interpreter {
     struct stack *call_stack;
     stack_word *locals;
     struct module *module;
+    void **ext_libraries;  // Handles of the loaded libraries, indexed like module->ext_libraries.
+    struct ext_binding *ext_bindings;  // Indexed like module->externals.
     int current_function;
     int ip;
     int for_loop_level;
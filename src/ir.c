@@ -11,6 +11,7 @@
 
 #ifndef BLOCK_INIT_SIZE
 #define BLOCK_INIT_SIZE 128
+#define LOCATION_TABLE_INIT_SIZE 16
 #endif
 
 #ifndef JUMP_INFO_TABLE_INIT_SIZE
@@ -74,28 +75,48 @@ static const int w_instruction_sizes[] = {
     [W_OP_DUPEN16]                   = 3,
     [W_OP_DUPEN32]                   = 5,
     [W_OP_EQUALS]                    = 1,
+    [W_OP_EQUALS_F32]                = 1,
+    [W_OP_EQUALS_F64]                = 1,
     [W_OP_EXIT]                      = 1,
     [W_OP_FOR_DEC_START]             = 3,
     [W_OP_FOR_DEC]                   = 3,
     [W_OP_FOR_INC_START]             = 3,
     [W_OP_FOR_INC]                   = 3,
     [W_OP_GET_LOOP_VAR]              = 3,
+    [W_OP_GREATER_EQUALS]            = 1,
+    [W_OP_GREATER_EQUALS_F32]        = 1,
+    [W_OP_GREATER_EQUALS_F64]        = 1,
     [W_OP_GREATER_THAN]              = 1,
+    [W_OP_GREATER_THAN_F32]          = 1,
+    [W_OP_GREATER_THAN_F64]          = 1,
+    [W_OP_HIGHER_SAME]               = 1,
     [W_OP_HIGHER_THAN]               = 1,
     [W_OP_JUMP]                      = 3,
     [W_OP_JUMP_COND]                 = 3,
     [W_OP_JUMP_NCOND]                = 3,
+    [W_OP_LESS_EQUALS]               = 1,
+    [W_OP_LESS_EQUALS_F32]           = 1,
+    [W_OP_LESS_EQUALS_F64]           = 1,
     [W_OP_LESS_THAN]                 = 1,
+    [W_OP_LESS_THAN_F32]             = 1,
+    [W_OP_LESS_THAN_F64]             = 1,
     [W_OP_LOCAL_GET]                 = 3,
     [W_OP_LOCAL_SET]                 = 3,
+    [W_OP_LOWER_SAME]                = 1,
     [W_OP_LOWER_THAN]                = 1,
     [W_OP_MULT]                      = 1,
     [W_OP_MULTF32]                   = 1,
     [W_OP_MULTF64]                   = 1,
+    [W_OP_NEG]                       = 1,
+    [W_OP_NEGF32]                    = 1,
+    [W_OP_NEGF64]                    = 1,
     [W_OP_NOT]                       = 1,
     [W_OP_NOT_EQUALS]                = 1,
+    [W_OP_NOT_EQUALS_F32]            = 1,
+    [W_OP_NOT_EQUALS_F64]            = 1,
     [W_OP_OR]                        = 1,
     [W_OP_PRINT]                     = 1,
+    [W_OP_PRINT_BOOL]                = 1,
     [W_OP_PRINT_CHAR]                = 1,
     [W_OP_PRINT_FLOAT]               = 1,
     [W_OP_PRINT_INT]                 = 1,
@@ -126,7 +147,11 @@ static const int w_instruction_sizes[] = {
     [W_OP_ICONVF32L]                 = 1,
     [W_OP_ICONVF64]                  = 1,
     [W_OP_ICONVF64L]                 = 1,
+    [W_OP_FCONVI32]                  = 1,
     [W_OP_FCONVI64]                  = 1,
+    [W_OP_ICONVB]                    = 1,
+    [W_OP_FCONVB32]                  = 1,
+    [W_OP_FCONVB64]                  = 1,
     [W_OP_ICONVC32]                  = 1,
     [W_OP_CHAR_8CONV32]              = 1,
     [W_OP_CHAR_32CONV8]              = 1,
@@ -162,6 +187,12 @@ static const int w_instruction_sizes[] = {
     [W_OP_COMP_SUBCOMP_SET8]         = 3,
     [W_OP_COMP_SUBCOMP_SET16]        = 5,
     [W_OP_COMP_SUBCOMP_SET32]        = 9,
+    [W_OP_ARRAY_GET8]                = 3,
+    [W_OP_ARRAY_GET16]               = 5,
+    [W_OP_ARRAY_GET32]               = 9,
+    [W_OP_ARRAY_SET8]                = 3,
+    [W_OP_ARRAY_SET16]               = 5,
+    [W_OP_ARRAY_SET32]               = 9,
     [W_OP_CALL8]                     = 2,
     [W_OP_CALL16]                    = 3,
     [W_OP_CALL32]                    = 5,
@@ -172,7 +203,7 @@ static const int w_instruction_sizes[] = {
 };
 
 int get_w_instruction_size(enum w_opcode opcode) {
-    assert(0 <= opcode && opcode < sizeof w_instruction_sizes);
+    assert(0 <= opcode && opcode < sizeof w_instruction_sizes / sizeof w_instruction_sizes[0]);
     return w_instruction_sizes[opcode];
 }
 
@@ -206,20 +237,88 @@ bool is_w_jump(enum w_opcode instruction) {
     }
 }
 
+bool read_w_int_constant(struct ir_block *block, int index, uint64_t *value) {
+    // Signed pushes are sign-extended to a full word, as in the interpreter.
+    switch (block->code[index]) {
+    case W_OP_PUSH8:
+        *value = read_u8(block, index + 1);
+        return true;
+    case W_OP_PUSH16:
+        *value = read_u16(block, index + 1);
+        return true;
+    case W_OP_PUSH32:
+        *value = read_u32(block, index + 1);
+        return true;
+    case W_OP_PUSH64:
+        *value = read_u64(block, index + 1);
+        return true;
+    case W_OP_PUSH_INT8:
+        *value = s64_to_u64(read_s8(block, index + 1));
+        return true;
+    case W_OP_PUSH_INT16:
+        *value = s64_to_u64(read_s16(block, index + 1));
+        return true;
+    case W_OP_PUSH_INT32:
+        *value = s64_to_u64(read_s32(block, index + 1));
+        return true;
+    case W_OP_PUSH_INT64:
+        *value = s64_to_u64(read_s64(block, index + 1));
+        return true;
+    default:
+        return false;
+    }
+}
+
 void init_block(struct ir_block *block, enum ir_instruction_set instruction_set) {
     block->code = allocate_array(BLOCK_INIT_SIZE, sizeof *block->code);
-    block->locations = allocate_array(BLOCK_INIT_SIZE, sizeof *block->locations);
+    INIT_DARRAY(&block->locations, LOCATION_TABLE_INIT_SIZE);
     block->capacity = BLOCK_INIT_SIZE;
     block->count = 0;
     block->instruction_set = instruction_set;
     init_jump_info_table(&block->jumps);
 }
 
+/* Borrowed code (see `borrow_code()`) is the only code without a capacity of its own. */
+static bool is_borrowed(const struct ir_block *block) {
+    return block->capacity == 0 && block->code != NULL;
+}
+
+/* Copy borrowed code into a buffer owned by the block. */
+static void own_code(struct ir_block *block, int capacity) {
+    assert(capacity >= block->count && capacity > 0);
+    uint8_t *code = allocate_array(capacity, sizeof *code);
+    CHECK_ALLOCATION(code);
+    memcpy(code, block->code, block->count);
+    block->code = code;
+    block->capacity = capacity;
+}
+
+static void make_writable(struct ir_block *block) {
+    if (is_borrowed(block)) {
+        own_code(block, block->count);
+    }
+}
+
+void stop_borrowing_code(struct ir_block *block) {
+    if (is_borrowed(block)) {
+        own_code(block, (block->count > 0) ? block->count : BLOCK_INIT_SIZE);
+    }
+}
+
+void borrow_code(struct ir_block *block, const uint8_t *code, int count) {
+    assert(block->capacity == 0 && block->code == NULL);
+    assert(code != NULL);
+    // The code is never written through this pointer; it is copied first.
+    block->code = (uint8_t *)code;
+    block->count = count;
+}
+
 void free_block(struct ir_block *block) {
-    free_array(block->code, block->capacity, sizeof *block->code);
-    free_array(block->locations, block->capacity, sizeof *block->locations);
+    if (!is_borrowed(block)) {
+        free_array(block->code, block->capacity, sizeof *block->code);
+    }
+    FREE_DARRAY(&block->locations);
     block->code = NULL;
-    block->locations = NULL;
     block->capacity = 0;
     block->count = 0;
     free_jump_info_table(&block->jumps);
@@ -234,20 +333,87 @@ void free_jump_info_table(struct jump_info_table *jumps) {
 }
 
 static void grow_block(struct ir_block *block) {
+    if (is_borrowed(block)) {
+        own_code(block, block->count + BLOCK_INIT_SIZE);
+        return;
+    }
     int old_capacity = block->capacity;
     int new_capacity = (old_capacity > 0) ? old_capacity + old_capacity/2 : BLOCK_INIT_SIZE;
     block->code = reallocate_array(block->code, old_capacity, new_capacity,
                                    sizeof block->code[0]);
-    block->locations = reallocate_array(block->locations, old_capacity, new_capacity,
-                                        sizeof block->locations[0]);
     block->capacity = new_capacity;
 }
 
+static void add_location(struct ir_block *block, const struct location *location) {
+    struct location_table *locations = &block->locations;
+    if (locations->count > 0) {
+        struct location_run *last = &locations->items[locations->count - 1];
+        if (last->line == location->line && last->column == location->column) return;
+        if (last->start == block->count) {
+            // The previous run is empty, so replace it.
+            --locations->count;
+        }
+    }
+    struct location_run run = {
+        .start = block->count,
+        .line = location->line,
+        .column = location->column,
+    };
+    DARRAY_APPEND(locations, run);
+}
+
+/* Find the last run starting at or before `index`, or -1 if there isn't one. */
+static int find_location_run(const struct location_table *locations, int index) {
+    int lo = 0;
+    int hi = locations->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (locations->items[mid].start <= index) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static struct location run_location(const struct location_table *locations, int run) {
+    if (run < 0) return (struct location) {0};
+    const struct location_run *item = &locations->items[run];
+    return (struct location) {.line = item->line, .column = item->column};
+}
+
+struct location get_location(const struct ir_block *block, int index) {
+    return run_location(&block->locations, find_location_run(&block->locations, index));
+}
+
+struct location get_next_location(const struct ir_block *block, int index, int *run) {
+    const struct location_table *locations = &block->locations;
+    int current = *run;
+    if (current >= 0 && current < locations->count && locations->items[current].start <= index) {
+        // Scan forward a little before falling back to a binary search.
+        for (int i = 0; i < 4 && current + 1 < locations->count; ++i) {
+            if (locations->items[current + 1].start > index) {
+                *run = current;
+                return run_location(locations, current);
+            }
+            ++current;
+        }
+        if (current + 1 == locations->count) {
+            *run = current;
+            return run_location(locations, current);
+        }
+    }
+    *run = find_location_run(locations, index);
+    return run_location(locations, *run);
+}
+
 void write_simple(struct ir_block *block, opcode instruction, struct location *location) {
     if (block->count + 1 > block->capacity) {
         grow_block(block);
     }
-    block->locations[block->count] = *location;
+    add_location(block, location);
     block->code[block->count++] = instruction;
 }
 
@@ -255,7 +421,7 @@ void write_u8(struct ir_block *block, uint8_t operand, struct location *location
     if (block->count + 1 > block->capacity) {
         grow_block(block);
     }
-    block->locations[block->count] = *location;
+    add_location(block, location);
     block->code[block->count++] = operand;
 }
 
@@ -267,9 +433,7 @@ void write_u16(struct ir_block *block, uint16_t operand, struct location *locati
     if (block->count + 2 > block->capacity) {
         grow_block(block);
     }
-    for (int i = 0; i < 2; ++i) {
-        block->locations[block->count + i] = *location;
-    }
+    add_location(block, location);
     block->code[block->count++] = operand;
     block->code[block->count++] = operand >> 8;
 }
@@ -282,9 +446,7 @@ void write_u32(struct ir_block *block, uint32_t operand, struct location *locati
     if (block->count + 4 > block->capacity) {
         grow_block(block);
     }
-    for (int i = 0; i < 4; ++i) {
-        block->locations[block->count + i] = *location;
-    }
+    add_location(block, location);
     block->code[block->count++] = operand;
     block->code[block->count++] = operand >> 8;
     block->code[block->count++] = operand >> 16;
@@ -299,9 +461,7 @@ void write_u64(struct ir_block *block, uint64_t operand, struct location *locati
     if (block->count + 8 > block->capacity) {
         grow_block(block);
     }
-    for (int i = 0; i < 8; ++i) {
-        block->locations[block->count + i] = *location;
-    }
+    add_location(block, location);
     block->code[block->count++] = operand;
     block->code[block->count++] = operand >> 8;
     block->code[block->count++] = operand >> 16;
@@ -321,8 +481,7 @@ void write_immediate_u8(struct ir_block *block, opcode instruction, uint8_t oper
     if (block->count + 2 > block->capacity) {
         grow_block(block);
     }
-    block->locations[block->count] = *location;
-    block->locations[block->count + 1] = *location;
+    add_location(block, location);
     block->code[block->count++] = instruction;
     block->code[block->count++] = operand;
 }
@@ -337,7 +496,7 @@ void write_immediate_u16(struct ir_block *block, opcode instruction, uint16_t op
     if (block->count + 3 > block->capacity) {
         grow_block(block);
     }
-    block->locations[block->count] = *location;
+    add_location(block, location);
     block->code[block->count++] = instruction;
     write_u16(block, operand, location);
 }
@@ -352,7 +511,7 @@ void write_immediate_u32(struct ir_block *block, opcode instruction, uint32_t op
     if (block->count + 5 > block->capacity) {
         grow_block(block);
     }
-    block->locations[block->count] = *location;
+    add_location(block, location);
     block->code[block->count++] = instruction;
     write_u32(block, operand, location);
 }
@@ -367,7 +526,7 @@ void write_immediate_u64(struct ir_block *block, opcode instruction, uint64_t op
     if (block->count + 9 > block->capacity) {
         grow_block(block);
     }
-    block->locations[block->count] = *location;
+    add_location(block, location);
     block->code[block->count++] = instruction;
     write_u64(block, operand, location);
 }
@@ -379,6 +538,7 @@ void write_immediate_s64(struct ir_block *block, opcode instruction, int64_t ope
 
 void overwrite_u8(struct ir_block *block, int start, uint8_t value) {
     assert(0 <= start && start < block->count);
+    make_writable(block);
     block->code[start] = value;
 }
 
@@ -388,6 +548,7 @@ void overwrite_s8(struct ir_block *block, int start, int8_t value) {
 
 void overwrite_u16(struct ir_block *block, int start, uint16_t value) {
     assert(0 <= start && start + 1 < block->count);  // Make sure there's space.
+    make_writable(block);
     // Note: The IR instruction set is little-endian.
     block->code[start] = value;  // LSB.
     block->code[start + 1] = value >> 8;  // MSB.
@@ -399,6 +560,7 @@ void overwrite_s16(struct ir_block *block, int start, int16_t value) {
 
 void overwrite_u32(struct ir_block *block, int start, uint32_t value) {
     assert(0 <= start && start + 3 < block->count);
+    make_writable(block);
     block->code[start] = value;
     block->code[start + 1] = value >> 8;
     block->code[start + 2] = value >> 16;
@@ -411,6 +573,7 @@ void overwrite_s32(struct ir_block *block, int start, int32_t value) {
 
 void overwrite_u64(struct ir_block *block, int start, uint64_t value) {
     assert(0 <= start && start + 7 < block->count);
+    make_writable(block);
     block->code[start] = value;
     block->code[start + 1] = value >> 8;
     block->code[start + 2] = value >> 16;
@@ -463,7 +626,7 @@ int32_t read_s32(struct ir_block *block, int index) {
 }
 
 uint64_t read_u64(struct ir_block *block, int index) {
-    assert(0 <= index && index + 3 < block->count);
+    assert(0 <= index && index + 7 < block->count);
 
     uint64_t result = block->code[index];
     result ^= (uint64_t)block->code[index + 1] << 8;
@@ -543,8 +706,84 @@ void recompute_jump_dests(struct ir_block *block) {
     }
 }
 
+/* The number of entries in the table which the operand of the instruction at `ip` indexes, or
+ * -1 if the instruction doesn't have a table index operand.
+ */
+static int64_t get_table_count(struct ir_block *block, int ip, const struct w_code_tables *tables,
+                               uint32_t *index) {
+    enum w_opcode instruction = block->code[ip];
+    enum w_opcode base = 0;
+    int count = 0;
+    if (W_OP_LOAD_STRING8 <= instruction && instruction <= W_OP_LOAD_STRING32) {
+        base = W_OP_LOAD_STRING8;
+        count = tables->string_count;
+    }
+    else if (W_OP_CALL8 <= instruction && instruction <= W_OP_CALL32) {
+        base = W_OP_CALL8;
+        count = tables->function_count;
+    }
+    else if (W_OP_EXTCALL8 <= instruction && instruction <= W_OP_EXTCALL32) {
+        base = W_OP_EXTCALL8;
+        count = tables->external_count;
+    }
+    else {
+        return -1;
+    }
+    // Each instruction comes in 8-, 16- and 32-bit versions, in that order.
+    switch (instruction - base) {
+    case 0: *index = read_u8(block, ip + 1); break;
+    case 1: *index = read_u16(block, ip + 1); break;
+    default: *index = read_u32(block, ip + 1); break;
+    }
+    return count;
+}
+
+bool check_w_code(struct ir_block *block, const struct w_code_tables *tables) {
+    assert(block->instruction_set == IR_WORD_ORIENTED);
+    const int opcode_count = sizeof w_instruction_sizes / sizeof w_instruction_sizes[0];
+    // One flag per byte of code, plus one for the end of the block, which is a valid jump
+    // destination.
+    bool *is_start = allocate_array(block->count + 1, sizeof *is_start);
+    CHECK_ARRAY_ALLOCATION(is_start, block->count + 1);
+    memset(is_start, 0, (block->count + 1) * sizeof *is_start);
+    bool is_valid = true;
+    for (int ip = 0; ip < block->count; ) {
+        is_start[ip] = true;
+        int instruction = block->code[ip];
+        int size = (instruction < opcode_count) ? w_instruction_sizes[instruction] : 0;
+        if (size <= 0 || size > block->count - ip) {
+            is_valid = false;
+            goto done;
+        }
+        uint32_t index = 0;
+        int64_t table_count = get_table_count(block, ip, tables, &index);
+        if (table_count >= 0 && index >= table_count) {
+            is_valid = false;
+            goto done;
+        }
+        ip += size;
+    }
+    is_start[block->count] = true;
+    // Now that every instruction start is known, check the jumps land on them, filling in the
+    // jump table as we go.
+    block->jumps.count = 0;
+    for (int ip = 0; ip < block->count; ip += w_instruction_sizes[block->code[ip]]) {
+        if (!is_w_jump(block->code[ip])) continue;
+        int dest = ip + 1 + read_s16(block, ip + 1);
+        if (dest < 0 || dest > block->count || !is_start[dest]) {
+            is_valid = false;
+            goto done;
+        }
+        add_jump(block, dest);
+    }
+done:
+    free_array(is_start, block->count + 1, sizeof *is_start);
+    return is_valid;
+}
+
 void ir_error(const char *restrict filename, struct ir_block *block,
               size_t index, const char *restrict message) {
-    report_location(filename, &block->locations[index]);
+    struct location location = get_location(block, index);
+    report_location(filename, &location);
     fprintf(stderr, message);
 }
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "location.h"
 #include "string_builder.h"
 #include "string_view.h"
 
@@ -533,11 +534,27 @@ struct jump_info_table {
     int *items;
 };
 
+/* A run of code which was all generated from the same source location. The run starts at
+ * `start` and continues up to the start of the next run.
+ */
+struct location_run {
+    int32_t start;
+    uint32_t line;
+    uint32_t column;
+};
+
+/* Source locations of the code in a block, stored as runs in order of their start offsets. */
+struct location_table {
+    int capacity;
+    int count;
+    struct location_run *items;
+};
+
 struct ir_block {
     int capacity;
     int count;
     uint8_t *code;
-    struct location *locations;
+    struct location_table locations;
     enum ir_instruction_set instruction_set;
     struct jump_info_table jumps;
 };
@@ -557,6 +574,7 @@ int get_w_instruction_size(enum w_opcode opcode);
 
 bool is_t_jump(enum t_opcode instruction);
 bool is_w_jump(enum w_opcode instruction);
+bool read_w_int_constant(struct ir_block *block, int index, uint64_t *value);
 
 #define is_jump(instruction)\
     _Generic((instruction),\
@@ -566,11 +584,25 @@ bool is_w_jump(enum w_opcode instruction);
 
 void init_block(struct ir_block *block, enum ir_instruction_set instruction_set);
 void free_block(struct ir_block *block);
+/* Make an empty block (with no code of its own) use `count` bytes of `code` which it doesn't
+ * own, such as code in a mapped file. The code is copied the first time the block is modified,
+ * and is not freed along with the block.
+ */
+void borrow_code(struct ir_block *block, const uint8_t *code, int count);
+/* Give a block its own copy of any code it borrows, so it no longer depends on the original. */
+void stop_borrowing_code(struct ir_block *block);
 void init_jump_info_table(struct jump_info_table *jumps);
 void free_jump_info_table(struct jump_info_table *jumps);
 
 void copy_metadata(struct ir_block *restrict dest, struct ir_block *restrict src);
 
+/* Get the source location of the code at `index`, or a zeroed location if there isn't one. */
+struct location get_location(const struct ir_block *block, int index);
+/* Like get_location(), but faster when the code is visited in order. `run` should start as -1
+ * and is updated on each call.
+ */
+struct location get_next_location(const struct ir_block *block, int index, int *run);
+
 void write_simple(struct ir_block *block, opcode instruction, struct location *location);
 
 void write_immediate_u8(struct ir_block *block, opcode instruction, uint8_t operand,
@@ -624,6 +656,19 @@ int add_jump(struct ir_block *block, int dest);
 int find_jump(struct ir_block *block, int dest);
 bool is_jump_dest(struct ir_block *block, int dest);
 void recompute_jump_dests(struct ir_block *block);
+/* The sizes of the module tables which word-oriented code can refer to. */
+struct w_code_tables {
+    int function_count;
+    int string_count;
+    int external_count;
+};
+
+/* Check that word-oriented code is well-formed: every opcode is valid, every instruction fits
+ * in the block, every jump lands on the start of an instruction or the end of the block and
+ * every function, string or external function index refers to an entry in `tables`. The
+ * block's jump table is recomputed along the way, as by recompute_jump_dests().
+ */
+bool check_w_code(struct ir_block *block, const struct w_code_tables *tables);
 
 void ir_error(const char *restrict filename, struct ir_block *block,
               size_t index, const char *restrict message);
@@ -2,27 +2,130 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lexer.h"
 #include "string_builder.h"
 #include "string_view.h"
 
-static void set_position(struct lexer *lexer, struct location position) {
-    lexer->position = position;
-    lexer->start_position = position;
+/* Vectorised scanning.
+ *
+ * Long runs of whitespace, comments, string bodies and symbols are skipped a block at a time
+ * rather than a character at a time. A block is 32 bytes with AVX2 and 16 bytes with SSE2 (which
+ * every x86-64 target has). Other targets, and the tail of the source, are scanned one byte at a
+ * time.
+ */
+#if defined(__AVX2__)
+#define SCAN_BLOCK_SIZE 32
+typedef __m256i scan_block;
+#define load_block(p) _mm256_loadu_si256((const __m256i *)(p))
+#define splat(c) _mm256_set1_epi8(c)
+#define block_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define block_or(a, b) _mm256_or_si256(a, b)
+#define block_sub(a, b) _mm256_sub_epi8(a, b)
+#define block_min(a, b) _mm256_min_epu8(a, b)
+#define block_mask(a) (uint32_t)_mm256_movemask_epi8(a)
+#define FULL_MASK UINT32_MAX
+#elif defined(__SSE2__)
+#define SCAN_BLOCK_SIZE 16
+typedef __m128i scan_block;
+#define load_block(p) _mm_loadu_si128((const __m128i *)(p))
+#define splat(c) _mm_set1_epi8(c)
+#define block_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define block_or(a, b) _mm_or_si128(a, b)
+#define block_sub(a, b) _mm_sub_epi8(a, b)
+#define block_min(a, b) _mm_min_epu8(a, b)
+#define block_mask(a) (uint32_t)_mm_movemask_epi8(a)
+#define FULL_MASK UINT32_C(0xFFFF)
+#endif
+
+#ifdef SCAN_BLOCK_SIZE
+
+/* The bytes of a block for which `isspace()` is true in the "C" locale: ' ' and '\t' to '\r'. */
+static scan_block whitespace_in(scan_block bytes) {
+    scan_block offset = block_sub(bytes, splat('\t'));
+    scan_block is_control = block_eq(block_min(offset, splat('\r' - '\t')), offset);
+    return block_or(is_control, block_eq(bytes, splat(' ')));
+}
+
+/* The bytes of a block which can't be part of a symbol (see `is_symbolic()`). */
+static scan_block non_symbolic_in(scan_block bytes) {
+    scan_block special = block_or(block_or(block_eq(bytes, splat('#')),
+                                           block_eq(bytes, splat('['))),
+                                  block_or(block_eq(bytes, splat(']')),
+                                           block_eq(bytes, splat('\0'))));
+    return block_or(whitespace_in(bytes), special);
+}
+
+/* The bytes of a block which end a run of plain characters in a string literal. */
+static scan_block string_stops_in(scan_block bytes) {
+    return block_or(block_eq(bytes, splat('"')), block_eq(bytes, splat('\\')));
+}
+
+#endif
+
+static const char *skip_whitespace_run(const char *p, const char *end) {
+#ifdef SCAN_BLOCK_SIZE
+    for (; end - p >= SCAN_BLOCK_SIZE; p += SCAN_BLOCK_SIZE) {
+        uint32_t stops = ~block_mask(whitespace_in(load_block(p))) & FULL_MASK;
+        if (stops != 0) return p + __builtin_ctz(stops);
+    }
+#endif
+    while (p < end && isspace(*p)) ++p;
+    return p;
+}
+
+static bool is_symbolic(char c);
+
+static const char *skip_symbol_run(const char *p, const char *end) {
+#ifdef SCAN_BLOCK_SIZE
+    for (; end - p >= SCAN_BLOCK_SIZE; p += SCAN_BLOCK_SIZE) {
+        uint32_t stops = block_mask(non_symbolic_in(load_block(p)));
+        if (stops != 0) return p + __builtin_ctz(stops);
+    }
+#endif
+    while (p < end && is_symbolic(*p)) ++p;
+    return p;
+}
+
+static const char *skip_string_run(const char *p, const char *end) {
+#ifdef SCAN_BLOCK_SIZE
+    for (; end - p >= SCAN_BLOCK_SIZE; p += SCAN_BLOCK_SIZE) {
+        uint32_t stops = block_mask(string_stops_in(load_block(p)));
+        if (stops != 0) return p + __builtin_ctz(stops);
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\') ++p;
+    return p;
 }
 
 void init_lexer(struct lexer *lexer, const char *src, const char *src_end, const char *filename) {
     lexer->start = src;
-    lexer->end = src_end;
+    lexer->end = (src_end != NULL) ? src_end : src + strlen(src);
     lexer->current = src;
-    set_position(lexer, (struct location) {LINE_START, COLUMN_START});
+    lexer->line = LINE_START;
+    lexer->line_start = src;
+    lexer->start_position = (struct location) {LINE_START, COLUMN_START};
     lexer->filename = filename;
 }
 
+/* The location of the next character. */
+static struct location current_location(struct lexer *lexer) {
+    return (struct location) {
+        .line = lexer->line,
+        .column = lexer->current - lexer->line_start + COLUMN_START,
+    };
+}
+
 static void lex_error(struct lexer *lexer, const char *restrict message, ...) {
     report_location(lexer->filename, &lexer->start_position);
     fprintf(stderr, "Syntax Error: ");
@@ -33,36 +136,51 @@ static void lex_error(struct lexer *lexer, const char *restrict message, ...) {
     fprintf(stderr, "\n");
 }
 
+static bool is_at_end(struct lexer *lexer) {
+    return lexer->current == lexer->end;
+}
+
 static char advance(struct lexer *lexer) {
-    struct location *pos = &lexer->position;
+    // The source needn't be null-terminated, so we must never read past the end.
+    if (is_at_end(lexer)) return '\0';
     if (*lexer->current == '\n') {
-        ++pos->line;
-        pos->column = COLUMN_START;
-    }
-    else {
-        ++pos->column;
+        ++lexer->line;
+        lexer->line_start = lexer->current + 1;
     }
     return *lexer->current++;
 }
 
-static bool check(struct lexer *lexer, char c) {
-    return *lexer->current == c;
+/* Advance to `p`, which is on the same line. */
+static void skip_within_line(struct lexer *lexer, const char *p) {
+    assert(lexer->current <= p && p <= lexer->end);
+    lexer->current = p;
 }
 
-static bool check_any(struct lexer *lexer, const char *cs) {
-    for (; *cs != '\0'; ++cs ) {
-        if (check(lexer, *cs)) return true;
+/* Advance to `p`, counting any newlines on the way. */
+static void skip_lines(struct lexer *lexer, const char *p) {
+    assert(lexer->current <= p && p <= lexer->end);
+    const char *newline = NULL;
+    while ((newline = memchr(lexer->current, '\n', p - lexer->current)) != NULL) {
+        ++lexer->line;
+        lexer->current = lexer->line_start = newline + 1;
     }
-    return false;
+    lexer->current = p;
 }
 
 static char peek(struct lexer *lexer) {
-    return *lexer->current;
+    // The end of the source looks like a null terminator, whether or not there is one.
+    return (is_at_end(lexer)) ? '\0' : *lexer->current;
 }
 
-static bool is_at_end(struct lexer *lexer) {
-    if (lexer->end != NULL) return lexer->current == lexer->end;
-    return *lexer->current == '\0';
+static bool check(struct lexer *lexer, char c) {
+    return peek(lexer) == c;
+}
+
+static bool check_any(struct lexer *lexer, const char *cs) {
+    for (; *cs != '\0'; ++cs ) {
+        if (check(lexer, *cs)) return true;
+    }
+    return false;
 }
 
 static bool match(struct lexer *lexer, char c) {
@@ -79,16 +197,21 @@ static bool match_any(struct lexer *lexer, const char *cs) {
 }
 
 static void consume_comment(struct lexer *lexer) {
-    while (!is_at_end(lexer) && advance(lexer) != '\n') {
-        /* Do nothing. */
+    // The comment runs up to and including the next newline.
+    const char *newline = memchr(lexer->current, '\n', lexer->end - lexer->current);
+    if (newline == NULL) {
+        skip_within_line(lexer, lexer->end);
+        return;
     }
+    skip_within_line(lexer, newline);
+    advance(lexer);
 }
 
 static void consume_whitespace(struct lexer *lexer) {
     while (!is_at_end(lexer)) {
         char c = peek(lexer);
         if (isspace(c)) {
-            advance(lexer);
+            skip_lines(lexer, skip_whitespace_run(lexer->current, lexer->end));
         }
         else if (c == '#') {
             consume_comment(lexer);
@@ -100,12 +223,13 @@ static void consume_whitespace(struct lexer *lexer) {
 }
 
 static void lex_string(struct lexer *lexer) {
-    while (!is_at_end(lexer) && !check(lexer, '"')) {
-        char c = advance(lexer);
-        if (c == '\\') {
-            // Escape sequence.
-            advance(lexer);
-        }
+    for (;;) {
+        // String literals may span several lines.
+        skip_lines(lexer, skip_string_run(lexer->current, lexer->end));
+        if (is_at_end(lexer) || check(lexer, '"')) break;
+        // Escape sequence.
+        advance(lexer);
+        advance(lexer);
     }
     if (is_at_end(lexer)) {
         lex_error(lexer, "unterminated string literal.");
@@ -139,7 +263,7 @@ static void lex_subscript(struct lexer *lexer) {
 static struct token make_token(struct lexer *lexer, enum token_type type, bool allow_subscript) {
     int length = lexer->current - lexer->start;
     const char *subscript_start = lexer->current;
-    struct location subscript_location = lexer->position;
+    struct location subscript_location = current_location(lexer);
     if (allow_subscript && match(lexer, '[')) {
         lex_subscript(lexer);
     }
@@ -175,55 +299,62 @@ static enum token_type check_terminal(struct lexer *lexer, int length, enum toke
     return (lexer->current - lexer->start == length) ? type : TOKEN_SYMBOL;
 }
 
+/* The `index`th character of the symbol being lexed, or '\0' if the symbol is shorter. The
+ * source may end right after the symbol, so we can't look past it.
+ */
+static char symbol_char(struct lexer *lexer, int index) {
+    return (lexer->current - lexer->start > index) ? lexer->start[index] : '\0';
+}
+
 static enum token_type symbol_type(struct lexer *lexer) {
-    switch (lexer->start[0]) {
+    switch (symbol_char(lexer, 0)) {
     case '+': return check_terminal(lexer, 1, TOKEN_PLUS);
     case '-':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case '>': return check_terminal(lexer, 2, TOKEN_RIGHT_ARROW);
         default: return check_terminal(lexer, 1, TOKEN_MINUS);
         }
         break;
     case '*': return check_terminal(lexer, 1, TOKEN_STAR);
     case '/':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case '=': return check_terminal(lexer, 2, TOKEN_SLASH_EQUALS);
         default: return check_terminal(lexer, 1, TOKEN_SLASH);
         }
         break;
     case '%': return check_terminal(lexer, 1, TOKEN_PERCENT);
     case '<':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case '-': return check_terminal(lexer, 2, TOKEN_LEFT_ARROW);
         case '=': return check_terminal(lexer, 2, TOKEN_LESS_EQUALS);
         default: return check_terminal(lexer, 1, TOKEN_LESS_THAN);
         }
         break;
     case '=': return check_terminal(lexer, 1, TOKEN_EQUALS);
-    case '>': switch (lexer->start[1]) {
+    case '>': switch (symbol_char(lexer, 1)) {
         case '=': return check_terminal(lexer, 2, TOKEN_GREATER_EQUALS);
         default: return check_terminal(lexer, 1, TOKEN_GREATER_THAN);
         }
         break;
     case '~': return check_terminal(lexer, 1, TOKEN_TILDE);
     case 'a':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'n': return check_keyword(lexer, 2, 1, "d", TOKEN_AND);
         case 'r': return check_keyword(lexer, 2, 3, "ray", TOKEN_ARRAY);
         case 's': return check_terminal(lexer, 2, TOKEN_AS);
         }
         break;
     case 'b':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'o': return check_keyword(lexer, 2, 2, "ol", TOKEN_BOOL);
         case 'y': return check_keyword(lexer, 2, 2, "te", TOKEN_BYTE);
         }
         break;
     case 'c':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'h':
             if (check_middle(lexer, 2, 2, "ar")) {
-                switch (lexer->start[4]) {
+                switch (symbol_char(lexer, 4)) {
                 case '1': return check_keyword(lexer, 5, 1, "6", TOKEN_CHAR16);
                 case '3': return check_keyword(lexer, 5, 1, "2", TOKEN_CHAR32);
                 default: return check_terminal(lexer, 4, TOKEN_CHAR);
@@ -234,9 +365,9 @@ static enum token_type symbol_type(struct lexer *lexer) {
         }
         break;
     case 'd':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'e':
-            switch (lexer->start[2]) {
+            switch (symbol_char(lexer, 2)) {
             case 'c': return check_keyword(lexer, 3, 3, "omp", TOKEN_DECOMP);
             case 'f': return check_terminal(lexer, 3, TOKEN_DEF);
             case 'r': return check_keyword(lexer, 3, 2, "ef", TOKEN_DEREF);
@@ -248,11 +379,11 @@ static enum token_type symbol_type(struct lexer *lexer) {
         }
         break;
     case 'e':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'd': return check_keyword(lexer, 2, 5, "ivmod", TOKEN_EDIVMOD);
         case 'l':
             if (lexer->current - lexer->start > 2) {
-                switch (lexer->start[2]) {
+                switch (symbol_char(lexer, 2)) {
                 case 'i': return check_keyword(lexer, 3, 1, "f", TOKEN_ELIF);
                 case 's': return check_keyword(lexer, 3, 1, "e", TOKEN_ELSE);
                 }
@@ -263,7 +394,7 @@ static enum token_type symbol_type(struct lexer *lexer) {
         }
         break;
     case 'f':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'a': return check_keyword(lexer, 2, 3, "lse", TOKEN_FALSE);
         case 'o': return check_keyword(lexer, 2, 1, "r", TOKEN_FOR);
         case 'r': return check_keyword(lexer, 2, 2, "om", TOKEN_FROM);
@@ -273,7 +404,7 @@ static enum token_type symbol_type(struct lexer *lexer) {
         }
         break;
     case 'i':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'd': return check_keyword(lexer, 2, 5, "ivmod", TOKEN_IDIVMOD);
         case 'f': return check_terminal(lexer, 2, TOKEN_IF);
         case 'm': return check_keyword(lexer, 2, 4, "port", TOKEN_IMPORT);
@@ -282,13 +413,13 @@ static enum token_type symbol_type(struct lexer *lexer) {
         break;
     case 'n': return check_keyword(lexer, 1, 2, "ot", TOKEN_NOT);
     case 'p':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'a':
             return check_keyword(lexer, 2, 2, "ck", TOKEN_PACK);
         case 'o': return check_keyword(lexer, 2, 1, "p", TOKEN_POP);
         case 'r':
             if (check_middle(lexer, 2, 3, "int")) {
-                switch (lexer->start[5]) {
+                switch (symbol_char(lexer, 5)) {
                 case '-': return check_keyword(lexer, 6, 4, "char", TOKEN_PRINT_CHAR);
                 case 'l': return check_keyword(lexer, 6, 1, "n", TOKEN_PRINTLN);
                 case 's': return check_keyword(lexer, 6, 1, "p", TOKEN_PRINTSP);
@@ -301,19 +432,19 @@ static enum token_type symbol_type(struct lexer *lexer) {
         }
         break;
     case 'o':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'r': return check_terminal(lexer, 2, TOKEN_OR);
         case 'v': return check_keyword(lexer, 2, 2, "er", TOKEN_OVER);
         }
         break;
     case 'r':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'e': return check_keyword(lexer, 2, 1, "t", TOKEN_RET);
         case 'o': return check_keyword(lexer, 2, 1, "t", TOKEN_ROT);
         }
         break;
     case 's':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 't': return check_keyword(lexer, 2, 4, "ring", TOKEN_STRING);
         case 'w': return check_keyword(lexer, 2, 2, "ap", TOKEN_SWAP);
         case '8': return check_terminal(lexer, 2, TOKEN_S8);
@@ -322,14 +453,14 @@ static enum token_type symbol_type(struct lexer *lexer) {
         }
         break;
     case 't':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'h': return check_keyword(lexer, 2, 2, "en", TOKEN_THEN);
         case 'o': return check_terminal(lexer, 2, TOKEN_TO);
         case 'r': return check_keyword(lexer, 2, 2, "ue", TOKEN_TRUE);
         }
         break;
     case 'u':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case '8': return check_terminal(lexer, 2, TOKEN_U8);
         case '1': return check_keyword(lexer, 2, 1, "6", TOKEN_U16);
         case '3': return check_keyword(lexer, 2, 1, "2", TOKEN_U32);
@@ -338,7 +469,7 @@ static enum token_type symbol_type(struct lexer *lexer) {
         break;
     case 'v': return check_keyword(lexer, 1, 2, "ar", TOKEN_VAR);
     case 'w':
-        switch (lexer->start[1]) {
+        switch (symbol_char(lexer, 1)) {
         case 'h': return check_keyword(lexer, 2, 3, "ile", TOKEN_WHILE);
         case 'i': return check_keyword(lexer, 2, 2, "th", TOKEN_WITH);
         case 'o': return check_keyword(lexer, 2, 2, "rd", TOKEN_WORD);
@@ -358,9 +489,7 @@ static bool is_symbolic(char c) {
 }
 
 static struct token symbol(struct lexer *lexer) {
-    while (!is_at_end(lexer) && is_symbolic(peek(lexer))) {
-        advance(lexer);
-    }
+    skip_within_line(lexer, skip_symbol_run(lexer->current, lexer->end));
     return make_token(lexer, symbol_type(lexer), true);
 }
 
@@ -571,7 +700,7 @@ static bool is_number(struct lexer *lexer) {
 
 static void start_token(struct lexer *lexer) {
     lexer->start = lexer->current;
-    lexer->start_position = lexer->position;
+    lexer->start_position = current_location(lexer);
 }
 
 struct token next_token(struct lexer *lexer) {
@@ -606,14 +735,19 @@ struct lexer get_subscript_lexer(struct token token, const char *filename) {
     struct location location = token.subscript_location;
     if (HAS_SUBSCRIPT(token)) {
         ++start;
-        --end;
+        // A subscript cut short by a comment has no closing ']'.
+        if (end > start && end[-1] == ']') {
+            --end;
+        }
         ++location.column;
     }
     return (struct lexer) {
         .start = start,
         .end = end,
         .current = start,
-        .position = location,
+        .line = location.line,
+        // The subscript is part of the same source, so this is where its first line starts.
+        .line_start = start - (location.column - COLUMN_START),
         .start_position = location,
         .filename = filename,
     };
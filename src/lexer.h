@@ -110,15 +110,22 @@ struct token {
 
 struct lexer {
     const char *start;
-    const char *end;  // If NULL, lex until EOF.
+    const char *end;
     const char *current;
-    struct location position;
+    /* The line `current` is on and where that line starts. Columns are only worked out from
+     * these when a token's location is needed, rather than being counted byte by byte.
+     */
+    size_t line;
+    const char *line_start;
     struct location start_position;
     const char *filename;
 };
 
 #define HAS_SUBSCRIPT(token) ((token).subscript_start != (token).subscript_end)
 
+/* Lex the source code from `src` up to `src_end`. If `src_end` is NULL, the source must be
+ * null-terminated.
+ */
 void init_lexer(struct lexer *lexer, const char *src, const char *src_end, const char *filename);
 struct token next_token(struct lexer *lexer);
 struct lexer get_subscript_lexer(struct token token, const char *filename);
@@ -0,0 +1,632 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "function.h"
+#include "ir.h"
+#include "linker.h"
+#include "memory.h"
+#include "reader.h"
+#include "region.h"
+#include "string_view.h"
+#include "symbol.h"
+#include "type.h"
+
+
+/* Where the strings, functions and external functions of one of the modules being linked end
+ * up in the linked module. Its user-defined types are appended in order, so they only need a
+ * new base.
+ */
+struct index_maps {
+    struct module *module;
+    int string_count;
+    int *strings;
+    int function_count;
+    int *functions;  // -1 for a function which was left out.
+    int external_count;
+    int *externals;
+    int first_function;  // The first function which was merged (1 if the top level was left out).
+    int function_base;  // Where its first merged function is in the merged function table.
+    type_index ud_type_base;
+};
+
+static int *new_index_map(int count) {
+    int *map = allocate_array(count, sizeof map[0]);
+    CHECK_ARRAY_ALLOCATION(map, count);
+    for (int i = 0; i < count; ++i) {
+        map[i] = i;
+    }
+    return map;
+}
+
+static void free_index_maps(struct index_maps *maps) {
+    free_array(maps->strings, maps->string_count, sizeof maps->strings[0]);
+    free_array(maps->functions, maps->function_count, sizeof maps->functions[0]);
+    free_array(maps->externals, maps->external_count, sizeof maps->externals[0]);
+}
+
+static type_index map_type(const struct index_maps *maps, type_index type) {
+    if (type < SIMPLE_TYPE_COUNT + BUILTIN_TYPE_COUNT) return type;
+    return maps->ud_type_base + (type - SIMPLE_TYPE_COUNT - BUILTIN_TYPE_COUNT);
+}
+
+static type_index *copy_types(const type_index *types, int count, const struct index_maps *maps,
+                              struct region *region) {
+    type_index *copy = region_calloc(region, count, sizeof copy[0]);
+    CHECK_ARRAY_ALLOCATION(copy, count);
+    for (int i = 0; i < count; ++i) {
+        copy[i] = map_type(maps, types[i]);
+    }
+    return copy;
+}
+
+static struct signature copy_signature(const struct signature *sig,
+                                       const struct index_maps *maps, struct region *region) {
+    return (struct signature) {
+        .param_count = sig->param_count,
+        .ret_count = sig->ret_count,
+        .params = copy_types(sig->params, sig->param_count, maps, region),
+        .rets = copy_types(sig->rets, sig->ret_count, maps, region),
+    };
+}
+
+static struct string_view copy_name(struct string_view *name, struct region *region) {
+    if (name->start == NULL) return *name;
+    struct string_view copy = copy_view_in_region(name, region);
+    CHECK_ALLOCATION(copy.start);
+    return copy;
+}
+
+/* The module's own tables stay where they are. */
+static void init_own_maps(struct module *module, struct index_maps *maps) {
+    *maps = (struct index_maps) {
+        .module = module,
+        .string_count = module->strings.count,
+        .strings = new_index_map(module->strings.count),
+        .function_count = module->functions.count,
+        .functions = new_index_map(module->functions.count),
+        .external_count = module->externals.count,
+        .externals = new_index_map(module->externals.count),
+        .function_base = 0,
+        .ud_type_base = SIMPLE_TYPE_COUNT + BUILTIN_TYPE_COUNT,
+    };
+}
+
+static void merge_strings(struct module *module, struct module *other,
+                          struct index_maps *maps) {
+    maps->string_count = other->strings.count;
+    maps->strings = allocate_array(maps->string_count, sizeof maps->strings[0]);
+    CHECK_ARRAY_ALLOCATION(maps->strings, maps->string_count);
+    for (int i = 0; i < other->strings.count; ++i) {
+        struct string_view *string = &other->strings.items[i];
+        int index = find_string(module, string);
+        if (index < 0) {
+            // NOTE: Copies made by copy_view_in_region() are null-terminated, like all strings.
+            struct string_view copy = copy_name(string, module->region);
+            DARRAY_APPEND(&module->strings, copy);
+            index = module->strings.count - 1;
+        }
+        maps->strings[i] = index;
+    }
+}
+
+static void merge_types(struct module *module, struct module *other, struct index_maps *maps) {
+    struct type_table *types = &module->types;
+    maps->ud_type_base = SIMPLE_TYPE_COUNT + types->count;
+    for (int i = BUILTIN_TYPE_COUNT; i < other->types.count; ++i) {
+        struct type_info info = other->types.items[i];
+        info.name = copy_name(&info.name, types->extra_info);
+        switch (info.kind) {
+        case KIND_PACK:
+            for (int j = 0; j < info.pack.field_count; ++j) {
+                info.pack.fields[j] = map_type(maps, info.pack.fields[j]);
+            }
+            break;
+        case KIND_COMP: {
+            int field_count = info.comp.field_count;
+            info.comp.fields = copy_types(info.comp.fields, field_count, maps,
+                                          types->extra_info);
+            if (info.comp.offsets != NULL) {
+                int *offsets = alloc_extra(types, field_count * sizeof offsets[0]);
+                CHECK_ARRAY_ALLOCATION(offsets, field_count);
+                for (int j = 0; j < field_count; ++j) {
+                    offsets[j] = info.comp.offsets[j];
+                }
+                info.comp.offsets = offsets;
+            }
+            break;
+        }
+        case KIND_ARRAY:
+            info.array.element_type = map_type(maps, info.array.element_type);
+            break;
+        case KIND_UNINIT:
+        case KIND_SIMPLE:
+            // Do nothing.
+            break;
+        }
+        DARRAY_APPEND(types, info);
+    }
+}
+
+static int find_ext_library(struct module *module, const struct string_view *filename) {
+    for (int i = 0; i < module->ext_libraries.count; ++i) {
+        if (sv_eq(&module->ext_libraries.items[i].filename, filename)) return i;
+    }
+    return -1;
+}
+
+static bool merge_externals(struct module *module, struct module *other,
+                            struct index_maps *maps) {
+    maps->external_count = other->externals.count;
+    maps->externals = allocate_array(maps->external_count, sizeof maps->externals[0]);
+    CHECK_ARRAY_ALLOCATION(maps->externals, maps->external_count);
+    for (int i = 0; i < other->externals.count; ++i) {
+        struct ext_function external = other->externals.items[i];
+        external.sig = copy_signature(&external.sig, maps, module->region);
+        external.name = copy_name(&external.name, module->region);
+        DARRAY_APPEND(&module->externals, external);
+        maps->externals[i] = module->externals.count - 1;
+    }
+    // Libraries with the same file are merged.
+    for (int i = 0; i < other->ext_libraries.count; ++i) {
+        struct ext_library *library = &other->ext_libraries.items[i];
+        int index = find_ext_library(module, &library->filename);
+        if (index < 0) {
+            struct ext_library new_library = {
+                .filename = copy_name(&library->filename, module->region),
+                .link_type = library->link_type,
+            };
+            index = add_ext_library(&module->ext_libraries, new_library);
+        }
+        struct ext_library *linked_library = get_ext_library(&module->ext_libraries, index);
+        for (int j = 0; j < library->count; ++j) {
+            int ext_index = library->items[j];
+            if (ext_index < 0 || ext_index >= maps->external_count) return false;
+            DARRAY_APPEND(linked_library, maps->externals[ext_index]);
+        }
+    }
+    return true;
+}
+
+static void merge_functions(struct module *module, struct module *other,
+                            struct index_maps *maps) {
+    maps->function_base = module->functions.count;
+    maps->function_count = other->functions.count;
+    maps->functions = allocate_array(maps->function_count, sizeof maps->functions[0]);
+    CHECK_ARRAY_ALLOCATION(maps->functions, maps->function_count);
+    // Only the module being linked into runs its top-level code, so the others' is left out. It
+    // has been checked to be empty (see `merge_module()`).
+    free_function(&other->functions.items[0]);
+    maps->functions[0] = -1;
+    maps->first_function = 1;
+    for (int i = 1; i < other->functions.count; ++i) {
+        struct function function = other->functions.items[i];
+        // The code may be in the other module's mapping, which is unmapped when it's freed.
+        stop_borrowing_code(&function.w_code);
+        function.sig = copy_signature(&function.sig, maps, module->functions.region);
+        for (int j = 0; j < function.locals.count; ++j) {
+            struct local *local = &function.locals.items[j];
+            local->type = map_type(maps, local->type);
+        }
+        DARRAY_APPEND(&module->functions, function);
+        maps->functions[i] = module->functions.count - 1;
+    }
+    // The functions belong to `module` now.
+    other->functions.count = 0;
+}
+
+/* Whether the module's top-level code (function 0) does nothing but return. */
+static bool has_empty_top_level(struct module *module) {
+    if (module->functions.count == 0) return false;
+    struct ir_block *block = &module->functions.items[0].w_code;
+    return block->count == 1 && block->code[0] == W_OP_RET;
+}
+
+static bool merge_module(struct module *module, struct module *other,
+                         struct index_maps *maps) {
+    *maps = (struct index_maps) {.module = other};
+    if (!load_all_functions(other)) return false;
+    if (!has_empty_top_level(other)) {
+        fprintf(stderr, "Error: `%s` has top-level code, which would never run when linked.\n",
+                other->filename);
+        return false;
+    }
+    merge_strings(module, other, maps);
+    merge_types(module, other, maps);
+    if (!merge_externals(module, other, maps)) {
+        fprintf(stderr, "Invalid external library in `%s`.\n", other->filename);
+        return false;
+    }
+    merge_functions(module, other, maps);
+    return true;
+}
+
+static const char *find_definer(const struct index_maps *maps, int count, int index) {
+    for (int i = count - 1; i > 0; --i) {
+        if (index >= maps[i].function_base) return maps[i].module->filename;
+    }
+    return maps[0].module->filename;
+}
+
+/* User-defined types are appended to the linked module's type table once for each module which
+ * defines them, so two indices may stand for the same type. Type names aren't kept in BudeBWF
+ * files, so such types match if they are the same kind and their fields (or elements) match.
+ */
+static bool types_match(const struct type_table *types, type_index a, type_index b) {
+    if (a == b) return true;
+    if (IS_SIMPLE_TYPE(a) || IS_SIMPLE_TYPE(b)) return false;
+    const struct type_info *a_info = lookup_type(types, a);
+    const struct type_info *b_info = lookup_type(types, b);
+    if (a_info == NULL || b_info == NULL) return false;
+    if (a_info->kind != b_info->kind) return false;
+    switch (a_info->kind) {
+    case KIND_PACK:
+        if (a_info->pack.field_count != b_info->pack.field_count) return false;
+        for (int i = 0; i < a_info->pack.field_count; ++i) {
+            if (!types_match(types, a_info->pack.fields[i], b_info->pack.fields[i])) return false;
+        }
+        return true;
+    case KIND_COMP:
+        if (a_info->comp.field_count != b_info->comp.field_count) return false;
+        for (int i = 0; i < a_info->comp.field_count; ++i) {
+            if (!types_match(types, a_info->comp.fields[i], b_info->comp.fields[i])) return false;
+        }
+        return true;
+    case KIND_ARRAY:
+        return a_info->array.element_count == b_info->array.element_count
+            && types_match(types, a_info->array.element_type, b_info->array.element_type);
+    case KIND_UNINIT:
+    case KIND_SIMPLE:
+        break;
+    }
+    return false;
+}
+
+static bool signatures_match(const struct type_table *types, const struct signature *a,
+                             const struct signature *b) {
+    if (a->param_count != b->param_count || a->ret_count != b->ret_count) return false;
+    for (int i = 0; i < a->param_count; ++i) {
+        if (!types_match(types, a->params[i], b->params[i])) return false;
+    }
+    for (int i = 0; i < a->ret_count; ++i) {
+        if (!types_match(types, a->rets[i], b->rets[i])) return false;
+    }
+    return true;
+}
+
+/* Work out where each function of the merged function table ends up once the imports which
+ * have been resolved are removed, and build the linked module's symbol table. `targets` is set
+ * to the function each resolved import resolves to, or -1 for other functions.
+ */
+static bool resolve_imports(struct module *module, struct index_maps *maps, int count,
+                            int *targets, int *final_indices) {
+    struct symbol_dictionary exports;
+    init_symbol_dictionary(&exports);
+    bool ok = true;
+    for (int i = 0; i < count; ++i) {
+        struct link_symbol_table *symbols = &maps[i].module->link_symbols;
+        for (int j = 0; j < symbols->count; ++j) {
+            struct link_symbol *symbol = &symbols->items[j];
+            if (symbol->kind != LINK_SYMBOL_EXPORT) continue;
+            int index = maps[i].functions[symbol->index];
+            struct symbol *previous = lookup_symbol(&exports, &symbol->name);
+            if (previous != NULL && previous->function.index < maps[i].function_base) {
+                fprintf(stderr, "Error: function '%"PRI_SV"' is defined in both `%s` and `%s`.\n",
+                        SV_FMT(symbol->name), find_definer(maps, count, previous->function.index),
+                        maps[i].module->filename);
+                ok = false;
+                continue;
+            }
+            // Within a module, a later definition replaces an earlier one.
+            insert_symbol(&exports, &(struct symbol) {
+                    .name = symbol->name,
+                    .type = SYM_FUNCTION,
+                    .function.index = index,
+                });
+        }
+    }
+    int function_count = module->functions.count;
+    for (int i = 0; i < function_count; ++i) {
+        targets[i] = -1;
+    }
+    bool signatures_ok = true;
+    for (int i = 0; i < count && ok; ++i) {
+        struct link_symbol_table *symbols = &maps[i].module->link_symbols;
+        for (int j = 0; j < symbols->count; ++j) {
+            struct link_symbol *symbol = &symbols->items[j];
+            if (symbol->kind != LINK_SYMBOL_IMPORT) continue;
+            struct symbol *export = lookup_symbol(&exports, &symbol->name);
+            if (export == NULL) continue;
+            int index = maps[i].functions[symbol->index];
+            int target = export->function.index;
+            if (!signatures_match(&module->types, &module->functions.items[index].sig,
+                                  &module->functions.items[target].sig)) {
+                fprintf(stderr, "Error: function '%"PRI_SV"' is imported by `%s` with a different "
+                        "signature from its definition in `%s`.\n",
+                        SV_FMT(symbol->name), maps[i].module->filename,
+                        find_definer(maps, count, target));
+                signatures_ok = false;
+                continue;
+            }
+            targets[index] = target;
+        }
+    }
+    free_symbol_dictionary(&exports);
+    if (!ok || !signatures_ok) return false;
+    int kept_count = 0;
+    for (int i = 0; i < function_count; ++i) {
+        if (targets[i] < 0) {
+            final_indices[i] = kept_count++;
+        }
+    }
+    for (int i = 0; i < function_count; ++i) {
+        if (targets[i] >= 0) {
+            // Only defined functions are exported, so a target is never removed itself.
+            assert(targets[targets[i]] < 0);
+            final_indices[i] = final_indices[targets[i]];
+        }
+    }
+    // Keep the exports and any unresolved imports, so the module can be linked again.
+    struct link_symbol_table linked_symbols = {0};
+    INIT_DARRAY(&linked_symbols, module->link_symbols.capacity);
+    for (int i = 0; i < count; ++i) {
+        struct link_symbol_table *symbols = &maps[i].module->link_symbols;
+        for (int j = 0; j < symbols->count; ++j) {
+            struct link_symbol symbol = symbols->items[j];
+            int index = maps[i].functions[symbol.index];
+            if (symbol.kind == LINK_SYMBOL_IMPORT && targets[index] >= 0) continue;
+            symbol.index = final_indices[index];
+            if (i > 0) {
+                symbol.name = copy_name(&symbol.name, module->region);
+            }
+            DARRAY_APPEND(&linked_symbols, symbol);
+        }
+    }
+    FREE_DARRAY(&module->link_symbols);
+    module->link_symbols = linked_symbols;
+    return true;
+}
+
+/* An instruction whose operand is an index into one of the tables being merged. Each comes in
+ * 8-, 16- and 32-bit versions, in that order.
+ */
+struct index_operand {
+    enum w_opcode base;  // The 8-bit version of the instruction.
+    int size;            // Size of the operand in bytes.
+    const int *map;
+    int map_count;
+};
+
+static bool get_index_operand(const struct index_maps *maps, enum w_opcode instruction,
+                              struct index_operand *operand) {
+    if (W_OP_LOAD_STRING8 <= instruction && instruction <= W_OP_LOAD_STRING32) {
+        *operand = (struct index_operand) {
+            .base = W_OP_LOAD_STRING8, .map = maps->strings, .map_count = maps->string_count,
+        };
+    }
+    else if (W_OP_CALL8 <= instruction && instruction <= W_OP_CALL32) {
+        *operand = (struct index_operand) {
+            .base = W_OP_CALL8, .map = maps->functions, .map_count = maps->function_count,
+        };
+    }
+    else if (W_OP_EXTCALL8 <= instruction && instruction <= W_OP_EXTCALL32) {
+        *operand = (struct index_operand) {
+            .base = W_OP_EXTCALL8, .map = maps->externals, .map_count = maps->external_count,
+        };
+    }
+    else {
+        return false;
+    }
+    operand->size = 1 << (instruction - operand->base);
+    return true;
+}
+
+static uint32_t read_index(struct ir_block *block, int ip, int size) {
+    switch (size) {
+    case 1: return read_u8(block, ip + 1);
+    case 2: return read_u16(block, ip + 1);
+    default: return read_u32(block, ip + 1);
+    }
+}
+
+static int get_index_size(uint32_t index) {
+    if (index <= UINT8_MAX) return 1;
+    if (index <= UINT16_MAX) return 2;
+    return 4;
+}
+
+/* Look up the new index of the operand of the instruction at `ip`. Returns false if the
+ * operand is out of range or refers to something which was left out.
+ */
+static bool remap_index(struct ir_block *block, int ip, const struct index_operand *operand,
+                        uint32_t *new_index) {
+    uint32_t index = read_index(block, ip, operand->size);
+    if (index >= (uint32_t)operand->map_count || operand->map[index] < 0) return false;
+    *new_index = operand->map[index];
+    return true;
+}
+
+/* Check every index operand, returning false if any are out of range. `fits` is set to whether
+ * every new index fits in its instruction's operand.
+ */
+static bool check_indices(struct ir_block *block, const struct index_maps *maps, bool *fits) {
+    *fits = true;
+    for (int ip = 0; ip < block->count; ip += get_w_instruction_size(block->code[ip])) {
+        struct index_operand operand = {0};
+        if (!get_index_operand(maps, block->code[ip], &operand)) continue;
+        uint32_t new_index = 0;
+        if (!remap_index(block, ip, &operand, &new_index)) return false;
+        if (get_index_size(new_index) > operand.size) {
+            *fits = false;
+        }
+    }
+    return true;
+}
+
+static void patch_indices(struct ir_block *block, const struct index_maps *maps) {
+    for (int ip = 0; ip < block->count; ip += get_w_instruction_size(block->code[ip])) {
+        struct index_operand operand = {0};
+        if (!get_index_operand(maps, block->code[ip], &operand)) continue;
+        uint32_t new_index = 0;
+        remap_index(block, ip, &operand, &new_index);
+        if (new_index == read_index(block, ip, operand.size)) continue;
+        switch (operand.size) {
+        case 1: overwrite_u8(block, ip + 1, new_index); break;
+        case 2: overwrite_u16(block, ip + 1, new_index); break;
+        default: overwrite_u32(block, ip + 1, new_index); break;
+        }
+    }
+}
+
+/* Rewrite the code with wider operands where the new indices need them. Since this moves the
+ * code after each widened instruction, the jumps are fixed up afterwards. Returns false if a
+ * jump no longer fits in its offset.
+ */
+static bool rebuild_code(struct ir_block *block, const struct index_maps *maps) {
+    struct ir_block new_block;
+    init_block(&new_block, IR_WORD_ORIENTED);
+    // Where each instruction has moved to, or -1 for the middle of an instruction.
+    int *new_offsets = allocate_array(block->count + 1, sizeof new_offsets[0]);
+    CHECK_ARRAY_ALLOCATION(new_offsets, block->count + 1);
+    for (int i = 0; i <= block->count; ++i) {
+        new_offsets[i] = -1;
+    }
+    int run = -1;
+    for (int ip = 0; ip < block->count; ) {
+        enum w_opcode instruction = block->code[ip];
+        int size = get_w_instruction_size(instruction);
+        struct location location = get_next_location(block, ip, &run);
+        new_offsets[ip] = new_block.count;
+        struct index_operand operand = {0};
+        uint32_t new_index = 0;
+        if (get_index_operand(maps, instruction, &operand)) {
+            remap_index(block, ip, &operand, &new_index);
+            switch (get_index_size(new_index)) {
+            case 1:
+                write_immediate_u8(&new_block, operand.base, new_index, &location);
+                break;
+            case 2:
+                write_immediate_u16(&new_block, operand.base + 1, new_index, &location);
+                break;
+            default:
+                write_immediate_u32(&new_block, operand.base + 2, new_index, &location);
+                break;
+            }
+        }
+        else {
+            write_simple(&new_block, instruction, &location);
+            for (int i = 1; i < size; ++i) {
+                write_u8(&new_block, block->code[ip + i], &location);
+            }
+        }
+        ip += size;
+    }
+    new_offsets[block->count] = new_block.count;
+    bool ok = true;
+    for (int ip = 0; ip < block->count && ok; ip += get_w_instruction_size(block->code[ip])) {
+        if (!is_w_jump(block->code[ip])) continue;
+        int dest = ip + 1 + read_s16(block, ip + 1);
+        if (dest < 0 || dest > block->count || new_offsets[dest] < 0) {
+            ok = false;
+            break;
+        }
+        int jump = new_offsets[dest] - (new_offsets[ip] + 1);
+        if (jump < INT16_MIN || jump > INT16_MAX) {
+            ok = false;
+            break;
+        }
+        overwrite_s16(&new_block, new_offsets[ip] + 1, jump);
+    }
+    free_array(new_offsets, block->count + 1, sizeof new_offsets[0]);
+    if (!ok) {
+        free_block(&new_block);
+        return false;
+    }
+    recompute_jump_dests(&new_block);
+    free_block(block);
+    *block = new_block;
+    return true;
+}
+
+static bool remap_code(struct ir_block *block, const struct index_maps *maps) {
+    bool fits = true;
+    if (!check_indices(block, maps, &fits)) return false;
+    if (fits) {
+        // The usual case: the code stays the same size, so it can be patched in place.
+        patch_indices(block, maps);
+        return true;
+    }
+    return rebuild_code(block, maps);
+}
+
+bool link_modules(struct module *module, struct module *others, int count) {
+    if (!load_all_functions(module)) return false;
+    struct index_maps *maps = allocate_array(count + 1, sizeof maps[0]);
+    CHECK_ARRAY_ALLOCATION(maps, count + 1);
+    init_own_maps(module, &maps[0]);
+    int linked_count = 1;
+    bool ok = true;
+    for (int i = 0; i < count && ok; ++i) {
+        ok = merge_module(module, &others[i], &maps[i + 1]);
+        ++linked_count;
+    }
+    int function_count = module->functions.count;
+    int *targets = allocate_array(function_count, sizeof targets[0]);
+    CHECK_ARRAY_ALLOCATION(targets, function_count);
+    int *final_indices = allocate_array(function_count, sizeof final_indices[0]);
+    CHECK_ARRAY_ALLOCATION(final_indices, function_count);
+    ok = ok && resolve_imports(module, maps, linked_count, targets, final_indices);
+    for (int i = 0; i < linked_count && ok; ++i) {
+        for (int j = maps[i].first_function; j < maps[i].function_count; ++j) {
+            maps[i].functions[j] = final_indices[maps[i].functions[j]];
+        }
+        for (int j = maps[i].first_function; j < maps[i].function_count; ++j) {
+            int index = maps[i].function_base + j - maps[i].first_function;
+            if (targets[index] >= 0) continue;  // Removed below.
+            if (!remap_code(&module->functions.items[index].w_code, &maps[i])) {
+                fprintf(stderr, "Failed to link function %d of `%s`.\n",
+                        j, maps[i].module->filename);
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (ok) {
+        // Remove the imports which have been resolved.
+        struct function_table *functions = &module->functions;
+        functions->count = 0;
+        for (int i = 0; i < function_count; ++i) {
+            if (targets[i] >= 0) {
+                free_function(&functions->items[i]);
+            }
+            else {
+                functions->items[functions->count++] = functions->items[i];
+            }
+        }
+        // The index no longer matches the file the module was read from.
+        struct bwf_index *index = &module->bwf_index;
+        free_array(index->function_offsets, function_count, sizeof index->function_offsets[0]);
+        *index = (struct bwf_index) {0};
+    }
+    free_array(final_indices, function_count, sizeof final_indices[0]);
+    free_array(targets, function_count, sizeof targets[0]);
+    for (int i = 0; i < linked_count; ++i) {
+        free_index_maps(&maps[i]);
+    }
+    free_array(maps, count + 1, sizeof maps[0]);
+    return ok;
+}
+
+bool check_imports_resolved(struct module *module) {
+    bool resolved = true;
+    for (int i = 0; i < module->link_symbols.count; ++i) {
+        struct link_symbol *symbol = &module->link_symbols.items[i];
+        if (symbol->kind != LINK_SYMBOL_IMPORT) continue;
+        fprintf(stderr,
+                "Error: function '%"PRI_SV"' is imported but not defined. "
+                "Use `--link <file>` to link the module defining it.\n",
+                SV_FMT(symbol->name));
+        resolved = false;
+    }
+    return resolved;
+}
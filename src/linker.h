@@ -0,0 +1,30 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <stdbool.h>
+
+#include "module.h"
+
+/* Separate compilation.
+ *
+ * Each module exports every function it defines and imports every function it only declares
+ * (with `import def ... end`) under the function's name (see `struct link_symbol`). Linking
+ * merges other modules into one: their strings, types, external functions and libraries and
+ * functions are added to it, the indices in their code are remapped to match, and every call
+ * to an imported function is redirected to the exported function of the same name, which must
+ * have the same signature (see the SYMBOL-TABLE in bwf.h). Imports which no module exports are
+ * left in the linked module, so it can be linked again later. Only the top-level code of the
+ * module being linked into is kept, so the other modules mustn't have any.
+ */
+
+/* Link `count` other modules into `module`. The functions of the other modules are moved into
+ * `module`, but they must still be freed. Returns false (after printing an error message) if
+ * the modules can't be linked.
+ */
+bool link_modules(struct module *module, struct module *others, int count);
+/* Returns false (after printing an error message for each of them) if any of the module's
+ * imports haven't been resolved by linking.
+ */
+bool check_imports_resolved(struct module *module);
+
+#endif
@@ -3,5 +3,5 @@
 #include "location.h"
 
 void report_location(const char *restrict filename, const struct location *location) {
-    fprintf(stderr, "%s:%zu:%zu: ", filename, location->line, location->column);
+    fprintf(stderr, PRI_LOCATION, LOCATION_FMT(filename, location));
 }
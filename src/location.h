@@ -15,6 +15,9 @@ struct location {
     size_t line, column;
 };
 
+#define PRI_LOCATION "%s:%zu:%zu: "
+#define LOCATION_FMT(filename, location) (filename), (location)->line, (location)->column
+
 void report_location(const char *restrict filename, const struct location *location);
 
 #endif
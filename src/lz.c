@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_NIBBLE_MAX 15
+
+
+static uint32_t read_u32_unaligned(const uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof value);
+    return value;
+}
+
+static uint32_t hash_u32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_compress_bound(size_t size) {
+    return size + size/255 + 16;
+}
+
+static uint8_t *write_extra_length(uint8_t *out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+/* Write a sequence of literals followed by a match. A `match_length` of 0 means no match. */
+static uint8_t *write_sequence(uint8_t *out, const uint8_t *literals, size_t literal_count,
+                               size_t offset, size_t match_length) {
+    uint8_t *token = out++;
+    *token = ((literal_count < LZ_NIBBLE_MAX) ? literal_count : LZ_NIBBLE_MAX) << 4;
+    if (literal_count >= LZ_NIBBLE_MAX) {
+        out = write_extra_length(out, literal_count - LZ_NIBBLE_MAX);
+    }
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+    if (match_length == 0) return out;
+    size_t length = match_length - LZ_MIN_MATCH;
+    *token |= (length < LZ_NIBBLE_MAX) ? length : LZ_NIBBLE_MAX;
+    *out++ = offset;
+    *out++ = offset >> 8;
+    if (length >= LZ_NIBBLE_MAX) {
+        out = write_extra_length(out, length - LZ_NIBBLE_MAX);
+    }
+    return out;
+}
+
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dest) {
+    // Position (plus one) of the last place each hashed 4-byte sequence was seen, or 0.
+    uint32_t table[LZ_HASH_SIZE] = {0};
+    uint8_t *out = dest;
+    size_t anchor = 0;  // Start of the literals not yet written.
+    for (size_t ip = 0; ip + LZ_MIN_MATCH <= size; ) {
+        uint32_t sequence = read_u32_unaligned(&src[ip]);
+        uint32_t hash = hash_u32(sequence);
+        size_t candidate = table[hash];
+        table[hash] = ip + 1;
+        if (candidate == 0 || ip - (candidate - 1) > LZ_MAX_OFFSET
+            || read_u32_unaligned(&src[candidate - 1]) != sequence) {
+            ++ip;
+            continue;
+        }
+        size_t match = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < size && src[match + length] == src[ip + length]) {
+            ++length;
+        }
+        out = write_sequence(out, &src[anchor], ip - anchor, ip - match, length);
+        ip += length;
+        anchor = ip;
+    }
+    out = write_sequence(out, &src[anchor], size - anchor, 0, 0);
+    return out - dest;
+}
+
+static bool read_extra_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+    uint8_t byte = 0;
+    do {
+        if (*in == end || *length > SIZE_MAX/2) return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t *src, size_t size, uint8_t *dest, size_t dest_size) {
+    const uint8_t *in = src;
+    const uint8_t *end = src + size;
+    size_t op = 0;
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t literal_count = token >> 4;
+        if (literal_count == LZ_NIBBLE_MAX && !read_extra_length(&in, end, &literal_count)) {
+            return false;
+        }
+        if (literal_count > (size_t)(end - in) || literal_count > dest_size - op) return false;
+        memcpy(&dest[op], in, literal_count);
+        in += literal_count;
+        op += literal_count;
+        if (in == end) break;  // The last sequence has no match.
+        if (end - in < 2) return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > op) return false;
+        size_t length = token & LZ_NIBBLE_MAX;
+        if (length == LZ_NIBBLE_MAX && !read_extra_length(&in, end, &length)) return false;
+        length += LZ_MIN_MATCH;
+        if (length > dest_size - op) return false;
+        if (offset >= length) {
+            memcpy(&dest[op], &dest[op - offset], length);
+        }
+        else {
+            // The match overlaps the bytes it produces, so it must be copied in order.
+            for (size_t i = 0; i < length; ++i) {
+                dest[op + i] = dest[op - offset + i];
+            }
+        }
+        op += length;
+    }
+    return op == dest_size;
+}
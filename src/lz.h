@@ -0,0 +1,32 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A small LZ77 block compressor in the style of LZ4.
+ *
+ * A compressed block is a series of sequences. Each sequence starts with a token byte whose
+ * high nibble is the number of literals and whose low nibble is the length of the match minus
+ * LZ_MIN_MATCH. A nibble of 15 means the length continues in the following bytes, each of
+ * which is added to it, until a byte other than 255. The token is followed by the literals
+ * themselves, then the match offset (u16, little-endian) and any extra match length bytes.
+ * The last sequence has no match, so it ends after its literals.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* The most space `lz_compress()` could need to compress `size` bytes. */
+size_t lz_compress_bound(size_t size);
+/* Compress `size` bytes from `src` into `dest`, which must have room for
+ * `lz_compress_bound(size)` bytes. Returns the size of the compressed block.
+ */
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dest);
+/* Decompress a block of `size` bytes into exactly `dest_size` bytes. Returns false if the block
+ * is malformed or doesn't decompress to exactly `dest_size` bytes.
+ */
+bool lz_decompress(const uint8_t *src, size_t size, uint8_t *dest, size_t dest_size);
+
+#endif
@@ -1,10 +1,12 @@
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "asm.h"
+#include "cache.h"
 #include "compiler.h"
 #include "disassembler.h"
 #include "function.h"
@@ -12,8 +14,11 @@
 #include "interpreter.h"
 #include "ir.h"
 #include "lexer.h"
+#include "linker.h"
+#include "mapped_file.h"
 #include "memory.h"
-//#include "optimiser.h"
+#include "optimiser.h"
+#include "parallel.h"
 #include "reader.h"
 #include "stack.h"
 #include "symbol.h"
@@ -21,8 +26,6 @@
 #include "writer.h"
 
 
-#define INPUT_BUFFER_SIZE 4 * 1024 * 1024
-
 static const char *const version_number = "0.0.1";
 
 struct cmdopts {
@@ -32,10 +35,21 @@ struct cmdopts {
     bool interpret;
     bool generate_asm;
     bool generate_bytecode;
+    bool compress_bytecode;
     bool from_bytecode;
     bool show_tokens;
+    bool region_stats;
+    bool use_cache;
     // Parameterised options.
     const char *output_filename;
+    int job_count;
+    struct {
+        int capacity;
+        int count;
+        const char **items;
+    } link_filenames;  // BudeBWF modules to link with.
+    const char *cache_directory;  // NULL for the default.
+    struct hash128 cache_key;  // Everything but the source code (see cache.h).
     // Positional args.
     const char *filename;
     // Private fields.
@@ -185,7 +199,10 @@ static void print_explanation(FILE *file, struct cmdopts *opts, struct module *m
         print_output_file(file, opts, "assembly", module);
     }
     else if (opts->generate_bytecode) {
-        print_output_file(file, opts, "IR code (in BudeBWF format)", module);
+        const char *description = (opts->compress_bytecode)
+            ? "IR code (in compressed BudeBWF format)"
+            : "IR code (in BudeBWF format)";
+        print_output_file(file, opts, description, module);
     }
     fprintf(file, " and %s.\n", (opts->interpret) ? "interpret it" : "exit");
     for (int i = 0; i < module->ext_libraries.count; ++i) {
@@ -193,6 +210,13 @@ static void print_explanation(FILE *file, struct cmdopts *opts, struct module *m
         const char *linking_adverb = (library->link_type == LINK_STATIC) ? "statically" : "dynamically";
         fprintf(file, "  Link %s with library %"PRI_SV".\n", linking_adverb, SV_FMT(library->filename));
     }
+    for (int i = 0; i < opts->link_filenames.count; ++i) {
+        fprintf(file, "  Link with module %s.\n", opts->link_filenames.items[i]);
+    }
+    if (opts->use_cache) {
+        fprintf(file, "  Reuse the compiled IR code from the cache if %s hasn't changed.\n",
+                input_filename);
+    }
     fprintf(file, "\n");
     print_help_prompt(file, opts);
 }
@@ -208,6 +232,12 @@ static void print_help(FILE *file, const char *name) {
             "  -b                generate bytecode only\n"
             "  -B                load bytecode from a BudeBWF file instead of "
                                        "a Bude source code file.\n"
+            "  --cache           keep the compiled IR code in a cache and reuse it the next time "
+                                       "the same\n"
+            "                    file is compiled with the same options, unless it has "
+                                       "changed. The cache is\n"
+            "                    kept in $XDG_CACHE_HOME/bude (or ~/.cache/bude) by default.\n"
+            "  --cache-dir <dir> like --cache, but keep the cache in the specified directory\n"
             "  -d, --dump        dump the generated ir code and exit "
                                        "unless -i or -a are specified\n"
             "  -o <file>         write the output to the specified file. This option can be omitted,\n"
@@ -216,6 +246,9 @@ static void print_help(FILE *file, const char *name) {
             "  -h, -?, --help    display this help message and exit\n"
             "  --explain         explain the meaning of the arguments parsed up until `--explain` is used\n"
             "  -i, --interpret   interpret ir code (enabled by default)\n"
+            "  -j <n>            use up to n threads for type checking and code generation "
+                                       "(default: one per\n"
+            "                    processor)\n"
             "  --lib[:st|:dy] <libname>=<path> link with a STatic or DYnamic library. "
                                        "If neither :st nor :dy\n"
             "                    are specified, the default linking strategy is used. "
@@ -225,10 +258,17 @@ static void print_help(FILE *file, const char *name) {
                                        "DYnamic.\n"
             "                    This option can be used multiple times and affects "
                                        "subsequent uses of --lib.\n"
+            "  --link <file>     link with a module compiled separately (using -b). Functions "
+                                       "declared with\n"
+            "                    `import def ... end` are resolved to the modules' functions. "
+                                       "This option can be\n"
+            "                    used multiple times to link multiple modules.\n"
             "  -O, --optimise    optimise ir code\n"
+            "  --region-stats    print memory usage statistics for the module's regions on exit\n"
             "  -t                print the token stream and exit "
                                        "unless -i or -a are specified\n"
             "  -v, --version     display the version number and exit\n"
+            "  -z                compress the bytecode generated by -b\n"
             "  --                treat all following arguments as positional\n"
         );
 }
@@ -240,6 +280,7 @@ static void print_version(FILE *file) {
 static struct cmdopts new_cmdopts() {
     return (struct cmdopts) {
         .interpret = true,
+        .cache_key = new_cache_key(version_number),
         ._default_linking = LINK_DYNAMIC,
         // All other fields set to zero.
     };
@@ -317,6 +358,9 @@ static void parse_short_opt(const char *arg, struct cmdopts *opts) {
             print_version(stderr);
             DEFER_EXIT(*opts, 0);
             return;
+        case 'z':
+            opts->compress_bytecode = true;
+            break;
         default:
             BAD_OPTION(*opts, arg);
             DEFER_EXIT(*opts, 1);
@@ -370,6 +414,7 @@ static struct cmdopts parse_args(int argc, char *argv[], struct symbol_dictionar
             case 'O':
             case 't':
             case 'v':
+            case 'z':
                 parse_short_opt(arg, &opts);
                 break;
             case 'o': {
@@ -388,6 +433,24 @@ static struct cmdopts parse_args(int argc, char *argv[], struct symbol_dictionar
                 opts.output_filename = filename;
                 break;
             }
+            case 'j': {
+                const char *count = NULL;
+                if (arg[2] != '\0') {
+                    count = &arg[2];
+                }
+                else if (i + 1 < argc) {
+                    count = argv[++i];
+                }
+                char *end = NULL;
+                long job_count = (count != NULL) ? strtol(count, &end, 10) : 0;
+                if (count == NULL || *end != '\0' || job_count <= 0 || job_count > INT_MAX) {
+                    fprintf(stderr, "'%s' option requires a positive integer argument 'n'.\n", arg);
+                    DEFER_EXIT(opts, 1);
+                    break;
+                }
+                opts.job_count = job_count;
+                break;
+            }
             case '-':
                 if (arg[2] == '\0') {
                     // End of options.
@@ -399,7 +462,19 @@ static struct cmdopts parse_args(int argc, char *argv[], struct symbol_dictionar
                     goto check_filename;
                 }
                 // Long options.
-                if (strcmp(&arg[2], "dump") == 0) {
+                if (strcmp(&arg[2], "cache") == 0) {
+                    opts.use_cache = true;
+                }
+                else if (strcmp(&arg[2], "cache-dir") == 0) {
+                    if (i + 1 >= argc) {
+                        fprintf(stderr, "'%s' option missing required argument 'dir'.\n", arg);
+                        DEFER_EXIT(opts, 1);
+                        break;
+                    }
+                    opts.use_cache = true;
+                    opts.cache_directory = argv[++i];
+                }
+                else if (strcmp(&arg[2], "dump") == 0) {
                     opts.dump_ir = true;
                     opts.interpret = opts._had_i;
                     opts.generate_asm = opts._had_a;
@@ -416,6 +491,14 @@ static struct cmdopts parse_args(int argc, char *argv[], struct symbol_dictionar
                     opts.interpret = true;
                     opts._had_i = true;
                 }
+                else if (strcmp(&arg[2], "link") == 0) {
+                    if (i + 1 >= argc) {
+                        fprintf(stderr, "'%s' option missing required argument 'file'.\n", arg);
+                        DEFER_EXIT(opts, 1);
+                        break;
+                    }
+                    DARRAY_APPEND(&opts.link_filenames, argv[++i]);
+                }
                 else if (strcmp(&arg[2], "lib-type:") == 0) {
                     // NOTE: this must come BEFORE the check for `--lib`.
                     const char *rest = &arg[2 + sizeof "lib-type:" - 1];
@@ -454,10 +537,17 @@ static struct cmdopts parse_args(int argc, char *argv[], struct symbol_dictionar
                             .type = SYM_EXT_LIBRARY,
                             .ext_library.index = index,
                     });
+                    // The libraries are part of the module, so they're part of the cache key.
+                    opts.cache_key = hash_cache_option(opts.cache_key,
+                                                       (linking == LINK_STATIC) ? "st" : "dy");
+                    opts.cache_key = hash_cache_option(opts.cache_key, arg);
                 }
                 else if (strcmp(&arg[2], "optimise") == 0) {
                     opts.optimise = true;
                 }
+                else if (strcmp(&arg[2], "region-stats") == 0) {
+                    opts.region_stats = true;
+                }
                 else if (strcmp(&arg[2], "version") == 0) {
                     print_version(stderr);
                     DEFER_EXIT(opts, 0);
@@ -492,27 +582,129 @@ check_filename:
 #undef DEFER_EXIT
 
 
-void load_source(const char *restrict filename, char *restrict inbuf) {
-    enum filetype filetype = get_filetype(filename);
-    FILE *file = (filetype == FILE_FILE) ? fopen(filename, "r") : stdin;
-    if (file == NULL) {
-        fprintf(stderr, "Could not open input file '%s': %s.\n", filename, strerror(errno));
+/* Load the source code. Files are mapped rather than copied, so the source isn't
+ * null-terminated: it ends at `source->data + source->size`.
+ */
+static void load_source(const char *filename, struct mapped_file *source) {
+    bool loaded = (get_filetype(filename) == FILE_FILE)
+        ? map_file(filename, source)
+        : read_stream(stdin, source);
+    if (!loaded) {
+        fprintf(stderr, "Could not load input file '%s'.\n", filename);
         exit(1);
     }
-    size_t length = fread(inbuf, sizeof *inbuf, INPUT_BUFFER_SIZE - 1, file);
-    if (ferror(file)) {
-        fprintf(stderr, "Error reading input file '%s': %s.\n", filename, strerror(errno));
+}
+
+/* Get the path of the cache entry for the given source code, or NULL if there's nowhere to
+ * keep the cache. The path is allocated with `malloc()`.
+ */
+static char *get_cache_path(struct cmdopts *opts, const struct mapped_file *source) {
+    const char *directory = opts->cache_directory;
+    char *default_directory = NULL;
+    if (directory == NULL) {
+        directory = default_directory = get_default_cache_directory();
+        if (directory == NULL) {
+            fprintf(stderr, "Warning: no cache directory could be found, so the cache "
+                    "won't be used. Specify one with --cache-dir.\n");
+            return NULL;
+        }
+    }
+    char *path = get_cache_entry_path(directory, opts->cache_key, (const char *)source->data,
+                                      source->size);
+    free(default_directory);
+    return path;
+}
+
+/* Link the module with the modules given by `--link`. */
+static void link_with_modules(struct module *module, struct cmdopts *opts) {
+    int count = opts->link_filenames.count;
+    struct module *others = allocate_array(count, sizeof others[0]);
+    CHECK_ARRAY_ALLOCATION(others, count);
+    for (int i = 0; i < count; ++i) {
+        others[i] = read_bytecode(opts->link_filenames.items[i]);
+    }
+    bool linked = link_modules(module, others, count);
+    for (int i = 0; i < count; ++i) {
+        free_module(&others[i]);
+    }
+    free_array(others, count, sizeof others[0]);
+    if (!linked) {
+        // Error message(s) already emitted.
         exit(1);
     }
-    if (!feof(file)) {
-        fprintf(stderr, "Input file '%s' too large.\n", filename);
+}
+
+static void print_module_region_stats(FILE *file, struct module *module) {
+    print_region_stats(file, "module", module->region);
+    print_region_stats(file, "functions", module->functions.region);
+    print_region_stats(file, "types", module->types.extra_info);
+}
+
+/* Compiler callbacks for pipelined type checking. */
+
+static void function_compiled(void *pipeline, int func_index) {
+    queue_type_check(pipeline, func_index);
+}
+
+static void begin_table_update(void *pipeline) {
+    lock_pipeline_tables(pipeline);
+}
+
+static void end_table_update(void *pipeline) {
+    unlock_pipeline_tables(pipeline);
+}
+
+struct asm_output {
+    FILE *file;
+    enum filetype filetype;
+    struct asm_block *assembly;
+};
+
+/* Set while assembly code is being streamed to a file, so the file can be removed if we exit
+ * before it is complete. */
+static const char *partial_output_filename = NULL;
+
+static void remove_partial_output(void) {
+    if (partial_output_filename != NULL) {
+        remove(partial_output_filename);
+    }
+}
+
+static void open_asm_output(struct asm_output *output, const char *filename) {
+    output->filetype = get_filetype(filename);
+    output->file = (output->filetype == FILE_FILE) ? fopen(filename, "w") : stdout;
+    if (output->file == NULL) {
+        fprintf(stderr, "Failed to open output file '%s': %s.\n", filename, strerror(errno));
         exit(1);
     }
-    inbuf[length] = '\0';  // Set null byte.
-    if (filetype == FILE_FILE && fclose(file) != 0) {
-        fprintf(stderr, "Failed to close input file '%s': %s.\n", filename, strerror(errno));
+    output->assembly = malloc(sizeof *output->assembly);
+    CHECK_ALLOCATION(output->assembly);
+    init_assembly(output->assembly, output->file);
+}
+
+static void close_asm_output(struct asm_output *output, const char *filename) {
+    if (output->filetype == FILE_FILE && fclose(output->file) != 0) {
+        fprintf(stderr, "Failed to close output file '%s': %s.\n", filename, strerror(errno));
         exit(1);
     }
+    free(output->assembly);
+    output->assembly = NULL;
+}
+
+/* Type checker callback for generating assembly code as functions are checked. */
+
+struct asm_stream {
+    struct module *module;
+    struct generator *generator;
+    bool optimise;
+};
+
+static void function_checked(void *context, int func_index) {
+    struct asm_stream *stream = context;
+    if (stream->optimise) {
+        optimise_function(get_function(&stream->module->functions, func_index));
+    }
+    generate_next_function(stream->generator, func_index);
 }
 
 int main(int argc, char *argv[]) {
@@ -533,45 +725,134 @@ int main(int argc, char *argv[]) {
         }
         exit(opts._exit_code);
     }
+    // If the module is only interpreted, each function is loaded the first time it's called.
+    bool only_interpret = !opts.optimise && !opts.dump_ir && !opts.generate_asm
+        && !opts.generate_bytecode && opts.link_filenames.count == 0;
     if (!opts.from_bytecode) {
-        char *inbuf = calloc(INPUT_BUFFER_SIZE, sizeof *inbuf);
-        CHECK_ALLOCATION(inbuf);
-        load_source(opts.filename, inbuf);
+        struct mapped_file source = {0};
+        load_source(opts.filename, &source);
+        const char *src = (const char *)source.data;
+        const char *src_end = src + source.size;
 
         module.filename = opts.filename;
         if (opts.show_tokens) {
             struct lexer lexer = {0};
-            init_lexer(&lexer, inbuf, NULL, module.filename);
+            init_lexer(&lexer, src, src_end, module.filename);
             struct token token = {0};
             while ((token = next_token(&lexer)).type != TOKEN_EOT) {
                 print_token(token);
             }
         }
-        compile(inbuf, &module, &symbols);
-        free(inbuf);
-        inbuf = NULL;
-        free_symbol_dictionary(&symbols);
-        symbols = (struct symbol_dictionary){0};
-        if (opts.optimise) {
-            // optimise(&module);
+        // The IR is dumped before type checking, which a cached module has already been through.
+        char *cache_path = (opts.use_cache && !opts.dump_ir)
+            ? get_cache_path(&opts, &source)
+            : NULL;
+        struct module cached = {0};
+        if (cache_path != NULL && read_cached_module(cache_path, &cached)) {
+            unmap_file(&source);
+            free_symbol_dictionary(&symbols);
+            symbols = (struct symbol_dictionary){0};
+            free_module(&module);
+            module = cached;
+            // The entry has been read in full, so no more reader errors can name it.
+            module.filename = opts.filename;
+        }
+        // The IR must be dumped before type checking, so we can't check it while compiling.
+        else if (!opts.dump_ir) {
+            // If the module is only needed for its assembly code, each function is generated
+            // (and then freed) as soon as it has been checked. The cache needs the whole module.
+            bool stream_asm = opts.generate_asm && !opts.interpret
+                && opts.link_filenames.count == 0 && cache_path == NULL;
+            struct asm_output output = {0};
+            struct asm_stream stream = {.module = &module, .optimise = opts.optimise};
+            if (stream_asm) {
+                open_asm_output(&output, opts.output_filename);
+                if (output.filetype == FILE_FILE) {
+                    partial_output_filename = opts.output_filename;
+                    atexit(remove_partial_output);
+                }
+                stream.generator = start_generate(&module, output.assembly);
+            }
+            struct type_check_listener checked_listener = {
+                .context = &stream,
+                .function_checked = function_checked,
+            };
+            int thread_count = get_thread_count(opts.job_count);
+            struct type_check_pipeline *pipeline = start_type_check_pipeline(
+                &module, thread_count - 1, (stream_asm) ? &checked_listener : NULL
+            );
+            struct compile_listener listener = {
+                .context = pipeline,
+                .function_compiled = function_compiled,
+                .begin_table_update = begin_table_update,
+                .end_table_update = end_table_update,
+            };
+            compile(src, src_end, &module, &symbols, &listener);
+            unmap_file(&source);
+            free_symbol_dictionary(&symbols);
+            symbols = (struct symbol_dictionary){0};
+            if (finish_type_check_pipeline(pipeline) == TYPE_CHECK_ERROR) {
+                // Error message(s) already emitted.
+                exit(1);
+            }
+            if (cache_path != NULL) {
+                // The module is cached before it's linked or optimised.
+                write_cached_module(cache_path, &module);
+            }
+            if (stream_asm) {
+                if (!check_imports_resolved(&module)) {
+                    // The partial output is removed on exit.
+                    exit(1);
+                }
+                if (finish_generate(stream.generator) != GENERATE_OK) {
+                    fprintf(stderr, "Failed to write assembly code.\n");
+                    exit(1);
+                }
+                close_asm_output(&output, opts.output_filename);
+                partial_output_filename = NULL;
+                if (opts.region_stats) {
+                    print_module_region_stats(stderr, &module);
+                }
+                free_module(&module);
+                FREE_DARRAY(&opts.link_filenames);
+                return 0;
+            }
         }
-        if (opts.dump_ir) {
+        else {
+            compile(src, src_end, &module, &symbols, NULL);
+            unmap_file(&source);
+            free_symbol_dictionary(&symbols);
+            symbols = (struct symbol_dictionary){0};
             printf("=== Before type checking: ===\n");
             disassemble_tir(&module);
             printf("------------------------------------------------\n");
+            struct type_checker checker;
+            init_type_checker(&checker, &module);
+            if (type_check(&checker, opts.job_count) == TYPE_CHECK_ERROR) {
+                // Error message(s) already emitted.
+                exit(1);
+            }
+            free_type_checker(&checker);
         }
-        struct type_checker checker;
-        init_type_checker(&checker, &module);
-        if (type_check(&checker) == TYPE_CHECK_ERROR) {
-            // Error message(s) already emitted.
-            exit(1);
-        }
+        free(cache_path);
     }
     else {
         free_symbol_dictionary(&symbols);
         free_module(&module);
         symbols = (struct symbol_dictionary){0};
-        module = read_bytecode(opts.filename);
+        module = (only_interpret)
+            ? read_bytecode_lazily(opts.filename)
+            : read_bytecode(opts.filename);
+    }
+    if (opts.link_filenames.count > 0) {
+        link_with_modules(&module, &opts);
+    }
+    // Imports can be left for later when writing bytecode, but not when running the program.
+    if ((opts.interpret || opts.generate_asm) && !check_imports_resolved(&module)) {
+        exit(1);
+    }
+    if (opts.optimise) {
+        optimise(&module);
     }
     if (opts.dump_ir) {
         printf("=== After type checking: ===\n");
@@ -582,33 +863,22 @@ int main(int argc, char *argv[]) {
     }
     if (opts.interpret) {
         struct interpreter interpreter;
-        init_interpreter(&interpreter, &module);
+        if (!init_interpreter(&interpreter, &module)) {
+            fprintf(stderr, "Failed to initialise interpreter.\n");
+            exit(1);
+        }
         interpret(&interpreter);
         free_interpreter(&interpreter);
     }
     if (opts.generate_asm) {
         assert(!opts.generate_bytecode);
-        struct asm_block *assembly = malloc(sizeof *assembly);
-        CHECK_ALLOCATION(assembly);
-        init_assembly(assembly);
-        if (generate(&module, assembly) != GENERATE_OK) {
+        struct asm_output output = {0};
+        open_asm_output(&output, opts.output_filename);
+        if (generate(&module, output.assembly, opts.job_count) != GENERATE_OK) {
             fprintf(stderr, "Failed to write assembly code.\n");
             exit(1);
         }
-        enum filetype filetype = get_filetype(opts.output_filename);
-        FILE *outfile = (filetype == FILE_FILE) ? fopen(opts.output_filename, "w") : stdout;
-        if (outfile == NULL) {
-            fprintf(stderr, "Failed to open output file '%s': %s.\n",
-                    opts.output_filename, strerror(errno));
-            exit(1);
-        }
-        fprintf(outfile, "%s", assembly->code);
-        if (filetype == FILE_FILE && fclose(outfile) != 0) {
-            fprintf(stderr, "Failed to close output file '%s': %s.\n",
-                    opts.output_filename, strerror(errno));
-            exit(1);
-        }
-        free(assembly);
+        close_asm_output(&output, opts.output_filename);
     }
     if (opts.generate_bytecode) {
         assert(!opts.generate_asm);
@@ -621,7 +891,9 @@ int main(int argc, char *argv[]) {
                         opts.output_filename, strerror(errno));
                 exit(1);
             }
-            int error = write_bytecode(&module, outfile);
+            int error = (opts.compress_bytecode)
+                ? write_compressed_bytecode(&module, outfile)
+                : write_bytecode(&module, outfile);
             fclose(outfile);
             if (error != 0) {
                 fprintf(stderr, "Failed to write to file '%s': '%s'.\n",
@@ -632,6 +904,10 @@ int main(int argc, char *argv[]) {
             display_bytecode(&module, stdout);
         }
     }
+    if (opts.region_stats) {
+        print_module_region_stats(stderr, &module);
+    }
     free_module(&module);
+    FREE_DARRAY(&opts.link_filenames);
     return 0;
 }
@@ -0,0 +1,153 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L  // For `fdopen()`.
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+#include "memory.h"
+
+#ifndef READ_STREAM_INIT_SIZE
+#define READ_STREAM_INIT_SIZE 4096
+#endif
+
+
+static bool read_whole_file(const char *filename, struct mapped_file *file) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        perror("Failed to open file");
+        return false;
+    }
+    if (fseek(f, 0, SEEK_END) != 0) {
+        // Not seekable (e.g. a pipe), so the size isn't known in advance.
+        bool success = read_stream(f, file);
+        fclose(f);
+        return success;
+    }
+    long size = ftell(f);
+    if (size < 0) goto error;
+    if (fseek(f, 0, SEEK_SET) != 0) goto error;
+    unsigned char *data = allocate_array(size + 1, 1);
+    CHECK_ALLOCATION(data);
+    if (fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        goto error;
+    }
+    fclose(f);
+    *file = (struct mapped_file) {.data = data, .size = size, .is_mapped = false};
+    return true;
+error:
+    perror("Failed to read file");
+    fclose(f);
+    return false;
+}
+
+bool read_stream(FILE *stream, struct mapped_file *file) {
+    // The size of a stream isn't known in advance, so the buffer grows as it is read.
+    size_t capacity = READ_STREAM_INIT_SIZE;
+    size_t size = 0;
+    unsigned char *data = allocate_array(capacity, 1);
+    CHECK_ALLOCATION(data);
+    for (;;) {
+        size += fread(&data[size], 1, capacity - size, stream);
+        if (size < capacity) break;
+        data = reallocate_array(data, capacity, 2 * capacity, 1);
+        CHECK_ALLOCATION(data);
+        capacity *= 2;
+    }
+    if (ferror(stream)) {
+        perror("Failed to read stream");
+        free(data);
+        return false;
+    }
+    *file = (struct mapped_file) {.data = data, .size = size, .is_mapped = false};
+    return true;
+}
+
+#if defined(_WIN32)
+
+bool map_file(const char *filename, struct mapped_file *file) {
+    HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return read_whole_file(filename, file);
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+        // Empty files cannot be mapped.
+        CloseHandle(handle);
+        return read_whole_file(filename, file);
+    }
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+    if (mapping == NULL) return read_whole_file(filename, file);
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);  // The view keeps the mapping alive.
+    if (data == NULL) return read_whole_file(filename, file);
+    *file = (struct mapped_file) {.data = data, .size = size.QuadPart, .is_mapped = true};
+    return true;
+}
+
+void unmap_file(struct mapped_file *file) {
+    if (file->is_mapped) {
+        UnmapViewOfFile(file->data);
+    }
+    else {
+        free((void *)file->data);
+    }
+    *file = (struct mapped_file) {0};
+}
+
+#else
+
+bool map_file(const char *filename, struct mapped_file *file) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return read_whole_file(filename, file);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return read_whole_file(filename, file);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        // Pipes, FIFOs and devices can't be mapped and may not be readable twice, so the
+        // stream is read through the descriptor we already have.
+        FILE *stream = fdopen(fd, "rb");
+        if (stream == NULL) {
+            perror("Failed to open file");
+            close(fd);
+            return false;
+        }
+        bool success = read_stream(stream, file);
+        fclose(stream);
+        return success;
+    }
+    if (st.st_size == 0) {
+        // Empty files cannot be mapped.
+        close(fd);
+        return read_whole_file(filename, file);
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping keeps the file open.
+    if (data == MAP_FAILED) return read_whole_file(filename, file);
+    *file = (struct mapped_file) {.data = data, .size = st.st_size, .is_mapped = true};
+    return true;
+}
+
+void unmap_file(struct mapped_file *file) {
+    if (file->is_mapped) {
+        munmap((void *)file->data, file->size);
+    }
+    else {
+        free((void *)file->data);
+    }
+    *file = (struct mapped_file) {0};
+}
+
+#endif
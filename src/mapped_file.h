@@ -0,0 +1,29 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* A read-only view of a whole file. Where the platform supports it, the file is mapped into
+ * memory, so its pages are only read in as they are touched. Otherwise, the file is read into
+ * a single heap buffer.
+ */
+struct mapped_file {
+    const unsigned char *data;
+    size_t size;
+    bool is_mapped;  // Whether `data` is a mapping (as opposed to a heap buffer).
+};
+
+/* Map the file `filename`. Files which can't be mapped (e.g. pipes, FIFOs and `/dev/stdin`) are
+ * read into a heap buffer instead. On failure, an error message is printed and false is
+ * returned.
+ */
+bool map_file(const char *filename, struct mapped_file *file);
+/* Read the rest of `stream` (which may be a pipe) into a heap buffer. On failure, an error
+ * message is printed and false is returned.
+ */
+bool read_stream(FILE *stream, struct mapped_file *file);
+void unmap_file(struct mapped_file *file);
+
+#endif
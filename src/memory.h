@@ -36,9 +36,10 @@
         if (new_capacity == 0) new_capacity = DARRAY_INIT_SIZE;         \
         size_t size = sizeof (da)->items[0];                            \
         void *new_items =                                               \
-            reallocate_array((da)->items, old_capacity * size,          \
-                             new_capacity * size, size);                \
+            reallocate_array((da)->items, old_capacity,                 \
+                             new_capacity, size);                       \
         (da)->items = new_items;                                        \
+        (da)->capacity = new_capacity;                                  \
     } while (0)
 
 #define DARRAY_APPEND(da, item)                 \
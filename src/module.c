@@ -1,8 +1,11 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "module.h"
+#include "region.h"
 #include "string_view.h"
 
 #ifndef MODULE_REGION_SIZE
@@ -13,13 +16,87 @@
 #define STRING_TABLE_INIT_SIZE 64
 #endif
 
+// The string index is kept at most half full.
+#define STRING_INDEX_INIT_SIZE (2 * STRING_TABLE_INIT_SIZE)
+
+static_assert((STRING_INDEX_INIT_SIZE & (STRING_INDEX_INIT_SIZE - 1)) == 0,
+              "String index size must be a power of two");
+
+#ifndef LINK_SYMBOL_TABLE_INIT_SIZE
+#define LINK_SYMBOL_TABLE_INIT_SIZE 64
+#endif
+
 
 static void init_string_table(struct string_table *strings) {
     INIT_DARRAY(strings, STRING_TABLE_INIT_SIZE);
+    strings->slot_capacity = STRING_INDEX_INIT_SIZE;
+    strings->indexed_count = 0;
+    strings->slots = allocate_array(strings->slot_capacity, sizeof strings->slots[0]);
+    CHECK_ARRAY_ALLOCATION(strings->slots, strings->slot_capacity);
 }
 
 static void free_string_table(struct string_table *strings) {
     FREE_DARRAY(strings);
+    free_array(strings->slots, strings->slot_capacity, sizeof strings->slots[0]);
+    strings->slots = NULL;
+    strings->slot_capacity = 0;
+    strings->indexed_count = 0;
+}
+
+/* Returns the slot holding a string equal to `view`, or the empty slot where it would go. */
+static struct string_slot *probe_strings(struct string_table *strings,
+                                         const struct string_view *view, uint32_t hash) {
+    int mask = strings->slot_capacity - 1;
+    for (int i = hash & mask; ; i = (i + 1) & mask) {
+        struct string_slot *slot = &strings->slots[i];
+        if (slot->index == 0) return slot;
+        if (slot->hash == hash && sv_eq(&strings->items[slot->index - 1], view)) return slot;
+    }
+}
+
+static void grow_string_index(struct string_table *strings) {
+    int old_capacity = strings->slot_capacity;
+    struct string_slot *old_slots = strings->slots;
+    strings->slot_capacity = old_capacity * 2;
+    strings->slots = allocate_array(strings->slot_capacity, sizeof strings->slots[0]);
+    CHECK_ARRAY_ALLOCATION(strings->slots, strings->slot_capacity);
+    int mask = strings->slot_capacity - 1;
+    for (int i = 0; i < old_capacity; ++i) {
+        if (old_slots[i].index == 0) continue;
+        // The strings are all distinct, so they only need an empty slot.
+        int j = old_slots[i].hash & mask;
+        while (strings->slots[j].index != 0) {
+            j = (j + 1) & mask;
+        }
+        strings->slots[j] = old_slots[i];
+    }
+    free_array(old_slots, old_capacity, sizeof old_slots[0]);
+}
+
+/* Index the strings which have been added since the index was last updated. If a string is
+ * already in the table, the index keeps pointing to the earlier copy.
+ */
+static void update_string_index(struct string_table *strings) {
+    for (; strings->indexed_count < strings->count; ++strings->indexed_count) {
+        int index = strings->indexed_count;
+        if (2 * (index + 1) > strings->slot_capacity) {
+            grow_string_index(strings);
+        }
+        struct string_view *view = &strings->items[index];
+        uint32_t hash = hash_sv(view);
+        struct string_slot *slot = probe_strings(strings, view, hash);
+        if (slot->index == 0) {
+            *slot = (struct string_slot) {.hash = hash, .index = index + 1};
+        }
+    }
+}
+
+static void init_link_symbol_table(struct link_symbol_table *symbols) {
+    INIT_DARRAY(symbols, LINK_SYMBOL_TABLE_INIT_SIZE);
+}
+
+static void free_link_symbol_table(struct link_symbol_table *symbols) {
+    FREE_DARRAY(symbols);
 }
 
 void init_module(struct module *module, const char *filename) {
@@ -31,22 +108,40 @@ void init_module(struct module *module, const char *filename) {
     init_function_table(&module->functions);
     init_string_table(&module->strings);
     init_type_table(&module->types);
+    init_link_symbol_table(&module->link_symbols);
+    module->mapping = (struct mapped_file) {0};
+    module->bwf_index = (struct bwf_index) {0};
 }
 
 void free_module(struct module *module) {
+    struct bwf_index *index = &module->bwf_index;
+    free_array(index->function_offsets, module->functions.count,
+               sizeof index->function_offsets[0]);
+    *index = (struct bwf_index) {0};
     free_external_table(&module->externals);
     free_ext_lib_table(&module->ext_libraries);
     free_function_table(&module->functions);
     free_string_table(&module->strings);
     free_type_table(&module->types);
+    free_link_symbol_table(&module->link_symbols);
     kill_region(module->region);
     module->region = NULL;
+    unmap_file(&module->mapping);
 }
 
 int write_string(struct module *module, struct string_builder *builder) {
+    REGION_RESTORE restore = record_region(module->region);
     struct string_view view = build_string_in_region(builder, module->region);
+    CHECK_ALLOCATION(view.start);
+    int index = find_string(module, &view);
+    if (index >= 0) {
+        // Give the space back, since the module already has this string.
+        restore_region(module->region, restore);
+        return index;
+    }
     struct string_table *strings = &module->strings;
     DARRAY_APPEND(strings, view);
+    update_string_index(strings);
     return strings->count - 1;
 }
 
@@ -57,8 +152,19 @@ struct string_view *read_string(struct module *module, int index) {
 }
 
 int find_string(struct module *module, const struct string_view *view) {
-    for (int i = 0; i < module->strings.count; ++i) {
-        if (sv_eq(&module->strings.items[i], view)) return i;
-    }
-    return -1;
+    struct string_table *strings = &module->strings;
+    update_string_index(strings);
+    struct string_slot *slot = probe_strings(strings, view, hash_sv(view));
+    return slot->index - 1;
+}
+
+void add_link_symbol(struct module *module, enum link_symbol_kind kind, int index,
+                     struct string_view *name) {
+    struct link_symbol symbol = {
+        .kind = kind,
+        .index = index,
+        .name = copy_view_in_region(name, module->region),
+    };
+    CHECK_ALLOCATION(symbol.name.start);
+    DARRAY_APPEND(&module->link_symbols, symbol);
 }
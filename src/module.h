@@ -6,14 +6,57 @@
 
 #include "ext_function.h"
 #include "function.h"
+#include "mapped_file.h"
 #include "string_builder.h"
 #include "string_view.h"
 #include "type.h"
 
+/* A slot in the hash index of a string table. */
+struct string_slot {
+    uint32_t hash;
+    int index;  // Index of the string plus one, or 0 if the slot is empty.
+};
+
+/* The strings of a module. Each distinct string is only stored once: the strings are indexed by
+ * an open-addressing hash table (with linear probing) so that `write_string()` can reuse the
+ * index of an identical string and `find_string()` doesn't have to search the whole table.
+ * Strings appended to `items` directly are indexed the next time the table is searched.
+ */
 struct string_table {
     int capacity;
     int count;
     struct string_view *items;
+    int slot_capacity;  // Always a power of two.
+    int indexed_count;  // The number of items which have been indexed.
+    struct string_slot *slots;
+};
+
+/* A function which a module makes available to, or needs from, other modules when they are
+ * linked together (see linker.h).
+ */
+struct link_symbol {
+    enum link_symbol_kind {
+        LINK_SYMBOL_EXPORT,
+        LINK_SYMBOL_IMPORT,
+    } kind;
+    int index;  // Index of the function in the module.
+    struct string_view name;
+};
+
+struct link_symbol_table {
+    int capacity;
+    int count;
+    struct link_symbol *items;
+};
+
+/* Where things are in the BudeBWF file a module was read from (version 6 onwards). */
+struct bwf_index {
+    int version_number;
+    bool compressed;  // Whether the file is a BudeBWZ file.
+    /* For a module read lazily (see `read_bytecode_lazily()`), the offset of each function's
+     * entry in the file, or 0 once it has been loaded. NULL if every function is loaded.
+     */
+    int32_t *function_offsets;
 };
 
 struct module {
@@ -22,15 +65,29 @@ struct module {
     struct function_table functions;
     struct string_table strings;
     struct type_table types;
+    struct link_symbol_table link_symbols;
     struct region *region;
     const char *filename;
+    /* The BudeBWF file the module was loaded from, if any. Code and strings may point into it,
+     * so it stays mapped until the module is freed.
+     */
+    struct mapped_file mapping;
+    struct bwf_index bwf_index;
 };
 
 void init_module(struct module *module, const char *filename);
 void free_module(struct module *module);
 
+/* Add a string to the module, unless it already has an identical one. Returns the index of the
+ * string.
+ */
 int write_string(struct module *module, struct string_builder *builder);
 struct string_view *read_string(struct module *module, int index);
+/* Returns the index of the first string equal to `view`, or -1 if there isn't one. */
 int find_string(struct module *module, const struct string_view *view);
 
+/* Add a link symbol for a function. The name is copied into the module. */
+void add_link_symbol(struct module *module, enum link_symbol_kind kind, int index,
+                     struct string_view *name);
+
 #endif
@@ -1,113 +1,117 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "function.h"
 #include "ir.h"
+#include "module.h"
 #include "optimiser.h"
-/*
-static bool check_next(struct ir_block *block, int offset, int operand_size, enum opcode opcode) {
-    int next_offset = offset + 1;
-    switch (operand_size) {
+#include "type_punning.h"
+
+
+/* The optimiser works on word-oriented IR (WIR), after type checking.
+ *
+ * Rewrites are done in place: a sequence of instructions is replaced by one which is no longer,
+ * with any leftover bytes filled with W_OP_NOP. This means jump offsets and locations stay valid.
+ * The first instruction of a rewritten sequence may be a jump destination, but the others may
+ * not.
+ */
+
+static void fill_nops(struct ir_block *block, int start, int end) {
+    for (int i = start; i < end; ++i) {
+        overwrite_instruction(block, i, W_OP_NOP);
+    }
+}
+
+static int rewrite_simple(struct ir_block *block, int ip, enum w_opcode instruction) {
+    overwrite_instruction(block, ip, instruction);
+    return ip + 1;
+}
+
+static int rewrite_push_zero(struct ir_block *block, int ip) {
+    overwrite_instruction(block, ip, W_OP_PUSH8);
+    overwrite_u8(block, ip + 1, 0);
+    return ip + 2;
+}
+
+static bool reduce_mult(struct ir_block *block, int start, int end, uint64_t constant) {
+    /* Note: `PUSH c MULT` is at least 3 bytes long, so there's always room for the replacement. */
+    int ip = start;
+    switch (constant) {
     case 0:
-        // Simple instruction.
-        break;
-    case 8:
-        next_offset = offset + 2;
+        // x 0 * => 0
+        ip = rewrite_simple(block, ip, W_OP_POP);
+        ip = rewrite_push_zero(block, ip);
         break;
-    case 16:
-        next_offset = offset + 3;
+    case 1:
+        // x 1 * => x
         break;
-    case 32:
-        next_offset = offset + 5;
+    case 2:
+        // x 2 * => x x +
+        ip = rewrite_simple(block, ip, W_OP_DUPE);
+        ip = rewrite_simple(block, ip, W_OP_ADD);
         break;
     default:
-        assert(0 && "Invalid operand size. Allowed sizes are 0, 8, 16, 32.");
+        // Left to instruction selection in the generator.
+        return false;
     }
+    fill_nops(block, ip, end);
+    return true;
+}
 
-    if (next_offset >= block->count) return false;
-    if (is_jump_dest(block, next_offset)) return false;
+static bool reduce_divmod(struct ir_block *block, int start, int end, uint64_t constant,
+                          bool is_signed) {
+    int ip = start;
+    if (constant == 1) {
+        // x 1 divmod => x 0
+        ip = rewrite_push_zero(block, ip);
+    }
+    else if (is_signed && u64_to_s64(constant) == -1) {
+        // x -1 idivmod => -x 0
+        ip = rewrite_simple(block, ip, W_OP_NEG);
+        ip = rewrite_push_zero(block, ip);
+    }
+    else {
+        // Left to instruction selection in the generator.
+        return false;
+    }
+    fill_nops(block, ip, end);
+    return true;
+}
 
-    // Note: we assume the passed offset is to the start of an instruction.
-    return block->code[next_offset] == opcode;
+static bool reduce_strength(struct ir_block *block, int ip) {
+    /* Strength reduction of arithmetic with a constant right operand. */
+    uint64_t constant = 0;
+    if (!read_w_int_constant(block, ip, &constant)) return false;
+    int next_ip = ip + get_w_instruction_size(block->code[ip]);
+    if (next_ip >= block->count || is_jump_dest(block, next_ip)) return false;
+    int end = next_ip + get_w_instruction_size(block->code[next_ip]);
+    switch (block->code[next_ip]) {
+    case W_OP_MULT:
+        return reduce_mult(block, ip, end, constant);
+    case W_OP_DIVMOD:
+        return reduce_divmod(block, ip, end, constant, false);
+    case W_OP_IDIVMOD:
+    case W_OP_EDIVMOD:
+        return reduce_divmod(block, ip, end, constant, true);
+    default:
+        return false;
+    }
 }
 
+static void optimise_block(struct ir_block *block) {
+    assert(block->instruction_set == IR_WORD_ORIENTED);
+    for (int ip = 0; ip < block->count; ip += get_w_instruction_size(block->code[ip])) {
+        reduce_strength(block, ip);
+    }
+}
+
+void optimise_function(struct function *function) {
+    optimise_block(&function->w_code);
+}
 
-void optimise(struct ir_block *block) {
-    for (int ip = 0; ip < block->count; ++ip) {
-        switch (block->code[ip]) {
-        case OP_PUSH8:
-            if (check_next(block, ip, 8, OP_POP)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                // Note: this assumes that OP_NOP == 0.
-                overwrite_u8(block, ip + 1, 0);
-                static_assert(OP_NOP == 0);  // Assert the assumption, statically.
-                overwrite_instruction(block, ip + 2, OP_NOP);
-            }
-            ++ip;
-            break;
-        case OP_PUSH16:
-            if (check_next(block, ip, 16, OP_POP)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_u16(block, ip + 1, 0);
-                overwrite_instruction(block, ip + 3, OP_NOP);
-            }
-            ip += 2;
-            break;
-        case OP_PUSH32:
-            if (check_next(block, ip, 32, OP_POP)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_u32(block, ip + 1, 0);
-                overwrite_instruction(block, ip + 5, OP_NOP);
-            }
-            ip += 4;
-            break;
-        case OP_LOAD8:
-            if (check_next(block, ip, 8, OP_POP)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_instruction(block, ip + 1, OP_NOP);
-            }
-            ++ip;
-            break;
-        case OP_LOAD16:
-            if (check_next(block, ip, 16, OP_POP)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_instruction(block, ip + 1, OP_NOP);
-                overwrite_instruction(block, ip + 2, OP_NOP);
-            }
-            ip += 2;
-            break;
-        case OP_LOAD32:
-            if (check_next(block, ip, 32, OP_POP)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_instruction(block, ip + 1, OP_NOP);
-                overwrite_instruction(block, ip + 2, OP_NOP);
-                overwrite_instruction(block, ip + 3, OP_NOP);
-                overwrite_instruction(block, ip + 4, OP_NOP);
-            }
-            ip += 4;
-            break;
-        case OP_NOT:
-            if (check_next(block, ip, 0, OP_NOT)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_instruction(block, ip + 1, OP_NOP);
-                ++ip;
-            }
-            else if (check_next(block, ip, 0, OP_JUMP_NCOND)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_instruction(block, ip + 1, OP_JUMP_COND);
-                ++ip;
-            }
-            else if (check_next(block, ip, 0, OP_JUMP_COND)) {
-                overwrite_instruction(block, ip, OP_NOP);
-                overwrite_instruction(block, ip + 1, OP_JUMP_NCOND);
-                ++ip;
-            }
-            break;
-        case OP_JUMP:
-        case OP_JUMP_COND:
-        case OP_JUMP_NCOND:
-            ip += 2;
-            break;
-        }
+void optimise(struct module *module) {
+    for (int i = 0; i < module->functions.count; ++i) {
+        optimise_function(get_function(&module->functions, i));
     }
 }
-*/
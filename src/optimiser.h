@@ -1,6 +1,10 @@
 #ifndef OPTIMISER_H
 #define OPTIMISER_H
 
-void optimise(struct ir_block *block);
+#include "function.h"
+#include "module.h"
+
+void optimise_function(struct function *function);
+void optimise(struct module *module);
 
 #endif
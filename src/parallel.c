@@ -0,0 +1,163 @@
+#include <assert.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "memory.h"
+#include "parallel.h"
+
+int get_processor_count(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? count : 1;
+#else
+    return 1;
+#endif
+}
+
+int get_thread_count(int requested_count) {
+#ifndef __STDC_NO_THREADS__
+    return (requested_count > 0) ? requested_count : get_processor_count();
+#else
+    (void)requested_count;
+    return 1;
+#endif
+}
+
+#ifndef __STDC_NO_THREADS__
+
+bool init_work_queue(struct work_queue *queue, int capacity) {
+    assert(capacity > 0);
+    if (mtx_init(&queue->lock, mtx_plain) != thrd_success) return false;
+    if (cnd_init(&queue->not_empty) != thrd_success) {
+        mtx_destroy(&queue->lock);
+        return false;
+    }
+    if (cnd_init(&queue->not_full) != thrd_success) {
+        cnd_destroy(&queue->not_empty);
+        mtx_destroy(&queue->lock);
+        return false;
+    }
+    queue->capacity = capacity;
+    queue->count = 0;
+    queue->head = 0;
+    queue->closed = false;
+    queue->items = allocate_array(capacity, sizeof queue->items[0]);
+    return true;
+}
+
+void free_work_queue(struct work_queue *queue) {
+    free_array(queue->items, queue->capacity, sizeof queue->items[0]);
+    queue->items = NULL;
+    cnd_destroy(&queue->not_full);
+    cnd_destroy(&queue->not_empty);
+    mtx_destroy(&queue->lock);
+}
+
+void push_work(struct work_queue *queue, int item) {
+    mtx_lock(&queue->lock);
+    assert(!queue->closed);
+    while (queue->count == queue->capacity) {
+        cnd_wait(&queue->not_full, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count++) % queue->capacity] = item;
+    cnd_signal(&queue->not_empty);
+    mtx_unlock(&queue->lock);
+}
+
+bool pop_work(struct work_queue *queue, int *item) {
+    mtx_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        cnd_wait(&queue->not_empty, &queue->lock);
+    }
+    bool popped = queue->count > 0;
+    if (popped) {
+        *item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        --queue->count;
+        cnd_signal(&queue->not_full);
+    }
+    mtx_unlock(&queue->lock);
+    return popped;
+}
+
+void close_work_queue(struct work_queue *queue) {
+    mtx_lock(&queue->lock);
+    queue->closed = true;
+    cnd_broadcast(&queue->not_empty);
+    mtx_unlock(&queue->lock);
+}
+
+bool init_rw_lock(struct rw_lock *rw_lock) {
+    if (mtx_init(&rw_lock->lock, mtx_plain) != thrd_success) return false;
+    if (cnd_init(&rw_lock->can_read) != thrd_success) {
+        mtx_destroy(&rw_lock->lock);
+        return false;
+    }
+    if (cnd_init(&rw_lock->can_write) != thrd_success) {
+        cnd_destroy(&rw_lock->can_read);
+        mtx_destroy(&rw_lock->lock);
+        return false;
+    }
+    rw_lock->reader_count = 0;
+    rw_lock->waiting_writer_count = 0;
+    rw_lock->writing = false;
+    return true;
+}
+
+void free_rw_lock(struct rw_lock *rw_lock) {
+    cnd_destroy(&rw_lock->can_write);
+    cnd_destroy(&rw_lock->can_read);
+    mtx_destroy(&rw_lock->lock);
+}
+
+void lock_shared(struct rw_lock *rw_lock) {
+    mtx_lock(&rw_lock->lock);
+    while (rw_lock->writing || rw_lock->waiting_writer_count > 0) {
+        cnd_wait(&rw_lock->can_read, &rw_lock->lock);
+    }
+    ++rw_lock->reader_count;
+    mtx_unlock(&rw_lock->lock);
+}
+
+void unlock_shared(struct rw_lock *rw_lock) {
+    mtx_lock(&rw_lock->lock);
+    assert(rw_lock->reader_count > 0);
+    if (--rw_lock->reader_count == 0) {
+        cnd_signal(&rw_lock->can_write);
+    }
+    mtx_unlock(&rw_lock->lock);
+}
+
+void lock_exclusive(struct rw_lock *rw_lock) {
+    mtx_lock(&rw_lock->lock);
+    ++rw_lock->waiting_writer_count;
+    while (rw_lock->writing || rw_lock->reader_count > 0) {
+        cnd_wait(&rw_lock->can_write, &rw_lock->lock);
+    }
+    --rw_lock->waiting_writer_count;
+    rw_lock->writing = true;
+    mtx_unlock(&rw_lock->lock);
+}
+
+void unlock_exclusive(struct rw_lock *rw_lock) {
+    mtx_lock(&rw_lock->lock);
+    assert(rw_lock->writing);
+    rw_lock->writing = false;
+    if (rw_lock->waiting_writer_count > 0) {
+        cnd_signal(&rw_lock->can_write);
+    }
+    else {
+        cnd_broadcast(&rw_lock->can_read);
+    }
+    mtx_unlock(&rw_lock->lock);
+}
+
+#endif
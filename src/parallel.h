@@ -0,0 +1,58 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdbool.h>
+
+#ifndef __STDC_NO_THREADS__
+#include <threads.h>
+#endif
+
+int get_processor_count(void);
+
+/* Get the number of threads to use for a pass. A non-positive count means one per processor. */
+int get_thread_count(int requested_count);
+
+#ifndef __STDC_NO_THREADS__
+
+/* A bounded FIFO queue of work item indices shared between pipeline stages. Pushing to a full
+ * queue blocks until a consumer pops an item, so a fast producer cannot run arbitrarily far
+ * ahead of its consumers.
+ */
+struct work_queue {
+    mtx_t lock;
+    cnd_t not_empty;
+    cnd_t not_full;
+    int capacity;
+    int count;
+    int head;
+    bool closed;
+    int *items;
+};
+
+bool init_work_queue(struct work_queue *queue, int capacity);
+void free_work_queue(struct work_queue *queue);
+void push_work(struct work_queue *queue, int item);
+/* Returns false once the queue has been closed and all of its items have been popped. */
+bool pop_work(struct work_queue *queue, int *item);
+void close_work_queue(struct work_queue *queue);
+
+/* A readers-writer lock. Waiting writers take priority over new readers. */
+struct rw_lock {
+    mtx_t lock;
+    cnd_t can_read;
+    cnd_t can_write;
+    int reader_count;
+    int waiting_writer_count;
+    bool writing;
+};
+
+bool init_rw_lock(struct rw_lock *rw_lock);
+void free_rw_lock(struct rw_lock *rw_lock);
+void lock_shared(struct rw_lock *rw_lock);
+void unlock_shared(struct rw_lock *rw_lock);
+void lock_exclusive(struct rw_lock *rw_lock);
+void unlock_exclusive(struct rw_lock *rw_lock);
+
+#endif
+
+#endif
@@ -0,0 +1,407 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "asm.h"
+#include "peephole.h"
+
+
+/* The peephole optimiser works on the buffered assembly of a single function.
+ *
+ * Each pass looks at pairs of adjacent instructions, ignoring comments, and rewrites them in
+ * place. Removed lines are marked as deleted and compacted away at the end of the pass. Passes
+ * are repeated until nothing changes. Labels (and any raw text other than comments) act as
+ * barriers, since control may enter the code after them from elsewhere.
+ *
+ * Rewrites performed:
+ *  - `push X; pop X` is removed and `push X; pop Y` becomes `mov Y, X`.
+ *  - `pop X; push X` becomes `mov X, [rsp]`.
+ *  - `xchg A, B; mov A, B` becomes `mov B, A`.
+ *  - `mov r, r` is removed.
+ *  - `mov A, B; mov B, A` loses its second instruction.
+ *  - A write to a register immediately overwritten by the next instruction is removed.
+ *  - Jumps to a jump are threaded through to the final destination.
+ *  - Jumps to the next instruction are removed.
+ *  - Unreachable code after `jmp` or `ret` is removed, as are unused local labels.
+ */
+
+#define MAX_JUMP_THREADING_HOPS 16
+
+enum register_size {
+    REG_SIZE_NONE = 0,
+    REG_SIZE_8 = 1,
+    REG_SIZE_16 = 2,
+    REG_SIZE_32 = 4,
+    REG_SIZE_64 = 8,
+};
+
+struct reg {
+    int family;
+    enum register_size size;
+};
+
+#define REGISTER_FAMILY_COUNT 16
+#define REGISTER_FAMILY_RSP 4
+
+static const char *const register_names[][REGISTER_FAMILY_COUNT] = {
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+     "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+     "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+     "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"},
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+     "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+    {"ah", "ch", "dh", "bh"},
+};
+
+static const enum register_size register_sizes[] = {
+    REG_SIZE_64, REG_SIZE_32, REG_SIZE_16, REG_SIZE_8, REG_SIZE_8,
+};
+
+static_assert(sizeof register_names / sizeof register_names[0]
+              == sizeof register_sizes / sizeof register_sizes[0]);
+
+static struct reg parse_register_n(const char *name, size_t length) {
+    for (size_t i = 0; i < sizeof register_names / sizeof register_names[0]; ++i) {
+        for (int family = 0; family < REGISTER_FAMILY_COUNT; ++family) {
+            const char *reg_name = register_names[i][family];
+            if (reg_name == NULL) break;
+            if (strlen(reg_name) == length && strncmp(reg_name, name, length) == 0) {
+                return (struct reg) {.family = family, .size = register_sizes[i]};
+            }
+        }
+    }
+    return (struct reg) {.family = -1, .size = REG_SIZE_NONE};
+}
+
+static struct reg parse_register(const char *operand) {
+    return parse_register_n(operand, strlen(operand));
+}
+
+static bool is_gpr(struct reg reg) {
+    // We never touch rsp, since the stack is implicitly used by so many instructions.
+    return reg.size != REG_SIZE_NONE && reg.family != REGISTER_FAMILY_RSP;
+}
+
+static bool is_gpr64(const char *operand) {
+    struct reg reg = parse_register(operand);
+    return is_gpr(reg) && reg.size == REG_SIZE_64;
+}
+
+static bool is_memory(const char *operand) {
+    return strchr(operand, '[') != NULL;
+}
+
+static bool is_identifier_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+static bool mentions_register(const char *operand, int family) {
+    const char *start = operand;
+    while (*start != '\0') {
+        if (!is_identifier_char(*start)) {
+            ++start;
+            continue;
+        }
+        const char *end = start;
+        while (is_identifier_char(*end)) ++end;
+        if (parse_register_n(start, end - start).family == family) return true;
+        start = end;
+    }
+    return false;
+}
+
+static bool mentions_name(const char *operand, const char *name) {
+    size_t length = strlen(name);
+    const char *found = operand;
+    while ((found = strstr(found, name)) != NULL) {
+        bool starts_token = (found == operand || !is_identifier_char(found[-1]));
+        bool ends_token = !is_identifier_char(found[length]);
+        if (starts_token && ends_token) return true;
+        ++found;
+    }
+    return false;
+}
+
+static const char *strip_size(const char *operand) {
+    static const char prefix[] = "qword ";
+    if (strncmp(operand, prefix, sizeof prefix - 1) == 0) {
+        return operand + sizeof prefix - 1;
+    }
+    return operand;
+}
+
+static bool is_comment(const struct asm_line *line) {
+    if (line->kind == ASM_LINE_DELETED) return true;
+    if (line->kind != ASM_LINE_TEXT) return false;
+    const char *text = line->mnemonic;
+    while (isspace((unsigned char)*text)) ++text;
+    return *text == '\0' || *text == ';';
+}
+
+static bool is_instruction(const struct asm_line *line, const char *mnemonic, int operand_count) {
+    return line->kind == ASM_LINE_INSTRUCTION
+        && strcmp(line->mnemonic, mnemonic) == 0
+        && line->operand_count == operand_count;
+}
+
+static bool is_jump(const struct asm_line *line) {
+    return line->kind == ASM_LINE_INSTRUCTION
+        && line->mnemonic[0] == 'j'
+        && line->operand_count == 1
+        && line->operands[0][0] == '.';  // Only local labels, which are confined to this function.
+}
+
+static bool is_unconditional_jump(const struct asm_line *line) {
+    return is_jump(line) && strcmp(line->mnemonic, "jmp") == 0;
+}
+
+static bool is_register_load(const struct asm_line *line) {
+    // Instructions which only write their first operand, without reading it or setting flags.
+    static const char *const mnemonics[] = {"mov", "movzx", "movsx", "movsxd", "lea"};
+    if (line->kind != ASM_LINE_INSTRUCTION || line->operand_count != 2) return false;
+    if (!is_gpr(parse_register(line->operands[0]))) return false;
+    for (size_t i = 0; i < sizeof mnemonics / sizeof mnemonics[0]; ++i) {
+        if (strcmp(line->mnemonic, mnemonics[i]) == 0) return true;
+    }
+    return false;
+}
+
+static void delete_line(struct asm_line *line) {
+    line->kind = ASM_LINE_DELETED;
+}
+
+static void make_mov(struct asm_line *line, const char *dest, const char *src) {
+    *line = (struct asm_line) {
+        .kind = ASM_LINE_INSTRUCTION,
+        .mnemonic = "mov",
+        .operand_count = 2,
+        .operands = {dest, src},
+    };
+}
+
+static int next_line(struct asm_line_list *lines, int index) {
+    do {
+        ++index;
+    } while (index < lines->count && is_comment(&lines->items[index]));
+    return index;
+}
+
+static int find_label(struct asm_line_list *lines, const char *name) {
+    for (int i = 0; i < lines->count; ++i) {
+        struct asm_line *line = &lines->items[i];
+        if (line->kind == ASM_LINE_LABEL && strcmp(line->mnemonic, name) == 0) return i;
+    }
+    return -1;
+}
+
+/* Index of the first instruction executed after jumping to the given line. */
+static int resolve_destination(struct asm_line_list *lines, int index) {
+    while (index < lines->count
+           && (is_comment(&lines->items[index]) || lines->items[index].kind == ASM_LINE_LABEL)) {
+        ++index;
+    }
+    return index;
+}
+
+static bool fold_pair(struct asm_line *first, struct asm_line *second) {
+    if (is_instruction(first, "push", 1) && is_instruction(second, "pop", 1)) {
+        const char *src = first->operands[0];
+        const char *dest = second->operands[0];
+        if (strcmp(src, dest) == 0 && is_gpr64(src)) {
+            delete_line(first);
+            delete_line(second);
+            return true;
+        }
+        if (is_gpr64(dest) && (is_gpr64(src) || is_memory(src))) {
+            make_mov(first, dest, src);
+            delete_line(second);
+            return true;
+        }
+        if (is_gpr64(src) && is_memory(dest)
+            && !mentions_register(dest, REGISTER_FAMILY_RSP)) {
+            make_mov(first, dest, src);
+            delete_line(second);
+            return true;
+        }
+        return false;
+    }
+    if (is_instruction(first, "pop", 1) && is_instruction(second, "push", 1)) {
+        const char *reg = first->operands[0];
+        if (strcmp(reg, second->operands[0]) == 0 && is_gpr64(reg)) {
+            make_mov(first, reg, "[rsp]");
+            delete_line(second);
+            return true;
+        }
+        return false;
+    }
+    if (is_instruction(first, "xchg", 2) && is_instruction(second, "mov", 2)) {
+        // xchg A, B; mov A, B -- both registers end up with the original value of A.
+        const char *a = first->operands[0];
+        const char *b = first->operands[1];
+        const char *dest = second->operands[0];
+        const char *src = second->operands[1];
+        if (is_gpr64(a) && is_gpr64(b)
+            && ((strcmp(dest, a) == 0 && strcmp(src, b) == 0)
+                || (strcmp(dest, b) == 0 && strcmp(src, a) == 0))) {
+            make_mov(first, src, dest);
+            delete_line(second);
+            return true;
+        }
+        return false;
+    }
+    if (is_register_load(first)) {
+        struct reg dest = parse_register(first->operands[0]);
+        // Is the register completely overwritten before it is read?
+        bool overwrites = false;
+        if (is_register_load(second)) {
+            struct reg second_dest = parse_register(second->operands[0]);
+            overwrites = second_dest.family == dest.family
+                && second_dest.size >= REG_SIZE_32
+                && !mentions_register(second->operands[1], dest.family);
+        }
+        else if (is_instruction(second, "pop", 1)) {
+            struct reg second_dest = parse_register(second->operands[0]);
+            overwrites = second_dest.family == dest.family && second_dest.size == REG_SIZE_64;
+        }
+        if (overwrites) {
+            delete_line(first);
+            return true;
+        }
+    }
+    if (is_instruction(first, "mov", 2) && is_instruction(second, "mov", 2)) {
+        // mov A, B; mov B, A -- the second move is redundant.
+        const char *a = first->operands[0];
+        const char *b = first->operands[1];
+        if (is_gpr64(a) && (is_gpr64(b) || is_memory(b))
+            && !mentions_register(b, parse_register(a).family)
+            && strcmp(second->operands[1], a) == 0
+            && strcmp(strip_size(second->operands[0]), strip_size(b)) == 0) {
+            delete_line(second);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool remove_redundant_move(struct asm_line *line) {
+    if (!is_instruction(line, "mov", 2)) return false;
+    struct reg dest = parse_register(line->operands[0]);
+    // Note: a 32-bit move zeroes the upper half of the register, so it is not redundant.
+    if (!is_gpr(dest) || dest.size == REG_SIZE_32) return false;
+    if (strcmp(line->operands[0], line->operands[1]) != 0) return false;
+    delete_line(line);
+    return true;
+}
+
+static bool thread_jump(struct asm_line_list *lines, struct asm_line *jump) {
+    bool changed = false;
+    for (int hops = 0; hops < MAX_JUMP_THREADING_HOPS; ++hops) {
+        int label = find_label(lines, jump->operands[0]);
+        if (label < 0) break;
+        int dest = resolve_destination(lines, label);
+        if (dest >= lines->count) break;
+        struct asm_line *dest_line = &lines->items[dest];
+        if (dest_line == jump || !is_unconditional_jump(dest_line)) break;
+        if (strcmp(dest_line->operands[0], jump->operands[0]) == 0) break;
+        jump->operands[0] = dest_line->operands[0];
+        changed = true;
+    }
+    return changed;
+}
+
+static bool remove_jump_to_next(struct asm_line_list *lines, int index) {
+    struct asm_line *jump = &lines->items[index];
+    for (int i = next_line(lines, index); i < lines->count; i = next_line(lines, i)) {
+        struct asm_line *line = &lines->items[i];
+        if (line->kind != ASM_LINE_LABEL) break;
+        if (strcmp(line->mnemonic, jump->operands[0]) == 0) {
+            delete_line(jump);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool remove_unreachable(struct asm_line_list *lines, int index) {
+    bool changed = false;
+    for (int i = next_line(lines, index); i < lines->count; i = next_line(lines, i)) {
+        struct asm_line *line = &lines->items[i];
+        if (line->kind != ASM_LINE_INSTRUCTION) break;
+        delete_line(line);
+        changed = true;
+    }
+    return changed;
+}
+
+static bool is_label_used(struct asm_line_list *lines, const char *name) {
+    for (int i = 0; i < lines->count; ++i) {
+        struct asm_line *line = &lines->items[i];
+        if (line->kind != ASM_LINE_INSTRUCTION) continue;
+        for (int j = 0; j < line->operand_count; ++j) {
+            if (mentions_name(line->operands[j], name)) return true;
+        }
+    }
+    return false;
+}
+
+static bool remove_unused_labels(struct asm_line_list *lines) {
+    bool changed = false;
+    for (int i = 0; i < lines->count; ++i) {
+        struct asm_line *line = &lines->items[i];
+        if (line->kind != ASM_LINE_LABEL || line->mnemonic[0] != '.') continue;
+        if (!is_label_used(lines, line->mnemonic)) {
+            delete_line(line);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void compact(struct asm_line_list *lines) {
+    int count = 0;
+    for (int i = 0; i < lines->count; ++i) {
+        if (lines->items[i].kind != ASM_LINE_DELETED) {
+            lines->items[count++] = lines->items[i];
+        }
+    }
+    lines->count = count;
+}
+
+static bool peephole_pass(struct asm_line_list *lines) {
+    bool changed = false;
+    for (int i = 0; i < lines->count; ++i) {
+        struct asm_line *line = &lines->items[i];
+        if (line->kind != ASM_LINE_INSTRUCTION) continue;
+        if (remove_redundant_move(line)) {
+            changed = true;
+            continue;
+        }
+        if (is_jump(line)) {
+            changed |= thread_jump(lines, line);
+            if (remove_jump_to_next(lines, i)) {
+                changed = true;
+                continue;
+            }
+        }
+        if (is_unconditional_jump(line) || is_instruction(line, "ret", 0)) {
+            changed |= remove_unreachable(lines, i);
+            continue;
+        }
+        int next = next_line(lines, i);
+        if (next < lines->count) {
+            changed |= fold_pair(line, &lines->items[next]);
+        }
+    }
+    changed |= remove_unused_labels(lines);
+    compact(lines);
+    return changed;
+}
+
+void peephole_optimise(struct asm_line_list *lines) {
+    while (peephole_pass(lines)) {
+        // Keep going until there's nothing left to do.
+    }
+}
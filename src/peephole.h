@@ -0,0 +1,8 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "asm.h"
+
+void peephole_optimise(struct asm_line_list *lines);
+
+#endif
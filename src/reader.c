@@ -2,101 +2,298 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "bwf.h"
 #include "ir.h"
 #include "function.h"
-#include "location.h"
+#include "lz.h"
+#include "mapped_file.h"
 #include "memory.h"
 #include "reader.h"
 #include "region.h"
 #include "string_view.h"
 
 
-#define reader_version_number 5
+#define reader_version_number 6
 
+/* The reader maps the whole file into memory and parses it in a single pass. Code is not
+ * copied out of the mapping: each function's `w_code` points straight into it (see
+ * `borrow_code()`), so the module keeps the mapping alive. Everything else is small and is
+ * copied into the module's own tables.
+ *
+ * From version 6, the file has an index of where each table and function starts. When read
+ * lazily, the FUNCTION-TABLE is skipped and each function is only parsed the first time it is
+ * loaded with `load_function()`.
+ *
+ * In the compressed variant (BudeBWZ), fields are varints, so `take_s32()` and `take_u32()`
+ * decode whichever encoding the file uses. Code can't be borrowed from the mapping there;
+ * instead, it is decompressed straight into the function's own buffer.
+ */
+struct bwf_cursor {
+    const unsigned char *start;
+    const unsigned char *current;
+    const unsigned char *end;
+    bool compressed;
+};
 
-static int parse_header(FILE *f) {
-    static char header_buffer[1024] = {0};
-    if (fgets(header_buffer, sizeof header_buffer, f) == NULL) {
-        perror("Failed to read header line");
+static size_t bytes_remaining(const struct bwf_cursor *cursor) {
+    return cursor->end - cursor->current;
+}
+
+static const unsigned char *take_bytes(struct bwf_cursor *cursor, size_t size) {
+    if (size > bytes_remaining(cursor)) return NULL;
+    const unsigned char *bytes = cursor->current;
+    cursor->current += size;
+    return bytes;
+}
+
+/* Take a field which has a fixed size even in the compressed variant. */
+static bool take_fixed_u32(struct bwf_cursor *cursor, uint32_t *value) {
+    const unsigned char *bytes = take_bytes(cursor, sizeof *value);
+    if (bytes == NULL) return false;
+    memcpy(value, bytes, sizeof *value);
+    return true;
+}
+
+static bool take_fixed_s32(struct bwf_cursor *cursor, int32_t *value) {
+    uint32_t bits = 0;
+    if (!take_fixed_u32(cursor, &bits)) return false;
+    memcpy(value, &bits, sizeof *value);
+    return true;
+}
+
+static bool take_u32(struct bwf_cursor *cursor, uint32_t *value) {
+    if (!cursor->compressed) return take_fixed_u32(cursor, value);
+    int size = decode_varint(cursor->current, bytes_remaining(cursor), value);
+    cursor->current += size;
+    return size != 0;
+}
+
+static bool take_s32(struct bwf_cursor *cursor, int32_t *value) {
+    uint32_t bits = 0;
+    if (!take_u32(cursor, &bits)) return false;
+    memcpy(value, &bits, sizeof *value);
+    return true;
+}
+
+/* The fewest bytes a field can take, which bounds how many of them can fit in the file. */
+static size_t min_field_size(const struct bwf_cursor *cursor) {
+    return (cursor->compressed) ? 1 : 4;
+}
+
+/* Find the end of an entry of `entry_size` bytes, whose fields start at `fields` (i.e. just
+ * after its `entry-size` field).
+ */
+static const unsigned char *entry_end(const struct bwf_cursor *cursor,
+                                      const unsigned char *fields, int32_t entry_size) {
+    if (entry_size < 0) return NULL;
+    if ((size_t)entry_size > (size_t)(cursor->end - fields)) return NULL;
+    return fields + entry_size;
+}
+
+/* Skip any fields of the entry which we don't know about. */
+static bool skip_to(struct bwf_cursor *cursor, const unsigned char *end) {
+    if (end == NULL || end < cursor->current) return false;
+    cursor->current = end;
+    return true;
+}
+
+static int parse_header(struct bwf_cursor *cursor) {
+    char header_buffer[1024] = {0};
+    size_t length = bytes_remaining(cursor);
+    if (length > sizeof header_buffer - 1) {
+        length = sizeof header_buffer - 1;
+    }
+    const unsigned char *newline = memchr(cursor->current, '\n', length);
+    if (newline == NULL) {
+        fprintf(stderr, "Invalid BudeBWF header\n");
         return -1;
     }
+    length = newline + 1 - cursor->current;
+    memcpy(header_buffer, take_bytes(cursor, length), length);
     int version_number = -1;
-    if (sscanf(header_buffer, "BudeBWFv%d", &version_number) != 1) {
+    char variant = '\0';
+    if (sscanf(header_buffer, "BudeBW%cv%d", &variant, &version_number) != 2
+        || (variant != 'F' && variant != 'Z')) {
         fprintf(stderr, "Invalid BudeBWF header\n");
         return -1;
     }
+    cursor->compressed = variant == 'Z';
+    if (cursor->compressed && version_number < 6) {
+        fprintf(stderr, "Compressed BudeBWF files must be version 6 or later.\n");
+        return -1;
+    }
     return version_number;
 }
 
-static bool parse_data_info(FILE *f, int version_number, struct data_info *di) {
+static bool parse_data_info(struct bwf_cursor *cursor, int version_number,
+                            struct data_info *di) {
     int32_t field_count = 2;
-    long start_pos = ftell(f);
     if (version_number >= 2) {
         // Read data-field-count field
-        if (fread(&field_count, sizeof field_count, 1, f) != 1) return false;
-        if (field_count < 2) {
+        if (!take_s32(cursor, &field_count)) return false;
+        if (field_count < 2 || field_count > INT32_MAX/4) {
             fprintf(stderr, "Bad `data-info-field-count`: %d.\n", field_count);
             return false;
         }
     }
-    if (fread(&di->string_count, sizeof di->string_count, 1, f) != 1) return false;
-    if (fread(&di->function_count, sizeof di->function_count, 1, f) != 1) return false;
+    const unsigned char *fields = cursor->current;
+    if (!take_s32(cursor, &di->string_count)) return false;
+    if (!take_s32(cursor, &di->function_count)) return false;
     if (version_number < 4) goto skip_rest;
     // Version 4+ fields.
-    if (fread(&di->ud_type_count, sizeof di->ud_type_count, 1, f) != 1) return false;
+    if (!take_s32(cursor, &di->ud_type_count)) return false;
     if (version_number < 5) goto skip_rest;
     // Version 5+ fields.
-    if (fread(&di->ext_function_count, sizeof di->ext_function_count, 1, f) != 1) return false;
-    if (fread(&di->ext_library_count, sizeof di->ext_library_count, 1, f) != 1) return false;
+    if (!take_s32(cursor, &di->ext_function_count)) return false;
+    if (!take_s32(cursor, &di->ext_library_count)) return false;
 skip_rest:
-    long bytes_left = start_pos + (field_count + 1)*4 - ftell(f);
-    assert(bytes_left >= 0);
-    if (bytes_left > 0) {
+    if (version_number < 2) return true;
+    if (cursor->compressed) {
+        // Varints can't be skipped by size, so any extra fields are read one by one.
+        int known_count = get_field_count(version_number);
+        if (field_count < known_count) return false;
+        if (field_count > known_count) {
+            fprintf(stderr, "Warning: extra fields not read\n.");
+        }
+        for (int i = known_count; i < field_count; ++i) {
+            int32_t unused = 0;
+            if (!take_s32(cursor, &unused)) return false;
+        }
+        return true;
+    }
+    const unsigned char *end = entry_end(cursor, fields, field_count*4);
+    if (end != NULL && end > cursor->current) {
         fprintf(stderr, "Warning: extra fields not read\n.");
-        if (fseek(f, bytes_left, SEEK_CUR) != 0) return false;
+    }
+    return skip_to(cursor, end);
+}
+
+static bool parse_section_index(struct bwf_cursor *cursor, const struct data_info *di,
+                                int32_t section_offsets[BWF_SECTION_COUNT],
+                                struct module *module, bool lazy) {
+    int32_t section_count = 0;
+    if (!take_fixed_s32(cursor, &section_count)) return false;
+    if (section_count < BWF_REQUIRED_SECTION_COUNT) return false;
+    if ((size_t)section_count > bytes_remaining(cursor)/4) return false;
+    for (int i = 0; i < section_count; ++i) {
+        int32_t offset = 0;
+        if (!take_fixed_s32(cursor, &offset)) return false;
+        if (i >= BWF_SECTION_COUNT) continue;  // Ignore sections we don't know about.
+        if (offset < 0 || (size_t)offset > (size_t)(cursor->end - cursor->start)) return false;
+        section_offsets[i] = offset;
+    }
+    if ((size_t)di->function_count > bytes_remaining(cursor)/4) return false;
+    if (!lazy) {
+        cursor->current += di->function_count*4;
+        return true;
+    }
+    int32_t *offsets = allocate_array(di->function_count, sizeof offsets[0]);
+    CHECK_ARRAY_ALLOCATION(offsets, di->function_count);
+    for (int i = 0; i < di->function_count; ++i) {
+        take_fixed_s32(cursor, &offsets[i]);
+        if (offsets[i] <= 0 || (size_t)offsets[i] >= (size_t)(cursor->end - cursor->start)) {
+            free_array(offsets, di->function_count, sizeof offsets[0]);
+            return false;
+        }
+    }
+    module->bwf_index.function_offsets = offsets;
+    return true;
+}
+
+/* Move to the start of a table. Before version 6, the tables are simply read in order. */
+static void seek_section(struct bwf_cursor *cursor, int version_number,
+                         const int32_t section_offsets[BWF_SECTION_COUNT],
+                         enum bwf_section section) {
+    if (version_number < 6) return;
+    cursor->current = cursor->start + section_offsets[section];
+}
+
+/* Decompress `size` bytes of code into a buffer of its own. Empty code has no buffer. */
+static bool take_compressed_code(struct bwf_cursor *cursor, int32_t size, uint8_t **code) {
+    int32_t compressed_size = 0;
+    if (!take_s32(cursor, &compressed_size)) return false;
+    if (compressed_size < 0) return false;
+    const unsigned char *compressed = take_bytes(cursor, compressed_size);
+    if (compressed == NULL) return false;
+    if (size == 0) {
+        uint8_t empty[1];
+        *code = NULL;
+        return lz_decompress(compressed, compressed_size, empty, 0);
+    }
+    // No sequence can expand to more than 255 times its size, so a bad size can't cause a huge
+    // allocation.
+    if ((size_t)size/255 > (size_t)compressed_size + 1) return false;
+    *code = allocate_array(size, sizeof (*code)[0]);
+    CHECK_ARRAY_ALLOCATION(*code, size);
+    if (!lz_decompress(compressed, compressed_size, *code, size)) {
+        free_array(*code, size, sizeof (*code)[0]);
+        return false;
     }
     return true;
 }
 
-static bool parse_function(FILE *f, int version_number, struct function *function) {
-    long start_pos = ftell(f);
+static struct w_code_tables get_w_code_tables(const struct module *module) {
+    return (struct w_code_tables) {
+        .function_count = module->functions.count,
+        .string_count = module->strings.count,
+        .external_count = module->externals.count,
+    };
+}
+
+static bool parse_function(struct bwf_cursor *cursor, int version_number,
+                           struct function *function, const struct w_code_tables *tables) {
     int32_t entry_size = 0;
     if (version_number >= 3) {
-        if (fread(&entry_size, sizeof entry_size, 1, f) != 1) return false;
+        if (!take_s32(cursor, &entry_size)) return false;
     }
+    const unsigned char *fields = cursor->current;
     int32_t size = 0;
-    if (fread(&size, sizeof size, 1, f) != 1) return false;
-    if (entry_size == 0) entry_size = size;
+    if (!take_s32(cursor, &size)) return false;
+    if (version_number < 3) {
+        // The code-size field doubles as the entry-size field.
+        fields = cursor->current;
+        entry_size = size;
+    }
     if (size < 0) return false;
-    uint8_t *code = allocate_array(size, 1);
-    struct location *locations = allocate_array(size, sizeof *locations);
+    const unsigned char *code = NULL;
+    uint8_t *owned_code = NULL;
+    if (cursor->compressed) {
+        if (!take_compressed_code(cursor, size, &owned_code)) return false;
+    }
+    else {
+        code = take_bytes(cursor, size);
+        if (code == NULL) return false;
+    }
     int32_t max_for_loop_level = 0;
     int32_t locals_size = 0;
     int32_t local_count = 0;
     struct local *locals = NULL;
-    if (fread(code, 1, size, f) != (size_t)size) return false;
     if (version_number < 4) goto skip_rest;
     // Version 4+ fields.
-    if (fread(&max_for_loop_level, sizeof max_for_loop_level, 1, f) != 1) return false;
-    if (fread(&locals_size, sizeof locals_size, 1, f) != 1) return false;
-    if (fread(&local_count, sizeof local_count, 1, f) != 1) return false;
-    if (local_count < 0) return false;
+    if (!take_s32(cursor, &max_for_loop_level)) return false;
+    if (!take_s32(cursor, &locals_size)) return false;
+    if (!take_s32(cursor, &local_count)) return false;
+    if (local_count < 0 || (size_t)local_count > bytes_remaining(cursor)/min_field_size(cursor)) {
+        return false;
+    }
     locals = allocate_array(local_count, sizeof *locals);
-    if (fread(locals, sizeof locals[0], local_count, f) != (size_t)local_count) return false;
+    CHECK_ARRAY_ALLOCATION(locals, local_count);
+    for (int i = 0; i < local_count; ++i) {
+        // NOTE: Only the type of each local is stored. Its offset and size are worked out
+        // once the types have been read (see `set_local_offsets()`).
+        int32_t type = 0;
+        if (!take_s32(cursor, &type)) return false;
+        locals[i] = (struct local) {.type = type};
+    }
 skip_rest:
-    long bytes_left = (start_pos + entry_size + 4) - ftell(f);
-    if (bytes_left < 0) return false;
-    if (fseek(f, bytes_left, SEEK_CUR) != 0) return false;
+    if (!skip_to(cursor, entry_end(cursor, fields, entry_size))) return false;
     // NOTE: We set all other field to 0/NULL since we don't care about them.
     *function = (struct function) {
         .w_code = {
             .instruction_set = IR_WORD_ORIENTED,
-            .capacity = size,
-            .count = size,
-            .code = code,
-            .locations = locations,  // NOTE: All initialised to 0.
+            // NOTE: No location information is stored in the file, so `locations` is empty.
         },
         .locals = {
             .capacity = local_count,
@@ -105,13 +302,24 @@ skip_rest:
         },
         .max_for_loop_level = max_for_loop_level,
         .locals_size = locals_size,
+        // These come from the SYMBOL-TABLE, which may have been read before the function.
+        .sig = function->sig,
+        .is_imported = function->is_imported,
     };
+    if (code != NULL) {
+        borrow_code(&function->w_code, code, size);
+    }
+    else if (owned_code != NULL) {
+        function->w_code.code = owned_code;
+        function->w_code.capacity = size;
+        function->w_code.count = size;
+    }
     init_jump_info_table(&function->w_code.jumps);
-    recompute_jump_dests(&function->w_code);
-    return true;
+    // This fills in the jump table too.
+    return check_w_code(&function->w_code, tables);
 }
 
-static bool parse_type(FILE *f, int version_number, struct type_info *info,
+static bool parse_type(struct bwf_cursor *cursor, int version_number, struct type_info *info,
                        struct region *region) {
     (void)version_number;
     int32_t entry_size = 0;
@@ -119,13 +327,14 @@ static bool parse_type(FILE *f, int version_number, struct type_info *info,
     int32_t field_count = 0;
     int32_t word_count = 1;
     type_index *fields = NULL;
-    long start_pos = ftell(f);
-    if (fread(&entry_size, sizeof entry_size, 1, f) != 1) return false;
-    if (fread(&kind, sizeof kind, 1, f) != 1) return false;
-    if (fread(&field_count, sizeof field_count, 1, f) != 1) return false;
-    if (fread(&word_count, sizeof word_count, 1, f) != 1) return false;
+    if (!take_s32(cursor, &entry_size)) return false;
+    const unsigned char *entry_fields = cursor->current;
+    if (!take_s32(cursor, &kind)) return false;
+    if (!take_s32(cursor, &field_count)) return false;
+    if (!take_s32(cursor, &word_count)) return false;
     if (field_count < 0 || word_count < 0) return false;
-    info->kind = kind;
+    if ((size_t)field_count > bytes_remaining(cursor)/min_field_size(cursor)) return false;
+    *info = (struct type_info) {.kind = kind};
     switch (info->kind) {
     case KIND_PACK:
         if (field_count > 8) return false;
@@ -139,87 +348,99 @@ static bool parse_type(FILE *f, int version_number, struct type_info *info,
         info->comp.word_count = word_count;
         break;
     case KIND_ARRAY:
+        if (field_count != 1) return false;
         fields = &info->array.element_type;
         info->array.element_count = word_count;
-        assert(field_count == 1);
         break;
     case KIND_UNINIT:
     case KIND_SIMPLE:
         // Do nothing.
         break;
+    default:
+        return false;
     }
     if (fields != NULL) {
-        if (fread(fields, sizeof fields[0], field_count, f) != (size_t)field_count) return false;
+        for (int i = 0; i < field_count; ++i) {
+            int32_t field_type = 0;
+            if (!take_s32(cursor, &field_type)) return false;
+            fields[i] = field_type;
+        }
     }
-    long bytes_left = start_pos + 4 + entry_size - ftell(f);
-    if (bytes_left < 0) return false;
-    if (fseek(f, bytes_left, SEEK_CUR) != 0) return false;
-    return true;
+    return skip_to(cursor, entry_end(cursor, entry_fields, entry_size));
 }
 
-static bool parse_ext_function(FILE *f, int version_number, struct ext_function *external,
-                               struct module *module) {
-    (void)version_number;
-    int32_t entry_size = 0;
+static bool parse_signature(struct bwf_cursor *cursor, struct region *region,
+                            struct signature *sig) {
     int32_t param_count = 0;
     int32_t ret_count = 0;
-    long start_pos = ftell(f);
-    if (fread(&entry_size, sizeof entry_size, 1, f) != 1) return false;
-    if (fread(&param_count, sizeof param_count, 1, f) != 1) return false;
-    if (fread(&ret_count, sizeof ret_count, 1, f) != 1) return false;
+    if (!take_s32(cursor, &param_count)) return false;
+    if (!take_s32(cursor, &ret_count)) return false;
     if (param_count < 0 || ret_count < 0) return false;
-    type_index *params = region_calloc(module->region, param_count, sizeof params[0]);
+    if ((size_t)param_count + ret_count > bytes_remaining(cursor)/min_field_size(cursor)) {
+        return false;
+    }
+    type_index *params = region_calloc(region, param_count, sizeof params[0]);
     CHECK_ARRAY_ALLOCATION(params, param_count);
-    type_index *rets = region_calloc(module->region, ret_count, sizeof rets[0]);
+    type_index *rets = region_calloc(region, ret_count, sizeof rets[0]);
     CHECK_ARRAY_ALLOCATION(rets, ret_count);
     for (int i = 0; i < param_count; ++i) {
         int32_t param_type = 0;
-        if (fread(&param_type, sizeof param_type, 1, f) != 1) return false;
+        if (!take_s32(cursor, &param_type)) return false;
         params[i] = param_type;
     }
     for (int i = 0; i < ret_count; ++i) {
         int32_t ret_type = 0;
-        if (fread(&ret_type, sizeof ret_type, 1, f) != 1) return false;
+        if (!take_s32(cursor, &ret_type)) return false;
         rets[i] = ret_type;
     }
+    *sig = (struct signature) {param_count, ret_count, params, rets};
+    return true;
+}
+
+static bool parse_ext_function(struct bwf_cursor *cursor, int version_number,
+                               struct ext_function *external, struct module *module) {
+    (void)version_number;
+    int32_t entry_size = 0;
+    if (!take_s32(cursor, &entry_size)) return false;
+    const unsigned char *fields = cursor->current;
+    struct signature sig = {0};
+    if (!parse_signature(cursor, module->region, &sig)) return false;
     int32_t name_index = 0;
     int32_t call_conv = 0;
-    if (fread(&name_index, sizeof name_index, 1, f) != 1) return false;
-    if (fread(&call_conv, sizeof call_conv, 1, f) != 1) return false;
+    if (!take_s32(cursor, &name_index)) return false;
+    if (!take_s32(cursor, &call_conv)) return false;
     if (name_index < 0 || name_index >= module->strings.count) return false;
-    long bytes_left = start_pos + 4 + entry_size - ftell(f);
-    if (bytes_left < 0) return false;
-    if (fseek(f, bytes_left, SEEK_CUR) != 0) return false;
+    if (!skip_to(cursor, entry_end(cursor, fields, entry_size))) return false;
     *external = (struct ext_function) {
-        .sig = {param_count, ret_count, params, rets},
+        .sig = sig,
         .name = module->strings.items[name_index],
         .call_conv = call_conv,
     };
     return true;
 }
 
-static bool parse_ext_library(FILE *f, int version_number, struct ext_library *library,
-                              struct module *module) {
+static bool parse_ext_library(struct bwf_cursor *cursor, int version_number,
+                              struct ext_library *library, struct module *module) {
     (void)version_number;
     int32_t entry_size = 0;
     int32_t external_count = 0;
-    long start_pos = ftell(f);
-    if (fread(&entry_size, sizeof entry_size, 1, f) != 1) return false;
-    if (fread(&external_count, sizeof external_count, 1, f) != 1) return false;
+    if (!take_s32(cursor, &entry_size)) return false;
+    const unsigned char *fields = cursor->current;
+    if (!take_s32(cursor, &external_count)) return false;
+    if (external_count < 0
+        || (size_t)external_count > bytes_remaining(cursor)/min_field_size(cursor)) return false;
     type_index *externals = allocate_array(external_count, sizeof externals[0]);
     CHECK_ARRAY_ALLOCATION(externals, external_count);
     for (int i = 0; i < external_count; ++i) {
         int32_t external_index = 0;
-        if (fread(&external_index, sizeof external_index, 1, f) != 1) return false;
+        if (!take_s32(cursor, &external_index)) goto error;
         externals[i] = external_index;
     }
     int32_t filename_index = 0;
-    if (fread(&filename_index, sizeof filename_index, 1, f) != 1) return false;
-    if (filename_index < 0 || filename_index >= module->strings.count) return false;
-    long bytes_left = start_pos + 4 + entry_size - ftell(f);
-    if (bytes_left < 0) return false;
+    if (!take_s32(cursor, &filename_index)) goto error;
+    if (filename_index < 0 || filename_index >= module->strings.count) goto error;
     // TODO: print a diagnostic like in `parse_data_info()`.
-    if (fseek(f, bytes_left, SEEK_CUR) != 0) return false;
+    if (!skip_to(cursor, entry_end(cursor, fields, entry_size))) goto error;
     *library = (struct ext_library) {
         .capacity = external_count,
         .count = external_count,
@@ -227,92 +448,249 @@ static bool parse_ext_library(FILE *f, int version_number, struct ext_library *l
         .filename = module->strings.items[filename_index],
     };
     return true;
+error:
+    free_array(externals, external_count, sizeof externals[0]);
+    return false;
+}
+
+static bool set_local_offsets(struct module *module, struct function *function) {
+    int offset = 0;
+    for (int i = 0; i < function->locals.count; ++i) {
+        struct local *local = &function->locals.items[i];
+        if (local->type < 0 || local->type >= SIMPLE_TYPE_COUNT + module->types.count) {
+            return false;
+        }
+        local->size = type_word_count(&module->types, local->type);
+        local->offset = offset;
+        offset += local->size;
+    }
+    return offset == function->locals_size;
 }
 
-static bool parse_data(FILE *f, int version_number, struct module *module) {
+static bool parse_data(struct bwf_cursor *cursor, int version_number, struct module *module,
+                       const int32_t section_offsets[BWF_SECTION_COUNT]) {
+    bool lazy = module->bwf_index.function_offsets != NULL;
+    seek_section(cursor, version_number, section_offsets, BWF_STRING_TABLE);
     for (int i = 0; i < module->strings.count; ++i) {
         uint32_t size = 0;
-        if (fread(&size, sizeof size, 1, f) != 1) return false;
-        char *string = region_alloc(module->region, size);
-        if (string == NULL) return false;
-        if (fread(string, 1, size, f) != size) return false;
+        if (!take_u32(cursor, &size)) return false;
+        const unsigned char *bytes = take_bytes(cursor, size);
+        if (bytes == NULL) return false;
+        // NOTE: Programs rely on string literals being null-terminated in memory, which they
+        // aren't in the file, so strings are the one thing copied out of the mapping.
+        char *string = region_alloc_uninit(module->region, (size_t)size + 1);
+        CHECK_ALLOCATION(string);
+        memcpy(string, bytes, size);
+        string[size] = '\0';
         module->strings.items[i] = (struct string_view) {.length = size, .start = string};
     }
-    for (int i = 0; i < module->functions.count; ++i) {
+    seek_section(cursor, version_number, section_offsets, BWF_FUNCTION_TABLE);
+    struct w_code_tables tables = get_w_code_tables(module);
+    for (int i = 0; i < module->functions.count && !lazy; ++i) {
         struct function *function = &module->functions.items[i];
-        if (!parse_function(f, version_number, function)) return false;
+        if (!parse_function(cursor, version_number, function, &tables)) {
+            return false;
+        }
     }
     if (version_number < 4) return true;
+    seek_section(cursor, version_number, section_offsets, BWF_USER_DEFINED_TYPE_TABLE);
     for (int i = BUILTIN_TYPE_COUNT; i < module->types.count; ++i) {
         struct type_info *info = &module->types.items[i];
-        if (!parse_type(f, version_number, info, module->types.extra_info)) return false;
+        if (!parse_type(cursor, version_number, info, module->types.extra_info)) return false;
+    }
+    for (int i = 0; i < module->functions.count && !lazy; ++i) {
+        struct function *function = &module->functions.items[i];
+        if (!set_local_offsets(module, function)) return false;
     }
     if (version_number < 5) return true;
+    seek_section(cursor, version_number, section_offsets, BWF_EXTERNAL_FUNCTION_TABLE);
     for (int i = 0; i < module->externals.count; ++i) {
         struct ext_function *external = &module->externals.items[i];
-        if (!parse_ext_function(f, version_number, external, module)) return false;
+        if (!parse_ext_function(cursor, version_number, external, module)) return false;
     }
+    seek_section(cursor, version_number, section_offsets, BWF_EXTERNAL_LIBRARY_TABLE);
     for (int i = 0; i < module->ext_libraries.count; ++i) {
         struct ext_library *library = &module->ext_libraries.items[i];
-        if (!parse_ext_library(f, version_number, library, module)) return false;
+        if (!parse_ext_library(cursor, version_number, library, module)) return false;
     }
     return true;
 }
 
-struct module read_bytecode(const char *filename) {
+static bool parse_link_symbol(struct bwf_cursor *cursor, struct module *module) {
+    int32_t entry_size = 0;
+    int32_t kind = 0;
+    int32_t index = 0;
+    uint32_t name_size = 0;
+    if (!take_s32(cursor, &entry_size)) return false;
+    const unsigned char *end = entry_end(cursor, cursor->current, entry_size);
+    if (end == NULL) return false;
+    if (!take_s32(cursor, &kind)) return false;
+    if (kind != LINK_SYMBOL_EXPORT && kind != LINK_SYMBOL_IMPORT) {
+        return skip_to(cursor, end);  // A kind of symbol we don't know about.
+    }
+    if (!take_s32(cursor, &index)) return false;
+    // Function 0 is the top-level code, which can't be linked.
+    if (index <= 0 || index >= module->functions.count) return false;
+    if (!take_u32(cursor, &name_size)) return false;
+    const unsigned char *name = take_bytes(cursor, name_size);
+    if (name == NULL) return false;
+    struct signature sig = {0};
+    if (!parse_signature(cursor, module->functions.region, &sig)) return false;
+    if (!skip_to(cursor, end)) return false;
+    struct string_view view = {.start = (const char *)name, .length = name_size};
+    add_link_symbol(module, kind, index, &view);
+    module->functions.items[index].sig = sig;
+    if (kind == LINK_SYMBOL_IMPORT) {
+        module->functions.items[index].is_imported = true;
+    }
+    return true;
+}
+
+/* Read the SYMBOL-TABLE, if there is one. */
+static bool parse_symbol_table(const struct bwf_cursor *file, int32_t symbol_table_offset,
+                               struct module *module) {
+    if (symbol_table_offset == 0) return true;  // No symbols.
+    struct bwf_cursor cursor = *file;
+    cursor.current = cursor.start + symbol_table_offset;
+    int32_t symbol_count = 0;
+    if (!take_s32(&cursor, &symbol_count)) return false;
+    if (symbol_count < 0
+        || (size_t)symbol_count > bytes_remaining(&cursor)/min_field_size(&cursor)) return false;
+    for (int i = 0; i < symbol_count; ++i) {
+        if (!parse_link_symbol(&cursor, module)) return false;
+    }
+    // Only functions defined in the module can be exported from it.
+    for (int i = 0; i < module->link_symbols.count; ++i) {
+        struct link_symbol *symbol = &module->link_symbols.items[i];
+        if (symbol->kind == LINK_SYMBOL_EXPORT
+            && module->functions.items[symbol->index].is_imported) return false;
+    }
+    return true;
+}
+
+/* Every function defined in a module ends with a return, so only imported functions have no
+ * code. A function without code which isn't imported (e.g. because the SYMBOL-TABLE is missing)
+ * would do nothing when called.
+ */
+static bool check_function_code(const struct function *function) {
+    return (function->w_code.count == 0) == function->is_imported;
+}
+
+static bool check_loaded_functions(const struct module *module) {
+    const int32_t *offsets = module->bwf_index.function_offsets;
+    for (int i = 0; i < module->functions.count; ++i) {
+        if (offsets != NULL && offsets[i] != 0) continue;  // Checked when it's loaded.
+        if (!check_function_code(&module->functions.items[i])) return false;
+    }
+    return true;
+}
+
+/* Resize a table to hold exactly `new_count` items, which are then filled in by the parser. */
+#define RESIZE_TABLE(table, new_count)                                  \
+    do {                                                                \
+        if ((table)->capacity < (new_count)) {                          \
+            (table)->items = reallocate_array((table)->items, (table)->capacity, \
+                                              (new_count), sizeof (table)->items[0]); \
+            (table)->capacity = (new_count);                            \
+        }                                                               \
+        (table)->count = (new_count);                                   \
+    } while (0)
+
+bool try_read_bytecode(const char *filename, bool lazy, struct module *module_out) {
     struct module module;
     init_module(&module, filename);
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        perror("Failed to open file");
-        exit(1);
-    }
-    int version_number = parse_header(f);
+    if (!map_file(filename, &module.mapping)) goto error;
+    struct bwf_cursor cursor = {
+        .start = module.mapping.data,
+        .current = module.mapping.data,
+        .end = module.mapping.data + module.mapping.size,
+    };
+    int version_number = parse_header(&cursor);
     if (version_number <= 0) goto error;  // Error parsing header.
     if (version_number > reader_version_number) {
         fprintf(stderr, "BWF version number %d not supported.\n", version_number);
         goto error;
     }
     struct data_info di = {0};
-    if (!parse_data_info(f, version_number, &di)) goto error;
-    struct string_table *strings = &module.strings;
-    struct function_table *functions = &module.functions;
-    struct type_table *types = &module.types;
-    struct external_table *externals = &module.externals;
-    struct ext_lib_table *ext_libraries = &module.ext_libraries;
-    if (strings->capacity < di.string_count) {
-        reallocate_array(strings->items, strings->capacity, di.string_count, 1);
-        strings->capacity = di.string_count;
-    }
-    strings->count = di.string_count;
-    if (functions->capacity < di.function_count) {
-        reallocate_array(functions->items, functions->capacity, di.function_count,
-                         sizeof functions->items[0]);
-        functions->capacity = di.function_count;
-    }
-    functions->count = di.function_count;
-    int type_count = di.ud_type_count + BUILTIN_TYPE_COUNT;
-    if (types->capacity < type_count) {
-        reallocate_array(types->items, types->capacity, type_count, 1);
-        types->capacity = type_count;
-    }
-    types->count = type_count;
-    if (externals->capacity < di.ext_function_count) {
-        reallocate_array(externals->items, externals->capacity, di.ext_function_count,
-                         sizeof externals->items[0]);
-        externals->capacity = di.ext_function_count;
-    }
-    externals->count = di.ext_function_count;
-    if (ext_libraries->capacity < di.ext_library_count) {
-        reallocate_array(ext_libraries->items, ext_libraries->capacity, di.ext_library_count,
-                         sizeof ext_libraries->items[0]);
-        ext_libraries->capacity = di.ext_library_count;
-    }
-    ext_libraries->count = di.ext_library_count;
-    if (!parse_data(f, version_number, &module)) goto error;
-    fclose(f);
-    return module;
+    if (!parse_data_info(&cursor, version_number, &di)) goto malformed;
+    // Every entry takes at least one field, which stops a bad count from causing a huge
+    // allocation.
+    if (di.string_count < 0 || di.function_count < 0 || di.ud_type_count < 0
+        || di.ext_function_count < 0 || di.ext_library_count < 0) goto malformed;
+    size_t entry_count = (size_t)di.string_count + di.function_count + di.ud_type_count
+        + di.ext_function_count + di.ext_library_count;
+    if (entry_count > bytes_remaining(&cursor)/min_field_size(&cursor)) goto malformed;
+    int32_t section_offsets[BWF_SECTION_COUNT] = {0};
+    if (version_number >= 6) {
+        if (!parse_section_index(&cursor, &di, section_offsets, &module, lazy)) goto malformed;
+        module.bwf_index.version_number = version_number;
+        module.bwf_index.compressed = cursor.compressed;
+    }
+    RESIZE_TABLE(&module.strings, di.string_count);
+    RESIZE_TABLE(&module.functions, di.function_count);
+    RESIZE_TABLE(&module.types, di.ud_type_count + BUILTIN_TYPE_COUNT);
+    RESIZE_TABLE(&module.externals, di.ext_function_count);
+    RESIZE_TABLE(&module.ext_libraries, di.ext_library_count);
+    if (!parse_data(&cursor, version_number, &module, section_offsets)) goto malformed;
+    if (version_number >= 6
+        && !parse_symbol_table(&cursor, section_offsets[BWF_SYMBOL_TABLE], &module)) {
+        goto malformed;
+    }
+    if (!check_loaded_functions(&module)) goto malformed;
+    *module_out = module;
+    return true;
+malformed:
+    fprintf(stderr, "Invalid or truncated BudeBWF file `%s`.\n", filename);
 error:
-    fclose(f);
-    exit(1);
+    free_module(&module);
+    return false;
+}
+
+struct module read_bytecode(const char *filename) {
+    struct module module;
+    if (!try_read_bytecode(filename, false, &module)) {
+        exit(1);
+    }
+    return module;
+}
+
+struct module read_bytecode_lazily(const char *filename) {
+    struct module module;
+    if (!try_read_bytecode(filename, true, &module)) {
+        exit(1);
+    }
+    return module;
+}
+
+bool load_function(struct module *module, int index) {
+    int32_t *offsets = module->bwf_index.function_offsets;
+    if (index < 0 || index >= module->functions.count) {
+        fprintf(stderr, "Invalid or truncated BudeBWF file `%s` (no function %d).\n",
+                module->filename, index);
+        return false;
+    }
+    if (offsets == NULL || offsets[index] == 0) return true;  // Already loaded.
+    struct bwf_cursor cursor = {
+        .start = module->mapping.data,
+        .current = module->mapping.data + offsets[index],
+        .end = module->mapping.data + module->mapping.size,
+        .compressed = module->bwf_index.compressed,
+    };
+    struct function *function = &module->functions.items[index];
+    struct w_code_tables tables = get_w_code_tables(module);
+    if (!parse_function(&cursor, module->bwf_index.version_number, function, &tables)
+        || !check_function_code(function) || !set_local_offsets(module, function)) {
+        fprintf(stderr, "Invalid or truncated BudeBWF file `%s` (function %d).\n",
+                module->filename, index);
+        return false;
+    }
+    offsets[index] = 0;
+    return true;
+}
+
+bool load_all_functions(struct module *module) {
+    for (int i = 0; i < module->functions.count; ++i) {
+        if (!load_function(module, i)) return false;
+    }
+    return true;
 }
@@ -1,8 +1,24 @@
 #ifndef READER_H
 #define READER_H
 
+#include <stdbool.h>
+
 #include "module.h"
 
 struct module read_bytecode(const char *filename);
+/* Like read_bytecode(), but functions are left unloaded until they are passed to
+ * load_function(). Files older than version 6 have no function index, so they are read in
+ * full.
+ */
+struct module read_bytecode_lazily(const char *filename);
+/* Load a function of a lazily-read module if it hasn't been already. Returns false (after
+ * printing an error message) if the function's entry is malformed.
+ */
+bool load_function(struct module *module, int index);
+/* Like read_bytecode() (or read_bytecode_lazily() if `lazy` is true), but returns false (after
+ * printing an error message) instead of exiting if the file can't be read.
+ */
+bool try_read_bytecode(const char *filename, bool lazy, struct module *module);
+bool load_all_functions(struct module *module);
 
 #endif
@@ -1,38 +1,30 @@
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "region.h"
 
-#define ALIGN_TO(alignment, count)                      \
-    do {                                                \
-        if ((count) % alignment != 0) {                 \
-            count += alignment - (count) % alignment;   \
-        }                                               \
-    } while (0)
+static size_t align_for(size_t count, size_t size) {
+    size_t alignment = (size % 16 == 0) ? 16
+        : (size % 8 == 0) ? 8
+        : (size % 4 == 0) ? 4
+        : (size % 2 == 0) ? 2
+        : 1;
+    return (count + alignment - 1) & ~(alignment - 1);
+}
 
-#define ALIGN(count, size)                                      \
-    do {                                                        \
-        if (size % 16 == 0) {                                   \
-            ALIGN_TO(16, count);                                \
-        }                                                       \
-        else if (size % 8 == 0) {                               \
-            ALIGN_TO(8, count);                                 \
-        }                                                       \
-        else if (size % 4 == 0) {                               \
-            ALIGN_TO(4, count);                                 \
-        }                                                       \
-        else if (size % 2 == 0) {                               \
-            ALIGN_TO(2, count);                                 \
-        }                                                       \
-    } while (0)
+static struct region *new_block(size_t size) {
+    // Memory is zeroed as it is allocated rather than up front, so that clearing a region doesn't
+    // have to touch every byte in it.
+    struct region *block = malloc(sizeof *block + size);
+    if (block == NULL) return NULL;
+    *block = (struct region) {.next = NULL, .tail = block, .size = size, .alloc_count = 0};
+    return block;
+}
 
 struct region *new_region(size_t size) {
-    struct region *r = calloc(1, sizeof *r + size);
-    if (r == NULL) return NULL;
-    r->next = NULL;
-    r->size = size;
-    r->alloc_count = 0;
-    return r;
+    return new_block(size);
 }
 
 void kill_region(struct region *region) {
@@ -44,52 +36,122 @@ void kill_region(struct region *region) {
 }
 
 struct region *copy_region(const struct region *region) {
-    struct region *new = new_region(region->size);
-    memcpy(new->bytes, region->bytes, region->alloc_count);
-    new->alloc_count = region->alloc_count;
-    if (region->next != NULL) {
-        new->next = copy_region(region->next);
+    struct region *new = NULL;
+    struct region **link = &new;
+    for (const struct region *block = region; block != NULL; block = block->next) {
+        struct region *copy = new_block(block->size);
+        if (copy == NULL) {
+            kill_region(new);
+            return NULL;
+        }
+        memcpy(copy->bytes, block->bytes, block->alloc_count);
+        copy->alloc_count = block->alloc_count;
+        *link = copy;
+        link = &copy->next;
+        if (block == region->tail) {
+            new->tail = copy;
+        }
     }
+    new->requested = region->requested;
+    new->allocations = region->allocations;
     return new;
 }
 
 void clear_region(struct region *region) {
-    // Need to maintain that the memory is zeored.
-    memset(region->bytes, 0, region->size);
-    region->alloc_count = 0;
-    if (region->next != NULL) {
-        clear_region(region->next);
+    for (struct region *block = region; block != NULL; block = block->next) {
+        block->alloc_count = 0;
     }
+    region->tail = region;
+    region->requested = 0;
+    region->allocations = 0;
 }
 
 REGION_RESTORE record_region(const struct region *region) {
-    return &region->bytes[region->alloc_count];
+    return (REGION_RESTORE) {
+        .block = region->tail,
+        .alloc_count = region->tail->alloc_count,
+        .requested = region->requested,
+        .allocations = region->allocations,
+    };
 }
 
 void restore_region(struct region *region, REGION_RESTORE restore_point) {
-    ptrdiff_t diff = &region->bytes[region->alloc_count] - (const char *)restore_point;
-    region->alloc_count -= diff;
-    memset(&region->bytes[region->alloc_count], 0, diff);
+    struct region *block = restore_point.block;
+    block->alloc_count = restore_point.alloc_count;
+    for (struct region *later = block->next; later != NULL; later = later->next) {
+        later->alloc_count = 0;
+    }
+    region->tail = block;
+    region->requested = restore_point.requested;
+    region->allocations = restore_point.allocations;
 }
 
-void *region_alloc(struct region *region, size_t size) {
+static size_t next_block_size(const struct region *tail, size_t size) {
+    size_t new_size = tail->size;
+    if (new_size < REGION_MAX_BLOCK_SIZE / 2) {
+        new_size *= 2;
+    }
+    else if (new_size < REGION_MAX_BLOCK_SIZE) {
+        new_size = REGION_MAX_BLOCK_SIZE;
+    }
+    return (size > new_size) ? size : new_size;
+}
+
+void *region_alloc_uninit(struct region *region, size_t size) {
     if (size == 0) return NULL;
-    if (size > region->size) return NULL;
-    ALIGN(region->alloc_count, size);
-    if (region->alloc_count + size > region->size) {
-        if (region->next == NULL) {
-            region->next = new_region(region->size);
-            if (region->next == NULL) return NULL;
+    struct region *block = region->tail;
+    size_t start = align_for(block->alloc_count, size);
+    while (start > block->size || size > block->size - start) {
+        // Blocks left over from before the region was cleared or restored are reused.
+        if (block->next == NULL) {
+            block->next = new_block(next_block_size(block, size));
+            if (block->next == NULL) return NULL;
         }
-        return region_alloc(region->next, size);
+        block = block->next;
+        start = align_for(block->alloc_count, size);
     }
-    void *start = &region->bytes[region->alloc_count];
-    region->alloc_count += size;
-    return start;
+    region->tail = block;
+    block->alloc_count = start + size;
+    region->requested += size;
+    ++region->allocations;
+    return &block->bytes[start];
+}
+
+void *region_alloc(struct region *region, size_t size) {
+    void *start = region_alloc_uninit(region, size);
+    if (start == NULL) return NULL;
+    return memset(start, 0, size);
 }
 
 void *region_calloc(struct region *region, size_t count, size_t size) {
     if (size == 0) return NULL;
     if (SIZE_MAX / size < count) return NULL;  // Multiplication overflow.
-    return region_alloc(region, count * size);  // Region zeroed on initial allocation.
+    return region_alloc(region, count * size);
+}
+
+struct region_stats get_region_stats(const struct region *region) {
+    struct region_stats stats = {
+        .requested = region->requested,
+        .allocations = region->allocations,
+    };
+    bool past_tail = false;
+    for (const struct region *block = region; block != NULL; block = block->next) {
+        ++stats.block_count;
+        stats.reserved += block->size;
+        stats.used += block->alloc_count;
+        if (!past_tail && block != region->tail) {
+            stats.wasted += block->size - block->alloc_count;
+        }
+        past_tail = past_tail || block == region->tail;
+    }
+    stats.wasted += stats.used - stats.requested;
+    return stats;
+}
+
+void print_region_stats(FILE *file, const char *name, const struct region *region) {
+    struct region_stats stats = get_region_stats(region);
+    fprintf(file, "%-12s %8zu allocations, %10zu bytes requested, %10zu used, %10zu wasted, "
+            "%10zu reserved in %zu block%s\n",
+            name, stats.allocations, stats.requested, stats.used, stats.wasted,
+            stats.reserved, stats.block_count, (stats.block_count != 1) ? "s" : "");
 }
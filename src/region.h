@@ -1,15 +1,41 @@
 #ifndef REGION_H
 #define REGION_H
 
+#include <stdalign.h>
 #include <stddef.h>
+#include <stdio.h>
 
-typedef const void *REGION_RESTORE;
+/* Once the last block in a region fills up, a new one twice its size (up to this limit, or
+ * larger if needed for a single allocation) is added to the end of the chain. */
+#define REGION_MAX_BLOCK_SIZE (64 * 1024 * 1024)
 
+/* A region is a chain of blocks. The first block holds the bookkeeping for the whole region:
+ * the block allocations currently come from and the allocation counters.
+ */
 struct region {
     struct region *next;
+    struct region *tail;  // Only used in the first block.
     size_t size;
     size_t alloc_count;
-    char bytes[];
+    size_t requested;  // Only used in the first block.
+    size_t allocations;  // Only used in the first block.
+    alignas(max_align_t) char bytes[];
+};
+
+typedef struct region_restore {
+    struct region *block;
+    size_t alloc_count;
+    size_t requested;
+    size_t allocations;
+} REGION_RESTORE;
+
+struct region_stats {
+    size_t block_count;
+    size_t reserved;  // Bytes in all blocks.
+    size_t used;  // Bytes handed out, including alignment padding.
+    size_t requested;  // Bytes asked for.
+    size_t wasted;  // Padding plus space left at the end of blocks which have been moved past.
+    size_t allocations;
 };
 
 struct region *new_region(size_t size);
@@ -20,7 +46,12 @@ void clear_region(struct region *region);
 REGION_RESTORE record_region(const struct region *region);
 void restore_region(struct region *region, REGION_RESTORE restore_point);
 
+/* Allocations are zeroed unless made with region_alloc_uninit(). */
 void *region_alloc(struct region *region, size_t size);
+void *region_alloc_uninit(struct region *region, size_t size);
 void *region_calloc(struct region *region, size_t count, size_t size);
 
+struct region_stats get_region_stats(const struct region *region);
+void print_region_stats(FILE *file, const char *name, const struct region *region);
+
 #endif
@@ -91,7 +91,7 @@ struct string_view join_string_in_region(struct string_builder *builder, const c
     for (struct string_builder *sb = builder->next; sb != NULL; sb = sb->next) {
         length += fill_length;
     }
-    char *buffer = region_alloc(region, length + 1);
+    char *buffer = region_alloc_uninit(region, length + 1);
     if (buffer == NULL) return (struct string_view) {0};
     join_string(builder, fill, buffer);
     return (struct string_view) {.start = buffer, .length = length};
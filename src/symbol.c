@@ -6,67 +6,271 @@
 #include "memory.h"
 #include "symbol.h"
 
-#define HASH2_P 113u  // Prime number < table size.
-static_assert(HASH2_P < SYMDICT_INIT_SIZE);
+static_assert((SYMDICT_INIT_SIZE & (SYMDICT_INIT_SIZE - 1)) == 0,
+              "Symbol dictionary size must be a power of two");
 
-static uint32_t hash2(uint32_t hash) {
-    //return HASH2_P - (hash % HASH2_P);
-    return hash + 1 - hash;
+static void allocate_slots(struct symbol_dictionary *dict, int capacity) {
+    dict->capacity = capacity;
+    dict->entries = allocate_array(capacity, sizeof dict->entries[0]);
+    dict->symbols = allocate_array(capacity, sizeof dict->symbols[0]);
+}
+
+static void free_slots(struct symdict_entry *entries, struct symbol *symbols, int capacity) {
+    free_array(entries, capacity, sizeof entries[0]);
+    free_array(symbols, capacity, sizeof symbols[0]);
 }
 
 void init_symbol_dictionary(struct symbol_dictionary *dict) {
-    dict->capacity = SYMDICT_INIT_SIZE;
     dict->count = 0;
-    dict->slots = calloc(SYMDICT_INIT_SIZE, sizeof dict->slots[0]);
-    CHECK_ALLOCATION(dict->slots);
+    allocate_slots(dict, SYMDICT_INIT_SIZE);
 }
 
 void free_symbol_dictionary(struct symbol_dictionary *dict) {
-    free(dict->slots);
+    free_slots(dict->entries, dict->symbols, dict->capacity);
+    dict->entries = NULL;
+    dict->symbols = NULL;
     dict->capacity = 0;
     dict->count = 0;
 }
 
-static bool check_name(const struct symdict_slot *slot, uint32_t hash,
-                       const struct string_view *name) {
-    return slot->hash == hash && sv_eq(&slot->symbol.name, name);
-}
-
-static struct symdict_slot *find_slot(const struct symbol_dictionary *dict,
-                                      const struct string_view *name, uint32_t hash) {
-    int index = hash % dict->capacity;
-    struct symdict_slot *slot = &dict->slots[index];
-    int stride = hash2(hash);
-    int visit_count = 1;
-    while (slot->is_occupied && !check_name(slot, hash, name)) {
-        if (visit_count >= dict->capacity) return NULL;  // Not enough space.
-        ++visit_count;
-        if (slot < &dict->slots[dict->capacity] - stride) {
-            slot += stride;
-        } else {
-            // Stay within table.
-            slot += stride - dict->capacity;
+static struct symdict_entry make_entry(const struct string_view *name) {
+    assert(name->length > 0 && name->length <= UINT32_MAX);
+    struct symdict_entry entry = {
+        .hash = hash_sv(name),
+        .length = name->length,
+        .prefix = 0,
+    };
+    size_t prefix_length = (name->length < SYMDICT_INLINE_NAME_SIZE)
+        ? name->length
+        : SYMDICT_INLINE_NAME_SIZE;
+    memcpy(&entry.prefix, name->start, prefix_length);
+    return entry;
+}
+
+static bool is_empty(const struct symdict_entry *entry) {
+    return entry->length == 0;
+}
+
+/* How far the entry in slot `index` is from the slot its hash maps to. */
+static int probe_distance(const struct symbol_dictionary *dict, int index) {
+    int mask = dict->capacity - 1;
+    return (index - (int)(dict->entries[index].hash & mask)) & mask;
+}
+
+static bool names_match(const struct symdict_entry *entry, const struct string_view *entry_name,
+                        const struct symdict_entry *key, const struct string_view *name) {
+    if (entry->hash != key->hash || entry->length != key->length
+        || entry->prefix != key->prefix) {
+        return false;
+    }
+    if (key->length <= SYMDICT_INLINE_NAME_SIZE) return true;
+    size_t rest = key->length - SYMDICT_INLINE_NAME_SIZE;
+    return memcmp(&entry_name->start[SYMDICT_INLINE_NAME_SIZE],
+                  &name->start[SYMDICT_INLINE_NAME_SIZE], rest) == 0;
+}
+
+static bool entry_matches(const struct symbol_dictionary *dict, int index,
+                          const struct symdict_entry *key, const struct string_view *name) {
+    return names_match(&dict->entries[index], &dict->symbols[index].name, key, name);
+}
+
+/* Returns the index of the symbol's slot, or -1 if it isn't in the dictionary. */
+static int find_slot(const struct symbol_dictionary *dict, const struct symdict_entry *key,
+                     const struct string_view *name) {
+    int mask = dict->capacity - 1;
+    int index = key->hash & mask;
+    for (int distance = 0; ; ++distance) {
+        if (is_empty(&dict->entries[index])) return -1;
+        // An entry closer to its home slot than we are to ours means the key would have
+        // displaced it, had it been inserted.
+        if (probe_distance(dict, index) < distance) return -1;
+        if (entry_matches(dict, index, key, name)) return index;
+        index = (index + 1) & mask;
+    }
+}
+
+/* Place a symbol known not to be in the dictionary, moving richer entries along. */
+static void place_symbol(struct symbol_dictionary *dict, struct symdict_entry entry,
+                         struct symbol symbol) {
+    int mask = dict->capacity - 1;
+    int index = entry.hash & mask;
+    for (int distance = 0; ; ++distance) {
+        struct symdict_entry *slot = &dict->entries[index];
+        if (is_empty(slot)) {
+            *slot = entry;
+            dict->symbols[index] = symbol;
+            ++dict->count;
+            return;
+        }
+        int slot_distance = probe_distance(dict, index);
+        if (slot_distance < distance) {
+            struct symdict_entry displaced_entry = *slot;
+            struct symbol displaced_symbol = dict->symbols[index];
+            *slot = entry;
+            dict->symbols[index] = symbol;
+            entry = displaced_entry;
+            symbol = displaced_symbol;
+            distance = slot_distance;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void grow_symbol_dictionary(struct symbol_dictionary *dict) {
+    int old_capacity = dict->capacity;
+    struct symdict_entry *old_entries = dict->entries;
+    struct symbol *old_symbols = dict->symbols;
+    allocate_slots(dict, old_capacity * 2);
+    dict->count = 0;
+    for (int i = 0; i < old_capacity; ++i) {
+        if (!is_empty(&old_entries[i])) {
+            place_symbol(dict, old_entries[i], old_symbols[i]);
         }
     }
-    return slot;
+    free_slots(old_entries, old_symbols, old_capacity);
 }
 
 void insert_symbol(struct symbol_dictionary *dict, const struct symbol *symbol) {
-    uint32_t hash = hash_sv(&symbol->name);
-    struct symdict_slot *slot = find_slot(dict, &symbol->name, hash);
-    assert(slot);  // Todo: grow dict when there isn't space.
-    memcpy(&slot->symbol, symbol, sizeof *symbol);
-    if (!slot->is_occupied) {
-        ++dict->count;
-        slot->is_occupied = true;
+    struct symdict_entry entry = make_entry(&symbol->name);
+    int index = find_slot(dict, &entry, &symbol->name);
+    if (index >= 0) {
+        dict->symbols[index] = *symbol;
+        return;
+    }
+    if ((dict->count + 1) * SYMDICT_MAX_LOAD_DEN > dict->capacity * SYMDICT_MAX_LOAD_NUM) {
+        grow_symbol_dictionary(dict);
     }
-    slot->hash = hash;
+    place_symbol(dict, entry, *symbol);
+}
+
+static struct symbol *lookup_with_key(const struct symbol_dictionary *dict,
+                                      const struct symdict_entry *key,
+                                      const struct string_view *name) {
+    int index = find_slot(dict, key, name);
+    if (index < 0) return NULL;
+    return &dict->symbols[index];
 }
 
 struct symbol *lookup_symbol(const struct symbol_dictionary *dict,
                              const struct string_view *name) {
-    uint32_t hash = hash_sv(name);
-    struct symdict_slot *slot = find_slot(dict, name, hash);
-    if (slot == NULL || !slot->is_occupied) return NULL;
-    return &slot->symbol;
+    struct symdict_entry key = make_entry(name);
+    return lookup_with_key(dict, &key, name);
+}
+
+static_assert((SCOPE_INDEX_INIT_SIZE & (SCOPE_INDEX_INIT_SIZE - 1)) == 0,
+              "Scope index size must be a power of two");
+
+void init_symbol_scopes(struct symbol_scopes *scopes, struct symbol_dictionary *globals) {
+    INIT_DARRAY(scopes, SYMBOL_SCOPES_INIT_SIZE);
+    scopes->slot_capacity = SCOPE_INDEX_INIT_SIZE;
+    scopes->slot_count = 0;
+    scopes->slots = allocate_array(SCOPE_INDEX_INIT_SIZE, sizeof scopes->slots[0]);
+    CHECK_ARRAY_ALLOCATION(scopes->slots, SCOPE_INDEX_INIT_SIZE);
+    scopes->globals = globals;
+}
+
+void free_symbol_scopes(struct symbol_scopes *scopes) {
+    FREE_DARRAY(scopes);
+    free_array(scopes->slots, scopes->slot_capacity, sizeof scopes->slots[0]);
+    scopes->slots = NULL;
+    scopes->slot_capacity = 0;
+    scopes->slot_count = 0;
+    scopes->globals = NULL;
+}
+
+/* Find the slot for a name, or the empty slot where it would go. Names are never removed from
+ * the index, so plain linear probing is enough.
+ */
+static struct scope_slot *find_scope_slot(const struct symbol_scopes *scopes,
+                                          const struct symdict_entry *key,
+                                          const struct string_view *name) {
+    int mask = scopes->slot_capacity - 1;
+    for (int index = key->hash & mask; ; index = (index + 1) & mask) {
+        struct scope_slot *slot = &scopes->slots[index];
+        if (is_empty(&slot->entry) || names_match(&slot->entry, &slot->name, key, name)) {
+            return slot;
+        }
+    }
+}
+
+static void grow_scope_index(struct symbol_scopes *scopes) {
+    int old_capacity = scopes->slot_capacity;
+    struct scope_slot *old_slots = scopes->slots;
+    scopes->slot_capacity = old_capacity * 2;
+    scopes->slots = allocate_array(scopes->slot_capacity, sizeof scopes->slots[0]);
+    CHECK_ARRAY_ALLOCATION(scopes->slots, scopes->slot_capacity);
+    for (int i = 0; i < old_capacity; ++i) {
+        if (is_empty(&old_slots[i].entry)) continue;
+        *find_scope_slot(scopes, &old_slots[i].entry, &old_slots[i].name) = old_slots[i];
+    }
+    free_array(old_slots, old_capacity, sizeof old_slots[0]);
+}
+
+/* Pop the top symbol, which must be the innermost of its name unless it has been removed. */
+static void pop_scoped_symbol(struct symbol_scopes *scopes) {
+    struct scoped_symbol *scoped = &scopes->items[--scopes->count];
+    if (scoped->is_removed) return;
+    struct scope_slot *slot = find_scope_slot(scopes, &scoped->entry, &scoped->symbol.name);
+    assert(slot->innermost == scopes->count);
+    slot->innermost = scoped->shadowed;
+}
+
+int open_scope(struct symbol_scopes *scopes) {
+    return scopes->count;
+}
+
+void close_scope(struct symbol_scopes *scopes, int scope) {
+    assert(0 <= scope && scope <= scopes->count);
+    while (scopes->count > scope) {
+        pop_scoped_symbol(scopes);
+    }
+}
+
+void insert_scoped_symbol(struct symbol_scopes *scopes, const struct symbol *symbol) {
+    if ((scopes->slot_count + 1) * SYMDICT_MAX_LOAD_DEN
+        > scopes->slot_capacity * SYMDICT_MAX_LOAD_NUM) {
+        grow_scope_index(scopes);
+    }
+    struct symdict_entry entry = make_entry(&symbol->name);
+    struct scope_slot *slot = find_scope_slot(scopes, &entry, &symbol->name);
+    if (is_empty(&slot->entry)) {
+        *slot = (struct scope_slot) {.entry = entry, .name = symbol->name, .innermost = -1};
+        ++scopes->slot_count;
+    }
+    struct scoped_symbol scoped = {
+        .entry = entry,
+        .symbol = *symbol,
+        .shadowed = slot->innermost,
+    };
+    slot->innermost = scopes->count;
+    DARRAY_APPEND(scopes, scoped);
+}
+
+void remove_scoped_symbol(struct symbol_scopes *scopes, int index) {
+    assert(0 <= index && index < scopes->count);
+    struct scoped_symbol *removed = &scopes->items[index];
+    assert(!removed->is_removed);
+    if (index == scopes->count - 1) {
+        pop_scoped_symbol(scopes);
+        return;
+    }
+    // Unlink it from the chain of symbols with its name. It's usually at the head.
+    struct scope_slot *slot = find_scope_slot(scopes, &removed->entry, &removed->symbol.name);
+    int *link = &slot->innermost;
+    while (*link != index) {
+        link = &scopes->items[*link].shadowed;
+    }
+    *link = removed->shadowed;
+    // The stack entry stays until its scope is closed.
+    removed->is_removed = true;
+}
+
+struct symbol *lookup_scoped_symbol(const struct symbol_scopes *scopes,
+                                    const struct string_view *name) {
+    struct symdict_entry key = make_entry(name);
+    struct scope_slot *slot = find_scope_slot(scopes, &key, name);
+    if (!is_empty(&slot->entry) && slot->innermost >= 0) {
+        return &scopes->items[slot->innermost].symbol;
+    }
+    return lookup_with_key(scopes->globals, &key, name);
 }
@@ -63,16 +63,67 @@ struct symbol {
     };
 };
 
-struct symdict_slot {
-    struct symbol symbol;
+/* Probe metadata for a slot, kept apart from the symbols so that probing stays within a few
+ * cache lines. Names of up to SYMDICT_INLINE_NAME_SIZE bytes are stored inline in the prefix, so
+ * they can be compared without looking at the symbol at all.
+ */
+#define SYMDICT_INLINE_NAME_SIZE 8
+
+struct symdict_entry {
     uint32_t hash;
-    bool is_occupied;
+    uint32_t length;  // Zero if the slot is empty.
+    uint64_t prefix;  // The first (up to) 8 bytes of the name, zero-padded.
 };
 
+/* An open-addressing hash table using Robin Hood probing. The capacity is always a power of two
+ * and the table grows once it is SYMDICT_MAX_LOAD_NUM/SYMDICT_MAX_LOAD_DEN full. Inserting a
+ * symbol may move other symbols, so pointers returned by lookup_symbol() are only valid until
+ * the next call to insert_symbol().
+ */
+#define SYMDICT_MAX_LOAD_NUM 7
+#define SYMDICT_MAX_LOAD_DEN 8
+
 struct symbol_dictionary {
     int capacity;
     int count;
-    struct symdict_slot *slots;
+    struct symdict_entry *entries;
+    struct symbol *symbols;
+};
+
+#define SYMBOL_SCOPES_INIT_SIZE 64
+#define SCOPE_INDEX_INIT_SIZE 64
+
+struct scoped_symbol {
+    struct symdict_entry entry;
+    struct symbol symbol;
+    int shadowed;  // The symbol of the same name this one hides, or -1 if there isn't one.
+    bool is_removed;
+};
+
+/* A slot of the scope index. Each name keeps its slot once it has been used, with `innermost`
+ * set to -1 while no symbol of that name is in scope.
+ */
+struct scope_slot {
+    struct symdict_entry entry;
+    struct string_view name;
+    int innermost;  // The innermost symbol with this name.
+};
+
+/* Symbols which are only visible within a function or loop (the local variables of functions
+ * and loop variables), layered over a dictionary of global symbols. The symbols in scope are
+ * kept on a stack, so closing a scope just pops everything pushed since it was opened. An index
+ * maps each name to the innermost symbol of that name, which links to the one it shadows, so a
+ * lookup is a single probe however many symbols are in scope. As with the dictionary, pointers
+ * returned by lookup_scoped_symbol() are only valid until the next insertion.
+ */
+struct symbol_scopes {
+    int capacity;
+    int count;
+    struct scoped_symbol *items;
+    int slot_capacity;  // Always a power of two.
+    int slot_count;
+    struct scope_slot *slots;
+    struct symbol_dictionary *globals;
 };
 
 void init_symbol_dictionary(struct symbol_dictionary *dict);
@@ -80,4 +131,18 @@ void free_symbol_dictionary(struct symbol_dictionary *dict);
 void insert_symbol(struct symbol_dictionary *dict, const struct symbol *symbol);
 struct symbol *lookup_symbol(const struct symbol_dictionary *dict, const struct string_view *sv);
 
+void init_symbol_scopes(struct symbol_scopes *scopes, struct symbol_dictionary *globals);
+void free_symbol_scopes(struct symbol_scopes *scopes);
+/* Open a new scope. The returned value must be passed to close_scope() to close it again. */
+int open_scope(struct symbol_scopes *scopes);
+void close_scope(struct symbol_scopes *scopes, int scope);
+void insert_scoped_symbol(struct symbol_scopes *scopes, const struct symbol *symbol);
+/* Remove the symbol at position `index` (a value returned by open_scope() just before it was
+ * inserted), keeping any symbols inserted after it in scope. If it is the innermost symbol,
+ * this is just a pop.
+ */
+void remove_scoped_symbol(struct symbol_scopes *scopes, int index);
+struct symbol *lookup_scoped_symbol(const struct symbol_scopes *scopes,
+                                    const struct string_view *name);
+
 #endif
@@ -203,6 +203,8 @@ void free_type_table(struct type_table *types) {
     types->items = NULL;
     types->capacity = 0;
     types->count = 0;
+    kill_region(types->extra_info);
+    types->extra_info = NULL;
 }
 
 type_index new_type(struct type_table *types, struct string_view *name) {
@@ -10,6 +10,7 @@
 #include "location.h"
 #include "memory.h"
 #include "module.h"
+#include "parallel.h"
 #include "type_checker.h"
 #include "type_punning.h"
 
@@ -46,31 +47,92 @@ static struct string_view type_array_to_sv(struct type_checker *checker,
     return build_string_in_region(&builder, checker->temp);
 }
 
+static void vreport(struct type_checker *checker, const char *restrict format, va_list args) {
+    struct diagnostic_buffer *diagnostics = checker->diagnostics;
+    if (diagnostics == NULL) {
+        vfprintf(stderr, format, args);
+        return;
+    }
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int length = vsnprintf(NULL, 0, format, args_copy);
+    va_end(args_copy);
+    if (length < 0) return;
+    size_t required = diagnostics->count + length + 1;  // Room for the null byte.
+    if (required > diagnostics->capacity) {
+        size_t new_capacity = (diagnostics->capacity > 0) ? diagnostics->capacity : 256;
+        while (new_capacity < required) {
+            new_capacity += new_capacity / 2;
+        }
+        diagnostics->text = reallocate_array(diagnostics->text, diagnostics->capacity,
+                                             new_capacity, 1);
+        diagnostics->capacity = new_capacity;
+    }
+    vsnprintf(&diagnostics->text[diagnostics->count], length + 1, format, args);
+    diagnostics->count += length;
+}
+
+static void report(struct type_checker *checker, const char *restrict format, ...) {
+    va_list args;
+    va_start(args, format);
+    vreport(checker, format, args);
+    va_end(args);
+}
+
+static struct location *current_location(struct type_checker *checker) {
+    if (checker->location_ip != checker->ip) {
+        checker->location = get_next_location(checker->in_block, checker->ip,
+                                               &checker->location_run);
+        checker->location_ip = checker->ip;
+    }
+    return &checker->location;
+}
+
 static void type_error(struct type_checker *checker, const char *restrict message, ...) {
     checker->had_error = true;
-    ir_error(checker->module->filename, checker->in_block, checker->ip, "Type error: ");
+    const struct location *location = current_location(checker);
+    report(checker, PRI_LOCATION"Type error: ", LOCATION_FMT(checker->module->filename, location));
     va_list args;
     va_start(args, message);
-    vfprintf(stderr, message, args);
+    vreport(checker, message, args);
     va_end(args);
-    fprintf(stderr, ".\n");
+    report(checker, ".\n");
+}
+
+static _Noreturn void fatal_type_error(struct type_checker *checker) {
+    if (checker->fatal_error != NULL) {
+        longjmp(*checker->fatal_error, 1);
+    }
+    exit(1);
 }
 
 enum jmpdir {JMP_DEST, JMP_SRC};  // Whether the CURRENT type stack is at the jump source or destination.
 
+static struct string_view snapshot_to_sv(struct type_checker *checker,
+                                         const struct tstack_snapshot *snapshot) {
+    size_t count = snapshot->count;
+    type_index *types = region_alloc_uninit(checker->temp, count * sizeof *types);
+    CHECK_ARRAY_ALLOCATION(types, count);
+    for (size_t i = count; i > 0; --i) {
+        types[i - 1] = snapshot->type;
+        snapshot = snapshot->below;
+    }
+    return type_array_to_sv(checker, count, types);
+}
+
 static void inconsistent_jump_error(struct type_checker *checker, int state_index, enum jmpdir direction) {
-    struct tstack_state *state = checker->states.states[state_index];
+    const struct tstack_snapshot *state = checker->states.states[state_index];
     struct type_stack *tstack = checker->tstack;
     struct string_view src_sv = {0};
     struct string_view dest_sv = {0};
     switch (direction) {
     case JMP_DEST:
-        src_sv = type_array_to_sv(checker, state->count, state->types);
+        src_sv = snapshot_to_sv(checker, state);
         dest_sv = type_array_to_sv(checker, TSTACK_COUNT(tstack), tstack->types);
         break;
     case JMP_SRC:
         src_sv = type_array_to_sv(checker, TSTACK_COUNT(tstack), tstack->types);
-        dest_sv = type_array_to_sv(checker, state->count, state->types);
+        dest_sv = snapshot_to_sv(checker, state);
         break;
     }
     type_error(checker, "inconsistent stack after jump instruction: %"PRI_SV" -> %"PRI_SV,
@@ -84,7 +146,7 @@ static void expect_types_equal(struct type_checker *checker, type_index expected
         struct string_view actual_sv = type_name(checker->types, actual_type);
         type_error(checker, "expected type %"PRI_SV" but got type %"PRI_SV,
                    SV_FMT(expected_sv), SV_FMT(actual_sv));
-        exit(1);
+        fatal_type_error(checker);
     }
 }
 
@@ -99,7 +161,7 @@ static const struct type_info *expect_keep_kind(struct type_checker *checker,
     if (info->kind != kind) {
         type_error(checker, "expected a '%s' type but got type '%"PRI_SV"' instead",
                    kind_name(kind), SV_FMT(type_name(checker->types, type)));
-        exit(1);
+        fatal_type_error(checker);
     }
     return info;
 }
@@ -118,6 +180,41 @@ static void expect_type(struct type_checker *checker, type_index expected_type)
     expect_types_equal(checker, expected_type, ts_pop(checker));
 }
 
+static void init_type_stack(struct type_stack *tstack) {
+    tstack->count = 0;
+    tstack->capacity = TYPE_STACK_INIT_SIZE;
+    tstack->types = allocate_array(tstack->capacity, sizeof tstack->types[0]);
+    tstack->snapshots = allocate_array(tstack->capacity, sizeof tstack->snapshots[0]);
+    tstack->snapshot_count = 0;
+}
+
+static void free_type_stack(struct type_stack *tstack) {
+    free_array(tstack->types, tstack->capacity, sizeof tstack->types[0]);
+    free_array(tstack->snapshots, tstack->capacity, sizeof tstack->snapshots[0]);
+    *tstack = (struct type_stack) {0};
+}
+
+static void reserve_type_stack(struct type_stack *tstack, size_t count) {
+    if (count <= tstack->capacity) return;
+    size_t new_capacity = tstack->capacity + tstack->capacity / 2;
+    if (new_capacity < count) {
+        new_capacity = count;
+    }
+    tstack->types = reallocate_array(tstack->types, tstack->capacity, new_capacity,
+                                     sizeof tstack->types[0]);
+    tstack->snapshots = reallocate_array(tstack->snapshots, tstack->capacity, new_capacity,
+                                         sizeof tstack->snapshots[0]);
+    tstack->capacity = new_capacity;
+}
+
+static void truncate_type_stack(struct type_stack *tstack, size_t count) {
+    assert(count <= tstack->count);
+    tstack->count = count;
+    if (tstack->snapshot_count > count) {
+        tstack->snapshot_count = count;
+    }
+}
+
 static void expect_types(struct type_checker *checker,
                          int count, type_index expected_types[count]) {
     assert(count >= 0);
@@ -128,56 +225,77 @@ static void expect_types(struct type_checker *checker,
         type_error(checker, "expected types %"PRI_SV", but got types %"PRI_SV,
                    SV_FMT(expected_sv),
                    SV_FMT(actual_sv));
-        checker->tstack->top = checker->tstack->types;
+        truncate_type_stack(checker->tstack, 0);
     }
     else {
-        if (!array_eq(count, &checker->tstack->top[-count],
-                      count, expected_types, sizeof(type_index))) {
+        type_index *actual_types = &checker->tstack->types[checker->tstack->count - count];
+        if (!array_eq(count, actual_types, count, expected_types, sizeof(type_index))) {
             struct string_view expected_sv = type_array_to_sv(checker, count, expected_types);
-            struct string_view actual_sv = type_array_to_sv(checker, count,
-                                                            &checker->tstack->top[-count]);
+            struct string_view actual_sv = type_array_to_sv(checker, count, actual_types);
             type_error(checker, "expected types %"PRI_SV", but got types %"PRI_SV,
                        SV_FMT(expected_sv),
                        SV_FMT(actual_sv));
         }
-        checker->tstack->top -= count;
+        truncate_type_stack(checker->tstack, checker->tstack->count - count);
     }
 }
 
 void reset_type_stack(struct type_stack *tstack) {
-    tstack->top = tstack->types;
+    tstack->count = 0;
+    tstack->snapshot_count = 0;
 }
 
 static void init_type_checker_states(struct type_checker_states *states) {
     states->region = new_region(TYPE_STACK_STATES_REGION_SIZE);
     CHECK_ALLOCATION(states->region);
+    states->size = 0;
+    states->capacity = 0;
+    states->states = NULL;
+    states->ips = NULL;
+    states->wir_dests = NULL;
+    states->wir_srcs = NULL;
+    INIT_DARRAY(&states->snapshots, SNAPSHOT_TABLE_INIT_SIZE);
+    memset(states->snapshots.items, 0, states->snapshots.capacity * sizeof states->snapshots.items[0]);
 }
 
 static void reset_type_checker_states(struct type_checker_states *states,
                                       struct jump_info_table *jumps) {
     clear_region(states->region);
     states->size = jumps->count;
+    if (states->size > states->capacity) {
+        size_t old_capacity = states->capacity;
+        size_t new_capacity = states->size;
+        states->states = reallocate_array(states->states, old_capacity, new_capacity,
+                                          sizeof *states->states);
+        states->ips = reallocate_array(states->ips, old_capacity, new_capacity,
+                                       sizeof *states->ips);
+        states->wir_dests = reallocate_array(states->wir_dests, old_capacity, new_capacity,
+                                             sizeof *states->wir_dests);
+        states->wir_srcs = reallocate_array(states->wir_srcs, old_capacity, new_capacity,
+                                            sizeof *states->wir_srcs);
+        states->capacity = new_capacity;
+    }
     if (states->size != 0) {
-        states->states    = region_calloc(states->region, states->size, sizeof *states->states);
-        CHECK_ALLOCATION(states->states);
-        states->ips       = region_calloc(states->region, states->size, sizeof *states->ips);
-        CHECK_ALLOCATION(states->ips);
-        states->wir_dests = region_calloc(states->region, states->size, sizeof *states->wir_dests);
-        CHECK_ALLOCATION(states->wir_dests);
-        states->wir_srcs  = region_calloc(states->region, states->size, sizeof *states->wir_srcs);
-        CHECK_ALLOCATION(states->wir_srcs);
-        memcpy(states->ips, jumps->items, states->size * sizeof states->ips[0]);
+        memset(states->states, 0, states->size * sizeof *states->states);
+        memcpy(states->ips, jumps->items, states->size * sizeof *states->ips);
+        memset(states->wir_dests, 0, states->size * sizeof *states->wir_dests);
+        memset(states->wir_srcs, 0, states->size * sizeof *states->wir_srcs);
     }
-    else {
-        states->states = NULL;
-        states->ips = NULL;
-        states->wir_dests = NULL;
-        states->wir_srcs = NULL;
+    // The snapshots lived in the region, so they must be forgotten too.
+    if (states->snapshots.count > 0) {
+        memset(states->snapshots.items, 0,
+               states->snapshots.capacity * sizeof states->snapshots.items[0]);
+        states->snapshots.count = 0;
     }
 }
 
 static void free_type_checker_states(struct type_checker_states *states) {
     kill_region(states->region);
+    free_array(states->states, states->capacity, sizeof *states->states);
+    free_array(states->ips, states->capacity, sizeof *states->ips);
+    free_array(states->wir_dests, states->capacity, sizeof *states->wir_dests);
+    free_array(states->wir_srcs, states->capacity, sizeof *states->wir_srcs);
+    FREE_DARRAY(&states->snapshots);
     // Zero out all fields.
     *states = (struct type_checker_states) {0};
 }
@@ -191,18 +309,25 @@ void init_type_checker(struct type_checker *checker, struct module *module) {
     checker->types = &module->types;  // The type table is used a lot so it gets its own field.
     checker->tstack = malloc(sizeof *checker->tstack);
     CHECK_ALLOCATION(checker->tstack);
+    init_type_stack(checker->tstack);
     checker->ip = 0;
     checker->current_function = 0;
     checker->had_error = false;
-    reset_type_stack(checker->tstack);
     checker->temp = new_region(TEMP_REGION_SIZE);
     CHECK_ALLOCATION(checker->temp);
+    checker->diagnostics = NULL;
+    checker->fatal_error = NULL;
+    checker->location_ip = -1;
+    checker->location_run = -1;
 }
 
 void free_type_checker(struct type_checker *checker) {
     free_type_checker_states(&checker->states);
+    free_type_stack(checker->tstack);
     free(checker->tstack);
     checker->tstack = NULL;
+    kill_region(checker->temp);
+    checker->temp = NULL;
 }
 
 
@@ -453,6 +578,87 @@ static size_t find_state(struct type_checker_states *states, int ip) {
     return lo;
 }
 
+static const struct tstack_snapshot empty_snapshot = {0};
+
+static uint32_t hash_snapshot(const struct tstack_snapshot *below, type_index type) {
+    uint32_t hash = below->hash ^ (uint32_t)type;
+    hash *= 16777619;  // FNV prime.
+    return hash ^ (hash >> 15);
+}
+
+static void grow_snapshot_table(struct snapshot_table *snapshots) {
+    size_t old_capacity = snapshots->capacity;
+    const struct tstack_snapshot **old_items = snapshots->items;
+    snapshots->capacity = 2 * old_capacity;
+    snapshots->items = allocate_array(snapshots->capacity, sizeof snapshots->items[0]);
+    memset(snapshots->items, 0, snapshots->capacity * sizeof snapshots->items[0]);
+    for (size_t i = 0; i < old_capacity; ++i) {
+        const struct tstack_snapshot *snapshot = old_items[i];
+        if (snapshot == NULL) continue;
+        size_t slot = snapshot->hash & (snapshots->capacity - 1);
+        while (snapshots->items[slot] != NULL) {
+            slot = (slot + 1) & (snapshots->capacity - 1);
+        }
+        snapshots->items[slot] = snapshot;
+    }
+    free_array(old_items, old_capacity, sizeof old_items[0]);
+}
+
+/* Get the unique snapshot with `type` on top of `below`, creating it if necessary. */
+static const struct tstack_snapshot *intern_snapshot(struct type_checker_states *states,
+                                                     const struct tstack_snapshot *below,
+                                                     type_index type) {
+    struct snapshot_table *snapshots = &states->snapshots;
+    if (2 * (snapshots->count + 1) > snapshots->capacity) {
+        grow_snapshot_table(snapshots);
+    }
+    uint32_t hash = hash_snapshot(below, type);
+    size_t slot = hash & (snapshots->capacity - 1);
+    for (const struct tstack_snapshot *snapshot;
+         (snapshot = snapshots->items[slot]) != NULL;
+         slot = (slot + 1) & (snapshots->capacity - 1)) {
+        if (snapshot->below == below && snapshot->type == type) return snapshot;
+    }
+    struct tstack_snapshot *snapshot = region_alloc_uninit(states->region, sizeof *snapshot);
+    CHECK_ALLOCATION(snapshot);
+    *snapshot = (struct tstack_snapshot) {
+        .below = below,
+        .count = below->count + 1,
+        .hash = hash,
+        .type = type,
+    };
+    snapshots->items[slot] = snapshot;
+    ++snapshots->count;
+    return snapshot;
+}
+
+/* Get the snapshot of the current type stack. Only the types pushed since the last snapshot
+ * need to be looked up.
+ */
+static const struct tstack_snapshot *snapshot_type_stack(struct type_checker *checker) {
+    struct type_stack *tstack = checker->tstack;
+    if (tstack->count == 0) return &empty_snapshot;
+    for (size_t i = tstack->snapshot_count; i < tstack->count; ++i) {
+        const struct tstack_snapshot *below = (i > 0) ? tstack->snapshots[i - 1] : &empty_snapshot;
+        tstack->snapshots[i] = intern_snapshot(&checker->states, below, tstack->types[i]);
+    }
+    tstack->snapshot_count = tstack->count;
+    return tstack->snapshots[tstack->count - 1];
+}
+
+static void restore_snapshot(struct type_checker *checker, const struct tstack_snapshot *snapshot) {
+    struct type_stack *tstack = checker->tstack;
+    size_t count = snapshot->count;
+    reserve_type_stack(tstack, count);
+    for (size_t i = count; i > 0; --i) {
+        tstack->types[i - 1] = snapshot->type;
+        tstack->snapshots[i - 1] = snapshot;
+        snapshot = snapshot->below;
+    }
+    tstack->count = count;
+    tstack->snapshot_count = count;
+}
+
 static bool save_state_with_index(struct type_checker *checker, size_t index) {
     struct type_checker_states *states = &checker->states;
     assert(index < (size_t)checker->in_block->jumps.count);
@@ -460,13 +666,7 @@ static bool save_state_with_index(struct type_checker *checker, size_t index) {
         // There was already a state saved there.
         return false;
     }
-    size_t count = TSTACK_COUNT(checker->tstack);
-    size_t tstack_size = count * sizeof(type_index);
-    struct tstack_state *state = region_alloc(states->region, sizeof *state + tstack_size);
-    CHECK_ALLOCATION(state);
-    state->count = count;
-    memcpy(state->types, checker->tstack->types, tstack_size);
-    states->states[index] = state;
+    states->states[index] = snapshot_type_stack(checker);
     return true;
 }
 
@@ -479,12 +679,11 @@ static bool save_state_at(struct type_checker *checker, int ip) {
 static bool load_state_at(struct type_checker *checker, int ip) {
     struct type_checker_states *states = &checker->states;
     size_t index = find_state(states, ip);
-    struct tstack_state *state = states->states[index];
+    const struct tstack_snapshot *state = states->states[index];
     if (state == NULL || states->ips[index] != ip) {
         return false;
     }
-    memcpy(checker->tstack->types, state->types, sizeof state->types[0] * state->count);
-    checker->tstack->top = &checker->tstack->types[state->count];
+    restore_snapshot(checker, state);
     return true;
 }
 
@@ -504,12 +703,13 @@ static bool check_type_array(struct type_checker *checker, size_t count,
 
 static bool check_state_with_index(struct type_checker *checker, size_t index) {
     struct type_checker_states *states = &checker->states;
-    struct tstack_state *state = states->states[index];
+    const struct tstack_snapshot *state = states->states[index];
     if (state == NULL) {
         // Did not find state.
         return false;
     }
-    return check_type_array(checker, state->count, state->types);
+    // Snapshots are unique, so equal stacks have the same snapshot.
+    return snapshot_type_stack(checker) == state;
 }
 
 static bool check_state_at(struct type_checker *checker, int ip) {
@@ -524,7 +724,7 @@ static bool save_jump(struct type_checker *checker, int dest_offset) {
     struct type_checker_states *states = &checker->states;
     size_t index = find_state(states, dest);
     assert(index < (size_t)checker->in_block->jumps.count);
-    struct src_list *src_node = region_alloc(states->region, sizeof *src_node);
+    struct src_list *src_node = region_alloc_uninit(states->region, sizeof *src_node);
     CHECK_ALLOCATION(src_node);
     src_node->next = states->wir_srcs[index];
     src_node->src = wir_src;
@@ -549,7 +749,7 @@ static bool is_forward_jump_dest(struct type_checker *checker, int ip) {
 }
 
 static void emit_simple(struct type_checker *checker, enum w_opcode instruction) {
-    write_simple(checker->out_block, instruction, &checker->in_block->locations[checker->ip]);
+    write_simple(checker->out_block, instruction, current_location(checker));
 }
 
 static void emit_simple_nnop(struct type_checker *checker, enum w_opcode instruction) {
@@ -563,19 +763,19 @@ static void emit_immediate_uv(struct type_checker *checker, enum w_opcode instru
     enum w_opcode instruction64 = instruction8 + 3;
     if (arg <= UINT8_MAX) {
         write_immediate_u8(checker->out_block, instruction8, arg,
-                           &checker->in_block->locations[checker->ip]);
+                           current_location(checker));
     }
     else if (arg <= UINT16_MAX) {
         write_immediate_u16(checker->out_block, instruction16, arg,
-                           &checker->in_block->locations[checker->ip]);
+                           current_location(checker));
     }
     else if (arg <= UINT32_MAX) {
         write_immediate_u32(checker->out_block, instruction32, arg,
-                           &checker->in_block->locations[checker->ip]);
+                           current_location(checker));
     }
     else if (arg <= UINT64_MAX) {
         write_immediate_u64(checker->out_block, instruction64, arg,
-                           &checker->in_block->locations[checker->ip]);
+                           current_location(checker));
     }
 }
 
@@ -587,7 +787,7 @@ static void emit_immediate_sv(struct type_checker *checker, enum w_opcode instru
 static uint8_t copy_immediate_u8(struct type_checker *checker, enum w_opcode instruction) {
     uint8_t value = read_u8(checker->in_block, checker->ip + 1);
     write_immediate_u8(checker->out_block, instruction, value,
-                       &checker->in_block->locations[checker->ip]);
+                       current_location(checker));
     checker->ip += 1;
     return value;
 }
@@ -595,7 +795,7 @@ static uint8_t copy_immediate_u8(struct type_checker *checker, enum w_opcode ins
 static uint16_t copy_immediate_u16(struct type_checker *checker, enum w_opcode instruction) {
     uint16_t value = read_u16(checker->in_block, checker->ip + 1);
     write_immediate_u16(checker->out_block, instruction, value,
-                        &checker->in_block->locations[checker->ip]);
+                        current_location(checker));
     checker->ip += 2;
     return value;
 }
@@ -603,7 +803,7 @@ static uint16_t copy_immediate_u16(struct type_checker *checker, enum w_opcode i
 static uint32_t copy_immediate_u32(struct type_checker *checker, enum w_opcode instruction) {
     uint32_t value = read_u32(checker->in_block, checker->ip + 1);
     write_immediate_u32(checker->out_block, instruction, value,
-                        &checker->in_block->locations[checker->ip]);
+                        current_location(checker));
     checker->ip += 4;
     return value;
 }
@@ -611,7 +811,7 @@ static uint32_t copy_immediate_u32(struct type_checker *checker, enum w_opcode i
 static uint64_t copy_immediate_u64(struct type_checker *checker, enum w_opcode instruction) {
     uint64_t value = read_u64(checker->in_block, checker->ip + 1);
     write_immediate_u64(checker->out_block, instruction, value,
-                        &checker->in_block->locations[checker->ip]);
+                        current_location(checker));
     checker->ip += 8;
     return value;
 }
@@ -631,7 +831,7 @@ static void copy_jump_instruction(struct type_checker *checker, enum w_opcode in
         wir_jump = wir_dest - wir_src - 1;
     }
     write_immediate_s16(checker->out_block, instruction, wir_jump,
-                        &checker->in_block->locations[checker->ip]);
+                        current_location(checker));
 }
 
 static void patch_jump(struct type_checker *checker, int ip, int jump) {
@@ -641,19 +841,19 @@ static void patch_jump(struct type_checker *checker, int ip, int jump) {
 static void emit_immediate_u8(struct type_checker *checker, enum w_opcode instruction,
                               uint8_t operand) {
     write_immediate_u8(checker->out_block, instruction, operand,
-                       &checker->in_block->locations[checker->ip]);
+                       current_location(checker));
 }
 
 static void emit_immediate_u16(struct type_checker *checker, enum w_opcode instruction,
                               uint16_t operand) {
     write_immediate_u16(checker->out_block, instruction, operand,
-                        &checker->in_block->locations[checker->ip]);
+                        current_location(checker));
 }
 
 static void emit_immediate_u32(struct type_checker *checker, enum w_opcode instruction,
                               uint32_t operand) {
     write_immediate_u32(checker->out_block, instruction, operand,
-                        &checker->in_block->locations[checker->ip]);
+                        current_location(checker));
 }
 
 static void emit_immediate_s8(struct type_checker *checker, enum w_opcode instruction,
@@ -672,15 +872,15 @@ static void emit_immediate_s32(struct type_checker *checker, enum w_opcode instr
 }
 
 static void emit_u8(struct type_checker *checker, uint8_t value) {
-    write_u8(checker->out_block, value, &checker->in_block->locations[checker->ip]);
+    write_u8(checker->out_block, value, current_location(checker));
 }
 
 static void emit_u16(struct type_checker *checker, uint16_t value) {
-    write_u16(checker->out_block, value, &checker->in_block->locations[checker->ip]);
+    write_u16(checker->out_block, value, current_location(checker));
 }
 
 static void emit_u32(struct type_checker *checker, uint32_t value) {
-    write_u32(checker->out_block, value, &checker->in_block->locations[checker->ip]);
+    write_u32(checker->out_block, value, current_location(checker));
 }
 
 static void emit_s8(struct type_checker *checker, int8_t value) {
@@ -1222,15 +1422,19 @@ static struct function *start_function(struct type_checker *checker, int func_in
     function->locals_size = get_locals_size(checker, &function->locals);
     checker->in_block = &function->t_code;
     checker->out_block = &function->w_code;
+    checker->location_ip = -1;
+    checker->location_run = -1;
     reset_type_checker_states(&checker->states, &checker->in_block->jumps);
     type_index *params = function->sig.params;
     int param_count = function->sig.param_count;
     assert(param_count >= 0);
+    reset_type_stack(checker->tstack);
+    reserve_type_stack(checker->tstack, param_count);
     if (param_count > 0) {
         assert(params != NULL);
-        memcpy(&checker->tstack->types, params, param_count * sizeof *params);
+        memcpy(checker->tstack->types, params, param_count * sizeof *params);
     }
-    checker->tstack->top = checker->tstack->types + param_count;
+    checker->tstack->count = param_count;
     checker->ip = 0;
     checker->current_function = func_index;
     return function;
@@ -2269,38 +2473,358 @@ static void type_check_function(struct type_checker *checker, int func_index) {
             break;
         }
     }
+    // Nothing reads the typed IR once it has been checked.
+    free_block(&function->t_code);
 }
 
-enum type_check_result type_check(struct type_checker *checker) {
-    for (int i = 0; i < checker->module->functions.count; ++i) {
-        type_check_function(checker, i);
+/* Parallel and pipelined type checking.
+ *
+ * A function's signature is fixed before its body is compiled and the type table is only read
+ * by the type checker, so each function can be checked independently, even while later
+ * functions are still being compiled. Every worker has its own type checker (and so its own
+ * type stack, states and temporary region) and holds the pipeline's table lock for reading
+ * while it checks a function; the compiler takes it for writing whenever it modifies a table
+ * that might be reallocated. Diagnostics are buffered per function and emitted in function
+ * order once all workers have finished, so the output matches the serial path. A fatal error
+ * stops checking its function; as in the serial path, diagnostics for any later functions are
+ * discarded.
+ *
+ * Checked functions are passed to the listener in the order they were queued. Workers may only
+ * finish a fixed window of functions ahead of the next one to be passed on (the compiler waits
+ * in queue_type_check() otherwise), which bounds the number of functions whose code is waiting
+ * for the listener. A pipeline without workers checks each function as soon as it is queued.
+ */
+
+#define TYPE_CHECK_QUEUE_PER_WORKER 16
+#define TYPE_CHECK_WINDOW_PER_WORKER 32
+
+struct function_check_result {
+    struct diagnostic_buffer diagnostics;
+    int func_index;
+    bool had_error;
+    bool was_fatal;
+};
+
+struct function_check_results {
+    int count;
+    int capacity;
+    struct function_check_result *items;
+};
+
+struct queued_check {
+    int func_index;
+    bool done;
+    bool had_error;
+};
+
+struct type_check_worker {
+    struct type_check_pipeline *pipeline;
+    struct function_check_results results;
+};
+
+struct type_check_pipeline {
+    struct module *module;
+    struct type_check_listener listener;
+    struct type_checker checker;  // Only used when there are no workers.
+    struct function_check_results results;
+    bool failed;  // Whether any function passed on so far had an error.
+    int worker_count;
+#ifndef __STDC_NO_THREADS__
+    struct work_queue queue;  // Holds sequence numbers rather than function indices.
+    struct rw_lock tables;
+    thrd_t *threads;
+    struct type_check_worker *workers;
+    mtx_t order_lock;
+    cnd_t order_progress;
+    int window;
+    int queued;  // The number of functions queued so far.
+    int delivered;  // The number of functions passed on to the listener so far.
+    bool delivering;
+    struct queued_check *order;  // Indexed by sequence number modulo window.
+#endif
+};
+
+static void check_queued_function(struct type_checker *checker,
+                                  struct function_check_result *result) {
+    jmp_buf fatal_error;
+    checker->fatal_error = &fatal_error;
+    checker->diagnostics = &result->diagnostics;
+    checker->had_error = false;
+    if (setjmp(fatal_error) == 0) {
+        type_check_function(checker, result->func_index);
+    }
+    else {
+        result->was_fatal = true;
+    }
+    checker->fatal_error = NULL;
+    checker->diagnostics = NULL;
+    result->had_error = checker->had_error;
+}
+
+static void notify_function_checked(struct type_check_pipeline *pipeline, int func_index,
+                                    bool had_error) {
+    pipeline->failed = pipeline->failed || had_error;
+    if (!pipeline->failed && pipeline->listener.function_checked != NULL) {
+        pipeline->listener.function_checked(pipeline->listener.context, func_index);
+    }
+}
+
+#ifndef __STDC_NO_THREADS__
+
+/* Pass on every function which is ready, in order. Must be called with the order lock held. */
+static void deliver_checked_functions(struct type_check_pipeline *pipeline) {
+    // Only one thread delivers at a time, so the listener is never called concurrently.
+    if (pipeline->delivering) return;
+    pipeline->delivering = true;
+    for (;;) {
+        struct queued_check *check = &pipeline->order[pipeline->delivered % pipeline->window];
+        if (!check->done) break;
+        mtx_unlock(&pipeline->order_lock);
+        lock_shared(&pipeline->tables);
+        notify_function_checked(pipeline, check->func_index, check->had_error);
+        unlock_shared(&pipeline->tables);
+        mtx_lock(&pipeline->order_lock);
+        check->done = false;
+        ++pipeline->delivered;
+        cnd_broadcast(&pipeline->order_progress);
+    }
+    pipeline->delivering = false;
+}
+
+static int type_check_worker(void *arg) {
+    struct type_check_worker *worker = arg;
+    struct type_check_pipeline *pipeline = worker->pipeline;
+    struct type_checker checker;
+    init_type_checker(&checker, pipeline->module);
+    int sequence = 0;
+    while (pop_work(&pipeline->queue, &sequence)) {
+        struct queued_check *check = &pipeline->order[sequence % pipeline->window];
+        struct function_check_result result = {.func_index = check->func_index};
+        lock_shared(&pipeline->tables);
+        check_queued_function(&checker, &result);
+        unlock_shared(&pipeline->tables);
+        DARRAY_APPEND(&worker->results, result);
+        mtx_lock(&pipeline->order_lock);
+        check->had_error = result.had_error || result.was_fatal;
+        check->done = true;
+        deliver_checked_functions(pipeline);
+        mtx_unlock(&pipeline->order_lock);
+    }
+    free_type_checker(&checker);
+    return 0;
+}
+
+static bool start_workers(struct type_check_pipeline *pipeline, int worker_count) {
+    if (!init_work_queue(&pipeline->queue, worker_count * TYPE_CHECK_QUEUE_PER_WORKER)) {
+        return false;
+    }
+    if (!init_rw_lock(&pipeline->tables)) {
+        free_work_queue(&pipeline->queue);
+        return false;
+    }
+    if (mtx_init(&pipeline->order_lock, mtx_plain) != thrd_success) {
+        free_rw_lock(&pipeline->tables);
+        free_work_queue(&pipeline->queue);
+        return false;
+    }
+    if (cnd_init(&pipeline->order_progress) != thrd_success) {
+        mtx_destroy(&pipeline->order_lock);
+        free_rw_lock(&pipeline->tables);
+        free_work_queue(&pipeline->queue);
+        return false;
+    }
+    pipeline->window = worker_count * TYPE_CHECK_WINDOW_PER_WORKER;
+    pipeline->order = allocate_array(pipeline->window, sizeof *pipeline->order);
+    pipeline->threads = allocate_array(worker_count, sizeof *pipeline->threads);
+    pipeline->workers = allocate_array(worker_count, sizeof *pipeline->workers);
+    pipeline->worker_count = 0;
+    for (int i = 0; i < worker_count; ++i) {
+        struct type_check_worker *worker = &pipeline->workers[i];
+        *worker = (struct type_check_worker) {.pipeline = pipeline};
+        if (thrd_create(&pipeline->threads[i], type_check_worker, worker) != thrd_success) break;
+        ++pipeline->worker_count;
+    }
+    if (pipeline->worker_count == 0) {
+        free_array(pipeline->workers, worker_count, sizeof *pipeline->workers);
+        free_array(pipeline->threads, worker_count, sizeof *pipeline->threads);
+        free_array(pipeline->order, pipeline->window, sizeof *pipeline->order);
+        cnd_destroy(&pipeline->order_progress);
+        mtx_destroy(&pipeline->order_lock);
+        free_rw_lock(&pipeline->tables);
+        free_work_queue(&pipeline->queue);
+        return false;
+    }
+    return true;
+}
+
+static void stop_workers(struct type_check_pipeline *pipeline) {
+    close_work_queue(&pipeline->queue);
+    for (int i = 0; i < pipeline->worker_count; ++i) {
+        struct type_check_worker *worker = &pipeline->workers[i];
+        thrd_join(pipeline->threads[i], NULL);
+        for (int j = 0; j < worker->results.count; ++j) {
+            DARRAY_APPEND(&pipeline->results, worker->results.items[j]);
+        }
+        FREE_DARRAY(&worker->results);
+    }
+    assert(pipeline->delivered == pipeline->queued);
+    free_array(pipeline->workers, pipeline->worker_count, sizeof *pipeline->workers);
+    free_array(pipeline->threads, pipeline->worker_count, sizeof *pipeline->threads);
+    free_array(pipeline->order, pipeline->window, sizeof *pipeline->order);
+    cnd_destroy(&pipeline->order_progress);
+    mtx_destroy(&pipeline->order_lock);
+    free_rw_lock(&pipeline->tables);
+    free_work_queue(&pipeline->queue);
+}
+
+#endif
+
+struct type_check_pipeline *start_type_check_pipeline(struct module *module,
+                                                      [[maybe_unused]] int worker_count,
+                                                      const struct type_check_listener *listener) {
+    struct type_check_pipeline *pipeline = allocate_array(1, sizeof *pipeline);
+    *pipeline = (struct type_check_pipeline) {.module = module};
+    if (listener != NULL) {
+        pipeline->listener = *listener;
+    }
+#ifndef __STDC_NO_THREADS__
+    if (worker_count > 0 && start_workers(pipeline, worker_count)) return pipeline;
+#endif
+    pipeline->worker_count = 0;
+    init_type_checker(&pipeline->checker, module);
+    return pipeline;
+}
+
+void queue_type_check(struct type_check_pipeline *pipeline, int func_index) {
+#ifndef __STDC_NO_THREADS__
+    if (pipeline->worker_count > 0) {
+        mtx_lock(&pipeline->order_lock);
+        while (pipeline->queued - pipeline->delivered >= pipeline->window) {
+            cnd_wait(&pipeline->order_progress, &pipeline->order_lock);
+        }
+        int sequence = pipeline->queued++;
+        pipeline->order[sequence % pipeline->window].func_index = func_index;
+        mtx_unlock(&pipeline->order_lock);
+        push_work(&pipeline->queue, sequence);
+        return;
+    }
+#endif
+    struct function_check_result result = {.func_index = func_index};
+    check_queued_function(&pipeline->checker, &result);
+    DARRAY_APPEND(&pipeline->results, result);
+    notify_function_checked(pipeline, func_index, result.had_error || result.was_fatal);
+}
+
+void lock_pipeline_tables([[maybe_unused]] struct type_check_pipeline *pipeline) {
+#ifndef __STDC_NO_THREADS__
+    if (pipeline->worker_count > 0) {
+        lock_exclusive(&pipeline->tables);
+    }
+#endif
+}
+
+void unlock_pipeline_tables([[maybe_unused]] struct type_check_pipeline *pipeline) {
+#ifndef __STDC_NO_THREADS__
+    if (pipeline->worker_count > 0) {
+        unlock_exclusive(&pipeline->tables);
+    }
+#endif
+}
+
+static int compare_check_results(const void *lhs, const void *rhs) {
+    const struct function_check_result *lhs_result = lhs;
+    const struct function_check_result *rhs_result = rhs;
+    return (lhs_result->func_index > rhs_result->func_index)
+        - (lhs_result->func_index < rhs_result->func_index);
+}
+
+enum type_check_result finish_type_check_pipeline(struct type_check_pipeline *pipeline) {
+#ifndef __STDC_NO_THREADS__
+    if (pipeline->worker_count > 0) {
+        stop_workers(pipeline);
+    }
+    else {
+        free_type_checker(&pipeline->checker);
+    }
+#else
+    free_type_checker(&pipeline->checker);
+#endif
+    struct function_check_results *results = &pipeline->results;
+    qsort(results->items, results->count, sizeof results->items[0], compare_check_results);
+    bool had_error = false;
+    bool was_fatal = false;
+    for (int i = 0; i < results->count; ++i) {
+        struct function_check_result *result = &results->items[i];
+        if (!was_fatal) {
+            if (result->diagnostics.count > 0) {
+                fwrite(result->diagnostics.text, 1, result->diagnostics.count, stderr);
+            }
+            had_error = had_error || result->had_error;
+            was_fatal = result->was_fatal;
+        }
+        free_array(result->diagnostics.text, result->diagnostics.capacity, 1);
+    }
+    FREE_DARRAY(results);
+    free_array(pipeline, 1, sizeof *pipeline);
+    if (was_fatal) {
+        exit(1);
+    }
+    return (!had_error) ? TYPE_CHECK_OK : TYPE_CHECK_ERROR;
+}
+
+enum type_check_result type_check(struct type_checker *checker, int thread_count) {
+    int function_count = checker->module->functions.count;
+    thread_count = get_thread_count(thread_count);
+    if (thread_count > function_count) {
+        thread_count = function_count;
+    }
+    if (thread_count > 1) {
+        struct type_check_pipeline *pipeline =
+            start_type_check_pipeline(checker->module, thread_count, NULL);
+        for (int i = 0; i < function_count; ++i) {
+            if (checker->module->functions.items[i].is_imported) continue;  // No code yet.
+            queue_type_check(pipeline, i);
+        }
+        if (finish_type_check_pipeline(pipeline) == TYPE_CHECK_ERROR) {
+            checker->had_error = true;
+        }
+    }
+    else {
+        for (int i = 0; i < function_count; ++i) {
+            if (checker->module->functions.items[i].is_imported) continue;
+            type_check_function(checker, i);
+        }
     }
     return (!checker->had_error) ? TYPE_CHECK_OK : TYPE_CHECK_ERROR;
 }
 
 void ts_push(struct type_checker *checker, type_index type) {
     struct type_stack *tstack = checker->tstack;
-    if (tstack->top >= &tstack->types[TYPE_STACK_SIZE]) {
+    if (tstack->count >= TYPE_STACK_SIZE) {
         type_error(checker, "insufficient stack space");
         return;
     }
-    *tstack->top++ = type;
+    if (tstack->count == tstack->capacity) {
+        reserve_type_stack(tstack, tstack->count + 1);
+    }
+    tstack->types[tstack->count++] = type;
 }
 
 type_index ts_pop(struct type_checker *checker) {
     struct type_stack *tstack = checker->tstack;
-    if (tstack->top == tstack->types) {
+    if (tstack->count == 0) {
         type_error(checker, "insufficient stack space");
         return TYPE_ERROR;
     }
-    return *--tstack->top;
+    truncate_type_stack(tstack, tstack->count - 1);
+    return tstack->types[tstack->count];
 }
 
 type_index ts_peek(struct type_checker *checker) {
     struct type_stack *tstack = checker->tstack;
-    if (tstack->top == tstack->types) {
+    if (tstack->count == 0) {
         type_error(checker, "insufficient stack space");
         return TYPE_ERROR;
     }
-    return tstack->top[-1];
+    return tstack->types[tstack->count - 1];
 }
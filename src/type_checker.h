@@ -2,6 +2,9 @@
 #define TYPE_CHECKER_H
 
 #include <assert.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "module.h"
 #include "ir.h"
@@ -9,18 +12,36 @@
 #include "type.h"
 
 #define TYPE_STACK_SIZE STACK_SIZE
-#define TYPE_STACK_STATES_REGION_SIZE TYPE_STACK_SIZE
+#define TYPE_STACK_INIT_SIZE 64
+#define TYPE_STACK_STATES_REGION_SIZE (64 * 1024)
+#define SNAPSHOT_TABLE_INIT_SIZE 64
 
-#define TSTACK_COUNT(tstack) (tstack->top - tstack->types)
+#define TSTACK_COUNT(tstack) ((ptrdiff_t)(tstack)->count)
+
+/* A saved type stack. Snapshots are hash-consed: each one is the top type of the stack along
+ * with the snapshot of the types below it, and equal snapshots are only stored once. This means
+ * that identical stacks are the same snapshot and stacks with a common prefix share it.
+ */
+struct tstack_snapshot {
+    const struct tstack_snapshot *below;
+    size_t count;
+    uint32_t hash;
+    type_index type;
+};
 
 struct type_stack {
-    type_index *top;
-    type_index types[TYPE_STACK_SIZE];
+    size_t count;
+    size_t capacity;
+    type_index *types;
+    // snapshots[i] is the snapshot of types[0] to types[i] for i < snapshot_count.
+    const struct tstack_snapshot **snapshots;
+    size_t snapshot_count;
 };
 
-struct tstack_state {
+struct snapshot_table {
     size_t count;
-    type_index types[];
+    size_t capacity;
+    const struct tstack_snapshot **items;
 };
 
 struct src_list {
@@ -30,13 +51,24 @@ struct src_list {
 
 struct type_checker_states {
     size_t size;
-    struct tstack_state **states;
+    size_t capacity;
+    const struct tstack_snapshot **states;
     int *ips;
     int *wir_dests;
     struct src_list **wir_srcs;
+    struct snapshot_table snapshots;
     struct region *region;
 };
 
+/* Diagnostics for a single function, buffered so that functions checked in parallel can report
+ * their errors in function order.
+ */
+struct diagnostic_buffer {
+    size_t count;
+    size_t capacity;
+    char *text;
+};
+
 struct type_checker {
     struct type_checker_states states;
     struct ir_block *in_block;
@@ -45,6 +77,11 @@ struct type_checker {
     struct type_table *types;
     struct module *module;
     struct region *temp;
+    struct diagnostic_buffer *diagnostics;  // If NULL, errors are reported immediately.
+    jmp_buf *fatal_error;  // If non-NULL, fatal errors jump here instead of exiting.
+    struct location location;  // Source location of the instruction at location_ip.
+    int location_ip;
+    int location_run;
     int ip;
     int current_function;
     bool had_error;
@@ -64,6 +101,35 @@ void ts_push(struct type_checker *checker, type_index type);
 type_index ts_pop(struct type_checker *checker);
 type_index ts_peek(struct type_checker *checker);
 
-enum type_check_result type_check(struct type_checker *checker);
+/* Type check every function in the module, using up to thread_count threads (or one per
+ * processor if thread_count is not positive). Errors are reported in function order either way.
+ */
+enum type_check_result type_check(struct type_checker *checker, int thread_count);
+
+/* Receives each function once it has been checked, in the order the functions were queued.
+ * Functions are only passed on until the first one with a type error. The listener is never
+ * called concurrently and may read, but not modify, the module's tables.
+ */
+struct type_check_listener {
+    void *context;
+    void (*function_checked)(void *context, int func_index);
+};
+
+/* A pool of worker threads which type check functions as they are queued, such as by the
+ * compiler as it finishes each function. The compiler must hold the pipeline's tables (using
+ * lock_pipeline_tables()) whilst modifying the module's function, type, external or string
+ * tables. If worker_count is not positive, or no workers could be started, functions are
+ * checked on the calling thread as they are queued instead. The typed IR of each function is
+ * freed once it has been checked. The listener may be NULL.
+ */
+struct type_check_pipeline;
+
+struct type_check_pipeline *start_type_check_pipeline(struct module *module, int worker_count,
+                                                      const struct type_check_listener *listener);
+void queue_type_check(struct type_check_pipeline *pipeline, int func_index);
+void lock_pipeline_tables(struct type_check_pipeline *pipeline);
+void unlock_pipeline_tables(struct type_check_pipeline *pipeline);
+/* Wait for all queued functions to be checked, report any errors and free the pipeline. */
+enum type_check_result finish_type_check_pipeline(struct type_check_pipeline *pipeline);
 
 #endif
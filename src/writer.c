@@ -1,17 +1,24 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L  // For `fileno()`.
+#endif
+
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 
 #include "bwf.h"
+#include "ir.h"
+#include "lz.h"
+#include "memory.h"
 #include "module.h"
 #include "writer.h"
 
-#define writer_version_number 5
-
-
-#define WRITE(obj, f) \
-    fwrite(&obj, sizeof obj, 1, f)
-
-#define WRITE_OR_ERR(obj, f, err_ret) \
-    if (WRITE(obj, f) != 1) return err_ret
+#define writer_version_number 6
 
 
 void display_bytecode(struct module *module, FILE *f) {
@@ -46,6 +53,11 @@ void display_bytecode(struct module *module, FILE *f) {
     for (int i = 0; i < module->functions.count; ++i) {
         struct function *function = &module->functions.items[i];
         struct ir_block *block = &function->w_code;
+        const int32_t *offsets = module->bwf_index.function_offsets;
+        if (offsets != NULL && offsets[i] != 0) {
+            fprintf(f,"func_%d: (not loaded)\n", i);
+            continue;
+        }
         fprintf(f,"func_%d:\n\t", i);
         int line_count = block->count / BYTECODE_COLUMN_COUNT;
         int leftover_count = block->count % BYTECODE_COLUMN_COUNT;
@@ -65,57 +77,166 @@ void display_bytecode(struct module *module, FILE *f) {
 #undef BYTECODE_COLUMN_COUNT
 }
 
-int write_bytecode(struct module *module, FILE *f) {
-    return write_bytecode_ex(module, f, BWF_version_number);
+/* The writer serialises the whole module into a single buffer, which is then written out in
+ * one go. The size of each entry is filled in once the entry has been written (see
+ * `end_entry()`), and the index is filled in as each table and function is reached, so nothing
+ * has to be worked out before it's written.
+ */
+struct byte_buffer {
+    size_t capacity;
+    size_t count;
+    uint8_t *items;
+};
+
+struct bwf_writer {
+    struct byte_buffer buffer;
+    struct byte_buffer scratch;  // Holds each function's code while it's compressed.
+    int version_number;
+    bool compressed;  // Whether to write a BudeBWZ file.
+    // Where the offsets in the SECTION-INDEX and FUNCTION-INDEX start (version 6+).
+    size_t section_offsets;
+    size_t function_offsets;
+};
+
+static void reserve_bytes(struct byte_buffer *buffer, size_t size) {
+    if (buffer->capacity - buffer->count >= size) return;
+    size_t new_capacity = buffer->capacity + buffer->capacity/2;
+    if (new_capacity < buffer->count + size) {
+        new_capacity = buffer->count + size;
+    }
+    buffer->items = reallocate_array(buffer->items, buffer->capacity, new_capacity,
+                                     sizeof buffer->items[0]);
+    buffer->capacity = new_capacity;
+}
+
+static void append_bytes(struct byte_buffer *buffer, const void *bytes, size_t size) {
+    if (size == 0) return;
+    reserve_bytes(buffer, size);
+    memcpy(&buffer->items[buffer->count], bytes, size);
+    buffer->count += size;
+}
+
+/* Append a field which has a fixed size even in the compressed variant. */
+static void append_fixed_field(struct byte_buffer *buffer, uint32_t value) {
+    append_bytes(buffer, &value, sizeof value);
+}
+
+static void append_field(struct bwf_writer *writer, uint32_t value) {
+    if (!writer->compressed) {
+        append_fixed_field(&writer->buffer, value);
+        return;
+    }
+    uint8_t bytes[BWF_VARINT_MAX_SIZE];
+    int size = encode_varint(value, bytes);
+    append_bytes(&writer->buffer, bytes, size);
 }
 
-static int write_data_info(struct data_info di, FILE *f, int version_number) {
-    int32_t field_count = get_field_count(version_number);
+/* Leave room for an entry-size field, to be filled in by `end_entry()`. Returns where the entry
+ * starts.
+ */
+static size_t begin_entry(struct bwf_writer *writer) {
+    size_t start = writer->buffer.count;
+    size_t size = (writer->compressed) ? BWF_VARINT_MAX_SIZE : 4;
+    reserve_bytes(&writer->buffer, size);
+    writer->buffer.count += size;
+    return start;
+}
+
+static void end_entry(struct bwf_writer *writer, size_t start) {
+    struct byte_buffer *buffer = &writer->buffer;
+    if (!writer->compressed) {
+        uint32_t entry_size = buffer->count - start - 4;
+        memcpy(&buffer->items[start], &entry_size, sizeof entry_size);
+        return;
+    }
+    size_t fields = start + BWF_VARINT_MAX_SIZE;
+    size_t entry_size = buffer->count - fields;
+    int size = encode_varint(entry_size, &buffer->items[start]);
+    // Close the gap left in case the size needed every byte.
+    memmove(&buffer->items[start + size], &buffer->items[fields], entry_size);
+    buffer->count -= BWF_VARINT_MAX_SIZE - size;
+}
+
+/* Leave room for `count` offsets, to be filled in by `patch_offset()`. Returns where they start.
+ */
+static size_t reserve_offsets(struct byte_buffer *buffer, int count) {
+    size_t start = buffer->count;
+    size_t size = (size_t)count*4;
+    reserve_bytes(buffer, size);
+    memset(&buffer->items[start], 0, size);
+    buffer->count += size;
+    return start;
+}
+
+/* Set the `index`th offset starting at `offsets_start` to the current end of the buffer. */
+static void patch_offset(struct byte_buffer *buffer, size_t offsets_start, int index) {
+    // NOTE: If the offset doesn't fit in 32 bits, neither does the file, which is caught later.
+    uint32_t offset = buffer->count;
+    memcpy(&buffer->items[offsets_start + (size_t)index*4], &offset, sizeof offset);
+}
+
+/* Record that a table starts at the current end of the buffer. */
+static void mark_section(struct bwf_writer *writer, enum bwf_section section) {
+    if (writer->version_number < 6) return;  // No index.
+    patch_offset(&writer->buffer, writer->section_offsets, section);
+}
+
+static void mark_function(struct bwf_writer *writer, int index) {
+    if (writer->version_number < 6) return;  // No index.
+    patch_offset(&writer->buffer, writer->function_offsets, index);
+}
+
+static void write_data_info(struct bwf_writer *writer, struct data_info di) {
+    int version_number = writer->version_number;
     if (version_number >= 2) {
-        WRITE_OR_ERR(field_count, f, errno);
+        append_field(writer, get_field_count(version_number));
     }
-    WRITE_OR_ERR(di.string_count, f, errno);
-    WRITE_OR_ERR(di.function_count, f, errno);
-    if (version_number < 4) return 0;
+    append_field(writer, di.string_count);
+    append_field(writer, di.function_count);
+    if (version_number < 4) return;
     // Version 4+ fields.
-    WRITE_OR_ERR(di.ud_type_count, f, errno);
-    if (version_number < 5) return 0;
+    append_field(writer, di.ud_type_count);
+    if (version_number < 5) return;
     // Version 5+ fields.
-    WRITE_OR_ERR(di.ext_function_count, f, errno);
-    WRITE_OR_ERR(di.ext_library_count , f, errno);
-    return 0;
+    append_field(writer, di.ext_function_count);
+    append_field(writer, di.ext_library_count);
 }
 
-static int write_function_entry(struct module *module, struct function *function,
-                                FILE *f, int version_number) {
-    (void)module;
-    struct ir_block *block = &function->w_code;
-    int32_t entry_size = get_function_entry_size(function, version_number);
+static void write_code(struct bwf_writer *writer, struct ir_block *block) {
+    append_field(writer, block->count);
+    if (!writer->compressed) {
+        append_bytes(&writer->buffer, block->code, block->count);
+        return;
+    }
+    struct byte_buffer *scratch = &writer->scratch;
+    scratch->count = 0;
+    reserve_bytes(scratch, lz_compress_bound(block->count));
+    scratch->count = lz_compress(block->code, block->count, scratch->items);
+    append_field(writer, scratch->count);
+    append_bytes(&writer->buffer, scratch->items, scratch->count);
+}
+
+static void write_function_entry(struct bwf_writer *writer, struct function *function) {
+    int version_number = writer->version_number;
+    // Before version 3, the code-size field doubles as the entry-size field.
+    size_t start = (version_number >= 3) ? begin_entry(writer) : 0;
+    write_code(writer, &function->w_code);
+    if (version_number >= 4) {
+        append_field(writer, function->max_for_loop_level);
+        append_field(writer, function->locals_size);
+        append_field(writer, function->locals.count);
+        for (int i = 0; i < function->locals.count; ++i) {
+            append_field(writer, function->locals.items[i].type);
+        }
+    }
     if (version_number >= 3) {
-        WRITE_OR_ERR(entry_size, f, errno);
-    }
-    if (fwrite(&block->count, sizeof block->count, 1, f) != 1) return errno;
-    if (fwrite(block->code, 1, block->count, f) != (size_t)block->count) return errno;
-    if (version_number < 4) return 0;
-    int32_t max_for_loop_level = function->max_for_loop_level;
-    int32_t locals_size = function->locals_size;
-    int32_t local_count = function->locals.count;
-    WRITE_OR_ERR(max_for_loop_level, f, errno);
-    WRITE_OR_ERR(locals_size, f, errno);
-    WRITE_OR_ERR(local_count, f, errno);
-    for (int i = 0; i < local_count; ++i) {
-        int32_t type = function->locals.items[i].type;
-        WRITE_OR_ERR(type, f, errno);
+        end_entry(writer, start);
     }
-    return 0;
 }
 
-static int write_type_entry(struct module *module, type_index type, FILE *f, int version_number) {
+static void write_type_entry(struct bwf_writer *writer, struct module *module,
+                             type_index type) {
     const struct type_info *info = lookup_type(&module->types, type);
-    int32_t entry_size = get_type_entry_size(info, version_number);
-    WRITE_OR_ERR(entry_size, f, errno);
-    int32_t kind = info->kind;
-    WRITE_OR_ERR(kind, f, errno);
     int32_t field_count = 0;
     int32_t word_count = 1;
     const type_index *fields = NULL;
@@ -139,58 +260,73 @@ static int write_type_entry(struct module *module, type_index type, FILE *f, int
         // Do nothing.
         break;
     }
-    WRITE_OR_ERR(field_count, f, errno);
-    WRITE_OR_ERR(word_count, f, errno);
+    size_t start = begin_entry(writer);
+    append_field(writer, info->kind);
+    append_field(writer, field_count);
+    append_field(writer, word_count);
     for (int i = 0; i < field_count; ++i) {
-        int32_t field_type = fields[i];
-        WRITE_OR_ERR(field_type, f, errno);
+        append_field(writer, fields[i]);
     }
-    return 0;
+    end_entry(writer, start);
 }
 
-static int write_ext_function_entry(struct module *module, struct ext_function *external,
-                                    FILE *f, int version_number) {
-    int32_t entry_size = get_ext_function_entry_size(external, version_number);
-    WRITE_OR_ERR(entry_size, f, errno);
-    int32_t param_count = external->sig.param_count;
-    int32_t ret_count = external->sig.ret_count;
-    WRITE_OR_ERR(param_count, f, errno);
-    WRITE_OR_ERR(ret_count, f, errno);
-    for (int i = 0; i < param_count; ++i) {
-        int32_t param_type = external->sig.params[i];
-        WRITE_OR_ERR(param_type, f, errno);
+static void write_signature(struct bwf_writer *writer, const struct signature *sig) {
+    append_field(writer, sig->param_count);
+    append_field(writer, sig->ret_count);
+    for (int i = 0; i < sig->param_count; ++i) {
+        append_field(writer, sig->params[i]);
     }
-    for (int i = 0; i < ret_count; ++i) {
-        int32_t ret_type = external->sig.rets[i];
-        WRITE_OR_ERR(ret_type, f, errno);
+    for (int i = 0; i < sig->ret_count; ++i) {
+        append_field(writer, sig->rets[i]);
     }
+}
+
+static void write_ext_function_entry(struct bwf_writer *writer, struct module *module,
+                                     struct ext_function *external) {
+    size_t start = begin_entry(writer);
+    write_signature(writer, &external->sig);
     int32_t name_index = find_string(module, &external->name);
     assert(name_index > 0);
-    int32_t call_conv = external->call_conv;
-    WRITE_OR_ERR(name_index, f, errno);
-    WRITE_OR_ERR(call_conv, f, errno);
-    return 0;
+    append_field(writer, name_index);
+    append_field(writer, external->call_conv);
+    end_entry(writer, start);
 }
 
-static int write_ext_library_entry(struct module *module, struct ext_library *library,
-                                   FILE *f, int version_number) {
-    int32_t entry_size = get_ext_library_entry_size(library, version_number);
-    WRITE_OR_ERR(entry_size, f, errno);
-    int32_t external_count = library->count;
-    WRITE_OR_ERR(external_count, f, errno);
-    for (int i = 0; i < external_count; ++i) {
-        int32_t external_index = library->items[i];
-        WRITE_OR_ERR(external_index, f, errno);
+static void write_ext_library_entry(struct bwf_writer *writer, struct module *module,
+                                    struct ext_library *library) {
+    size_t start = begin_entry(writer);
+    append_field(writer, library->count);
+    for (int i = 0; i < library->count; ++i) {
+        append_field(writer, library->items[i]);
     }
     int32_t filename_index = find_string(module, &library->filename);
     assert(filename_index > 0);
-    WRITE_OR_ERR(filename_index, f, errno);
-    return 0;
+    append_field(writer, filename_index);
+    end_entry(writer, start);
 }
 
-int write_bytecode_ex(struct module *module, FILE *f, int version_number) {
+static void write_symbol_table(struct bwf_writer *writer, struct module *module) {
+    append_field(writer, module->link_symbols.count);
+    for (int i = 0; i < module->link_symbols.count; ++i) {
+        struct link_symbol *symbol = &module->link_symbols.items[i];
+        size_t start = begin_entry(writer);
+        append_field(writer, symbol->kind);
+        append_field(writer, symbol->index);
+        append_field(writer, symbol->name.length);
+        append_bytes(&writer->buffer, symbol->name.start, symbol->name.length);
+        // The linker checks that an import's signature matches the export's.
+        write_signature(writer, &module->functions.items[symbol->index].sig);
+        end_entry(writer, start);
+    }
+}
+
+static void write_module(struct bwf_writer *writer, struct module *module) {
+    int version_number = writer->version_number;
     /* HEADER */
-    fprintf(f, "BudeBWFv%d\n", version_number);
+    char header[32];
+    int header_size = snprintf(header, sizeof header, "BudeBW%cv%d\n",
+                               (writer->compressed) ? 'Z' : 'F', version_number);
+    append_bytes(&writer->buffer, header, header_size);
     /* DATA-INFO */
     struct data_info di = {
         .string_count       = module->strings.count,
@@ -199,41 +335,98 @@ int write_bytecode_ex(struct module *module, FILE *f, int version_number) {
         .ext_function_count = module->externals.count,
         .ext_library_count  = module->ext_libraries.count,
     };
-    int ret = write_data_info(di, f, version_number);
-    if (ret != 0) return ret;
+    write_data_info(writer, di);
+    if (version_number >= 6) {
+        /* SECTION-INDEX */
+        append_fixed_field(&writer->buffer, BWF_SECTION_COUNT);
+        writer->section_offsets = reserve_offsets(&writer->buffer, BWF_SECTION_COUNT);
+        /* FUNCTION-INDEX */
+        writer->function_offsets = reserve_offsets(&writer->buffer, di.function_count);
+    }
     /* DATA */
     /* STRING-TABLE */
+    mark_section(writer, BWF_STRING_TABLE);
     for (int i = 0; i < di.string_count; ++i) {
         struct string_view *sv = &module->strings.items[i];
-        uint32_t length = sv->length;
-        WRITE_OR_ERR(length, f, errno);
-        if (fprintf(f, "%"PRI_SV, SV_FMT(*sv)) != (int)sv->length) return errno;
+        append_field(writer, sv->length);
+        append_bytes(&writer->buffer, sv->start, sv->length);
     }
     /* FUNCTION-TABLE */
+    mark_section(writer, BWF_FUNCTION_TABLE);
     for (int i = 0; i < di.function_count; ++i) {
-        struct function *function = &module->functions.items[i];
-        int ret = write_function_entry(module, function, f, version_number);
-        if (ret != 0) return ret;
+        mark_function(writer, i);
+        write_function_entry(writer, &module->functions.items[i]);
     }
-    if (version_number < 4) return 0;
+    if (version_number < 4) return;
     /* USER-DEFINED-TYPE-TABLE */
+    mark_section(writer, BWF_USER_DEFINED_TYPE_TABLE);
     for (int i = 0; i < di.ud_type_count; ++i) {
         type_index type = i + SIMPLE_TYPE_COUNT + BUILTIN_TYPE_COUNT;
-        int ret = write_type_entry(module, type, f, version_number);
-        if (ret != 0) return ret;
+        write_type_entry(writer, module, type);
     }
-    if (version_number < 5) return 0;
+    if (version_number < 5) return;
     /* EXTERNAL-FUNCTION-TABLE */
+    mark_section(writer, BWF_EXTERNAL_FUNCTION_TABLE);
     for (int i = 0; i < di.ext_function_count; ++i) {
-        struct ext_function *external = &module->externals.items[i];
-        int ret = write_ext_function_entry(module, external, f, version_number);
-        if (ret != 0) return ret;
+        write_ext_function_entry(writer, module, &module->externals.items[i]);
     }
     /* EXTERNAL-LIBRARY-TABLE */
+    mark_section(writer, BWF_EXTERNAL_LIBRARY_TABLE);
     for (int i = 0; i < di.ext_library_count; ++i) {
-        struct ext_library *library = &module->ext_libraries.items[i];
-        int ret = write_ext_library_entry(module, library, f, version_number);
-        if (ret != 0) return ret;
+        write_ext_library_entry(writer, module, &module->ext_libraries.items[i]);
+    }
+    if (version_number < 6) return;
+    if (module->link_symbols.count == 0) return;  // The SYMBOL-TABLE is optional.
+    /* SYMBOL-TABLE */
+    mark_section(writer, BWF_SYMBOL_TABLE);
+    write_symbol_table(writer, module);
+}
+
+/* Write the whole buffer with as few system calls as possible (normally one). */
+static int write_buffer(const struct byte_buffer *buffer, FILE *f) {
+#if defined(_WIN32)
+    if (fwrite(buffer->items, 1, buffer->count, f) != buffer->count) return errno;
+    return 0;
+#else
+    // Anything already buffered in `f` has to go first.
+    if (fflush(f) != 0) return errno;
+    int fd = fileno(f);
+    for (size_t written = 0; written < buffer->count; ) {
+        ssize_t ret = write(fd, &buffer->items[written], buffer->count - written);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        written += ret;
     }
     return 0;
+#endif
+}
+
+static int write_bwf(struct module *module, FILE *f, int version_number, bool compressed) {
+    struct bwf_writer writer = {.version_number = version_number, .compressed = compressed};
+    // Most of the file is code, so this is usually close to the final size.
+    size_t size_estimate = 4096;
+    for (int i = 0; i < module->functions.count; ++i) {
+        size_estimate += module->functions.items[i].w_code.count + 64;
+    }
+    reserve_bytes(&writer.buffer, size_estimate);
+    write_module(&writer, module);
+    // Every offset and size in the file is an s32.
+    int ret = (writer.buffer.count <= INT32_MAX) ? write_buffer(&writer.buffer, f) : EFBIG;
+    FREE_DARRAY(&writer.buffer);
+    FREE_DARRAY(&writer.scratch);
+    return ret;
+}
+
+int write_bytecode(struct module *module, FILE *f) {
+    return write_bwf(module, f, BWF_version_number, false);
+}
+
+int write_bytecode_ex(struct module *module, FILE *f, int version_number) {
+    return write_bwf(module, f, version_number, false);
+}
+
+int write_compressed_bytecode(struct module *module, FILE *f) {
+    return write_bwf(module, f, BWF_version_number, true);
 }
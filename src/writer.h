@@ -8,5 +8,7 @@
 void display_bytecode(struct module *module, FILE *f);
 int write_bytecode(struct module *module, FILE *f);
 int write_bytecode_ex(struct module *module, FILE *f, int version_number);
+/* Write the module as a compressed BudeBWF (BudeBWZ) file of the current version. */
+int write_compressed_bytecode(struct module *module, FILE *f);
 
 #endif
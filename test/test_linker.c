@@ -0,0 +1,122 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/compiler.h"
+#include "../src/linker.h"
+#include "../src/module.h"
+#include "../src/symbol.h"
+#include "../src/type_checker.h"
+
+static const char *const square_library =
+    "func int sq -> int def\n"
+    "    dupe *\n"
+    "end\n";
+
+static const char *const square_program =
+    "import def\n"
+    "    func int sq -> int end\n"
+    "end\n"
+    "7 sq println\n";
+
+static const char *const cube_program =
+    "import def\n"
+    "    func int cube -> int end\n"
+    "end\n"
+    "7 cube println\n";
+
+static const char *const mismatched_program =
+    "import def\n"
+    "    func int sq -> int int int end\n"
+    "end\n"
+    "7 sq + + println\n";
+
+static const char *const top_level_library =
+    "func int sq -> int def\n"
+    "    dupe *\n"
+    "end\n"
+    "1 println\n";
+
+static int failure_count = 0;
+
+static void compile_module(struct module *module, const char *filename, const char *src) {
+    init_module(module, filename);
+    struct symbol_dictionary symbols;
+    init_symbol_dictionary(&symbols);
+    compile(src, NULL, module, &symbols, NULL);
+    free_symbol_dictionary(&symbols);
+    struct type_checker checker;
+    init_type_checker(&checker, module);
+    if (type_check(&checker, 1) == TYPE_CHECK_ERROR) {
+        fprintf(stderr, "Failed to compile `%s`.\n", filename);
+        exit(1);
+    }
+    free_type_checker(&checker);
+}
+
+/* Link the program with the libraries and check whether linking succeeds and whether all the
+ * program's imports are resolved.
+ */
+static void test_link(const char *name, const char *program, const char *const *libraries,
+                      int library_count, bool expect_linked, bool expect_resolved) {
+    printf("%s:\n", name);
+    struct module module;
+    compile_module(&module, "program", program);
+    struct module *others = calloc(library_count, sizeof others[0]);
+    for (int i = 0; i < library_count; ++i) {
+        compile_module(&others[i], "library", libraries[i]);
+    }
+    bool linked = link_modules(&module, others, library_count);
+    bool resolved = linked && check_imports_resolved(&module);
+    if (linked != expect_linked || resolved != expect_resolved) {
+        printf("  FAILED: linked = %d (expected %d), resolved = %d (expected %d)\n",
+               linked, expect_linked, resolved, expect_resolved);
+        ++failure_count;
+    }
+    else {
+        printf("  OK\n");
+    }
+    for (int i = 0; i < library_count; ++i) {
+        free_module(&others[i]);
+    }
+    free(others);
+    free_module(&module);
+}
+
+/* Only the program's top-level code should be kept, and the resolved import replaced by the
+ * library's definition.
+ */
+static void test_function_count(void) {
+    printf("Linked function count:\n");
+    struct module module;
+    struct module library;
+    compile_module(&module, "program", square_program);
+    compile_module(&library, "library", square_library);
+    int expected_count = 2;
+    if (!link_modules(&module, &library, 1) || module.functions.count != expected_count) {
+        printf("  FAILED: %d functions (expected %d)\n", module.functions.count, expected_count);
+        ++failure_count;
+    }
+    else {
+        printf("  OK\n");
+    }
+    free_module(&library);
+    free_module(&module);
+}
+
+int main(void) {
+    const char *const one_library[] = {square_library};
+    const char *const two_libraries[] = {square_library, square_library};
+    test_link("Resolved import", square_program, one_library, 1, true, true);
+    test_link("Duplicate definitions", square_program, two_libraries, 2, false, false);
+    test_link("Unresolved import", cube_program, one_library, 1, true, false);
+    test_link("Signature mismatch", mismatched_program, one_library, 1, false, false);
+    const char *const top_level_libraries[] = {top_level_library};
+    test_link("Top-level code in library", square_program, top_level_libraries, 1, false, false);
+    test_function_count();
+    if (failure_count > 0) {
+        printf("%d test(s) failed.\n", failure_count);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/compiler.h"
+#include "../src/lz.h"
+#include "../src/module.h"
+#include "../src/reader.h"
+#include "../src/symbol.h"
+#include "../src/type_checker.h"
+#include "../src/writer.h"
+
+#define CHECK_ALLOC(p) do {                                            \
+        if (!p) {                                                      \
+            fprintf(stderr, "Allocation failed line %d\n", __LINE__);  \
+            exit(1);                                                   \
+        }                                                              \
+    } while (0)
+
+static const char *const program =
+    "func int sq -> int def\n"
+    "    dupe *\n"
+    "end\n"
+    "for i to 10 do\n"
+    "    i sq println\n"
+    "end\n"
+    "\"Hello, World!\" println\n";
+
+static int failure_count = 0;
+
+static void report(const char *name, bool ok) {
+    printf("%s:\n", name);
+    if (ok) {
+        printf("  OK\n");
+    }
+    else {
+        printf("  FAILED\n");
+        ++failure_count;
+    }
+}
+
+/* A deterministic stream of bytes which won't compress. */
+static void fill_random(uint8_t *bytes, size_t size, uint32_t seed) {
+    uint32_t state = seed;
+    for (size_t i = 0; i < size; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        bytes[i] = state >> 24;
+    }
+}
+
+static uint8_t *compress(const uint8_t *src, size_t size, size_t *compressed_size) {
+    uint8_t *compressed = malloc(lz_compress_bound(size));
+    CHECK_ALLOC(compressed);
+    *compressed_size = lz_compress(src, size, compressed);
+    if (*compressed_size > lz_compress_bound(size)) {
+        fprintf(stderr, "Compressed size %zu exceeds bound %zu.\n",
+                *compressed_size, lz_compress_bound(size));
+        exit(1);
+    }
+    return compressed;
+}
+
+/* Compress and decompress `src`, returning whether the result matches it. */
+static bool round_trip(const uint8_t *src, size_t size, size_t *compressed_size) {
+    uint8_t *compressed = compress(src, size, compressed_size);
+    // Leave room for a byte past the end, so overruns can be caught.
+    uint8_t *decompressed = malloc(size + 1);
+    CHECK_ALLOC(decompressed);
+    decompressed[size] = 0xA5;
+    bool ok = lz_decompress(compressed, *compressed_size, decompressed, size)
+        && memcmp(decompressed, src, size) == 0 && decompressed[size] == 0xA5;
+    free(decompressed);
+    free(compressed);
+    return ok;
+}
+
+static void test_empty(void) {
+    size_t compressed_size = 0;
+    uint8_t empty[1] = {0};
+    report("Empty input", round_trip(empty, 0, &compressed_size));
+}
+
+static void test_incompressible(void) {
+    size_t size = 100000;
+    uint8_t *src = malloc(size);
+    CHECK_ALLOC(src);
+    fill_random(src, size, 12345);
+    size_t compressed_size = 0;
+    bool ok = round_trip(src, size, &compressed_size);
+    printf("  %zu -> %zu bytes\n", size, compressed_size);
+    report("Incompressible input", ok);
+    free(src);
+}
+
+static void test_repetitive(void) {
+    size_t size = 100000;
+    uint8_t *src = malloc(size);
+    CHECK_ALLOC(src);
+    for (size_t i = 0; i < size; ++i) {
+        src[i] = "abc"[i % 3];
+    }
+    size_t compressed_size = 0;
+    bool ok = round_trip(src, size, &compressed_size);
+    printf("  %zu -> %zu bytes\n", size, compressed_size);
+    report("Repetitive input", ok && compressed_size < size/100);
+    free(src);
+}
+
+/* A random marker, a run of zeros and the marker again `distance` bytes after the first. Returns
+ * the compressed size, or 0 if the round trip fails.
+ */
+static size_t compress_marker(size_t distance) {
+    enum {MARKER_SIZE = 16};
+    size_t size = distance + MARKER_SIZE;
+    uint8_t *src = calloc(size, 1);
+    CHECK_ALLOC(src);
+    fill_random(src, MARKER_SIZE, 6789);
+    memcpy(&src[distance], src, MARKER_SIZE);
+    size_t compressed_size = 0;
+    bool ok = round_trip(src, size, &compressed_size);
+    free(src);
+    return (ok) ? compressed_size : 0;
+}
+
+static void test_max_offset(void) {
+    size_t in_range = compress_marker(LZ_MAX_OFFSET);
+    size_t out_of_range = compress_marker(LZ_MAX_OFFSET + 1);
+    printf("  offset %d -> %zu bytes, offset %d -> %zu bytes\n",
+           LZ_MAX_OFFSET, in_range, LZ_MAX_OFFSET + 1, out_of_range);
+    // Only the marker at the maximum offset can be matched.
+    report("Maximum offset", in_range > 0 && out_of_range > 0 && in_range < out_of_range);
+}
+
+static void test_truncated(void) {
+    size_t size = 5000;
+    uint8_t *src = malloc(size);
+    CHECK_ALLOC(src);
+    // A mixture of literals and long matches.
+    fill_random(src, size, 4242);
+    for (size_t i = 1000; i < 4000; ++i) {
+        src[i] = src[i % 7];
+    }
+    size_t compressed_size = 0;
+    uint8_t *compressed = compress(src, size, &compressed_size);
+    uint8_t *decompressed = malloc(size);
+    CHECK_ALLOC(decompressed);
+    bool ok = lz_decompress(compressed, compressed_size, decompressed, size);
+    for (size_t i = 0; i < compressed_size && ok; ++i) {
+        if (lz_decompress(compressed, i, decompressed, size)) {
+            printf("  Truncated to %zu of %zu bytes, but decompressed.\n", i, compressed_size);
+            ok = false;
+        }
+    }
+    // The whole block, but the wrong size.
+    ok = ok && !lz_decompress(compressed, compressed_size, decompressed, size - 1);
+    ok = ok && !lz_decompress(compressed, compressed_size, decompressed, size + 1);
+    // A match reaching back before the start of the output.
+    const uint8_t bad_offset[] = {0x10, 'a', 0x02, 0x00, 0x10, 'b'};
+    ok = ok && !lz_decompress(bad_offset, sizeof bad_offset, decompressed, 6);
+    report("Truncated and malformed input", ok);
+    free(decompressed);
+    free(compressed);
+    free(src);
+}
+
+static void compile_module(struct module *module, const char *filename, const char *src) {
+    init_module(module, filename);
+    struct symbol_dictionary symbols;
+    init_symbol_dictionary(&symbols);
+    compile(src, NULL, module, &symbols, NULL);
+    free_symbol_dictionary(&symbols);
+    struct type_checker checker;
+    init_type_checker(&checker, module);
+    if (type_check(&checker, 1) == TYPE_CHECK_ERROR) {
+        fprintf(stderr, "Failed to compile `%s`.\n", filename);
+        exit(1);
+    }
+    free_type_checker(&checker);
+}
+
+/* Write a module as BudeBWZ and check it reads back with the same code. */
+static void test_compressed_module(void) {
+    const char *filename = "test_lz.bbwz";
+    struct module module;
+    compile_module(&module, "program", program);
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        perror("Failed to open file");
+        exit(1);
+    }
+    bool ok = write_compressed_bytecode(&module, f) == 0;
+    fclose(f);
+    struct module read_module;
+    ok = ok && try_read_bytecode(filename, false, &read_module);
+    if (ok) {
+        ok = read_module.functions.count == module.functions.count;
+        for (int i = 0; i < module.functions.count && ok; ++i) {
+            struct ir_block *expected = &module.functions.items[i].w_code;
+            struct ir_block *actual = &read_module.functions.items[i].w_code;
+            ok = actual->count == expected->count
+                && memcmp(actual->code, expected->code, expected->count) == 0;
+        }
+        free_module(&read_module);
+    }
+    remove(filename);
+    free_module(&module);
+    report("Compressed module", ok);
+}
+
+int main(void) {
+    test_empty();
+    test_incompressible();
+    test_repetitive();
+    test_max_offset();
+    test_truncated();
+    test_compressed_module();
+    if (failure_count > 0) {
+        printf("%d test(s) failed.\n", failure_count);
+        return 1;
+    }
+    return 0;
+}
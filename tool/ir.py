@@ -589,6 +589,23 @@ class ExternalLibrary:
     filename: str
 
 
+class LinkSymbolKind(enum.IntEnum):
+    # NOTE: It is important to keep this in agreement with `enum link_symbol_kind` defined in
+    # ../src/module.h.
+    EXPORT = 0
+    IMPORT = enum.auto()
+
+
+@dataclasses.dataclass
+class LinkSymbol:
+    """A function a module exports to or imports from other modules."""
+
+    kind: LinkSymbolKind
+    index: int
+    name: str
+    sig: Signature
+
+
 @dataclasses.dataclass
 class Module:
     """A Bude 'Module' object which contains a list of strings and functions."""
@@ -598,6 +615,7 @@ class Module:
     user_defined_types: list[UserDefinedType]
     externals: list[ExternalFunction]
     ext_libraries: list[ExternalLibrary]
+    link_symbols: list[LinkSymbol] = dataclasses.field(default_factory=list)
 
     def pprint(self, file=sys.stdout) -> None:
         print("STRINGS", file=file)
@@ -625,6 +643,10 @@ class Module:
         for i, library in enumerate(self.ext_libraries):
             print(f"{i: 4}: {{indices ({' '.join(str(j) for j in library.indices)})",
                   f"filename {library.filename!r}}}", file=file, sep="  ")
+        print("LINK-SYMBOLS")
+        for i, symbol in enumerate(self.link_symbols):
+            print(f"{i: 4}: {{kind {symbol.kind.name}  index {symbol.index}",
+                  f"name {symbol.name!r}  sig {symbol.sig!s}}}", file=file, sep="  ")
 
 
 class ModuleBuilder:
@@ -634,6 +656,7 @@ class ModuleBuilder:
         self.user_defined_types = []
         self.externals = []
         self.ext_libraries = []
+        self.link_symbols = []
         self._current_function = self.functions[-1]
         self._current_extlib = None
 
@@ -646,6 +669,7 @@ class ModuleBuilder:
         builder.user_defined_types[:] = module.user_defined_types
         builder.externals[:] = module.externals
         builder.ext_libraries[:] = module.ext_libraries
+        builder.link_symbols[:] = module.link_symbols
         builder._current_function = builder.functions[-1]
         try:
             builder._current_extlib = builder.ext_libraries[-1]
@@ -711,4 +735,5 @@ class ModuleBuilder:
                       [function.build() for function in self.functions],
                       self.user_defined_types[:],
                       self.externals[:],
-                      self.ext_libraries[:])
+                      self.ext_libraries[:],
+                      self.link_symbols[:])
@@ -8,7 +8,9 @@ from typing import BinaryIO
 import ir
 
 
-CURRENT_VERSION_NUMBER = 5
+CURRENT_VERSION_NUMBER = 6
+SECTION_COUNT = 5  # Number of required sections in the `SECTION-INDEX`.
+KNOWN_SECTION_COUNT = 6  # Including the optional `SYMBOL-TABLE`. Any others are ignored.
 
 
 class ParseError(Exception):
@@ -64,6 +66,34 @@ def read_data_info(f: BinaryIO, version_number: int) -> DataInfo:
                     ext_function_count, ext_library_count)
 
 
+@dataclasses.dataclass
+class SectionIndex:
+    """Dataclass holding the offsets from the `SECTION-INDEX` section of a BudeBWF file."""
+
+    section_offsets: list[int]
+    function_offsets: list[int]
+
+
+def read_section_index(f: BinaryIO, version_number: int, di: DataInfo) -> SectionIndex:
+    """Read the `SECTION-INDEX` section of a BudeBWF file."""
+    assert version_number >= 6
+    section_count, _ = read_s32(f)
+    if section_count < SECTION_COUNT:
+        raise ParseError(f"`section-count` must be at least {SECTION_COUNT}, not {section_count}")
+    section_offsets = [read_s32(f)[0] for _ in range(section_count)]
+    function_offsets = [read_s32(f)[0] for _ in range(di.function_count)]
+    # Ignore any sections we don't know about and mark missing optional ones as absent (0).
+    section_offsets = section_offsets[:KNOWN_SECTION_COUNT]
+    section_offsets += [0] * (KNOWN_SECTION_COUNT - len(section_offsets))
+    return SectionIndex(section_offsets, function_offsets)
+
+
+def seek_section(f: BinaryIO, index: SectionIndex | None, section: int) -> None:
+    """Move to the start of a section. Before version 6, sections are read in order."""
+    if index is not None:
+        f.seek(index.section_offsets[section])
+
+
 def read_function(f: BinaryIO, version_number: int) -> ir.Function:
     """Read an entry from the `FUNCTION-TABLE` section of a BudeBWF file."""
     entry_size = None
@@ -153,10 +183,38 @@ def read_ext_library(f: BinaryIO, version_number: int, strings: list[str]) -> ir
     return ir.ExternalLibrary(externals, filename)
 
 
+def read_link_symbol(f: BinaryIO, version_number: int) -> ir.LinkSymbol:
+    assert version_number >= 6
+    entry_size, _ = read_s32(f)
+    bytes_read = 0
+    kind, bytes_read = read_s32(f, bytes_read)
+    index, bytes_read = read_s32(f, bytes_read)
+    name_size, bytes_read = read_u32(f, bytes_read)
+    name, bytes_read = read_bytes(f, name_size, bytes_read)
+    param_count, bytes_read = read_s32(f, bytes_read)
+    ret_count, bytes_read = read_s32(f, bytes_read)
+    params = []
+    rets = []
+    for _ in range(param_count):
+        param, bytes_read = read_s32(f, bytes_read)
+        params.append(param)
+    for _ in range(ret_count):
+        ret, bytes_read = read_s32(f, bytes_read)
+        rets.append(ret)
+    bytes_left = entry_size - bytes_read
+    assert bytes_left >= 0
+    if bytes_left > 0:
+        f.read(bytes_left)
+    return ir.LinkSymbol(ir.LinkSymbolKind(kind), index, name.decode(),
+                         ir.Signature(params, rets))
+
+
 def read_bytecode(f: BinaryIO, strict=True) -> ir.Module:
     """Read bytecode in file and return a list of strings and functions."""
     header_line = f.readline().decode()
     magic_number, _, version_number_string = header_line.partition("v")
+    if magic_number == "BudeBWZ":
+        raise ParseError("Compressed BudeBWF files are not supported")
     if magic_number != "BudeBWF":
         raise ParseError("Invalid file")
     try:
@@ -172,24 +230,48 @@ def read_bytecode(f: BinaryIO, strict=True) -> ir.Module:
             print(f"Warning: version {version_number} is not supported.",
                   "Some data may not be read correctly and some may not be read at all.")
     di = read_data_info(f, version_number)
+    index = None
+    if version_number >= 6:
+        index = read_section_index(f, version_number, di)
     strings = []
     functions = []
     user_defined_types = []
     ext_functions = []
     ext_libraries = []
+    seek_section(f, index, 0)  # STRING-TABLE
     for _ in range(di.string_count):
         length, _ = read_u32(f)
         strings.append(f.read(length).decode())
+    seek_section(f, index, 1)  # FUNCTION-TABLE
     for _ in range(di.function_count):
         function = read_function(f, version_number)
         functions.append(function)
+    seek_section(f, index, 2)  # USER-DEFINED-TYPE-TABLE
     for _ in range(di.user_defined_type_count):
         ud_type = read_ud_type(f, version_number)
         user_defined_types.append(ud_type)
+    seek_section(f, index, 3)  # EXTERNAL-FUNCTION-TABLE
     for _ in range(di.ext_function_count):
         external = read_ext_function(f, version_number, strings)
         ext_functions.append(external)
+    seek_section(f, index, 4)  # EXTERNAL-LIBRARY-TABLE
     for _ in range(di.ext_library_count):
         library = read_ext_library(f, version_number, strings)
         ext_libraries.append(library)
-    return ir.Module(strings, functions, user_defined_types, ext_functions, ext_libraries)
+    link_symbols = []
+    if index is not None and index.section_offsets[5] != 0:
+        seek_section(f, index, 5)  # SYMBOL-TABLE
+        symbol_count, _ = read_s32(f)
+        for _ in range(symbol_count):
+            symbol = read_link_symbol(f, version_number)
+            link_symbols.append(symbol)
+    # Only imported functions have no code.
+    for i, function in enumerate(functions):
+        is_imported = any(symbol.kind == ir.LinkSymbolKind.IMPORT and symbol.index == i
+                          for symbol in link_symbols)
+        if function.code.size == 0 and not is_imported:
+            raise ParseError(f"Function {i} has no code but is not imported")
+        if function.code.size > 0 and is_imported:
+            raise ParseError(f"Imported function {i} has code")
+    return ir.Module(strings, functions, user_defined_types, ext_functions, ext_libraries,
+                     link_symbols)
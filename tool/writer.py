@@ -6,7 +6,7 @@ from typing import BinaryIO
 import ir
 
 
-CURRENT_VERSION_NUMBER = 5
+CURRENT_VERSION_NUMBER = 6
 
 
 def get_field_count(version_number: int) -> int:
@@ -16,6 +16,7 @@ def get_field_count(version_number: int) -> int:
         3: 2,
         4: 3,
         5: 5,
+        6: 5,
     }
     return field_counts[version_number]
 
@@ -47,17 +48,52 @@ def write_data_info(f: BinaryIO, module: ir.Module, version_number: int) -> None
     assert bytes_written == 4 + field_count*4, f"{bytes_written = }, {field_count*4 = }"
 
 
+def get_function_entry_size(function: ir.Function, version_number: int) -> int:
+    size = function.code.size
+    if version_number < 3:
+        return size
+    entry_size = 4 + size
+    if version_number >= 4:
+        entry_size += 3*4 + len(function.locals)*4
+    return entry_size
+
+
+def write_section_index(f: BinaryIO, module: ir.Module, version_number: int) -> None:
+    """Write the `SECTION-INDEX`, working out where each section and function will be."""
+    field_count = get_field_count(version_number)
+    section_count = 6
+    offset = (len(f"BudeBWFv{version_number}\n") + 4 + field_count*4
+              + 4 + section_count*4 + len(module.functions)*4)
+    section_offsets = [offset]
+    offset += sum(4 + len(string.encode()) for string in module.strings)
+    section_offsets.append(offset)
+    function_offsets = []
+    for function in module.functions:
+        function_offsets.append(offset)
+        offset += 4 + get_function_entry_size(function, version_number)
+    section_offsets.append(offset)
+    offset += sum(4 + 3*4 + len(ud_type.fields)*4 for ud_type in module.user_defined_types)
+    section_offsets.append(offset)
+    offset += sum(4 + 2*4 + (len(external.sig.params) + len(external.sig.rets))*4 + 2*4
+                  for external in module.externals)
+    section_offsets.append(offset)
+    offset += sum(4 + 4 + len(library.indices)*4 + 4 for library in module.ext_libraries)
+    # The SYMBOL-TABLE is optional.
+    section_offsets.append(offset if module.link_symbols else 0)
+    write_s32(f, section_count)
+    for section_offset in section_offsets:
+        write_s32(f, section_offset)
+    for function_offset in function_offsets:
+        write_s32(f, function_offset)
+
+
 def write_function(f: BinaryIO, function: ir.Function, version_number: int) -> None:
     size = function.code.size
     local_count = len(function.locals)
     bytes_written = 0
+    entry_size = get_function_entry_size(function, version_number)
     if version_number >= 3:
-        entry_size = 4 + size
-        if version_number >= 4:
-            entry_size += 3*4 + local_count*4
         bytes_written += write_s32(f, entry_size)
-    else:
-        entry_size = size
     bytes_written += write_s32(f, size)
     bytes_written += f.write(function.code.code)
     if version_number >= 4:
@@ -113,10 +149,31 @@ def write_ext_library(f: BinaryIO, library: ir.ExternalLibrary, strings: list[st
     assert bytes_written == entry_size + 4, f"{bytes_written = }, {entry_size + 4 = }"
 
 
+def write_link_symbol(f: BinaryIO, symbol: ir.LinkSymbol, version_number: int) -> None:
+    bytes_written = 0
+    name = symbol.name.encode()
+    param_count = len(symbol.sig.params)
+    ret_count = len(symbol.sig.rets)
+    entry_size = 2*4 + 4 + len(name) + 2*4 + param_count*4 + ret_count*4
+    bytes_written += write_s32(f, entry_size)
+    bytes_written += write_s32(f, symbol.kind)
+    bytes_written += write_s32(f, symbol.index)
+    bytes_written += write_u32(f, len(name))
+    bytes_written += f.write(name)
+    bytes_written += write_s32(f, param_count)
+    bytes_written += write_s32(f, ret_count)
+    for param in symbol.sig.params:
+        bytes_written += write_s32(f, param)
+    for ret in symbol.sig.rets:
+        bytes_written += write_s32(f, ret)
+    assert bytes_written == entry_size + 4, f"{bytes_written = }, {entry_size + 4 = }"
+
+
 def write_data(f: BinaryIO, module: ir.Module, version_number: int) -> None:
     for string in module.strings:
-        write_u32(f, len(string))
-        f.write(string.encode())
+        encoded = string.encode()
+        write_u32(f, len(encoded))
+        f.write(encoded)
     for function in module.functions:
         write_function(f, function, version_number)
     if version_number < 4:
@@ -129,6 +186,11 @@ def write_data(f: BinaryIO, module: ir.Module, version_number: int) -> None:
         write_ext_function(f, external, module.strings, version_number)
     for library in module.ext_libraries:
         write_ext_library(f, library, module.strings, version_number)
+    if version_number < 6 or not module.link_symbols:
+        return
+    write_s32(f, len(module.link_symbols))
+    for symbol in module.link_symbols:
+        write_link_symbol(f, symbol, version_number)
 
 
 def write_bytecode(f: BinaryIO, module: ir.Module,
@@ -136,4 +198,6 @@ def write_bytecode(f: BinaryIO, module: ir.Module,
     """Write Bude bytecode to a BudeBWF file."""
     write_header(f, version_number)
     write_data_info(f, module, version_number)
+    if version_number >= 6:
+        write_section_index(f, module, version_number)
     write_data(f, module, version_number)